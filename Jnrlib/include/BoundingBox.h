@@ -97,5 +97,27 @@ namespace Jnrlib
         bb.pMax = max(boundingBox1.pMax, boundingBox2.pMax);
         return bb;
     }
+    /* Empty (pMin > pMax on some axis) if the boxes don't overlap */
+    inline BoundingBox Intersect(BoundingBox const& boundingBox1, BoundingBox const& boundingBox2)
+    {
+        BoundingBox bb{};
+        bb.pMin = max(boundingBox1.pMin, boundingBox2.pMin);
+        bb.pMax = min(boundingBox1.pMax, boundingBox2.pMax);
+        return bb;
+    }
+    /* Bounding box of the transformed corners */
+    inline BoundingBox Transform(BoundingBox const& boundingBox, Matrix4x4 const& transform)
+    {
+        BoundingBox bb{};
+        for (uint32_t i = 0; i < 8; ++i)
+        {
+            Vec4 corner((i & 1) ? boundingBox.pMax.x : boundingBox.pMin.x,
+                        (i & 2) ? boundingBox.pMax.y : boundingBox.pMin.y,
+                        (i & 4) ? boundingBox.pMax.z : boundingBox.pMin.z,
+                        One);
+            bb = Union(bb, Position(transform * corner));
+        }
+        return bb;
+    }
 
 }
\ No newline at end of file
@@ -0,0 +1,26 @@
+#pragma once
+
+/* Marks a function that is only called once GetCpuFeatures().avx was checked, so it's compiled for AVX even if the rest
+ * of the program isn't. MSVC doesn't need to be told, it always accepts AVX intrinsics
+ */
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET_AVX __attribute__((target("avx")))
+#else
+#define TARGET_AVX
+#endif
+
+namespace Jnrlib
+{
+    /* Instruction sets the CPU we're running on supports. The AVX ones also require the OS to save the YMM registers */
+    struct CpuFeatures
+    {
+        bool sse2 = false;
+        bool sse41 = false;
+        bool avx = false;
+        bool avx2 = false;
+        bool fma = false;
+    };
+
+    /* Queried once, on the first call */
+    CpuFeatures const& GetCpuFeatures();
+}
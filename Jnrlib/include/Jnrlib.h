@@ -6,11 +6,13 @@
 #include "Singletone.h"
 #include "CountParameters.h"
 #include "ThreadPool.h"
+#include "JobGroup.h"
 #include "Exceptions.h"
 #include "TypeHelpers.h"
 #include "RandomHelpers.h"
 #include "MathHelpers.h"
 #include "BoundingBox.h"
+#include "MemoryArena.h"
 
 #include <magic_enum.hpp>
 #include <magic_enum_iostream.hpp>
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "ThreadPool.h"
+
+
+namespace Jnrlib
+{
+    /* Polled by long running tasks, so they can stop early once their group is cancelled.
+     * Only valid as long as the group it came from
+     */
+    class CancellationToken
+    {
+        friend class JobGroup;
+    public:
+        /* A token that is never cancelled */
+        CancellationToken() = default;
+
+        bool IsCancelled() const
+        {
+            return mCancelled != nullptr && mCancelled->load(std::memory_order_relaxed);
+        }
+
+    private:
+        CancellationToken(std::atomic<bool> const* cancelled) :
+            mCancelled(cancelled)
+        { }
+
+    private:
+        std::atomic<bool> const* mCancelled = nullptr;
+    };
+
+    /* Tasks submitted through a group can be waited for and cancelled together, without touching the rest of the
+     * ThreadPool. Cancelling skips the tasks of the group that didn't start yet (and cancels their successors) and
+     * signals the token, so the running ones can stop early. The group has to outlive its tasks, the destructor waits for them
+     */
+    class JobGroup
+    {
+        friend class ThreadPool;
+    public:
+        JobGroup();
+        ~JobGroup();
+
+        JobGroup(JobGroup const&) = delete;
+        JobGroup& operator=(JobGroup const&) = delete;
+
+    public:
+        TaskHandle ExecuteDeffered(TaskFunction func);
+        std::vector<TaskHandle> ExecuteBatchDeffered(std::vector<TaskFunction> funcs);
+        /* Predecessors can be part of any group, or of none */
+        TaskHandle ExecuteAfter(std::span<TaskHandle const> predecessors, TaskFunction func);
+        TaskHandle ExecuteAfter(std::initializer_list<TaskHandle> predecessors, TaskFunction func);
+        TaskHandle Then(TaskHandle task, TaskFunction func);
+
+        /* Returns once every task of the group is done, the tasks submitted by other tasks of the group included */
+        void Wait(ThreadPool::WaitPolicy wp = ThreadPool::WaitPolicy::EXECUTE_THEN_EXIT);
+        /* Tasks submitted after this are cancelled as well, until the group is reset */
+        void Cancel();
+        /* Lets the group run tasks again after it was cancelled, it has to be done first */
+        void Reset();
+
+        bool IsCancelled() const
+        {
+            return mCancelled.load(std::memory_order_relaxed);
+        }
+        bool IsDone() const;
+        CancellationToken GetToken() const;
+
+    private:
+        ThreadPool* mThreadPool;
+
+        std::atomic<bool> mCancelled = false;
+        /* Submitted tasks of the group that were neither executed nor cancelled yet */
+        std::atomic<uint64_t> mPendingTasks = 0;
+    };
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+namespace Jnrlib
+{
+    /* Read-only view of a whole file mapped in memory. The mapping lives as long as the object */
+    class MappedFile
+    {
+    public:
+        MappedFile() = default;
+        ~MappedFile();
+
+        MappedFile(MappedFile const&) = delete;
+        MappedFile& operator=(MappedFile const&) = delete;
+        MappedFile(MappedFile&& rhs) noexcept;
+        MappedFile& operator=(MappedFile&& rhs) noexcept;
+
+    public:
+        /* Returns false if the file doesn't exist or can't be mapped. Empty files can't be mapped either */
+        bool Open(std::string const& path);
+        void Close();
+
+        bool IsOpen() const;
+        unsigned char const* GetData() const;
+        size_t GetSize() const;
+
+    private:
+        unsigned char const* mData = nullptr;
+        size_t mSize = 0;
+#ifdef _WIN32
+        void* mFileHandle = nullptr;
+        void* mMappingHandle = nullptr;
+#endif
+    };
+
+    /* 64-bit FNV-1a. Pass the result of a previous call as hash to continue hashing */
+    constexpr const uint64_t FNV_OFFSET_BASIS = 0xcbf29ce484222325ull;
+    uint64_t HashBytes(void const* data, size_t size, uint64_t hash = FNV_OFFSET_BASIS);
+}
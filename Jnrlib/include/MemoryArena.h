@@ -0,0 +1,80 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+#include <new>
+
+
+namespace Jnrlib
+{
+    /* Bump allocator: every allocation is a pointer increment inside a big block and everything
+     * is released at once by Reset() or by the destructor. Destructors of the allocated objects are never called.
+     */
+    class MemoryArena
+    {
+    public:
+        static constexpr const size_t DEFAULT_BLOCK_SIZE = 256 * 1024;
+
+    public:
+        MemoryArena(size_t blockSize = DEFAULT_BLOCK_SIZE);
+        ~MemoryArena();
+
+        MemoryArena(MemoryArena const&) = delete;
+        MemoryArena& operator=(MemoryArena const&) = delete;
+        MemoryArena(MemoryArena&& rhs) noexcept;
+        MemoryArena& operator=(MemoryArena&& rhs) noexcept;
+
+    public:
+        void* Alloc(size_t size, size_t alignment = alignof(std::max_align_t));
+
+        template <typename T, typename ... Args>
+        T* Create(Args&&... args)
+        {
+            static_assert(std::is_trivially_destructible_v<T>, "Objects allocated in a memory arena are never destroyed");
+            return new (Alloc(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+        }
+
+        template <typename T>
+        T* CreateArray(size_t count)
+        {
+            static_assert(std::is_trivially_destructible_v<T>, "Objects allocated in a memory arena are never destroyed");
+            T* result = (T*)Alloc(sizeof(T) * count, alignof(T));
+            for (size_t i = 0; i < count; ++i)
+            {
+                new (&result[i]) T();
+            }
+            return result;
+        }
+
+        /* Makes all the memory available again, without giving it back to the system */
+        void Reset();
+        /* Gives all the memory back to the system */
+        void Release();
+
+        /* Bytes requested from the system */
+        size_t GetTotalReserved() const;
+        /* Bytes handed out since the last Reset() */
+        size_t GetTotalUsed() const;
+
+    private:
+        struct Block
+        {
+            uint8_t* memory;
+            size_t size;
+        };
+
+    private:
+        size_t mBlockSize;
+
+        Block mCurrentBlock{ nullptr, 0 };
+        size_t mCurrentOffset = 0;
+
+        std::vector<Block> mUsedBlocks;
+        std::vector<Block> mAvailableBlocks;
+
+        size_t mTotalUsed = 0;
+    };
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+
+namespace Jnrlib
+{
+    /* A move-only void() callable for the ThreadPool. Unlike std::function, callables of up to INLINE_SIZE bytes
+     * (a lambda with a few captures, most std::bind results) are stored inside the object, without a heap allocation
+     */
+    class TaskFunction
+    {
+    public:
+        static constexpr const size_t INLINE_SIZE = 64;
+
+    public:
+        TaskFunction() = default;
+
+        template <typename Func, typename = std::enable_if_t<!std::is_same_v<std::decay_t<Func>, TaskFunction>>>
+        TaskFunction(Func&& func)
+        {
+            using Callable = std::decay_t<Func>;
+            if constexpr (IsStoredInline<Callable>())
+            {
+                new (mStorage) Callable(std::forward<Func>(func));
+                mOperations = &InlineOperations<Callable>;
+            }
+            else
+            {
+                *reinterpret_cast<Callable**>(mStorage) = new Callable(std::forward<Func>(func));
+                mOperations = &HeapOperations<Callable>;
+            }
+        }
+
+        TaskFunction(TaskFunction&& rhs) noexcept
+        {
+            MoveFrom(rhs);
+        }
+
+        TaskFunction& operator=(TaskFunction&& rhs) noexcept
+        {
+            if (this != &rhs)
+            {
+                Reset();
+                MoveFrom(rhs);
+            }
+            return *this;
+        }
+
+        TaskFunction(TaskFunction const&) = delete;
+        TaskFunction& operator=(TaskFunction const&) = delete;
+
+        ~TaskFunction()
+        {
+            Reset();
+        }
+
+        void operator()()
+        {
+            mOperations->invoke(mStorage);
+        }
+
+        explicit operator bool() const
+        {
+            return mOperations != nullptr;
+        }
+
+        /* Destroys the callable and everything it captured */
+        void Reset()
+        {
+            if (mOperations != nullptr)
+            {
+                mOperations->destroy(mStorage);
+                mOperations = nullptr;
+            }
+        }
+
+        template <typename Callable> static constexpr bool IsStoredInline()
+        {
+            return sizeof(Callable) <= INLINE_SIZE && alignof(Callable) <= alignof(std::max_align_t) &&
+                std::is_nothrow_move_constructible_v<Callable>;
+        }
+
+    private:
+        struct Operations
+        {
+            void (*invoke)(void* storage);
+            /* Move constructs the callable into an empty storage and destroys the source */
+            void (*move)(void* from, void* to);
+            void (*destroy)(void* storage);
+        };
+
+        template <typename Callable> static constexpr Operations InlineOperations = {
+            [](void* storage) { (*static_cast<Callable*>(storage))(); },
+            [](void* from, void* to)
+            {
+                new (to) Callable(std::move(*static_cast<Callable*>(from)));
+                static_cast<Callable*>(from)->~Callable();
+            },
+            [](void* storage) { static_cast<Callable*>(storage)->~Callable(); },
+        };
+
+        template <typename Callable> static constexpr Operations HeapOperations = {
+            [](void* storage) { (**static_cast<Callable**>(storage))(); },
+            [](void* from, void* to) { *static_cast<Callable**>(to) = *static_cast<Callable**>(from); },
+            [](void* storage) { delete *static_cast<Callable**>(storage); },
+        };
+
+        void MoveFrom(TaskFunction& rhs)
+        {
+            mOperations = rhs.mOperations;
+            if (mOperations != nullptr)
+            {
+                mOperations->move(rhs.mStorage, mStorage);
+                rhs.mOperations = nullptr;
+            }
+        }
+
+    private:
+        alignas(std::max_align_t) unsigned char mStorage[INLINE_SIZE];
+        Operations const* mOperations = nullptr;
+    };
+}
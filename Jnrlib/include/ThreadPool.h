@@ -2,18 +2,42 @@
 
 
 #include "Singletone.h"
+#include "TaskFunction.h"
 #include <thread>
 #include <unordered_set>
 #include <functional>
 #include <condition_variable>
 #include <atomic>
+#include <deque>
+#include <span>
+#include <initializer_list>
 
 
 namespace Jnrlib
 {
+    /* Refers to a task submitted to the ThreadPool. The storage of finished tasks is reused, so a handle is the index
+     * of the storage and the generation it had when the task was submitted. Once the task is done, finished or cancelled,
+     * the storage moves on to the next generation, so old handles never see the tasks submitted after them
+     */
+    struct TaskHandle
+    {
+        static constexpr const uint32_t INVALID_INDEX = (uint32_t)-1;
+
+        uint32_t index = INVALID_INDEX;
+        uint32_t generation = 0;
+
+        bool IsValid() const
+        {
+            return index != INVALID_INDEX;
+        }
+    };
+
+    class JobGroup;
+
     class ThreadPool : public Jnrlib::ISingletone<ThreadPool>
     {
         MAKE_SINGLETONE_CAPABLE(ThreadPool);
+        friend class JobGroup;
     private:
         ThreadPool(uint32_t nthreads = std::thread::hardware_concurrency() - 1);
         ~ThreadPool() final;
@@ -26,47 +50,129 @@ namespace Jnrlib
             SEARCH_AND_EXECUTE_THEN_EXIT,
         };
 
+        /* Rounds a thread spins looking for work or waiting for a task before it goes to sleep */
+        static constexpr const uint32_t DEFAULT_SPIN_BUDGET = 64;
+
     public:
-        std::shared_ptr<struct Task> ExecuteDeffered(std::function<void()> func);
-        std::vector<std::shared_ptr<struct Task>> ExecuteBatchDeffered(std::vector<std::function<void()>> const& funcs);
+        TaskHandle ExecuteDeffered(TaskFunction func);
+        /* Takes the storage for all the tasks at once */
+        std::vector<TaskHandle> ExecuteBatchDeffered(std::vector<TaskFunction> funcs);
+
+        /* Task graphs. The task is queued once all of its predecessors are done and it's cancelled if any of them is.
+         * Invalid handles and tasks that are already done don't hold it back
+         */
+        TaskHandle ExecuteAfter(std::span<TaskHandle const> predecessors, TaskFunction func);
+        TaskHandle ExecuteAfter(std::initializer_list<TaskHandle> predecessors, TaskFunction func);
+        /* Continuation of a single task */
+        TaskHandle Then(TaskHandle task, TaskFunction func);
+        /* A task without any work, done once all the tasks are done */
+        TaskHandle Join(std::span<TaskHandle const> tasks);
 
         void ExecuteParallelForImmediate(std::function<void(uint32_t)> const& func, uint32_t size, uint32_t batchSize, WaitPolicy wp = WaitPolicy::EXECUTE_THEN_EXIT);
-        void Wait(std::shared_ptr<struct Task> task, WaitPolicy wp = WaitPolicy::EXECUTE_THEN_EXIT);
+        /* Returns once the task is done. A cancelled task is done as well, it just never ran */
+        void Wait(TaskHandle task, WaitPolicy wp = WaitPolicy::EXECUTE_THEN_EXIT);
         void WaitForAll(WaitPolicy wp = WaitPolicy::EXECUTE_THEN_EXIT);
         void CancelRemainingTasks();
 
-        bool IsTaskCompleted(std::shared_ptr<struct Task> task);
+        bool IsTaskCompleted(TaskHandle task) const;
 
         uint32_t GetCurrentThreadId() const;
         uint32_t GetNumberOfThreads() const;
 
+        /* Every thread spins at most this many rounds before sleeping, fewer if spinning didn't pay off lately.
+         * 0 makes idle threads sleep right away
+         */
+        void SetSpinBudget(uint32_t rounds);
+        uint32_t GetSpinBudget() const;
+
 
     private:
+        /* Every worker owns a deque of tasks. The worker pushes and pops at the bottom without taking a lock,
+         * idle threads steal from the top of a random victim
+         */
+        struct Worker;
+
         void Init(uint32_t nthreads);
         void WorkerThread(uint32_t index);
 
+        /* The Execute functions, the tasks are part of the group if there is one */
+        TaskHandle ExecuteInGroup(JobGroup* group, TaskFunction func);
+        std::vector<TaskHandle> ExecuteBatchInGroup(JobGroup* group, std::vector<TaskFunction> funcs);
+        TaskHandle ExecuteAfterInGroup(JobGroup* group, std::span<TaskHandle const> predecessors, TaskFunction func);
+        void WaitForGroup(JobGroup const& group, WaitPolicy wp);
+
     private:
-        void WaitForTaskToFinish(std::shared_ptr<struct Task> task);
-        void ExecuteTasksUntilTaskCompleted(std::shared_ptr<struct Task> task);
-        void ExecuteSpecificTask(std::shared_ptr<struct Task> task);
+        struct Task& GetTask(uint32_t index) const;
+        void AllocateTasks(uint32_t count, TaskHandle* tasks);
+        void AllocateTaskBlock();
+        void ReleaseTask(uint32_t index);
+
+        template <typename CreateTask>
+        void SubmitBatch(uint32_t count, TaskHandle* tasks, JobGroup* group, CreateTask&& createTask);
+        void Enqueue(TaskHandle const* tasks, uint32_t count);
+        bool AddSuccessor(TaskHandle task, TaskHandle successor);
+        void ReleaseDependency(TaskHandle task, bool cancelled);
+        void WakeWorkers(uint32_t count);
+        bool HasQueuedTasks() const;
+
+        /* Returns a task removed from a queue, it still has to be claimed before running it */
+        bool FindTask(TaskHandle& task);
+        bool StealTask(Worker* thief, TaskHandle& task);
+        bool TryClaim(TaskHandle task);
+        void RunQueuedTask(TaskHandle task);
+        void Execute(TaskHandle task);
+        void FinishTask(TaskHandle task, bool cancelled);
+
+        void WaitForTaskToFinish(TaskHandle task);
+        void ExecuteTasksUntilTaskCompleted(TaskHandle task);
+        void ExecuteSpecificTask(TaskHandle task);
 
         void WaitForAllToFinish();
         void WaitForAllExecutingTasks();
 
+        /* Spins for a while, then sleeps until the condition holds. Executes queued tasks in the meantime if asked to.
+         * waitingThreads is the counter that makes FinishTask wake the thread up
+         */
+        template <typename Condition>
+        void WaitUntil(Condition&& condition, bool executeTasks, std::atomic<uint32_t>& waitingThreads);
+
     private:
         std::vector<std::thread> mThreads;
-
+        std::vector<std::unique_ptr<Worker>> mWorkers;
+
+        /* Tasks live in blocks that are never freed, so a handle can always be checked against its task.
+         * The table has a fixed size, so it can be read without a lock while new blocks are added
+         */
+        std::unique_ptr<struct Task*[]> mTaskBlocks;
+        std::vector<std::unique_ptr<struct Task[]>> mTaskStorage;
+        std::mutex mFreeTasksMutex;
+        std::vector<uint32_t> mFreeTasks;
+
+        /* Tasks submitted by threads that are not part of the pool */
+        std::mutex mInjectedTasksMutex;
+        std::deque<TaskHandle> mInjectedTasks;
+        std::atomic<uint64_t> mInjectedTasksCount = 0;
+
+        /* Workers that found nothing to steal sleep here */
+        std::mutex mSleepMutex;
         std::condition_variable mWorkersCV;
+        std::atomic<uint32_t> mSleepingWorkers = 0;
         std::atomic<bool> mShouldClose = false;
 
-        // If there will be lots of tasks, adding a look-up table would be very useful
-        std::mutex mWorkListMutex;
-        std::shared_ptr<struct Task> mWorkList = nullptr;
-        
-        /* TODO: Keep track of the last task */
-        // std::shared_ptr<struct Task> mLastTask = nullptr;
+        /* Threads that wait for tasks sleep here. The ones waiting for a task are woken up by every completed task,
+         * the ones waiting for all of them (or all of a group) only once nothing is pending anymore
+         */
+        std::mutex mCompletionMutex;
+        std::condition_variable mCompletionCV;
+        std::atomic<uint32_t> mWaitingThreads = 0;
+        std::atomic<uint32_t> mWaitingForAllThreads = 0;
+        /* Waiting threads that execute tasks, they're woken up by new tasks as well */
+        std::atomic<uint32_t> mHelpingThreads = 0;
+
+        std::atomic<uint32_t> mSpinBudget = DEFAULT_SPIN_BUDGET;
 
-        std::atomic<uint64_t> mActiveTasksCount = 0;
+        /* Submitted tasks that were neither executed nor cancelled yet */
+        std::atomic<uint64_t> mPendingTasks = 0;
     };
 
 
@@ -0,0 +1,80 @@
+#include "CpuFeatures.h"
+
+#if defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#include <immintrin.h>
+#define CPU_FEATURES_MSVC
+#elif defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#define CPU_FEATURES_GCC
+#endif
+
+using namespace Jnrlib;
+
+#if defined(CPU_FEATURES_MSVC) || defined(CPU_FEATURES_GCC)
+static void CpuId(unsigned int leaf, unsigned int subleaf, unsigned int registers[4])
+{
+#if defined(CPU_FEATURES_MSVC)
+    int values[4];
+    __cpuidex(values, (int)leaf, (int)subleaf);
+    for (unsigned int i = 0; i < 4; ++i)
+        registers[i] = (unsigned int)values[i];
+#else
+    __cpuid_count(leaf, subleaf, registers[0], registers[1], registers[2], registers[3]);
+#endif
+}
+
+static unsigned long long GetEnabledRegisterState()
+{
+#if defined(CPU_FEATURES_MSVC)
+    return _xgetbv(0);
+#else
+    unsigned int eax, edx;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return ((unsigned long long)edx << 32) | eax;
+#endif
+}
+
+static CpuFeatures QueryCpuFeatures()
+{
+    CpuFeatures features{};
+
+    unsigned int registers[4]; // eax, ebx, ecx, edx
+    CpuId(0, 0, registers);
+    unsigned int maxLeaf = registers[0];
+    if (maxLeaf < 1)
+        return features;
+
+    CpuId(1, 0, registers);
+    features.sse2 = (registers[3] & (1u << 26)) != 0;
+    features.sse41 = (registers[2] & (1u << 19)) != 0;
+
+    /* The OS has to save the XMM and YMM registers on context switches, otherwise AVX can't be used even if the CPU has it */
+    bool osSavesYmm = false;
+    if ((registers[2] & (1u << 27)) != 0)
+    {
+        osSavesYmm = (GetEnabledRegisterState() & 0x6) == 0x6;
+    }
+    features.avx = osSavesYmm && (registers[2] & (1u << 28)) != 0;
+    features.fma = features.avx && (registers[2] & (1u << 12)) != 0;
+
+    if (maxLeaf >= 7)
+    {
+        CpuId(7, 0, registers);
+        features.avx2 = features.avx && (registers[1] & (1u << 5)) != 0;
+    }
+    return features;
+}
+#else
+static CpuFeatures QueryCpuFeatures()
+{
+    /* Not an x86 CPU */
+    return CpuFeatures{};
+}
+#endif
+
+CpuFeatures const& Jnrlib::GetCpuFeatures()
+{
+    static CpuFeatures const features = QueryCpuFeatures();
+    return features;
+}
@@ -0,0 +1,65 @@
+#include "JobGroup.h"
+#include "glog/logging.h"
+
+using namespace Jnrlib;
+
+JobGroup::JobGroup() :
+    mThreadPool(ThreadPool::Get())
+{ }
+
+JobGroup::~JobGroup()
+{
+    Wait();
+}
+
+TaskHandle JobGroup::ExecuteDeffered(TaskFunction func)
+{
+    return mThreadPool->ExecuteInGroup(this, std::move(func));
+}
+
+std::vector<TaskHandle> JobGroup::ExecuteBatchDeffered(std::vector<TaskFunction> funcs)
+{
+    return mThreadPool->ExecuteBatchInGroup(this, std::move(funcs));
+}
+
+TaskHandle JobGroup::ExecuteAfter(std::span<TaskHandle const> predecessors, TaskFunction func)
+{
+    return mThreadPool->ExecuteAfterInGroup(this, predecessors, std::move(func));
+}
+
+TaskHandle JobGroup::ExecuteAfter(std::initializer_list<TaskHandle> predecessors, TaskFunction func)
+{
+    return ExecuteAfter(std::span<TaskHandle const>(predecessors.begin(), predecessors.size()), std::move(func));
+}
+
+TaskHandle JobGroup::Then(TaskHandle task, TaskFunction func)
+{
+    return ExecuteAfter(std::span<TaskHandle const>(&task, 1), std::move(func));
+}
+
+void JobGroup::Wait(ThreadPool::WaitPolicy wp)
+{
+    mThreadPool->WaitForGroup(*this, wp);
+}
+
+void JobGroup::Cancel()
+{
+    VLOG(3) << "Job group with " << mPendingTasks.load() << " pending tasks was cancelled";
+    mCancelled = true;
+}
+
+void JobGroup::Reset()
+{
+    CHECK(IsDone()) << "Can't reset a job group that still has tasks";
+    mCancelled = false;
+}
+
+bool JobGroup::IsDone() const
+{
+    return mPendingTasks.load() == 0;
+}
+
+CancellationToken JobGroup::GetToken() const
+{
+    return CancellationToken(&mCancelled);
+}
@@ -0,0 +1,163 @@
+#include "MappedFile.h"
+
+#include <utility>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace Jnrlib;
+
+MappedFile::~MappedFile()
+{
+    Close();
+}
+
+MappedFile::MappedFile(MappedFile&& rhs) noexcept
+{
+    *this = std::move(rhs);
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& rhs) noexcept
+{
+    if (this != &rhs)
+    {
+        Close();
+        std::swap(mData, rhs.mData);
+        std::swap(mSize, rhs.mSize);
+#ifdef _WIN32
+        std::swap(mFileHandle, rhs.mFileHandle);
+        std::swap(mMappingHandle, rhs.mMappingHandle);
+#endif
+    }
+    return *this;
+}
+
+#ifdef _WIN32
+
+bool MappedFile::Open(std::string const& path)
+{
+    Close();
+
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER size{};
+    if (!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+    {
+        CloseHandle(file);
+        return false;
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping == nullptr)
+    {
+        CloseHandle(file);
+        return false;
+    }
+
+    void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (data == nullptr)
+    {
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return false;
+    }
+
+    mFileHandle = file;
+    mMappingHandle = mapping;
+    mData = (unsigned char const*)data;
+    mSize = (size_t)size.QuadPart;
+    return true;
+}
+
+void MappedFile::Close()
+{
+    if (mData != nullptr)
+        UnmapViewOfFile(mData);
+    if (mMappingHandle != nullptr)
+        CloseHandle((HANDLE)mMappingHandle);
+    if (mFileHandle != nullptr)
+        CloseHandle((HANDLE)mFileHandle);
+
+    mData = nullptr;
+    mSize = 0;
+    mMappingHandle = nullptr;
+    mFileHandle = nullptr;
+}
+
+#else
+
+bool MappedFile::Open(std::string const& path)
+{
+    Close();
+
+    int file = open(path.c_str(), O_RDONLY);
+    if (file == -1)
+        return false;
+
+    struct stat fileInfo{};
+    if (fstat(file, &fileInfo) != 0 || fileInfo.st_size == 0)
+    {
+        close(file);
+        return false;
+    }
+
+    void* data = mmap(nullptr, (size_t)fileInfo.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+    /* The mapping keeps its own reference to the file */
+    close(file);
+    if (data == MAP_FAILED)
+        return false;
+
+    mData = (unsigned char const*)data;
+    mSize = (size_t)fileInfo.st_size;
+    return true;
+}
+
+void MappedFile::Close()
+{
+    if (mData != nullptr)
+        munmap((void*)mData, mSize);
+
+    mData = nullptr;
+    mSize = 0;
+}
+
+#endif
+
+bool MappedFile::IsOpen() const
+{
+    return mData != nullptr;
+}
+
+unsigned char const* MappedFile::GetData() const
+{
+    return mData;
+}
+
+size_t MappedFile::GetSize() const
+{
+    return mSize;
+}
+
+uint64_t Jnrlib::HashBytes(void const* data, size_t size, uint64_t hash)
+{
+    constexpr const uint64_t FNV_PRIME = 0x100000001b3ull;
+
+    unsigned char const* bytes = (unsigned char const*)data;
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
@@ -0,0 +1,141 @@
+#include "MemoryArena.h"
+#include "MathHelpers.h"
+
+#include <glog/logging.h>
+#include <algorithm>
+
+using namespace Jnrlib;
+
+static uint8_t* AllocateBlockMemory(size_t size)
+{
+    return (uint8_t*)::operator new(size, std::align_val_t{alignof(std::max_align_t)});
+}
+
+static void FreeBlockMemory(uint8_t* memory)
+{
+    ::operator delete(memory, std::align_val_t{alignof(std::max_align_t)});
+}
+
+MemoryArena::MemoryArena(size_t blockSize) :
+    mBlockSize(blockSize)
+{
+    CHECK(blockSize > 0) << "A memory arena needs a block size greater than 0";
+}
+
+MemoryArena::~MemoryArena()
+{
+    Release();
+}
+
+MemoryArena::MemoryArena(MemoryArena&& rhs) noexcept :
+    mBlockSize(rhs.mBlockSize),
+    mCurrentBlock(rhs.mCurrentBlock),
+    mCurrentOffset(rhs.mCurrentOffset),
+    mUsedBlocks(std::move(rhs.mUsedBlocks)),
+    mAvailableBlocks(std::move(rhs.mAvailableBlocks)),
+    mTotalUsed(rhs.mTotalUsed)
+{
+    rhs.mCurrentBlock = Block{ nullptr, 0 };
+    rhs.mCurrentOffset = 0;
+    rhs.mTotalUsed = 0;
+}
+
+MemoryArena& MemoryArena::operator=(MemoryArena&& rhs) noexcept
+{
+    if (this != &rhs)
+    {
+        Release();
+
+        mBlockSize = rhs.mBlockSize;
+        mCurrentBlock = rhs.mCurrentBlock;
+        mCurrentOffset = rhs.mCurrentOffset;
+        mUsedBlocks = std::move(rhs.mUsedBlocks);
+        mAvailableBlocks = std::move(rhs.mAvailableBlocks);
+        mTotalUsed = rhs.mTotalUsed;
+
+        rhs.mCurrentBlock = Block{ nullptr, 0 };
+        rhs.mCurrentOffset = 0;
+        rhs.mTotalUsed = 0;
+    }
+    return *this;
+}
+
+void* MemoryArena::Alloc(size_t size, size_t alignment)
+{
+    CHECK(alignment <= alignof(std::max_align_t)) << "Memory arena can't align allocations to more than " << alignof(std::max_align_t) << " bytes";
+
+    mCurrentOffset = AlignUp(mCurrentOffset, alignment);
+    if (mCurrentOffset + size > mCurrentBlock.size)
+    {
+        /* Current block is full => retire it and get a new one */
+        if (mCurrentBlock.memory != nullptr)
+        {
+            mUsedBlocks.push_back(mCurrentBlock);
+            mCurrentBlock = Block{ nullptr, 0 };
+        }
+
+        for (auto it = mAvailableBlocks.begin(); it != mAvailableBlocks.end(); ++it)
+        {
+            if (it->size >= size)
+            {
+                mCurrentBlock = *it;
+                mAvailableBlocks.erase(it);
+                break;
+            }
+        }
+
+        if (mCurrentBlock.memory == nullptr)
+        {
+            size_t blockSize = std::max(size, mBlockSize);
+            mCurrentBlock = Block{ AllocateBlockMemory(blockSize), blockSize };
+        }
+        mCurrentOffset = 0;
+    }
+
+    void* result = mCurrentBlock.memory + mCurrentOffset;
+    mCurrentOffset += size;
+    mTotalUsed += size;
+    return result;
+}
+
+void MemoryArena::Reset()
+{
+    if (mCurrentBlock.memory != nullptr)
+    {
+        mAvailableBlocks.push_back(mCurrentBlock);
+        mCurrentBlock = Block{ nullptr, 0 };
+    }
+    mAvailableBlocks.insert(mAvailableBlocks.end(), mUsedBlocks.begin(), mUsedBlocks.end());
+    mUsedBlocks.clear();
+    mCurrentOffset = 0;
+    mTotalUsed = 0;
+}
+
+void MemoryArena::Release()
+{
+    Reset();
+    for (auto const& block : mAvailableBlocks)
+    {
+        FreeBlockMemory(block.memory);
+    }
+    mAvailableBlocks.clear();
+}
+
+size_t MemoryArena::GetTotalReserved() const
+{
+    size_t totalReserved = mCurrentBlock.size;
+    for (auto const& block : mUsedBlocks)
+    {
+        totalReserved += block.size;
+    }
+    for (auto const& block : mAvailableBlocks)
+    {
+        totalReserved += block.size;
+    }
+    return totalReserved;
+}
+
+size_t MemoryArena::GetTotalUsed() const
+{
+    return mTotalUsed;
+}
@@ -1,59 +1,304 @@
 #include "ThreadPool.h"
+#include "JobGroup.h"
 #include "glog/logging.h"
 #include "Exceptions.h"
 
-#undef max
+#include <algorithm>
 
-#define WAIT_ALL_ACTIVE_THREADS \
-{ \
-while (true) \
-{\
-    if (mActiveTasksCount.load() == 0) \
-        break; \
-}\
-}
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CPU_RELAX() _mm_pause()
+#else
+#define CPU_RELAX() std::this_thread::yield()
+#endif
+
+#undef max
+#undef min
 
 namespace Jnrlib
 {
-    struct Task
+    class SpinLock
     {
-        static uint64_t TaskID;
+    public:
+        void lock()
+        {
+            while (mFlag.test_and_set(std::memory_order_acquire))
+            {
+                while (mFlag.test(std::memory_order_relaxed))
+                    std::this_thread::yield();
+            }
+        }
+
+        void unlock()
+        {
+            mFlag.clear(std::memory_order_release);
+        }
 
-        Task(std::function<void()> work) : taskID(TaskID++), work(work)
+    private:
+        std::atomic_flag mFlag;
+    };
+
+    /* The storage of a task, reused once the task is done */
+    struct alignas(64) Task
+    {
+        enum Status : uint32_t
         {
-            VLOG(2) << "Task with ID = " << taskID << " was created";
+            FREE,
+            /* Has predecessors that are not done yet */
+            WAITING,
+            QUEUED,
+            RUNNING,
         };
 
-        inline ~Task()
+        static uint64_t PackState(uint32_t generation, Status status)
+        {
+            return ((uint64_t)generation << 32) | status;
+        }
+
+        static uint32_t GetGeneration(uint64_t state)
         {
-            VLOG(2) << "Task with ID = " << taskID << " was destroyed";
+            return (uint32_t)(state >> 32);
         }
 
-        uint64_t taskID;
+        /* The generation in the upper 32 bits, the status in the lower ones */
+        std::atomic<uint64_t> state = PackState(0, FREE);
+        TaskFunction work;
 
-        std::function<void()> work;
-        std::shared_ptr<Task> nextTask = nullptr;
+        /* Predecessors that are not done yet */
+        std::atomic<uint32_t> remainingDependencies = 0;
+        /* Set when a predecessor was cancelled, the task is then cancelled instead of executed */
+        std::atomic<bool> cancelled = false;
+        JobGroup* group = nullptr;
 
-        bool completed = false;
+        /* Tasks waiting for this one. Once the generation moves on, nothing can be added anymore */
+        SpinLock successorsLock;
+        std::vector<TaskHandle> successors;
 
-        void Work()
+        bool IsDone(uint32_t generation) const
         {
-            VLOG(3) << "Task with ID = " << taskID << " is being executed now";
-            work();
-            Complete();
-            VLOG(3) << "Task with ID = " << taskID << " is done being executed";
+            return GetGeneration(state.load()) != generation;
         }
-        bool IsCompleted() const
+    };
+
+    /* Tasks are allocated in blocks of TASK_BLOCK_SIZE, the table can hold up to 64M tasks in flight */
+    static constexpr const uint32_t TASK_BLOCK_SHIFT = 12;
+    static constexpr const uint32_t TASK_BLOCK_SIZE = 1 << TASK_BLOCK_SHIFT;
+    static constexpr const uint32_t MAX_TASK_BLOCKS = 1 << 14;
+    /* Every worker keeps this many free tasks around, so it only takes the lock once in a while */
+    static constexpr const uint32_t TASK_CACHE_SIZE = 256;
+
+    static uint64_t PackHandle(TaskHandle task)
+    {
+        return ((uint64_t)task.generation << 32) | task.index;
+    }
+
+    static TaskHandle UnpackHandle(uint64_t packed)
+    {
+        return TaskHandle{ .index = (uint32_t)packed, .generation = (uint32_t)(packed >> 32) };
+    }
+
+    static constexpr const uint64_t NO_TASK = ~0ull;
+
+    /* Chase-Lev deque (Le et al., "Correct and Efficient Work-Stealing for Weak Memory Models") of packed task handles.
+     * Push and Pop may only be called by the owner, Steal by any thread
+     */
+    class WorkStealingDeque
+    {
+        struct Buffer
         {
-            return completed;
+            Buffer(int64_t capacity) :
+                capacity(capacity), mask(capacity - 1), items(new std::atomic<uint64_t>[capacity])
+            { }
+
+            uint64_t Get(int64_t index) const
+            {
+                return items[index & mask].load(std::memory_order_relaxed);
+            }
+
+            void Put(int64_t index, uint64_t task)
+            {
+                items[index & mask].store(task, std::memory_order_relaxed);
+            }
+
+            int64_t capacity;
+            int64_t mask;
+            std::unique_ptr<std::atomic<uint64_t>[]> items;
         };
-        void Complete()
+
+    public:
+        WorkStealingDeque()
+        {
+            mBuffers.emplace_back(new Buffer(INITIAL_CAPACITY));
+            mBuffer.store(mBuffers.back().get(), std::memory_order_relaxed);
+        }
+
+        void Push(uint64_t task)
         {
-            completed = true;
+            int64_t bottom = mBottom.load(std::memory_order_relaxed);
+            int64_t top = mTop.load(std::memory_order_acquire);
+            Buffer* buffer = mBuffer.load(std::memory_order_relaxed);
+            if (bottom - top > buffer->capacity - 1)
+            {
+                buffer = Grow(buffer, bottom, top);
+            }
+            buffer->Put(bottom, task);
+            std::atomic_thread_fence(std::memory_order_release);
+            mBottom.store(bottom + 1, std::memory_order_relaxed);
         }
+
+        uint64_t Pop()
+        {
+            int64_t bottom = mBottom.load(std::memory_order_relaxed) - 1;
+            Buffer* buffer = mBuffer.load(std::memory_order_relaxed);
+            mBottom.store(bottom, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            int64_t top = mTop.load(std::memory_order_relaxed);
+
+            if (top > bottom)
+            {
+                mBottom.store(bottom + 1, std::memory_order_relaxed);
+                return NO_TASK;
+            }
+
+            uint64_t task = buffer->Get(bottom);
+            if (top == bottom)
+            {
+                /* The last task, race the thieves for it */
+                if (!mTop.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                {
+                    task = NO_TASK;
+                }
+                mBottom.store(bottom + 1, std::memory_order_relaxed);
+            }
+            return task;
+        }
+
+        uint64_t Steal()
+        {
+            while (true)
+            {
+                int64_t top = mTop.load(std::memory_order_acquire);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                int64_t bottom = mBottom.load(std::memory_order_acquire);
+                if (top >= bottom)
+                {
+                    return NO_TASK;
+                }
+
+                uint64_t task = mBuffer.load(std::memory_order_acquire)->Get(top);
+                if (mTop.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                {
+                    return task;
+                }
+                /* Lost the race against another thief or the owner, try again while there's something left */
+            }
+        }
+
+        bool IsEmpty() const
+        {
+            return mTop.load(std::memory_order_relaxed) >= mBottom.load(std::memory_order_relaxed);
+        }
+
+    private:
+        Buffer* Grow(Buffer* buffer, int64_t bottom, int64_t top)
+        {
+            auto newBuffer = std::make_unique<Buffer>(buffer->capacity * 2);
+            for (int64_t i = top; i < bottom; ++i)
+            {
+                newBuffer->Put(i, buffer->Get(i));
+            }
+
+            /* Thieves might still read from the old buffer, so it's kept until the deque is destroyed */
+            mBuffers.emplace_back(std::move(newBuffer));
+            mBuffer.store(mBuffers.back().get(), std::memory_order_release);
+            return mBuffers.back().get();
+        }
+
+    private:
+        static constexpr const int64_t INITIAL_CAPACITY = 1024;
+
+        std::atomic<int64_t> mTop = 0;
+        std::atomic<int64_t> mBottom = 0;
+        std::atomic<Buffer*> mBuffer = nullptr;
+        std::vector<std::unique_ptr<Buffer>> mBuffers;
     };
 
-    uint64_t Task::TaskID = 0;
+    struct ThreadPool::Worker
+    {
+        WorkStealingDeque tasks;
+        std::vector<uint32_t> freeTasks;
+    };
+
+    /* Set on the threads of the pool */
+    static thread_local ThreadPool const* tCurrentPool = nullptr;
+    static thread_local uint32_t tWorkerIndex = 0;
+
+    static uint32_t GetRandomNumber()
+    {
+        /* xorshift, good enough for picking victims */
+        thread_local uint32_t state = (uint32_t)std::hash<std::thread::id>{}(std::this_thread::get_id()) | 1u;
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state;
+    }
+
+    /* A spin round looks for work once and then pauses for a bit */
+    static constexpr const uint32_t PAUSES_PER_SPIN = 16;
+    /* The adaptive limit never drops below this, so a thread can find out that spinning pays off again */
+    static constexpr const uint32_t MIN_SPIN_ROUNDS = 4;
+
+    /* The spin limit of the current thread, between MIN_SPIN_ROUNDS and the spin budget of the pool */
+    static thread_local uint32_t tSpinLimit = ~0u;
+
+    /* Spin-then-park. A wait that ends while spinning doubles the limit of the thread, a wait that has to
+     * sleep halves it, so threads that always end up sleeping stop burning the core first
+     */
+    class Backoff
+    {
+    public:
+        Backoff(uint32_t budget) :
+            mBudget(budget), mLimit(std::min(tSpinLimit, budget))
+        { }
+
+        /* Returns false once the thread spun for as long as its limit allows */
+        bool Spin()
+        {
+            if (mSpins >= mLimit)
+                return false;
+
+            mSpins++;
+            for (uint32_t i = 0; i < PAUSES_PER_SPIN; ++i)
+            {
+                CPU_RELAX();
+            }
+            return true;
+        }
+
+        /* Something showed up, the next wait starts from scratch */
+        void Succeeded()
+        {
+            if (mSpins > 0)
+            {
+                mLimit = std::min(mBudget, std::max(mLimit * 2, MIN_SPIN_ROUNDS));
+                tSpinLimit = mLimit;
+            }
+            mSpins = 0;
+        }
+
+        /* Nothing showed up while spinning, the thread goes to sleep */
+        void Parked()
+        {
+            mLimit = std::min(mBudget, std::max(mLimit / 2, MIN_SPIN_ROUNDS));
+            tSpinLimit = mLimit;
+            mSpins = 0;
+        }
+
+    private:
+        uint32_t mBudget;
+        uint32_t mLimit;
+        uint32_t mSpins = 0;
+    };
 }
 
 using namespace Jnrlib;
@@ -65,73 +310,106 @@ ThreadPool::ThreadPool(uint32_t numThreads)
 
 ThreadPool::~ThreadPool()
 {
-    mShouldClose = true;
+    {
+        std::unique_lock<std::mutex> lock(mSleepMutex);
+        mShouldClose = true;
+    }
+    mWorkersCV.notify_all();
     for (auto& thread : mThreads)
     {
         thread.join();
     }
+
+    /* Destroy the tasks that never got to run */
+    CancelRemainingTasks();
 }
 
-std::shared_ptr<Task> ThreadPool::ExecuteDeffered(std::function<void()> func)
+TaskHandle ThreadPool::ExecuteDeffered(TaskFunction func)
 {
-    auto currentTask = std::make_shared<Task>(func);
-    {
-        std::unique_lock lock(mWorkListMutex);
-        if (mWorkList != nullptr)
-        {
-            currentTask->nextTask = mWorkList;
-            mWorkList = currentTask;
-        }
-        else
-        {
-            mWorkList = currentTask;
-        }
-    }
-    VLOG(3) << "Task " << currentTask->taskID << " was inserted into the work list";
-    mWorkersCV.notify_all();
-    return currentTask;
+    return ExecuteInGroup(nullptr, std::move(func));
 }
 
-std::vector<std::shared_ptr<struct Task>> ThreadPool::ExecuteBatchDeffered(std::vector<std::function<void()>> const& funcs)
+std::vector<TaskHandle> ThreadPool::ExecuteBatchDeffered(std::vector<TaskFunction> funcs)
 {
-    std::vector<std::shared_ptr<struct Task>> tasks;
-    tasks.reserve(funcs.size());
+    return ExecuteBatchInGroup(nullptr, std::move(funcs));
+}
 
-    std::shared_ptr<struct Task> taskList;
-    for (auto const& func : funcs)
+TaskHandle ThreadPool::ExecuteInGroup(JobGroup* group, TaskFunction func)
+{
+    TaskHandle task;
+    SubmitBatch(1, &task, group, [&](uint32_t)
     {
-        auto currentTask = std::make_shared<Task>(func);
-        if (taskList == nullptr) [[unlikely]]
-        {
-            taskList = currentTask;
-        }
-        else
-        {
-            currentTask->nextTask = taskList;
-            taskList = currentTask;
-        }
+        return std::move(func);
+    });
+    VLOG(3) << "Task " << task.index << " (generation " << task.generation << ") was inserted into the work list";
+    return task;
+}
+
+std::vector<TaskHandle> ThreadPool::ExecuteBatchInGroup(JobGroup* group, std::vector<TaskFunction> funcs)
+{
+    std::vector<TaskHandle> tasks(funcs.size());
+    SubmitBatch((uint32_t)funcs.size(), tasks.data(), group, [&](uint32_t i)
+    {
+        return std::move(funcs[i]);
+    });
+    VLOG(3) << "A batch of " << tasks.size() << " tasks was inserted in the work list";
+    return tasks;
+}
 
-        tasks.push_back(currentTask);
-        VLOG(3) << "Task " << currentTask->taskID << " was inserted into a local work list";
+TaskHandle ThreadPool::ExecuteAfterInGroup(JobGroup* group, std::span<TaskHandle const> predecessors, TaskFunction func)
+{
+    TaskHandle task;
+    AllocateTasks(1, &task);
+
+    auto& storage = GetTask(task.index);
+    storage.work = std::move(func);
+    storage.cancelled = false;
+    storage.group = group;
+    if (group != nullptr)
+    {
+        group->mPendingTasks++;
     }
+    /* The extra dependency holds the task back until all the predecessors know about it */
+    storage.remainingDependencies = 1;
+    storage.state.store(Task::PackState(task.generation, Task::WAITING), std::memory_order_release);
+    mPendingTasks++;
 
+    for (auto const& predecessor : predecessors)
     {
-        std::unique_lock lock(mWorkListMutex);
-        if (mWorkList != nullptr)
-        {
-            CHECK(tasks[0]->nextTask == nullptr) << "The first task in the vector is not the first task inserted in the local work list";
-            tasks[0]->nextTask = mWorkList;
-            mWorkList = taskList;
-        }
-        else
+        if (!predecessor.IsValid())
+            continue;
+
+        /* Counted before it's added, otherwise the predecessor could finish and release the task too early */
+        storage.remainingDependencies++;
+        if (!AddSuccessor(predecessor, task))
         {
-            mWorkList = taskList;
+            storage.remainingDependencies--;
         }
-        VLOG(3) << "Local task list was inserted in the global work list";
     }
+    VLOG(3) << "Task " << task.index << " (generation " << task.generation << ") waits for " << predecessors.size() << " tasks";
 
-    mWorkersCV.notify_all();
-    return tasks;
+    ReleaseDependency(task, false);
+    return task;
+}
+
+TaskHandle ThreadPool::ExecuteAfter(std::span<TaskHandle const> predecessors, TaskFunction func)
+{
+    return ExecuteAfterInGroup(nullptr, predecessors, std::move(func));
+}
+
+TaskHandle ThreadPool::ExecuteAfter(std::initializer_list<TaskHandle> predecessors, TaskFunction func)
+{
+    return ExecuteAfter(std::span<TaskHandle const>(predecessors.begin(), predecessors.size()), std::move(func));
+}
+
+TaskHandle ThreadPool::Then(TaskHandle task, TaskFunction func)
+{
+    return ExecuteAfter(std::span<TaskHandle const>(&task, 1), std::move(func));
+}
+
+TaskHandle ThreadPool::Join(std::span<TaskHandle const> tasks)
+{
+    return ExecuteAfter(tasks, TaskFunction());
 }
 
 void ThreadPool::ExecuteParallelForImmediate(std::function<void(uint32_t)> const& func, uint32_t size, uint32_t batchSize, WaitPolicy wp)
@@ -148,42 +426,32 @@ void ThreadPool::ExecuteParallelForImmediate(std::function<void(uint32_t)> const
     uint32_t remainingTasks = size % batchSize;
     uint32_t fullTasks = size / batchSize;
 
-    std::vector<std::function<void()>> tasks;
-    tasks.reserve(fullTasks + remainingTasks);
+    /* With EXECUTE_THEN_EXIT the remainder is executed on this thread while the batches are picked up */
+    bool remainderIsTask = wp != WaitPolicy::EXECUTE_THEN_EXIT && remainingTasks > 0;
+    uint32_t taskCount = fullTasks + (remainderIsTask ? 1 : 0);
 
-    for (uint32_t taskBatch = 0; taskBatch < fullTasks; ++taskBatch)
+    /* The tasks only point to func, it outlives them since all of them are waited for */
+    std::vector<TaskHandle> tasksToWait(taskCount);
+    SubmitBatch(taskCount, tasksToWait.data(), nullptr, [&func, batchSize, size](uint32_t taskBatch)
     {
-        auto task = [batchSize, func, taskBatch]()
+        uint32_t first = taskBatch * batchSize;
+        uint32_t last = std::min(first + batchSize, size);
+        return [&func, first, last]()
         {
-            for (uint32_t i = 0; i < batchSize; ++i)
+            for (uint32_t i = first; i < last; ++i)
             {
-                func(taskBatch * batchSize + i);
+                func(i);
             }
         };
-        tasks.emplace_back(task);
-    }
+    });
 
-    std::vector<std::shared_ptr<struct Jnrlib::Task>> tasksToWait;
-    if (wp == WaitPolicy::EXECUTE_THEN_EXIT)
+    if (!remainderIsTask)
     {
-        tasksToWait = ExecuteBatchDeffered(tasks);
         for (uint32_t i = 0; i < remainingTasks; ++i)
         {
             func(fullTasks * batchSize + i);
         }
     }
-    else
-    {
-        auto task = [&]()
-        {
-            for (uint32_t i = 0; i < remainingTasks; ++i)
-            {
-                func(fullTasks * batchSize + i);
-            }
-        };
-        tasks.emplace_back(task);
-        tasksToWait = ExecuteBatchDeffered(tasks);
-    }
 
     for (const auto& task : tasksToWait)
     {
@@ -191,21 +459,18 @@ void ThreadPool::ExecuteParallelForImmediate(std::function<void(uint32_t)> const
     }
 }
 
-bool ThreadPool::IsTaskCompleted(std::shared_ptr<struct Task> task)
+bool ThreadPool::IsTaskCompleted(TaskHandle task) const
 {
-    return task->completed;
+    CHECK(task.IsValid()) << "Invalid task handle";
+    return GetTask(task.index).IsDone(task.generation);
 }
 
 
 uint32_t ThreadPool::GetCurrentThreadId() const
 {
-    auto currentThreadId = std::this_thread::get_id();
-    for (uint32_t i = 0; i < mThreads.size(); ++i)
+    if (tCurrentPool == this)
     {
-        if (currentThreadId == mThreads[i].get_id())
-        {
-            return i;
-        }
+        return tWorkerIndex;
     }
     return -1;
 }
@@ -215,8 +480,19 @@ uint32_t ThreadPool::GetNumberOfThreads() const
     return (uint32_t)mThreads.size();
 }
 
-void ThreadPool::Wait(std::shared_ptr<struct Task> task, WaitPolicy wp)
+void ThreadPool::SetSpinBudget(uint32_t rounds)
 {
+    mSpinBudget = rounds;
+}
+
+uint32_t ThreadPool::GetSpinBudget() const
+{
+    return mSpinBudget.load();
+}
+
+void ThreadPool::Wait(TaskHandle task, WaitPolicy wp)
+{
+    CHECK(task.IsValid()) << "Invalid task handle";
     if (wp == WaitPolicy::EXIT_ASAP)
     {
         WaitForTaskToFinish(task);
@@ -248,21 +524,57 @@ void ThreadPool::WaitForAll(WaitPolicy wp)
 
 void ThreadPool::CancelRemainingTasks()
 {
-    std::unique_lock<std::mutex> lock(mWorkListMutex);
-    
-    // Make sure we delete everything
-    while (mWorkList)
+    auto cancel = [this](TaskHandle task)
+    {
+        if (TryClaim(task))
+        {
+            VLOG(3) << "Task " << task.index << " (generation " << task.generation << ") was cancelled";
+            GetTask(task.index).work.Reset();
+            FinishTask(task, true);
+        }
+    };
+
+    /* Cancelling a task queues its successors as cancelled, so keep going until the queues stay empty */
+    bool foundTasks = true;
+    while (foundTasks)
     {
-        mWorkList = mWorkList->nextTask;
+        std::deque<TaskHandle> injectedTasks;
+        {
+            std::unique_lock<std::mutex> lock(mInjectedTasksMutex);
+            injectedTasks.swap(mInjectedTasks);
+            mInjectedTasksCount = 0;
+        }
+        foundTasks = !injectedTasks.empty();
+        for (auto task : injectedTasks)
+        {
+            cancel(task);
+        }
+
+        for (auto& worker : mWorkers)
+        {
+            for (uint64_t task = worker->tasks.Steal(); task != NO_TASK; task = worker->tasks.Steal())
+            {
+                cancel(UnpackHandle(task));
+                foundTasks = true;
+            }
+        }
     }
 }
 
 void ThreadPool::Init(uint32_t nthreads)
 {
     auto numThreads = std::max(1u, nthreads);
+    mWorkers.reserve(numThreads);
     mThreads.reserve(numThreads);
-    
-    for (uint32_t i = 0; i < nthreads; ++i)
+
+    mTaskBlocks.reset(new Task*[MAX_TASK_BLOCKS]());
+    AllocateTaskBlock();
+
+    for (uint32_t i = 0; i < numThreads; ++i)
+    {
+        mWorkers.emplace_back(std::make_unique<Worker>());
+    }
+    for (uint32_t i = 0; i < numThreads; ++i)
     {
         mThreads.emplace_back(&ThreadPool::WorkerThread, this, i);
     }
@@ -270,274 +582,427 @@ void ThreadPool::Init(uint32_t nthreads)
 
 void ThreadPool::WorkerThread(uint32_t index)
 {
-    std::unique_lock<std::mutex> lock(mWorkListMutex);
-    while (true)
+    tCurrentPool = this;
+    tWorkerIndex = index;
+
+    while (!mShouldClose)
     {
-        if (!mShouldClose && mWorkList == nullptr)
+        Backoff backoff(mSpinBudget.load(std::memory_order_relaxed));
+        if (TaskHandle task; FindTask(task))
         {
-            // No work to do, just wait
-            VLOG(4) << "Thread " << index << " starts waiting for work";
-            mWorkersCV.wait(lock, [this] { return mWorkList != nullptr; });
-            VLOG(4) << "Thread " << index << " stopped waiting for work" ;
+            RunQueuedTask(task);
+            continue;
         }
-        
-        if (mShouldClose)
+
+        while (backoff.Spin() && !mShouldClose)
         {
-            VLOG(4) << "Thread " << index << " is shutting down";
-            break;
+            if (HasQueuedTasks())
+                break;
         }
-        else
+        if (HasQueuedTasks())
         {
-            if (mWorkList == nullptr)
-                continue;
-
-            std::shared_ptr<Task> myTask = mWorkList;
-            mWorkList = mWorkList->nextTask;
-            myTask->nextTask = nullptr;
-            
-            {
-                mActiveTasksCount++;
-                VLOG(3) << "Thread " << index << " increased active tasks to " << mActiveTasksCount;
-                VLOG(2) << "Adding to active tasks task with id = " << myTask->taskID;
-            }
+            backoff.Succeeded();
+            continue;
+        }
+        backoff.Parked();
+
+        // No work to do, just wait
+        VLOG(4) << "Thread " << index << " starts waiting for work";
+        std::unique_lock<std::mutex> lock(mSleepMutex);
+        mSleepingWorkers++;
+        /* Pairs with the fence in WakeWorkers: either we see the new task or the submitter sees us sleeping */
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        mWorkersCV.wait(lock, [this] { return mShouldClose || HasQueuedTasks(); });
+        mSleepingWorkers--;
+        VLOG(4) << "Thread " << index << " stopped waiting for work";
+    }
+    VLOG(4) << "Thread " << index << " is shutting down";
+}
 
-            lock.unlock();
+Task& ThreadPool::GetTask(uint32_t index) const
+{
+    return mTaskBlocks[index >> TASK_BLOCK_SHIFT][index & (TASK_BLOCK_SIZE - 1)];
+}
 
-            myTask->Work();
+void ThreadPool::AllocateTasks(uint32_t count, TaskHandle* tasks)
+{
+    uint32_t allocated = 0;
+    std::vector<uint32_t>* cache = tCurrentPool == this ? &mWorkers[tWorkerIndex]->freeTasks : nullptr;
+    if (cache != nullptr)
+    {
+        for (; allocated < count && !cache->empty(); ++allocated)
+        {
+            tasks[allocated].index = cache->back();
+            cache->pop_back();
+        }
+    }
 
-            {
-                VLOG(2) << "Removing to active tasks task with id = " << myTask->taskID;
-                mActiveTasksCount--;
-                VLOG(3) << "Thread " << index << " decreased active tasks to " << mActiveTasksCount;
-                mWorkersCV.notify_all();
-            }
+    if (allocated < count)
+    {
+        std::unique_lock<std::mutex> lock(mFreeTasksMutex);
+        uint32_t needed = count - allocated + (cache != nullptr ? TASK_CACHE_SIZE : 0);
+        while (mFreeTasks.size() < needed)
+        {
+            AllocateTaskBlock();
+        }
 
-            lock.lock();
+        for (; allocated < count; ++allocated)
+        {
+            tasks[allocated].index = mFreeTasks.back();
+            mFreeTasks.pop_back();
         }
+        if (cache != nullptr)
+        {
+            cache->insert(cache->end(), mFreeTasks.end() - TASK_CACHE_SIZE, mFreeTasks.end());
+            mFreeTasks.resize(mFreeTasks.size() - TASK_CACHE_SIZE);
+        }
+    }
+
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        tasks[i].generation = Task::GetGeneration(GetTask(tasks[i].index).state.load(std::memory_order_relaxed));
     }
 }
 
-void ThreadPool::WaitForTaskToFinish(std::shared_ptr<struct Task> task)
+void ThreadPool::AllocateTaskBlock()
 {
-    // Just wait for other thread to finish this
-    std::unique_lock<std::mutex> lock(mWorkListMutex);
-    if (task->IsCompleted())
-        return;
-    mWorkersCV.wait(lock, [&]
+    uint32_t blockIndex = (uint32_t)mTaskStorage.size();
+    CHECK(blockIndex < MAX_TASK_BLOCKS) << "Too many tasks in flight";
+
+    mTaskStorage.emplace_back(new Task[TASK_BLOCK_SIZE]);
+    mTaskBlocks[blockIndex] = mTaskStorage.back().get();
+
+    /* Hand out the lower indices first */
+    uint32_t firstIndex = blockIndex << TASK_BLOCK_SHIFT;
+    for (uint32_t i = TASK_BLOCK_SIZE; i > 0; --i)
     {
-        return task->IsCompleted();
-    });
+        mFreeTasks.push_back(firstIndex + i - 1);
+    }
 }
 
-void ThreadPool::ExecuteTasksUntilTaskCompleted(std::shared_ptr<struct Task> task)
+void ThreadPool::ReleaseTask(uint32_t index)
 {
-    // Execute tasks in the queue until the searched task is executed
-    std::unique_lock<std::mutex> lock(mWorkListMutex);
-    while (true)
+    if (tCurrentPool == this)
     {
-        // Is it complete? then return
-        if (task->IsCompleted())
-            break;
-        if (mWorkList == nullptr)
-        {
-            // No work left? Let's check whether the task is completed
-            if (task->IsCompleted())
-            {
-                break;
-            }
+        auto& cache = mWorkers[tWorkerIndex]->freeTasks;
+        cache.push_back(index);
+        if (cache.size() < 2 * TASK_CACHE_SIZE)
+            return;
 
-            // Not completed? Let's wait for active tasks
-            bool found = false;
+        /* Tasks migrate to the workers that execute them, give some back */
+        std::unique_lock<std::mutex> lock(mFreeTasksMutex);
+        mFreeTasks.insert(mFreeTasks.end(), cache.end() - TASK_CACHE_SIZE, cache.end());
+        cache.resize(cache.size() - TASK_CACHE_SIZE);
+    }
+    else
+    {
+        std::unique_lock<std::mutex> lock(mFreeTasksMutex);
+        mFreeTasks.push_back(index);
+    }
+}
 
-            /* While waiting for the task to be finished, unlock the mutex, so other threads can still add tasks
-             * and if they do, it means that this task might depend on one of other threads, so give up waiting and 
-             * get back to doing work
-             */
-            bool shouldContinue = false;
-            auto numActiveTasksLast = mActiveTasksCount.load();
-            lock.unlock();
-            while (true)
-            {
-                if (task->IsCompleted())
-                {
-                    found = true;
-                    break;
-                }
-                auto numActiveTasksNow = mActiveTasksCount.load();
-                if (mActiveTasksCount.load() == 0)
-                    break;
+template <typename CreateTask>
+void ThreadPool::SubmitBatch(uint32_t count, TaskHandle* tasks, JobGroup* group, CreateTask&& createTask)
+{
+    if (count == 0)
+        return;
 
-                if (numActiveTasksNow >= numActiveTasksLast)
-                {
-                    shouldContinue = true;
-                }
-                numActiveTasksLast = numActiveTasksNow;
-            }
-            lock.lock();
+    AllocateTasks(count, tasks);
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        auto& task = GetTask(tasks[i].index);
+        task.work = createTask(i);
+        task.cancelled = false;
+        task.group = group;
+        task.state.store(Task::PackState(tasks[i].generation, Task::QUEUED), std::memory_order_release);
+    }
+    mPendingTasks += count;
+    if (group != nullptr)
+    {
+        group->mPendingTasks += count;
+    }
 
-            if (shouldContinue)
-            {
-                /* If there are new tasks added to the work list, we should just give up on waiting this one
-                 * and continue executing taks untill it's finished
-                 */
-                continue;
-            }
+    Enqueue(tasks, count);
+}
 
-            if (!found && !task->IsCompleted())
-            {
-                throw Exceptions::TaskNotFound(task->taskID, __FILE__, __LINE__);
-            }
-            else
-            {
-                break;
-            }
+void ThreadPool::Enqueue(TaskHandle const* tasks, uint32_t count)
+{
+    if (tCurrentPool == this)
+    {
+        auto& worker = mWorkers[tWorkerIndex];
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            worker->tasks.Push(PackHandle(tasks[i]));
         }
+    }
+    else
+    {
+        std::unique_lock<std::mutex> lock(mInjectedTasksMutex);
+        mInjectedTasks.insert(mInjectedTasks.end(), tasks, tasks + count);
+        mInjectedTasksCount += count;
+    }
 
-        // Get the first task in work list and then execute it
-        std::shared_ptr<Task> myTask = mWorkList;
-        mWorkList = mWorkList->nextTask;
-        myTask->nextTask = nullptr;
+    WakeWorkers(std::min(count, (uint32_t)mThreads.size()));
+}
 
-        lock.unlock();
+bool ThreadPool::AddSuccessor(TaskHandle task, TaskHandle successor)
+{
+    auto& storage = GetTask(task.index);
+    std::lock_guard<SpinLock> lock(storage.successorsLock);
+    if (storage.IsDone(task.generation))
+        return false;
 
-        myTask->Work();
+    storage.successors.push_back(successor);
+    return true;
+}
 
-        lock.lock();
+void ThreadPool::ReleaseDependency(TaskHandle task, bool cancelled)
+{
+    auto& storage = GetTask(task.index);
+    if (cancelled)
+    {
+        storage.cancelled = true;
     }
+    if (storage.remainingDependencies.fetch_sub(1, std::memory_order_acq_rel) != 1)
+        return;
+
+    /* A cancelled task is still queued, so long chains are cancelled one task at a time instead of recursively */
+    storage.state.store(Task::PackState(task.generation, Task::QUEUED), std::memory_order_release);
+    Enqueue(&task, 1);
 }
 
-void ThreadPool::ExecuteSpecificTask(std::shared_ptr<struct Task> task)
+void ThreadPool::WakeWorkers(uint32_t count)
 {
-    if (task->IsCompleted())
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (mHelpingThreads.load() > 0)
     {
-        VLOG(4) << "Task" << task->taskID << " is finished, returning";
+        std::unique_lock<std::mutex> lock(mCompletionMutex);
+        mCompletionCV.notify_all();
+    }
+
+    if (mSleepingWorkers.load() == 0)
         return;
+
+    std::unique_lock<std::mutex> lock(mSleepMutex);
+    if (count == 1)
+        mWorkersCV.notify_one();
+    else
+        mWorkersCV.notify_all();
+}
+
+bool ThreadPool::HasQueuedTasks() const
+{
+    if (mInjectedTasksCount.load() > 0)
+        return true;
+
+    for (auto const& worker : mWorkers)
+    {
+        if (!worker->tasks.IsEmpty())
+            return true;
     }
+    return false;
+}
 
-    // Search for the task and then execute it
-    VLOG(4) << "Task" << task->taskID << ". Locking work list mutex";
-    std::unique_lock<std::mutex> lock(mWorkListMutex);
-    if (mWorkList == nullptr)
+bool ThreadPool::FindTask(TaskHandle& task)
+{
+    Worker* worker = nullptr;
+    if (tCurrentPool == this)
     {
-        // No work left, check if the task is completed
-        if (IsTaskCompleted(task))
+        worker = mWorkers[tWorkerIndex].get();
+        if (uint64_t packed = worker->tasks.Pop(); packed != NO_TASK)
         {
-            VLOG(4) << "Task" << task->taskID << " is finished, returning";
-            return;
+            task = UnpackHandle(packed);
+            return true;
         }
-        
-        // If it's not completed, then we should wait for all active threads
-        WAIT_ALL_ACTIVE_THREADS;
+    }
 
-        // Now it MUST be either complete or invalid
-        if (task->IsCompleted())
+    /* Tasks from outside the pool are taken in the order they were submitted */
+    if (mInjectedTasksCount.load(std::memory_order_relaxed) > 0)
+    {
+        std::unique_lock<std::mutex> lock(mInjectedTasksMutex);
+        if (!mInjectedTasks.empty())
         {
-            VLOG(4) << "Task" << task->taskID << " is finished, returning";
-            return;
+            task = mInjectedTasks.front();
+            mInjectedTasks.pop_front();
+            mInjectedTasksCount--;
+            return true;
         }
-        else
+    }
+
+    return StealTask(worker, task);
+}
+
+bool ThreadPool::StealTask(Worker* thief, TaskHandle& task)
+{
+    uint32_t numWorkers = (uint32_t)mWorkers.size();
+    uint32_t firstVictim = GetRandomNumber() % numWorkers;
+    for (uint32_t i = 0; i < numWorkers; ++i)
+    {
+        auto& victim = mWorkers[(firstVictim + i) % numWorkers];
+        if (victim.get() == thief)
+            continue;
+
+        if (uint64_t packed = victim->tasks.Steal(); packed != NO_TASK)
         {
-            VLOG(4) << "Task" << task->taskID << " not found, throwing an exception";
-            throw Exceptions::TaskNotFound(task->taskID, __FILE__, __LINE__);
+            task = UnpackHandle(packed);
+            return true;
         }
     }
+    return false;
+}
 
-    VLOG(4) << "Task" << task->taskID << ". Start searching for it.";
-    std::shared_ptr<Task> previousTask = mWorkList;
-    std::shared_ptr<Task> currentTask = previousTask->nextTask;
+bool ThreadPool::TryClaim(TaskHandle task)
+{
+    /* A task can still be in a queue after a waiting thread executed it, or even after its storage was reused.
+     * Only the one that moves it from queued to running for the right generation gets to run it
+     */
+    uint64_t expected = Task::PackState(task.generation, Task::QUEUED);
+    auto& state = GetTask(task.index).state;
+    return state.load(std::memory_order_relaxed) == expected &&
+        state.compare_exchange_strong(expected, Task::PackState(task.generation, Task::RUNNING), std::memory_order_acquire);
+}
 
-    if (previousTask->taskID == task->taskID)
+void ThreadPool::RunQueuedTask(TaskHandle task)
+{
+    if (TryClaim(task))
     {
-        VLOG(4) << "Task" << task->taskID << " was found as first task, deleting it and executing it";
-        // Delete the first element from the list, execute the work and then return
-        mWorkList = mWorkList->nextTask;
-        lock.unlock();
-        previousTask->Work();
-        mWorkersCV.notify_all();
-        return;
+        Execute(task);
     }
+}
 
-    while (currentTask != nullptr && currentTask->taskID != task->taskID)
+void ThreadPool::Execute(TaskHandle task)
+{
+    auto& storage = GetTask(task.index);
+    /* The tasks of a cancelled group are skipped, whenever they were submitted */
+    bool cancelled = storage.cancelled || (storage.group != nullptr && storage.group->IsCancelled());
+    if (!cancelled && storage.work)
     {
-        previousTask = currentTask;
-        currentTask = currentTask->nextTask;
+        VLOG(3) << "Task " << task.index << " (generation " << task.generation << ") is being executed now";
+        storage.work();
     }
+    storage.work.Reset();
+    FinishTask(task, cancelled);
+}
 
-    if (currentTask == nullptr)
+void ThreadPool::FinishTask(TaskHandle task, bool cancelled)
+{
+    auto& storage = GetTask(task.index);
     {
-        // If we didn't find the task, something must be wrong :-(
-        // But we give it one more try and wait for all active workers to finish their tasks
-        WAIT_ALL_ACTIVE_THREADS;
+        /* Every handle to this generation sees the task as done from now on, and no more successors can be added */
+        std::lock_guard<SpinLock> lock(storage.successorsLock);
+        storage.state.store(Task::PackState(task.generation + 1, Task::FREE));
+    }
 
-        // And then check if the task is actually finished
-        if (task->IsCompleted())
-        {
-            return;
-        }
-        // And if that doesn't work, we throw an error
-        throw Exceptions::TaskNotFound(task->taskID, __FILE__, __LINE__);
+    for (auto const& successor : storage.successors)
+    {
+        ReleaseDependency(successor, cancelled);
     }
-    
-    if (currentTask->taskID == task->taskID)
+    storage.successors.clear();
+    JobGroup* group = storage.group;
+    storage.group = nullptr;
+    ReleaseTask(task.index);
+
+    /* Once its last task is done the group may be destroyed, so it's not touched after that */
+    bool groupIsDone = group != nullptr && --group->mPendingTasks == 0;
+    uint64_t pendingTasks = --mPendingTasks;
+    if (mWaitingThreads.load() > 0 || ((pendingTasks == 0 || groupIsDone) && mWaitingForAllThreads.load() > 0))
     {
-        VLOG(4) << "Task" << task->taskID << " was found, deleting it and executing it";
-        previousTask->nextTask = currentTask->nextTask;
-        lock.unlock();
-        task->Work();
-        task.reset();
-        return;
+        std::unique_lock<std::mutex> lock(mCompletionMutex);
+        mCompletionCV.notify_all();
     }
-
-    // This should never happen
-    throw Exceptions::ImpossibleToGetHere("Task ID = " + std::to_string(task->taskID) + ". Could not be found", __FILE__, __LINE__);
 }
 
-void ThreadPool::WaitForAllToFinish()
+template <typename Condition>
+void ThreadPool::WaitUntil(Condition&& condition, bool executeTasks, std::atomic<uint32_t>& waitingThreads)
 {
-    // Make sure that there are no tasks to be run
+    Backoff backoff(mSpinBudget.load(std::memory_order_relaxed));
+    while (!condition())
     {
-        std::unique_lock<std::mutex> lock(mWorkListMutex);
-        if (mWorkList != nullptr)
+        if (TaskHandle task; executeTasks && FindTask(task))
         {
-            mWorkersCV.wait(lock, [this]
-            {
-                return mWorkList == nullptr;
-            });
+            RunQueuedTask(task);
+            backoff.Succeeded();
+            continue;
         }
+
+        if (backoff.Spin())
+            continue;
+        backoff.Parked();
+
+        /* Completed tasks wake up the waiting threads, new tasks only the helping ones */
+        waitingThreads++;
+        if (executeTasks)
+            mHelpingThreads++;
+        {
+            std::unique_lock<std::mutex> lock(mCompletionMutex);
+            /* Pairs with the fence in WakeWorkers, like the one of the sleeping workers */
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            mCompletionCV.wait(lock, [&] { return condition() || (executeTasks && HasQueuedTasks()); });
+        }
+        if (executeTasks)
+            mHelpingThreads--;
+        waitingThreads--;
     }
+    backoff.Succeeded();
+}
 
-    WAIT_ALL_ACTIVE_THREADS;
+void ThreadPool::WaitForTaskToFinish(TaskHandle task)
+{
+    // Just wait for other thread to finish this
+    auto const& storage = GetTask(task.index);
+    WaitUntil([&] { return storage.IsDone(task.generation); }, false, mWaitingThreads);
 }
 
-void ThreadPool::WaitForAllExecutingTasks()
+void ThreadPool::ExecuteTasksUntilTaskCompleted(TaskHandle task)
 {
-    // Execute tasks in the queue until the searched task is executed
-    std::unique_lock<std::mutex> lock(mWorkListMutex);
-    while (true)
+    // Nobody picked it up yet, so run it here
+    if (TryClaim(task))
     {
-        // No tasks left in the worklist, wait for all threads to finish working
-        if (mWorkList == nullptr)
-        {
-            // Not completed? Let's wait for active tasks
-            bool found = false;
-            while (true)
-            {
-                if (mActiveTasksCount.load() == 0)
-                    break;
-            }
+        Execute(task);
+        return;
+    }
 
-            break;
-        }
+    // Someone else is running it, help with other tasks in the meantime
+    auto const& storage = GetTask(task.index);
+    WaitUntil([&] { return storage.IsDone(task.generation); }, true, mWaitingThreads);
+}
 
-        // Get the first task in work list and then execute it
-        std::shared_ptr<Task> myTask = mWorkList;
-        mWorkList = mWorkList->nextTask;
-        myTask->nextTask = nullptr;
+void ThreadPool::ExecuteSpecificTask(TaskHandle task)
+{
+    if (TryClaim(task))
+    {
+        VLOG(4) << "Task " << task.index << " was found, executing it";
+        Execute(task);
+        return;
+    }
 
-        lock.unlock();
+    VLOG(4) << "Task " << task.index << " was taken by another thread, waiting for it";
+    WaitForTaskToFinish(task);
+}
 
-        myTask->Work();
+void ThreadPool::WaitForAllToFinish()
+{
+    WaitUntil([this] { return mPendingTasks.load() == 0; }, false, mWaitingForAllThreads);
+}
 
-        lock.lock();
+void ThreadPool::WaitForAllExecutingTasks()
+{
+    // Execute tasks until there's nothing left to run
+    WaitUntil([this] { return mPendingTasks.load() == 0; }, true, mWaitingForAllThreads);
+}
+
+void ThreadPool::WaitForGroup(JobGroup const& group, WaitPolicy wp)
+{
+    auto isDone = [&] { return group.IsDone(); };
+    switch (wp)
+    {
+        case ThreadPool::WaitPolicy::EXECUTE_THEN_EXIT:
+            WaitUntil(isDone, true, mWaitingForAllThreads);
+            break;
+        case ThreadPool::WaitPolicy::EXIT_ASAP:
+            WaitUntil(isDone, false, mWaitingForAllThreads);
+            break;
+        default:
+            CHECK(false) << "Invalid policy provided to JobGroup::Wait()";
     }
 }
@@ -76,7 +76,9 @@ Jnrlib::Color Common::BufferDumper::GetPixelColor(uint32_t x, uint32_t y) const
 
 void BufferDumper::SetTotalWork(uint32_t totalWork)
 {
+    /* Called when a render starts, a restarted one reuses the dumper */
     mTotalWork = totalWork;
+    mDoneWork = 0;
 }
 
 void BufferDumper::AddDoneWork()
@@ -4,6 +4,7 @@
 
 #include "Scene/Components/Camera.h"
 #include "Scene/Components/Base.h"
+#include "Scene/Systems/TransformHierarchySystem.h"
 
 #include <glm/gtx/matrix_decompose.hpp>
 
@@ -77,3 +78,23 @@ Common::Ray Common::CameraUtils::GetRayForPixel(Common::Components::Base const*
 
     return ::GetRayForPixel(rp);
 }
+
+Common::Ray Common::CameraUtils::GetRayForPixel(Common::Systems::WorldTransform const& cameraTransform, Common::Components::Camera const* camera, uint32_t x, uint32_t y)
+{
+    RayForPixelInfo rp{};
+    {
+        rp.pixelX = (Jnrlib::Float)x;
+        rp.pixelY = (Jnrlib::Float)y;
+
+        rp.projectionSize = camera->projectionSize;
+        rp.viewportSize = camera->viewportSize;
+
+        rp.position = cameraTransform.translation;
+        rp.upperLeftForner = camera->upperLeftCorner;
+        rp.forwardDirection = camera->forwardDirection;
+        rp.rightDirection = camera->rightDirection;
+        rp.upDirection = camera->upDirection;
+    }
+
+    return ::GetRayForPixel(rp);
+}
@@ -14,6 +14,11 @@ namespace Common::Components
     struct Base;
 }
 
+namespace Common::Systems
+{
+    struct WorldTransform;
+}
+
 namespace Common
 {
     class CameraUtils
@@ -21,5 +26,7 @@ namespace Common
     public:
         static Ray GetRayForPixel(Common::EditorCamera const*, uint32_t x, uint32_t y);
         static Ray GetRayForPixel(Common::Components::Base const *baseComponent, Common::Components::Camera const*, uint32_t x, uint32_t y);
+        /* Same as above, but doesn't have to decompose the world matrix of the camera */
+        static Ray GetRayForPixel(Common::Systems::WorldTransform const& cameraTransform, Common::Components::Camera const*, uint32_t x, uint32_t y);
     };
 }
@@ -4,6 +4,7 @@
 #include <boost/algorithm/string.hpp>
 
 #include "Constants.h"
+#include "Scene/Components/KdTreeAccelerationStructure.h"
 
 using json = nlohmann::json;
 
@@ -85,10 +86,21 @@ namespace CreateInfo
         {
             j["split-type"] = magic_enum::enum_name(a.splitType);
             j["max-prims-in-node"] = a.maxPrimsInNode;
+            j["build-threads"] = a.buildThreads;
+            j["parallel-grain-size"] = a.parallelGrainSize;
+            j["bvh-width"] = a.bvhWidth;
+            j["node-compression"] = magic_enum::enum_name(a.nodeCompression);
+            j["sbvh-memory-budget"] = a.sbvhMemoryBudget;
+            j["precompute-triangles"] = a.precomputeTriangles;
+            j["cache-directory"] = a.cacheDirectory;
         }
         else if (a.accelerationType == AccelerationType::KdTree)
         {
-
+            j["intersect-cost"] = a.intersectCost;
+            j["traversal-cost"] = a.traversalCost;
+            j["empty-bonus"] = a.emptyBonus;
+            j["max-prims-in-node"] = a.maxPrimsInKdTreeNode;
+            j["max-depth"] = a.maxDepth;
         }
     }
 
@@ -119,10 +131,72 @@ namespace CreateInfo
                     {
                         j.at("max-prims-in-node").get_to(a.maxPrimsInNode);
                     }
+                    if (j.contains("build-threads"))
+                    {
+                        j.at("build-threads").get_to(a.buildThreads);
+                    }
+                    if (j.contains("parallel-grain-size"))
+                    {
+                        j.at("parallel-grain-size").get_to(a.parallelGrainSize);
+                    }
+                    if (j.contains("bvh-width"))
+                    {
+                        j.at("bvh-width").get_to(a.bvhWidth);
+                        CHECK(a.bvhWidth == 2 || a.bvhWidth == 4 || a.bvhWidth == 8) << "bvh-width " << a.bvhWidth << " is not valid; Use 2, 4 or 8";
+                    }
+                    if (j.contains("node-compression"))
+                    {
+                        std::string nodeCompressionString;
+                        j.at("node-compression").get_to(nodeCompressionString);
+                        auto nodeCompressionOptional = magic_enum::enum_cast<Common::Accelerators::BVH::NodeCompression>(nodeCompressionString);
+                        if (nodeCompressionOptional.has_value())
+                        {
+                            a.nodeCompression = *nodeCompressionOptional;
+                        }
+                    }
+                    if (j.contains("sbvh-memory-budget"))
+                    {
+                        j.at("sbvh-memory-budget").get_to(a.sbvhMemoryBudget);
+                        CHECK(a.sbvhMemoryBudget >= 0.0f) << "sbvh-memory-budget " << a.sbvhMemoryBudget << " is not valid; It must be positive";
+                    }
+                    if (j.contains("precompute-triangles"))
+                    {
+                        j.at("precompute-triangles").get_to(a.precomputeTriangles);
+                    }
+                    if (j.contains("cache-directory"))
+                    {
+                        j.at("cache-directory").get_to(a.cacheDirectory);
+                    }
                     break;
                 }
                 case CreateInfo::AccelerationType::KdTree:
+                {
+                    if (j.contains("intersect-cost"))
+                    {
+                        j.at("intersect-cost").get_to(a.intersectCost);
+                    }
+                    if (j.contains("traversal-cost"))
+                    {
+                        j.at("traversal-cost").get_to(a.traversalCost);
+                    }
+                    if (j.contains("empty-bonus"))
+                    {
+                        j.at("empty-bonus").get_to(a.emptyBonus);
+                        CHECK(a.emptyBonus >= 0.0f && a.emptyBonus <= 1.0f) << "empty-bonus " << a.emptyBonus << " is not valid; It must be between 0 and 1";
+                    }
+                    if (j.contains("max-prims-in-node"))
+                    {
+                        j.at("max-prims-in-node").get_to(a.maxPrimsInKdTreeNode);
+                        CHECK(a.maxPrimsInKdTreeNode > 0) << "max-prims-in-node must be greater than 0";
+                    }
+                    if (j.contains("max-depth"))
+                    {
+                        j.at("max-depth").get_to(a.maxDepth);
+                        CHECK(a.maxDepth <= Common::Components::KdTreeAccelerationStructure::MAX_DEPTH)
+                            << "max-depth " << a.maxDepth << " is not valid; It must be at most " << Common::Components::KdTreeAccelerationStructure::MAX_DEPTH;
+                    }
                     break;
+                }
                 case CreateInfo::AccelerationType::None:
                 default:
                     break;
@@ -6,6 +6,7 @@
 #include <nlohmann/json.hpp>
 #include "CameraCreateInfo.h"
 #include "Common/Scene/Accelerators/BVH.h"
+#include "Common/Scene/Accelerators/KdTree.h"
 
 namespace CreateInfo
 {
@@ -46,8 +47,26 @@ namespace CreateInfo
         /* BVH */
         Common::Accelerators::BVH::SplitType splitType = Common::Accelerators::BVH::SplitType::SAH;
         uint32_t maxPrimsInNode = 5;
+        /* Same meaning and default as BVH::Input::buildThreads; 0 => whole thread pool */
+        uint32_t buildThreads = 1;
+        uint32_t parallelGrainSize = 4096;
+        /* 2, 4 or 8 */
+        uint32_t bvhWidth = 2;
+        Common::Accelerators::BVH::NodeCompression nodeCompression = Common::Accelerators::BVH::NodeCompression::None;
+        /* SBVH only */
+        float sbvhMemoryBudget = 0.3f;
+        /* Faster leaf tests, but not watertight */
+        bool precomputeTriangles = false;
+        /* BVHs of meshes are cached here between runs, e.g. ".bvh-cache". Empty => don't cache */
+        std::string cacheDirectory = "";
 
         /* Kd Tree */
+        uint32_t intersectCost = 80;
+        uint32_t traversalCost = 1;
+        float emptyBonus = 0.5f;
+        uint32_t maxPrimsInKdTreeNode = 1;
+        /* 0 => chosen from the number of triangles */
+        uint32_t maxDepth = 0;
     };
 
     void to_json(nlohmann::json& j, const AccelerationStructure& a);
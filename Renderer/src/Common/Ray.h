@@ -21,12 +21,25 @@ namespace Common
         {
             return origin + direction * t;
         }
-        Ray TransformedRay(Jnrlib::Matrix4x4 const& inverseWorld)
+        /* The direction of the transformed ray is normalized again, so t is measured in the units of the new space.
+         * maxT is converted to them as well, divide a t found on the transformed ray by TransformedLength to get it back
+         */
+        Ray TransformedRay(Jnrlib::Matrix4x4 const& inverseWorld) const
         {
             Jnrlib::Direction transformedDirection = Jnrlib::Matrix3x3(inverseWorld) * direction;
             Jnrlib::Position transformedOrigin = inverseWorld * glm::vec4(origin, 1.0f);
 
-            return Ray(transformedOrigin, transformedDirection, maxT, Flags::NO_SAVE);
+            return Ray(transformedOrigin, transformedDirection, maxT * glm::length(transformedDirection), Flags::NO_SAVE);
+        }
+        /* How long a unit of t on this ray is after transforming it */
+        Jnrlib::Float TransformedLength(Jnrlib::Matrix4x4 const& inverseWorld) const
+        {
+            return glm::length(Jnrlib::Matrix3x3(inverseWorld) * direction);
+        }
+        /* Copy that ends at t. Like the transformed rays, it's not saved, as it's only used internally by the queries */
+        Ray Shortened(Jnrlib::Float t) const
+        {
+            return Ray(origin, direction, t, Flags::NO_SAVE);
         }
 
         ~Ray()
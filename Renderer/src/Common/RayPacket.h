@@ -0,0 +1,45 @@
+#pragma once
+
+
+#include "Jnrlib.h"
+#include "Ray.h"
+#include "HitPoint.h"
+
+namespace Common
+{
+    /* Rays traced together by Scene::GetClosestHits. Meant for coherent rays, like the primary rays of a block of pixels:
+     * they're traced as a packet while they visit the same nodes and one at a time once they diverge
+     */
+    class RayPacket
+    {
+    public:
+        /* 8x8 pixels */
+        static constexpr const uint32_t MAX_SIZE = 64;
+
+    public:
+        void Clear()
+        {
+            size = 0;
+        }
+
+        /* Returns the index of the ray in the packet */
+        uint32_t Add(Ray const& ray)
+        {
+            CHECK(size < MAX_SIZE) << "Ray packet is full";
+            rays[size] = ray;
+            hitPoints[size].reset();
+            return size++;
+        }
+
+        bool IsFull() const
+        {
+            return size == MAX_SIZE;
+        }
+
+    public:
+        Ray rays[MAX_SIZE];
+        /* Closest hit of each ray, filled by Scene::GetClosestHits */
+        std::optional<HitPoint> hitPoints[MAX_SIZE];
+        uint32_t size = 0;
+    };
+}
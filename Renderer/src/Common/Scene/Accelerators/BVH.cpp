@@ -1,6 +1,9 @@
 #include "BVH.h"
 
 #include <numeric>
+#include <chrono>
+#include <unordered_map>
+#include <bit>
 
 using namespace Common;
 using namespace Components;
@@ -10,12 +13,13 @@ using namespace BVH;
 
 struct BVHPrimitiveInfo
 {
+    BVHPrimitiveInfo() = default;
     BVHPrimitiveInfo(size_t primitiveIndex, BoundingBox const& bounds) :
         index(primitiveIndex),
         bounds(bounds),
         centroid(.5f * bounds.pMin + .5f * bounds.pMax)
     { }
-    size_t index;
+    size_t index = 0;
     BoundingBox bounds;
     Position centroid;
 };
@@ -30,7 +34,7 @@ struct BVHBuildNode
         children[0] = children[1] = nullptr;
     }
 
-    void InitAsInterior(Axis splitAxis_, std::shared_ptr<BVHBuildNode> c0, std::shared_ptr<BVHBuildNode> c1)
+    void InitAsInterior(Axis splitAxis_, BVHBuildNode* c0, BVHBuildNode* c1)
     {
         splitAxis = splitAxis_;
         children[0] = c0;
@@ -40,24 +44,28 @@ struct BVHBuildNode
     }
 
     BoundingBox bounds;
-    std::shared_ptr<BVHBuildNode> children[2];
+    BVHBuildNode* children[2];
     Axis splitAxis;
     uint32_t firstPrimitiveOffset;
     uint32_t numberOfPrimitives;
+
+    /* Only used by the treelet optimizer: SAH cost of the subtree, not normalized, and the number of primitives under it */
+    Float cost;
+    uint32_t subtreePrimitives;
 };
 
 struct MortonPrimitive
 {
     uint32_t primitiveIndex;
-    uint32_t mortonCode;
+    /* 30 or 63 bits, depending on the number of primitives */
+    uint64_t mortonCode;
 };
 
 struct LBVHTreelet
 {
     uint32_t startIndex;
     uint32_t primitiveCount;
-    std::vector<std::shared_ptr<BVHBuildNode>> buildNodes;
-    std::shared_ptr<BVHBuildNode> root;
+    BVHBuildNode* root = nullptr;
 };
 
 struct Context
@@ -66,8 +74,21 @@ struct Context
     const Input& input;
     std::vector<BVHPrimitiveInfo> primitives;
 
+    /* Subtrees above this depth are handed to the thread pool; 0 => single threaded build */
+    uint32_t maxTaskDepth = 0;
+    /* Input::buildThreads, with 0 resolved to the size of the thread pool */
+    uint32_t buildThreads = 1;
+
+    /* Build nodes live in these arenas until the tree is flattened. One arena per pool thread, so allocating never locks */
+    std::vector<MemoryArena> workerArenas;
+    MemoryArena callerArena;
+    std::thread::id callerThread = std::this_thread::get_id();
+    /* Threads outside the pool which help while waiting on their own tasks (rare) get their own arena, kept for the whole build */
+    std::mutex foreignArenasMutex;
+    std::unordered_map<std::thread::id, MemoryArena> foreignArenas;
+
     /* Output */
-    uint32_t totalNodes = 0;
+    std::atomic<uint32_t> totalNodes = 0;
     std::vector<size_t> orderedPrimitives;
 };
 
@@ -76,6 +97,12 @@ struct Bucket
     uint32_t count = 0;
     BoundingBox boundingBox;
 };
+
+struct RangeBounds
+{
+    BoundingBox bounds;
+    BoundingBox centroidBounds;
+};
 constexpr const uint32_t NUMBER_OF_BUCKETS = 12;
 
 static uint32_t LeftShift3(uint32_t x)
@@ -103,58 +130,198 @@ static uint32_t EncodeMorton3(Position const& v)
     return (LeftShift3((uint32_t)v.z) << 2) | (LeftShift3((uint32_t)v.y) << 1) | LeftShift3((uint32_t)v.x);
 }
 
-static std::shared_ptr<BVHBuildNode> RecursiveBuild(Context& ctx, uint32_t start, uint32_t end)
+/* Same as LeftShift3, for 21 bits */
+static uint64_t LeftShift3Wide(uint64_t x)
 {
-    CHECK(start < end) << "Recursive build with invalid range";
+    if (x == (1 << 21))
+        x--;
 
-    /* TODO: Replace with smart memory allocator */
-    auto node = std::make_shared<BVHBuildNode>();
+    x = (x | (x << 32)) & 0x001F'0000'0000'FFFF;
+    x = (x | (x << 16)) & 0x001F'0000'FF00'00FF;
+    x = (x | (x << 8)) & 0x100F'00F0'0F00'F00F;
+    x = (x | (x << 4)) & 0x10C3'0C30'C30C'30C3;
+    x = (x | (x << 2)) & 0x1249'2492'4924'9249;
 
-    ctx.totalNodes++;
+    return x;
+}
 
-    /* Create a bounding box for all the primitives that go in this node */
-    BoundingBox boundingBox;
-    for (uint32_t i = start; i < end; ++i)
+static uint64_t EncodeMorton3Wide(Position const& v)
+{
+    CHECK_GE(v.x, 0);
+    CHECK_GE(v.y, 0);
+    CHECK_GE(v.z, 0);
+    return (LeftShift3Wide((uint64_t)v.z) << 2) | (LeftShift3Wide((uint64_t)v.y) << 1) | LeftShift3Wide((uint64_t)v.x);
+}
+
+static bool ShouldBinInParallel(Context const& ctx, uint32_t numberOfPrimitives)
+{
+    return ctx.maxTaskDepth > 0 && numberOfPrimitives >= 2 * ctx.input.parallelGrainSize;
+}
+
+static int GetBucketIndex(BoundingBox const& boundingBox, Position const& centroid, Axis axis)
+{
+    int bucketIndex = (int)((Float)NUMBER_OF_BUCKETS * GetElementByAxis(boundingBox.Offset(centroid), axis));
+
+    if (bucketIndex == NUMBER_OF_BUCKETS)
     {
-        BoundingBox box = ctx.primitives[i].bounds;
+        bucketIndex -= 1;
+    }
 
-        /* Merge the bounding box */
-        boundingBox = Union(box, boundingBox);
+    CHECK_GE(bucketIndex, 0);
+    CHECK_LT(bucketIndex, (int)NUMBER_OF_BUCKETS);
+
+    return bucketIndex;
+}
+
+static RangeBounds ComputeRangeBounds(Context const& ctx, uint32_t start, uint32_t end)
+{
+    auto computeBounds = [&ctx](uint32_t first, uint32_t last)
+    {
+        RangeBounds result{};
+        for (uint32_t i = first; i < last; ++i)
+        {
+            result.bounds = Union(result.bounds, ctx.primitives[i].bounds);
+            result.centroidBounds = Union(result.centroidBounds, ctx.primitives[i].centroid);
+        }
+        return result;
+    };
+
+    if (!ShouldBinInParallel(ctx, end - start))
+    {
+        return computeBounds(start, end);
     }
 
-    CHECK(boundingBox.Diagonal().length() != 0) << "The length of the bounding box must be greater than 0";
+    /* Each chunk is reduced on its own, then the partial boxes are merged. min / max are exact, so the result is the same as the serial one */
+    uint32_t grain = ctx.input.parallelGrainSize;
+    uint32_t chunkCount = DivideByMultiple(end - start, grain);
+    std::vector<RangeBounds> partialBounds(chunkCount);
+    ThreadPool::Get()->ExecuteParallelForImmediate(
+        [&](uint32_t chunk)
+    {
+        uint32_t first = start + chunk * grain;
+        partialBounds[chunk] = computeBounds(first, std::min(first + grain, end));
+    }, chunkCount, 1);
 
-    uint32_t numberOfPrimitives = end - start;
-    if (numberOfPrimitives <= ctx.input.maxPrimsInNode)
+    RangeBounds result{};
+    for (auto const& partial : partialBounds)
     {
-        /* Simple case => build a leaf */
-        uint32_t firstPrimitive = (uint32_t)ctx.orderedPrimitives.size();
-        for (uint32_t i = start; i < end; ++i)
+        result.bounds = Union(result.bounds, partial.bounds);
+        result.centroidBounds = Union(result.centroidBounds, partial.centroidBounds);
+    }
+    return result;
+}
+
+static std::array<Bucket, NUMBER_OF_BUCKETS> ComputeBuckets(Context const& ctx, uint32_t start, uint32_t end,
+                                                            BoundingBox const& centroidBounds, Axis axis)
+{
+    auto computeBuckets = [&](uint32_t first, uint32_t last)
+    {
+        std::array<Bucket, NUMBER_OF_BUCKETS> buckets;
+        for (uint32_t i = first; i < last; ++i)
         {
-            ctx.orderedPrimitives.push_back(ctx.primitives[i].index);
+            auto const& currentPrimitive = ctx.primitives[i];
+            int bucketIndex = GetBucketIndex(centroidBounds, currentPrimitive.centroid, axis);
+
+            buckets[bucketIndex].count++;
+            buckets[bucketIndex].boundingBox = Union(buckets[bucketIndex].boundingBox, currentPrimitive.bounds);
         }
-        node->InitAsLeaf(firstPrimitive, numberOfPrimitives, boundingBox);
-        return node;
+        return buckets;
+    };
+
+    if (!ShouldBinInParallel(ctx, end - start))
+    {
+        return computeBuckets(start, end);
+    }
+
+    uint32_t grain = ctx.input.parallelGrainSize;
+    uint32_t chunkCount = DivideByMultiple(end - start, grain);
+    std::vector<std::array<Bucket, NUMBER_OF_BUCKETS>> partialBuckets(chunkCount);
+    ThreadPool::Get()->ExecuteParallelForImmediate(
+        [&](uint32_t chunk)
+    {
+        uint32_t first = start + chunk * grain;
+        partialBuckets[chunk] = computeBuckets(first, std::min(first + grain, end));
+    }, chunkCount, 1);
+
+    std::array<Bucket, NUMBER_OF_BUCKETS> buckets;
+    for (auto const& partial : partialBuckets)
+    {
+        for (uint32_t i = 0; i < NUMBER_OF_BUCKETS; ++i)
+        {
+            buckets[i].count += partial[i].count;
+            buckets[i].boundingBox = Union(buckets[i].boundingBox, partial[i].boundingBox);
+        }
+    }
+    return buckets;
+}
+
+static MemoryArena& GetThreadArena(Context& ctx)
+{
+    uint32_t threadId = ThreadPool::Get()->GetCurrentThreadId();
+    if (threadId < ctx.workerArenas.size())
+    {
+        return ctx.workerArenas[threadId];
+    }
+    if (std::this_thread::get_id() == ctx.callerThread)
+    {
+        return ctx.callerArena;
     }
 
+    /* Elements of an unordered_map don't move when it grows, so the reference stays valid after unlocking */
+    std::unique_lock lock(ctx.foreignArenasMutex);
+    return ctx.foreignArenas[std::this_thread::get_id()];
+}
+
+template <typename Function>
+static void ForEachArena(Context& ctx, Function&& func)
+{
+    for (auto& arena : ctx.workerArenas)
+        func(arena);
+    func(ctx.callerArena);
+    for (auto& [threadId, arena] : ctx.foreignArenas)
+        func(arena);
+}
 
-    BoundingBox centroidBounds{};
+static void InitLeaf(Context& ctx, BVHBuildNode* node, uint32_t start, uint32_t end, BoundingBox const& boundingBox)
+{
+    /* Every node owns the range [start, end) of the ordered primitives, so leaves built on different threads never overlap */
     for (uint32_t i = start; i < end; ++i)
     {
-        centroidBounds = Union(centroidBounds, ctx.primitives[i].centroid);
+        ctx.orderedPrimitives[i] = ctx.primitives[i].index;
+    }
+    node->InitAsLeaf(start, end - start, boundingBox);
+}
+
+static BVHBuildNode* RecursiveBuild(Context& ctx, MemoryArena& arena, uint32_t start, uint32_t end, uint32_t depth = 0)
+{
+    CHECK(start < end) << "Recursive build with invalid range";
+
+    auto node = arena.Create<BVHBuildNode>();
+
+    ctx.totalNodes++;
+
+    /* Create a bounding box for all the primitives that go in this node and one for their centroids */
+    RangeBounds rangeBounds = ComputeRangeBounds(ctx, start, end);
+    BoundingBox const& boundingBox = rangeBounds.bounds;
+    BoundingBox const& centroidBounds = rangeBounds.centroidBounds;
+
+    CHECK(boundingBox.Diagonal().length() != 0) << "The length of the bounding box must be greater than 0";
+
+    uint32_t numberOfPrimitives = end - start;
+    if (numberOfPrimitives <= ctx.input.maxPrimsInNode)
+    {
+        /* Simple case => build a leaf */
+        InitLeaf(ctx, node, start, end, boundingBox);
+        return node;
     }
+
     Axis maximumAxis = centroidBounds.MaximumExtent();
     auto axisIndex = (uint32_t)maximumAxis;
 
     if (centroidBounds.pMin[axisIndex] == centroidBounds.pMax[axisIndex])
     {
         /* Same centroid for all primitives => Make this a leaf */
-        uint32_t firstPrimitive = (uint32_t)ctx.orderedPrimitives.size();
-        for (uint32_t i = start; i < end; ++i)
-        {
-            ctx.orderedPrimitives.push_back(ctx.primitives[i].index);
-        }
-        node->InitAsLeaf(firstPrimitive, numberOfPrimitives, boundingBox);
+        InitLeaf(ctx, node, start, end, boundingBox);
         return node;
     }
 
@@ -164,7 +331,7 @@ static std::shared_ptr<BVHBuildNode> RecursiveBuild(Context& ctx, uint32_t start
     {
         case SplitType::Middle:
         {
-            Float middle = (centroidBounds.pMin[axisIndex] - centroidBounds.pMax[axisIndex]) * Half;
+            Float middle = (centroidBounds.pMin[axisIndex] + centroidBounds.pMax[axisIndex]) * Half;
             BVHPrimitiveInfo const* middlePtr = std::partition(
                 &ctx.primitives[start], &ctx.primitives[end - 1] + 1,
                 [&](BVHPrimitiveInfo const& pi)
@@ -199,23 +366,8 @@ static std::shared_ptr<BVHBuildNode> RecursiveBuild(Context& ctx, uint32_t start
             }
             else
             {
-                std::array<Bucket, NUMBER_OF_BUCKETS> buckets;
-                for (uint32_t i = start; i < end; ++i)
-                {
-                    auto const& currentPrimitive = ctx.primitives[i];
-                    int bucketIndex = (int)((Float)NUMBER_OF_BUCKETS * GetElementByAxis(boundingBox.Offset(currentPrimitive.centroid), maximumAxis));
-
-                    if (bucketIndex == NUMBER_OF_BUCKETS)
-                    {
-                        bucketIndex -= 1;
-                    }
-
-                    CHECK_GE(bucketIndex, 0);
-                    CHECK_LT(bucketIndex, (int)NUMBER_OF_BUCKETS);
-
-                    buckets[bucketIndex].count++;
-                    buckets[bucketIndex].boundingBox = Union(buckets[bucketIndex].boundingBox, currentPrimitive.bounds);
-                }
+                /* Buckets split the centroid bounds; Splitting the node bounds can put every centroid in the same bucket when primitives are long */
+                std::array<Bucket, NUMBER_OF_BUCKETS> buckets = ComputeBuckets(ctx, start, end, centroidBounds, maximumAxis);
 
                 std::array<float, NUMBER_OF_BUCKETS -1> cost;
                 float minimumCost = FLT_MAX;
@@ -258,30 +410,24 @@ static std::shared_ptr<BVHBuildNode> RecursiveBuild(Context& ctx, uint32_t start
                         &ctx.primitives[start], &ctx.primitives[end - 1] + 1,
                         [&](BVHPrimitiveInfo const& pi)
                     {
-                        int bucketIndex = (int)((Float)NUMBER_OF_BUCKETS * GetElementByAxis(boundingBox.Offset(pi.centroid), maximumAxis));
-
-                        if (bucketIndex == NUMBER_OF_BUCKETS)
-                        {
-                            bucketIndex -= 1;
-                        }
-
-                        CHECK_GE(bucketIndex, 0);
-                        CHECK_LT(bucketIndex, (int)NUMBER_OF_BUCKETS);
-
-                        return bucketIndex <= minimumBucket;
-
+                        return GetBucketIndex(centroidBounds, pi.centroid, maximumAxis) <= minimumBucket;
                     });
                     mid = (uint32_t)(middlePtr - &ctx.primitives[0]);
+                    if (mid == start || mid == end)
+                    {
+                        mid = std::midpoint(start, end);
+                        std::nth_element(
+                            &ctx.primitives[start], &ctx.primitives[mid], &ctx.primitives[end - 1] + 1,
+                            [&](BVHPrimitiveInfo const& lhs, BVHPrimitiveInfo const& rhs)
+                        {
+                            return lhs.centroid[axisIndex] < rhs.centroid[axisIndex];
+                        });
+                    }
                 }
                 else
                 {
                     /* Create leaf */
-                    uint32_t firstPrimitive = (uint32_t)ctx.orderedPrimitives.size();
-                    for (uint32_t i = start; i < end; ++i)
-                    {
-                        ctx.orderedPrimitives.push_back(ctx.primitives[i].index);
-                    }
-                    node->InitAsLeaf(firstPrimitive, numberOfPrimitives, boundingBox);
+                    InitLeaf(ctx, node, start, end, boundingBox);
                     return node;
                 }
             }
@@ -291,15 +437,32 @@ static std::shared_ptr<BVHBuildNode> RecursiveBuild(Context& ctx, uint32_t start
             break;
     }
 
-    node->InitAsInterior(maximumAxis,
-                            RecursiveBuild(ctx, start, (uint32_t)mid),
-                            RecursiveBuild(ctx, (uint32_t)mid, end));
-    
+    BVHBuildNode* children[2];
+    if (depth < ctx.maxTaskDepth && numberOfPrimitives >= ctx.input.parallelGrainSize)
+    {
+        /* Hand the first half to the thread pool and keep building the second half on this thread */
+        auto threadPool = ThreadPool::Get();
+        auto task = threadPool->ExecuteDeffered(
+            [&ctx, &children, start, mid, depth]()
+        {
+            /* The task may run on any thread, so it has to allocate from that thread's arena */
+            children[0] = RecursiveBuild(ctx, GetThreadArena(ctx), start, mid, depth + 1);
+        });
+        children[1] = RecursiveBuild(ctx, arena, mid, end, depth + 1);
+        threadPool->Wait(task);
+    }
+    else
+    {
+        children[0] = RecursiveBuild(ctx, arena, start, mid, depth + 1);
+        children[1] = RecursiveBuild(ctx, arena, mid, end, depth + 1);
+    }
+
+    node->InitAsInterior(maximumAxis, children[0], children[1]);
 
     return node;
 }
 
-static uint32_t FlattenBVHTree(std::shared_ptr<BVHBuildNode> node, uint32_t* offset, AccelerationStructure& structure)
+static uint32_t FlattenBVHTree(BVHBuildNode const* node, uint32_t* offset, AccelerationStructure& structure)
 {
     CHECK(node != nullptr) << "Cannot flatten a nullptr node";
     std::vector<LinearBVHNode>& nodes = structure.nodes;;
@@ -325,9 +488,210 @@ static uint32_t FlattenBVHTree(std::shared_ptr<BVHBuildNode> node, uint32_t* off
     return myOffset;
 }
 
+static float RoundDown(Float value)
+{
+    float result = (float)value;
+    if ((Float)result > value)
+        result = std::nextafter(result, -std::numeric_limits<float>::infinity());
+    return result;
+}
+
+static float RoundUp(Float value)
+{
+    float result = (float)value;
+    if ((Float)result < value)
+        result = std::nextafter(result, std::numeric_limits<float>::infinity());
+    return result;
+}
+
+template <uint32_t Width>
+static uint32_t CollapseBVHNode(std::vector<LinearBVHNode> const& binaryNodes, uint32_t binaryIndex, std::vector<WideBVHNode<Width>>& wideNodes)
+{
+    std::array<uint32_t, Width> children;
+    uint32_t childCount = 0;
+
+    LinearBVHNode const& binaryNode = binaryNodes[binaryIndex];
+    if (binaryNode.primitiveCount > 0)
+    {
+        /* Only happens when the root is a leaf */
+        children[childCount++] = binaryIndex;
+    }
+    else
+    {
+        children[childCount++] = binaryIndex + 1;
+        children[childCount++] = binaryNode.secondChildOffset;
+        while (childCount < Width)
+        {
+            /* Pull up the children of the biggest interior child, as it's the one most likely to be hit */
+            int biggestChild = -1;
+            Float biggestSurfaceArea = -One;
+            for (uint32_t i = 0; i < childCount; ++i)
+            {
+                auto const& child = binaryNodes[children[i]];
+                if (child.primitiveCount == 0 && child.bounds.SurfaceArea() > biggestSurfaceArea)
+                {
+                    biggestSurfaceArea = child.bounds.SurfaceArea();
+                    biggestChild = i;
+                }
+            }
+            if (biggestChild == -1)
+                break;
+
+            uint32_t openedChild = children[biggestChild];
+            children[biggestChild] = openedChild + 1;
+            children[childCount++] = binaryNodes[openedChild].secondChildOffset;
+        }
+    }
+
+    uint32_t wideIndex = (uint32_t)wideNodes.size();
+    wideNodes.emplace_back();
+
+    WideBVHNode<Width> wideNode;
+    for (uint32_t i = 0; i < Width; ++i)
+    {
+        if (i >= childCount)
+        {
+            wideNode.minX[i] = wideNode.minY[i] = wideNode.minZ[i] = std::numeric_limits<float>::infinity();
+            wideNode.maxX[i] = wideNode.maxY[i] = wideNode.maxZ[i] = -std::numeric_limits<float>::infinity();
+            wideNode.childOffset[i] = 0;
+            wideNode.primitiveCount[i] = WideBVHNode<Width>::EMPTY_CHILD;
+            continue;
+        }
+
+        auto const& child = binaryNodes[children[i]];
+        wideNode.minX[i] = RoundDown(child.bounds.pMin.x);
+        wideNode.minY[i] = RoundDown(child.bounds.pMin.y);
+        wideNode.minZ[i] = RoundDown(child.bounds.pMin.z);
+        wideNode.maxX[i] = RoundUp(child.bounds.pMax.x);
+        wideNode.maxY[i] = RoundUp(child.bounds.pMax.y);
+        wideNode.maxZ[i] = RoundUp(child.bounds.pMax.z);
+        if (child.primitiveCount > 0)
+        {
+            wideNode.childOffset[i] = child.primitiveOffset;
+            wideNode.primitiveCount[i] = child.primitiveCount;
+        }
+        else
+        {
+            wideNode.childOffset[i] = CollapseBVHNode(binaryNodes, children[i], wideNodes);
+            wideNode.primitiveCount[i] = WideBVHNode<Width>::INTERIOR_CHILD;
+        }
+    }
+    /* wideNodes might have been reallocated by the recursive calls */
+    wideNodes[wideIndex] = wideNode;
+
+    return wideIndex;
+}
+
+template <uint32_t Width>
+static std::vector<WideBVHNode<Width>> CollapseBVH(std::vector<LinearBVHNode> const& binaryNodes)
+{
+    std::vector<WideBVHNode<Width>> wideNodes;
+    /* Every wide node replaces at least Width / 2 binary interior nodes */
+    wideNodes.reserve(binaryNodes.size() / Width + 1);
+    CollapseBVHNode<Width>(binaryNodes, 0, wideNodes);
+    return wideNodes;
+}
+
+template <typename T>
+static void QuantizeChildBounds(QuantizedBVHNode<T>& node, uint32_t child, BoundingBox const& childBounds,
+                                float const parentMin[3], float const parentMax[3], float childMin[3], float childMax[3])
+{
+    constexpr uint32_t steps = QuantizedBVHNode<T>::QUANTIZATION_STEPS;
+    for (uint32_t axis = 0; axis < 3; ++axis)
+    {
+        Float extent = parentMax[axis] - parentMin[axis];
+        Float minOffset = extent > 0 ? (childBounds.pMin[axis] - parentMin[axis]) / extent : 0;
+        Float maxOffset = extent > 0 ? (childBounds.pMax[axis] - parentMin[axis]) / extent : 1;
+
+        int32_t quantizedMin = std::clamp((int32_t)std::floor(minOffset * steps), 0, (int32_t)steps);
+        int32_t quantizedMax = std::clamp((int32_t)std::ceil(maxOffset * steps), 0, (int32_t)steps);
+
+        /* Rounding during decoding could still shrink the box, so move the planes outwards until the decoded box is conservative */
+        while (quantizedMin > 0 && DequantizeBound(parentMin[axis], parentMax[axis], quantizedMin, steps) > childBounds.pMin[axis])
+            quantizedMin--;
+        while (quantizedMax < (int32_t)steps && DequantizeBound(parentMin[axis], parentMax[axis], quantizedMax, steps) < childBounds.pMax[axis])
+            quantizedMax++;
+
+        node.childMin[child][axis] = (T)quantizedMin;
+        node.childMax[child][axis] = (T)quantizedMax;
+    }
+    DequantizeChildBounds(node, child, parentMin, parentMax, childMin, childMax);
+}
+
+template <typename T>
+static uint32_t QuantizeBVHNode(std::vector<LinearBVHNode> const& binaryNodes, uint32_t binaryIndex,
+                                float const nodeMin[3], float const nodeMax[3], std::vector<QuantizedBVHNode<T>>& quantizedNodes)
+{
+    using Node = QuantizedBVHNode<T>;
+
+    LinearBVHNode const& binaryNode = binaryNodes[binaryIndex];
+    uint32_t children[2] = {binaryIndex + 1, binaryNode.secondChildOffset};
+    uint32_t childCount = 2;
+    if (binaryNode.primitiveCount > 0)
+    {
+        /* Only happens when the root is a leaf */
+        children[0] = binaryIndex;
+        childCount = 1;
+    }
+
+    uint32_t quantizedIndex = (uint32_t)quantizedNodes.size();
+    quantizedNodes.emplace_back();
+
+    Node quantizedNode;
+    for (uint32_t i = 0; i < 2; ++i)
+    {
+        if (i >= childCount)
+        {
+            for (uint32_t axis = 0; axis < 3; ++axis)
+            {
+                quantizedNode.childMin[i][axis] = (T)Node::QUANTIZATION_STEPS;
+                quantizedNode.childMax[i][axis] = 0;
+            }
+            quantizedNode.childOffset[i] = 0;
+            quantizedNode.primitiveCount[i] = Node::EMPTY_CHILD;
+            continue;
+        }
+
+        auto const& child = binaryNodes[children[i]];
+        float childMin[3], childMax[3];
+        QuantizeChildBounds(quantizedNode, i, child.bounds, nodeMin, nodeMax, childMin, childMax);
+        if (child.primitiveCount > 0)
+        {
+            quantizedNode.childOffset[i] = child.primitiveOffset;
+            quantizedNode.primitiveCount[i] = child.primitiveCount;
+        }
+        else
+        {
+            quantizedNode.childOffset[i] = QuantizeBVHNode(binaryNodes, children[i], childMin, childMax, quantizedNodes);
+            quantizedNode.primitiveCount[i] = Node::INTERIOR_CHILD;
+        }
+    }
+    quantizedNodes[quantizedIndex] = quantizedNode;
+
+    return quantizedIndex;
+}
+
+template <typename T>
+static std::vector<QuantizedBVHNode<T>> QuantizeBVH(AccelerationStructure& accelerationStructure)
+{
+    auto const& binaryNodes = accelerationStructure.nodes;
+    auto const& rootBounds = binaryNodes[0].bounds;
+    for (uint32_t axis = 0; axis < 3; ++axis)
+    {
+        accelerationStructure.quantizedRootMin[axis] = RoundDown(rootBounds.pMin[axis]);
+        accelerationStructure.quantizedRootMax[axis] = RoundUp(rootBounds.pMax[axis]);
+    }
+
+    std::vector<QuantizedBVHNode<T>> quantizedNodes;
+    /* One node for each interior node of the binary tree */
+    quantizedNodes.reserve(binaryNodes.size() / 2 + 1);
+    QuantizeBVHNode<T>(binaryNodes, 0, accelerationStructure.quantizedRootMin, accelerationStructure.quantizedRootMax, quantizedNodes);
+    return quantizedNodes;
+}
+
 static void ReorderPrimitives(Context& ctx, std::vector<uint32_t>& indices)
 {
-    indices.resize(ctx.input.indices.size());
+    indices.resize(ctx.orderedPrimitives.size() * 3);
     for (size_t i = 0; i < ctx.orderedPrimitives.size(); ++i)
     {
         auto currentPrimitive = ctx.orderedPrimitives[i];
@@ -341,6 +705,31 @@ static void ReorderPrimitives(Context& ctx, std::vector<uint32_t>& indices)
     }
 }
 
+static void PrecomputeTriangles(std::vector<LinearBVHNode> const& nodes, uint32_t const* indices, VertexPositionNormal const* vertices,
+                                std::vector<float>& precomputedTriangles)
+{
+    for (auto const& node : nodes)
+    {
+        if (node.primitiveCount == 0)
+            continue;
+
+        float* leaf = precomputedTriangles.data() + node.primitiveOffset * PRECOMPUTED_TRIANGLE_FLOATS;
+        for (uint32_t i = 0; i < node.primitiveCount; ++i)
+        {
+            uint32_t first = (node.primitiveOffset + i) * 3;
+            glm::vec3 p0 = vertices[indices[first + 0]].position;
+            glm::vec3 edge1 = vertices[indices[first + 1]].position - p0;
+            glm::vec3 edge2 = vertices[indices[first + 2]].position - p0;
+
+            float const values[PRECOMPUTED_TRIANGLE_FLOATS] = {p0.x, p0.y, p0.z, edge1.x, edge1.y, edge1.z, edge2.x, edge2.y, edge2.z};
+            for (uint32_t j = 0; j < PRECOMPUTED_TRIANGLE_FLOATS; ++j)
+            {
+                leaf[j * node.primitiveCount + i] = values[j];
+            }
+        }
+    }
+}
+
 static bool SafetyCheck(std::vector<MortonPrimitive> const& primitives, uint32_t size)
 {
     if (primitives.size() != size)
@@ -365,63 +754,104 @@ static bool SafetyCheck(std::vector<MortonPrimitive> const& primitives, uint32_t
     return good;
 }
 
-static void RadixSort(std::vector<MortonPrimitive>* v)
+/* LSD radix sort on the lowest numberOfBits bits of the Morton codes. Stable, so the result doesn't depend on the number of threads */
+static void RadixSort(Context const& ctx, std::vector<MortonPrimitive>* v, uint32_t numberOfBits)
 {
-    uint32_t initialSize = (uint32_t)v->size();
-    std::vector<MortonPrimitive> tempVector(v->size());
-    constexpr uint32_t bitsPerPass = 6;
-    constexpr uint32_t numberOfBits = 30;
-    static_assert((numberOfBits % bitsPerPass) == 0, "Radix sort bits per pass must evenly divide number of bit");
-    constexpr uint32_t numberOfPasses = numberOfBits / bitsPerPass;
+    constexpr uint32_t bitsPerPass = 8;
+    constexpr uint32_t numberOfBuckets = 1 << bitsPerPass;
+    constexpr uint64_t bitMask = numberOfBuckets - 1;
+    uint32_t numberOfPasses = DivideByMultiple(numberOfBits, bitsPerPass);
+
+    uint32_t size = (uint32_t)v->size();
+    std::vector<MortonPrimitive> tempVector(size);
+    MortonPrimitive* in = v->data();
+    MortonPrimitive* out = tempVector.data();
+
+    /* Each thread counts and scatters its own contiguous chunk. Chunk c writes the elements of a bucket after the ones of chunks 0..c-1 */
+    uint32_t chunkCount = 1;
+    if (ShouldBinInParallel(ctx, size))
+    {
+        chunkCount = std::min(ctx.buildThreads, DivideByMultiple(size, ctx.input.parallelGrainSize));
+    }
+    uint32_t chunkSize = DivideByMultiple(size, chunkCount);
+    std::vector<std::array<uint32_t, numberOfBuckets>> chunkOffsets(chunkCount);
+
+    auto forEachChunk = [&](auto&& func)
+    {
+        auto processChunk = [&](uint32_t chunk)
+        {
+            uint32_t first = chunk * chunkSize;
+            func(chunk, first, std::min(first + chunkSize, size));
+        };
+        if (chunkCount > 1)
+        {
+            ThreadPool::Get()->ExecuteParallelForImmediate(processChunk, chunkCount, 1);
+        }
+        else
+        {
+            processChunk(0);
+        }
+    };
 
     for (uint32_t pass = 0; pass < numberOfPasses; ++pass)
     {
         uint32_t lowBit = pass * bitsPerPass;
 
-        std::vector<MortonPrimitive> const& in = (pass & 1) ? tempVector : *v;
-        std::vector<MortonPrimitive>& out = (pass & 1) ? *v : tempVector;
-
-        constexpr uint32_t numberOfBuckets = 1 << bitsPerPass;
-        constexpr uint32_t bitMask = (1 << bitsPerPass) - 1;
-        uint32_t bucketCount[numberOfBuckets] = {0};
-        for (MortonPrimitive const& mp : in)
+        forEachChunk([&](uint32_t chunk, uint32_t first, uint32_t last)
         {
-            uint32_t bucket = (mp.mortonCode >> lowBit) & bitMask;
-            CHECK_GE(bucket, 0u);
-            CHECK_LE(bucket, numberOfBuckets);
-            bucketCount[bucket]++;
-        }
-        
-        int outIndex[numberOfBuckets] = {0};
-        outIndex[0] = 0;
-        for (uint32_t i = 1; i < numberOfBuckets; ++i)
+            auto& bucketCount = chunkOffsets[chunk];
+            bucketCount.fill(0);
+            for (uint32_t i = first; i < last; ++i)
+            {
+                bucketCount[(in[i].mortonCode >> lowBit) & bitMask]++;
+            }
+        });
+
+        /* Exclusive prefix scan, bucket major, which turns the counts into the first output index of every chunk */
+        uint32_t outIndex = 0;
+        bool sameBucket = false;
+        for (uint32_t bucket = 0; bucket < numberOfBuckets; ++bucket)
         {
-            outIndex[i] = outIndex[i - 1] + bucketCount[i - 1];
+            uint32_t bucketStart = outIndex;
+            for (uint32_t chunk = 0; chunk < chunkCount; ++chunk)
+            {
+                uint32_t count = chunkOffsets[chunk][bucket];
+                chunkOffsets[chunk][bucket] = outIndex;
+                outIndex += count;
+            }
+            sameBucket |= outIndex - bucketStart == size;
         }
+        CHECK_EQ(outIndex, size);
+
+        /* Every code has the same digit, so the pass wouldn't move anything. Common for the high bits of the wide codes */
+        if (sameBucket)
+            continue;
 
         /* Store sorted values in output array */
-        for (MortonPrimitive const& mp : in)
+        forEachChunk([&](uint32_t chunk, uint32_t first, uint32_t last)
         {
-            uint32_t bucket = (mp.mortonCode >> lowBit) & bitMask;
-            CHECK_GE(bucket, 0u);
-            CHECK_LE(bucket, numberOfBuckets);
-            out[outIndex[bucket]++] = mp;
-        }
+            auto& outIndices = chunkOffsets[chunk];
+            for (uint32_t i = first; i < last; ++i)
+            {
+                out[outIndices[(in[i].mortonCode >> lowBit) & bitMask]++] = in[i];
+            }
+        });
+        std::swap(in, out);
     }
 
-    if (numberOfPasses & 1)
+    if (in != v->data())
         std::swap(*v, tempVector);
 }
 
-static std::shared_ptr<BVHBuildNode> emitLBVH(Context& ctx, std::vector<std::shared_ptr<BVHBuildNode>>& buildNodes,
-                                              MortonPrimitive const* mortonPrimitives, uint32_t primitiveCount, int bitIndex,
-                                              uint32_t& totalNodes, std::atomic<uint32_t>& orderedPrimsOffset)
+static BVHBuildNode* emitLBVH(Context& ctx, MemoryArena& arena,
+                              MortonPrimitive const* mortonPrimitives, uint32_t primitiveCount, int bitIndex,
+                              uint32_t& totalNodes, std::atomic<uint32_t>& orderedPrimsOffset)
 {
     if (bitIndex == -1 || primitiveCount < ctx.input.maxPrimsInNode)
     {
         // Leaf node => Create it and return it
         totalNodes++;
-        auto& buildNode = buildNodes.emplace_back(std::make_shared<BVHBuildNode>());
+        auto buildNode = arena.Create<BVHBuildNode>();
         uint32_t firstPrimitive = orderedPrimsOffset.fetch_add(primitiveCount);
         BoundingBox bbox;
         
@@ -436,9 +866,9 @@ static std::shared_ptr<BVHBuildNode> emitLBVH(Context& ctx, std::vector<std::sha
     }
     else
     {
-        int mask = 1 << bitIndex;
+        uint64_t mask = 1ull << bitIndex;
         if ((mortonPrimitives[0].mortonCode & mask) == (mortonPrimitives[primitiveCount - 1].mortonCode & mask))
-            return emitLBVH(ctx, buildNodes, mortonPrimitives, primitiveCount,
+            return emitLBVH(ctx, arena, mortonPrimitives, primitiveCount,
                             bitIndex - 1, totalNodes, orderedPrimsOffset);
 
         // Find LVBH split point for this dimension
@@ -461,29 +891,29 @@ static std::shared_ptr<BVHBuildNode> emitLBVH(Context& ctx, std::vector<std::sha
 
         totalNodes++;
 
-        std::shared_ptr<BVHBuildNode> lbvh[2] = {
-            emitLBVH(ctx, buildNodes, mortonPrimitives, splitOffset, bitIndex - 1,
+        BVHBuildNode* lbvh[2] = {
+            emitLBVH(ctx, arena, mortonPrimitives, splitOffset, bitIndex - 1,
             totalNodes, orderedPrimsOffset),
-            emitLBVH(ctx, buildNodes, &mortonPrimitives[splitOffset], primitiveCount - splitOffset,
+            emitLBVH(ctx, arena, &mortonPrimitives[splitOffset], primitiveCount - splitOffset,
             bitIndex - 1, totalNodes, orderedPrimsOffset),
         };
         int axis = bitIndex % 3;
         
-        auto& buildNode = buildNodes.emplace_back(std::make_shared<BVHBuildNode>());
+        auto buildNode = arena.Create<BVHBuildNode>();
         buildNode->InitAsInterior(Axis(axis), lbvh[0], lbvh[1]);
         return buildNode;
     }
 }
 
-static std::shared_ptr<BVHBuildNode> BuildUpperSAH(std::vector<std::shared_ptr<BVHBuildNode>>& treeletRoots,
-                                                   uint32_t start, uint32_t end, uint32_t& totalNodes)
+static BVHBuildNode* BuildUpperSAH(MemoryArena& arena, std::vector<BVHBuildNode*>& treeletRoots,
+                                   uint32_t start, uint32_t end, std::atomic<uint32_t>& totalNodes)
 {
     CHECK_LT(start, end);
     uint32_t numNodes = end - start;
     if (numNodes == 1)
         return treeletRoots[start];
     
-    std::shared_ptr<BVHBuildNode> node = std::make_unique<BVHBuildNode>();
+    BVHBuildNode* node = arena.Create<BVHBuildNode>();
     totalNodes++;
 
     BoundingBox bbox;
@@ -550,7 +980,7 @@ static std::shared_ptr<BVHBuildNode> BuildUpperSAH(std::vector<std::shared_ptr<B
     /* Split */
     auto middlePtr = std::partition(
         &treeletRoots[start], &treeletRoots[end - 1] + 1,
-        [&](std::shared_ptr<BVHBuildNode> const& pi)
+        [&](BVHBuildNode const* pi)
         {
             Float centroid =
                 (pi->bounds.pMin[dim] + pi->bounds.pMax[dim]) * 0.5f;
@@ -572,13 +1002,13 @@ static std::shared_ptr<BVHBuildNode> BuildUpperSAH(std::vector<std::shared_ptr<B
     CHECK(mid >= start);
     CHECK(mid <= end);
     node->InitAsInterior((Axis)dim,
-                         BuildUpperSAH(treeletRoots, start, mid, totalNodes),
-                         BuildUpperSAH(treeletRoots, mid, end, totalNodes));
+                         BuildUpperSAH(arena, treeletRoots, start, mid, totalNodes),
+                         BuildUpperSAH(arena, treeletRoots, mid, end, totalNodes));
     return node;
 
 }
 
-static std::shared_ptr<BVHBuildNode> BuildHLBVH(Context& ctx)
+static BVHBuildNode* BuildHLBVH(Context& ctx)
 {
     BoundingBox boundingBox;
     for (auto const& primitive : ctx.primitives)
@@ -589,33 +1019,34 @@ static std::shared_ptr<BVHBuildNode> BuildHLBVH(Context& ctx)
 
     std::vector<MortonPrimitive> mortonPrimitives(ctx.primitives.size());
 
+    /* Large meshes quantize their centroids more finely, otherwise lots of them end up in the same grid cell and in the same leaf */
+    bool wideCodes = ctx.primitives.size() >= ctx.input.hlbvhWideMortonThreshold;
+    uint32_t const mortonBits = wideCodes ? 21 : 10;
+    uint32_t const numberOfBits = 3 * mortonBits;
+
     /* Compute Morton indices */
     ThreadPool::Get()->ExecuteParallelForImmediate(
         [&](uint32_t i)
     {
-        constexpr uint32_t mortonBits = 10;
-        constexpr uint32_t mortonScale = 1 << mortonBits;
         mortonPrimitives[i].primitiveIndex = (uint32_t)ctx.primitives[i].index;
-        Position centroidOffset = boundingBox.Offset(ctx.primitives[i].centroid);
-        mortonPrimitives[i].mortonCode = EncodeMorton3(centroidOffset * (Float)mortonScale);
+        Position centroidOffset = boundingBox.Offset(ctx.primitives[i].centroid) * (Float)(1 << mortonBits);
+        mortonPrimitives[i].mortonCode = wideCodes ? EncodeMorton3Wide(centroidOffset) : EncodeMorton3(centroidOffset);
     }, (uint32_t)ctx.primitives.size(), 512);
 
-    RadixSort(&mortonPrimitives);
+    RadixSort(ctx, &mortonPrimitives, numberOfBits);
 
     /* Build bottom level treelets */
     std::vector<LBVHTreelet> treelets;
-    uint32_t mask = 0b00111111111111000000000000000000;
-    /* Checking the last 12 bits => clustering into 2^12 grid cells => we will have at most 2^16 treelets */
+    /* Checking the top 12 bits => clustering into 2^12 grid cells => we will have at most 2^12 treelets */
+    constexpr uint32_t treeletBits = 12;
+    uint64_t mask = ((1ull << treeletBits) - 1) << (numberOfBits - treeletBits);
     for (uint32_t start = 0, end = 1; end <= mortonPrimitives.size(); ++end)
     {
         if (end == mortonPrimitives.size() ||
             (mortonPrimitives[start].mortonCode & mask) != (mortonPrimitives[end].mortonCode & mask))
         {
             uint32_t count = end - start;
-            uint32_t maxBVHNodes = 2 * count;
-            std::vector<std::shared_ptr<BVHBuildNode>> buildNodes;
-            buildNodes.reserve(maxBVHNodes);
-            treelets.emplace_back(start, count, buildNodes);
+            treelets.emplace_back(start, count);
             start = end;
         }
     }
@@ -627,9 +1058,10 @@ static std::shared_ptr<BVHBuildNode> BuildHLBVH(Context& ctx)
         [&](uint32_t i)
         {
             uint32_t nodesCreated = 0;
-            const int firstBitIndex = 29 - 12; // 29 is the first bit from which we subtract the mask
+            /* The first bit below the treelet bits */
+            const int firstBitIndex = (int)(numberOfBits - treeletBits) - 1;
 
-            treelets[i].root = emitLBVH(ctx, treelets[i].buildNodes, mortonPrimitives.data() + treelets[i].startIndex,
+            treelets[i].root = emitLBVH(ctx, GetThreadArena(ctx), mortonPrimitives.data() + treelets[i].startIndex,
                                         treelets[i].primitiveCount, firstBitIndex, nodesCreated, orderedPrimsOffset);
 
             totalNodes += nodesCreated;
@@ -637,65 +1069,988 @@ static std::shared_ptr<BVHBuildNode> BuildHLBVH(Context& ctx)
 
     ctx.totalNodes = totalNodes.load();
 
-    std::vector<std::shared_ptr<BVHBuildNode>> finishedTreelets;
+    std::vector<BVHBuildNode*> finishedTreelets;
     finishedTreelets.reserve(treelets.size());
     for (LBVHTreelet& treelet : treelets)
     {
-        if (!treelet.buildNodes.empty())
+        if (treelet.root != nullptr)
         {
             finishedTreelets.push_back(treelet.root);
         }
     }
 
-    return BuildUpperSAH(finishedTreelets, 0, (uint32_t)finishedTreelets.size(), ctx.totalNodes);
+    return BuildUpperSAH(ctx.callerArena, finishedTreelets, 0, (uint32_t)finishedTreelets.size(), ctx.totalNodes);
 }
 
-Output Common::Accelerators::BVH::Generate(Input const& input)
+/* Treelet optimizer (TRBVH). Every node with enough primitives under it is the root of a treelet: the root and its
+ * descendants, expanded by surface area until there are TREELET_LEAVES leaves. The topology of the treelet is then
+ * replaced by the one with the smallest SAH cost, found by dynamic programming over the subsets of its leaves.
+ * Leaves are moved around as they are, so the primitive order and the number of nodes don't change
+ */
+constexpr const uint32_t TREELET_LEAVES = 7;
+constexpr const uint32_t TREELET_SUBSETS = 1 << TREELET_LEAVES;
+/* Each pass doubles the primitives a treelet root needs, so the later passes only revisit the top of the tree */
+constexpr const uint32_t TREELET_OPTIMIZATION_PASSES = 3;
+
+static void ComputeTreeletCosts(BVHBuildNode* node)
 {
-    if (input.indices.empty())
-        return {}; // Empty Input => Empty Output
+    if (node->numberOfPrimitives > 0)
+    {
+        node->cost = node->bounds.SurfaceArea() * (Float)node->numberOfPrimitives;
+        node->subtreePrimitives = node->numberOfPrimitives;
+        return;
+    }
 
-    CHECK(input.indices.size() % 3 == 0) << "Cannot generate BVH with non-triangle faces";
+    ComputeTreeletCosts(node->children[0]);
+    ComputeTreeletCosts(node->children[1]);
+    node->cost = node->bounds.SurfaceArea() + node->children[0]->cost + node->children[1]->cost;
+    node->subtreePrimitives = node->children[0]->subtreePrimitives + node->children[1]->subtreePrimitives;
+}
 
-    Context ctx{.input = input};
+static Axis GetChildrenAxis(BVHBuildNode const* c0, BVHBuildNode const* c1)
+{
+    BoundingBox centroidBounds;
+    centroidBounds = Union(centroidBounds, (c0->bounds.pMin + c0->bounds.pMax) * Half);
+    centroidBounds = Union(centroidBounds, (c1->bounds.pMin + c1->bounds.pMax) * Half);
+    return centroidBounds.MaximumExtent();
+}
 
-    /* Create array of primitives */
-    uint32_t totalPrimitives = (uint32_t)input.indices.size() / 3;
-    ctx.primitives.reserve(totalPrimitives);
-    for (uint32_t i = 0; i < totalPrimitives; ++i)
+static void RestructureTreelet(BVHBuildNode* root)
+{
+    BVHBuildNode* leaves[TREELET_LEAVES] = {root->children[0], root->children[1]};
+    BVHBuildNode* interiors[TREELET_LEAVES - 1] = {root};
+    uint32_t leafCount = 2;
+    uint32_t interiorCount = 1;
+    while (leafCount < TREELET_LEAVES)
     {
-        uint32_t index0 = input.indices[i * 3 + 0];
-        uint32_t index1 = input.indices[i * 3 + 1];
-        uint32_t index2 = input.indices[i * 3 + 2];
-
-        BoundingBox box(input.vertices[index0].position);
-        box = Union(box, input.vertices[index1].position);
-        box = Union(box, input.vertices[index2].position);
+        /* Expanding the biggest leaf gives the most freedom to the optimization */
+        int biggest = -1;
+        Float biggestArea = -One;
+        for (uint32_t i = 0; i < leafCount; ++i)
+        {
+            Float area = leaves[i]->bounds.SurfaceArea();
+            if (leaves[i]->numberOfPrimitives == 0 && area > biggestArea)
+            {
+                biggest = (int)i;
+                biggestArea = area;
+            }
+        }
+        if (biggest == -1)
+            break;
 
-        ctx.primitives.emplace_back(i, box);
+        BVHBuildNode* expanded = leaves[biggest];
+        interiors[interiorCount++] = expanded;
+        leaves[biggest] = expanded->children[0];
+        leaves[leafCount++] = expanded->children[1];
     }
 
-    std::shared_ptr<BVHBuildNode> root;
-    if (input.splitType == SplitType::HLBVH)
+    /* 3 leaves or more, otherwise there's only one possible topology */
+    if (leafCount > 2)
     {
-        root = BuildHLBVH(ctx);
-    }
+        uint32_t const fullSet = (1u << leafCount) - 1;
+        BoundingBox subsetBounds[TREELET_SUBSETS];
+        Float optimalCost[TREELET_SUBSETS];
+        uint32_t optimalPartition[TREELET_SUBSETS];
+        uint32_t subsetPrimitives[TREELET_SUBSETS];
+        for (uint32_t i = 0; i < leafCount; ++i)
+        {
+            subsetBounds[1u << i] = leaves[i]->bounds;
+            optimalCost[1u << i] = leaves[i]->cost;
+            subsetPrimitives[1u << i] = leaves[i]->subtreePrimitives;
+        }
+
+        /* Subsets are smaller than the sets containing them, so they're always solved first */
+        for (uint32_t subset = 3; subset <= fullSet; ++subset)
+        {
+            uint32_t lowestLeaf = subset & (~subset + 1);
+            if (subset == lowestLeaf)
+                continue;
+
+            uint32_t rest = subset ^ lowestLeaf;
+            subsetBounds[subset] = Union(subsetBounds[rest], subsetBounds[lowestLeaf]);
+            subsetPrimitives[subset] = subsetPrimitives[rest] + subsetPrimitives[lowestLeaf];
+
+            /* Only the partitions where the lowest leaf is on the left, the others are the same ones mirrored */
+            Float bestCost = optimalCost[lowestLeaf] + optimalCost[rest];
+            uint32_t bestPartition = lowestLeaf;
+            for (uint32_t others = (rest - 1) & rest; others != 0; others = (others - 1) & rest)
+            {
+                uint32_t left = others | lowestLeaf;
+                Float cost = optimalCost[left] + optimalCost[subset ^ left];
+                if (cost < bestCost)
+                {
+                    bestCost = cost;
+                    bestPartition = left;
+                }
+            }
+            optimalCost[subset] = subsetBounds[subset].SurfaceArea() + bestCost;
+            optimalPartition[subset] = bestPartition;
+        }
+
+        /* Rounding errors can make the same topology look cheaper */
+        constexpr Float minimumImprovement = (Float)1e-5;
+        if (optimalCost[fullSet] < root->cost * (One - minimumImprovement))
+        {
+            /* The root stays the root, so its parent doesn't have to change */
+            uint32_t nextInterior = 1;
+            auto assignSubset = [&](auto&& self, uint32_t subset) -> BVHBuildNode*
+            {
+                if ((subset & (subset - 1)) == 0)
+                {
+                    return leaves[std::countr_zero(subset)];
+                }
+
+                BVHBuildNode* node = subset == fullSet ? root : interiors[nextInterior++];
+                BVHBuildNode* c0 = self(self, optimalPartition[subset]);
+                BVHBuildNode* c1 = self(self, subset ^ optimalPartition[subset]);
+                node->InitAsInterior(GetChildrenAxis(c0, c1), c0, c1);
+                node->cost = optimalCost[subset];
+                node->subtreePrimitives = subsetPrimitives[subset];
+                return node;
+            };
+            assignSubset(assignSubset, fullSet);
+            CHECK_EQ(nextInterior, interiorCount);
+            return;
+        }
+    }
+
+    root->cost = root->bounds.SurfaceArea() + root->children[0]->cost + root->children[1]->cost;
+}
+
+/* Bottom up, so the treelets below a node are optimized before the node's own treelet */
+static void OptimizeTreelets(Context& ctx, BVHBuildNode* node, uint32_t minimumPrimitives, uint32_t depth)
+{
+    if (node->numberOfPrimitives > 0 || node->subtreePrimitives < minimumPrimitives)
+        return;
+
+    if (depth < ctx.maxTaskDepth && node->subtreePrimitives >= ctx.input.parallelGrainSize)
+    {
+        /* Treelets in different subtrees don't share nodes, so they can be optimized at the same time */
+        auto threadPool = ThreadPool::Get();
+        auto task = threadPool->ExecuteDeffered(
+            [&ctx, node, minimumPrimitives, depth]()
+        {
+            OptimizeTreelets(ctx, node->children[0], minimumPrimitives, depth + 1);
+        });
+        OptimizeTreelets(ctx, node->children[1], minimumPrimitives, depth + 1);
+        threadPool->Wait(task);
+    }
     else
     {
-        root = RecursiveBuild(ctx, 0, totalPrimitives);
+        OptimizeTreelets(ctx, node->children[0], minimumPrimitives, depth + 1);
+        OptimizeTreelets(ctx, node->children[1], minimumPrimitives, depth + 1);
     }
-    
+
+    RestructureTreelet(node);
+}
+
+static void OptimizeTreeletsPasses(Context& ctx, BVHBuildNode* root)
+{
+    ComputeTreeletCosts(root);
+    Float rootSurfaceArea = std::max(root->bounds.SurfaceArea(), std::numeric_limits<Float>::min());
+    Float initialCost = root->cost;
+
+    for (uint32_t pass = 0; pass < TREELET_OPTIMIZATION_PASSES; ++pass)
+    {
+        OptimizeTreelets(ctx, root, TREELET_LEAVES << pass, 0);
+    }
+
+    VLOG(1) << "Treelet optimization changed the SAH cost from " << initialCost / rootSurfaceArea << " to " << root->cost / rootSurfaceArea;
+}
+
+/* SBVH */
+constexpr const uint32_t NUMBER_OF_SPATIAL_BINS = 32;
+/* Spatial splits are only tried when the children of the best object split overlap by more than this fraction of the root surface */
+constexpr const Float SBVH_OVERLAP_THRESHOLD = 1e-5f;
+
+struct SBVHContext
+{
+    Context& ctx;
+    Float rootSurfaceArea;
+    /* References that can still be created by splitting triangles */
+    uint32_t remainingDuplicates;
+};
+
+struct SBVHSplit
+{
+    Float cost = FLT_MAX;
+    Axis axis = Axis::X;
+    bool spatial = false;
+
+    /* Object split => last bucket of the left child; Spatial split => position of the plane */
+    int bucket = -1;
+    Float position = Zero;
+
+    BoundingBox leftBounds;
+    BoundingBox rightBounds;
+    uint32_t leftCount = 0;
+    uint32_t rightCount = 0;
+};
+
+struct SpatialBin
+{
+    BoundingBox bounds;
+    uint32_t entries = 0;
+    uint32_t exits = 0;
+};
+
+/* Splits a reference with the plane axis = position. Both halves are clipped to the triangle, not just to the box of the reference */
+static void SplitReference(Context const& ctx, BVHPrimitiveInfo const& reference, Axis axis, Float position,
+                           BoundingBox& leftBounds, BoundingBox& rightBounds)
+{
+    auto axisIndex = (uint32_t)axis;
+    Position vertices[3];
+    for (uint32_t i = 0; i < 3; ++i)
+    {
+        vertices[i] = ctx.input.vertices[ctx.input.indices[reference.index * 3 + i]].position;
+    }
+
+    leftBounds = BoundingBox();
+    rightBounds = BoundingBox();
+    for (uint32_t i = 0; i < 3; ++i)
+    {
+        Position const& v0 = vertices[i];
+        Position const& v1 = vertices[(i + 1) % 3];
+        Float p0 = v0[axisIndex];
+        Float p1 = v1[axisIndex];
+
+        if (p0 <= position)
+            leftBounds = Union(leftBounds, v0);
+        if (p0 >= position)
+            rightBounds = Union(rightBounds, v0);
+
+        if ((p0 < position && position < p1) || (p1 < position && position < p0))
+        {
+            /* The edge crosses the plane */
+            Float t = std::clamp((position - p0) / (p1 - p0), Zero, One);
+            Position intersection = v0 + (v1 - v0) * t;
+            leftBounds = Union(leftBounds, intersection);
+            rightBounds = Union(rightBounds, intersection);
+        }
+    }
+
+    /* The reference might have been clipped already by the splits above it */
+    leftBounds.pMax[axisIndex] = position;
+    rightBounds.pMin[axisIndex] = position;
+    leftBounds = Intersect(leftBounds, reference.bounds);
+    rightBounds = Intersect(rightBounds, reference.bounds);
+}
+
+static bool IsValid(BoundingBox const& bounds)
+{
+    return bounds.pMin.x <= bounds.pMax.x && bounds.pMin.y <= bounds.pMax.y && bounds.pMin.z <= bounds.pMax.z;
+}
+
+static void FindObjectSplit(std::vector<BVHPrimitiveInfo> const& references, BoundingBox const& bounds,
+                            BoundingBox const& centroidBounds, SBVHSplit& bestSplit)
+{
+    for (uint32_t axisIndex = 0; axisIndex < 3; ++axisIndex)
+    {
+        if (centroidBounds.pMin[axisIndex] == centroidBounds.pMax[axisIndex])
+            continue;
+
+        Axis axis = (Axis)axisIndex;
+        std::array<Bucket, NUMBER_OF_BUCKETS> buckets;
+        for (auto const& reference : references)
+        {
+            int bucketIndex = GetBucketIndex(centroidBounds, reference.centroid, axis);
+            buckets[bucketIndex].count++;
+            buckets[bucketIndex].boundingBox = Union(buckets[bucketIndex].boundingBox, reference.bounds);
+        }
+
+        /* Sweep from the right first, so every candidate is evaluated in linear time */
+        std::array<BoundingBox, NUMBER_OF_BUCKETS> rightBounds;
+        std::array<uint32_t, NUMBER_OF_BUCKETS> rightCounts;
+        BoundingBox accumulatedBounds;
+        uint32_t accumulatedCount = 0;
+        for (int i = NUMBER_OF_BUCKETS - 1; i > 0; --i)
+        {
+            accumulatedBounds = Union(accumulatedBounds, buckets[i].boundingBox);
+            accumulatedCount += buckets[i].count;
+            rightBounds[i] = accumulatedBounds;
+            rightCounts[i] = accumulatedCount;
+        }
+
+        accumulatedBounds = BoundingBox();
+        accumulatedCount = 0;
+        for (int i = 0; i < NUMBER_OF_BUCKETS - 1; ++i)
+        {
+            accumulatedBounds = Union(accumulatedBounds, buckets[i].boundingBox);
+            accumulatedCount += buckets[i].count;
+            if (accumulatedCount == 0 || rightCounts[i + 1] == 0)
+                continue;
+
+            Float cost = 1 + (accumulatedCount * accumulatedBounds.SurfaceArea() + rightCounts[i + 1] * rightBounds[i + 1].SurfaceArea()) / bounds.SurfaceArea();
+            if (cost < bestSplit.cost)
+            {
+                bestSplit.cost = cost;
+                bestSplit.axis = axis;
+                bestSplit.spatial = false;
+                bestSplit.bucket = i;
+                bestSplit.leftBounds = accumulatedBounds;
+                bestSplit.rightBounds = rightBounds[i + 1];
+                bestSplit.leftCount = accumulatedCount;
+                bestSplit.rightCount = rightCounts[i + 1];
+            }
+        }
+    }
+}
+
+static void FindSpatialSplit(SBVHContext const& sbvh, std::vector<BVHPrimitiveInfo> const& references, BoundingBox const& bounds, SBVHSplit& bestSplit)
+{
+    for (uint32_t axisIndex = 0; axisIndex < 3; ++axisIndex)
+    {
+        Float axisStart = bounds.pMin[axisIndex];
+        Float binSize = (bounds.pMax[axisIndex] - axisStart) / NUMBER_OF_SPATIAL_BINS;
+        if (binSize <= Zero)
+            continue;
+
+        Axis axis = (Axis)axisIndex;
+        auto getBinIndex = [&](Float position)
+        {
+            return std::clamp((int)((position - axisStart) / binSize), 0, (int)NUMBER_OF_SPATIAL_BINS - 1);
+        };
+
+        /* Chop every reference into the bins it overlaps */
+        std::array<SpatialBin, NUMBER_OF_SPATIAL_BINS> bins;
+        for (auto const& reference : references)
+        {
+            int firstBin = getBinIndex(reference.bounds.pMin[axisIndex]);
+            int lastBin = getBinIndex(reference.bounds.pMax[axisIndex]);
+            bins[firstBin].entries++;
+            bins[lastBin].exits++;
+
+            BVHPrimitiveInfo remaining = reference;
+            for (int i = firstBin; i < lastBin; ++i)
+            {
+                BoundingBox leftBounds, rightBounds;
+                SplitReference(sbvh.ctx, remaining, axis, axisStart + binSize * (i + 1), leftBounds, rightBounds);
+                bins[i].bounds = Union(bins[i].bounds, leftBounds);
+                remaining.bounds = rightBounds;
+            }
+            bins[lastBin].bounds = Union(bins[lastBin].bounds, remaining.bounds);
+        }
+
+        std::array<BoundingBox, NUMBER_OF_SPATIAL_BINS> rightBounds;
+        std::array<uint32_t, NUMBER_OF_SPATIAL_BINS> rightCounts;
+        BoundingBox accumulatedBounds;
+        uint32_t accumulatedCount = 0;
+        for (int i = NUMBER_OF_SPATIAL_BINS - 1; i > 0; --i)
+        {
+            accumulatedBounds = Union(accumulatedBounds, bins[i].bounds);
+            accumulatedCount += bins[i].exits;
+            rightBounds[i] = accumulatedBounds;
+            rightCounts[i] = accumulatedCount;
+        }
+
+        accumulatedBounds = BoundingBox();
+        accumulatedCount = 0;
+        for (int i = 0; i < NUMBER_OF_SPATIAL_BINS - 1; ++i)
+        {
+            accumulatedBounds = Union(accumulatedBounds, bins[i].bounds);
+            accumulatedCount += bins[i].entries;
+            if (accumulatedCount == 0 || rightCounts[i + 1] == 0)
+                continue;
+
+            Float cost = 1 + (accumulatedCount * accumulatedBounds.SurfaceArea() + rightCounts[i + 1] * rightBounds[i + 1].SurfaceArea()) / bounds.SurfaceArea();
+            if (cost < bestSplit.cost)
+            {
+                bestSplit.cost = cost;
+                bestSplit.axis = axis;
+                bestSplit.spatial = true;
+                bestSplit.position = axisStart + binSize * (i + 1);
+                bestSplit.leftBounds = accumulatedBounds;
+                bestSplit.rightBounds = rightBounds[i + 1];
+                bestSplit.leftCount = accumulatedCount;
+                bestSplit.rightCount = rightCounts[i + 1];
+            }
+        }
+    }
+}
+
+static void PerformSpatialSplit(SBVHContext& sbvh, std::vector<BVHPrimitiveInfo> const& references, SBVHSplit const& split,
+                                std::vector<BVHPrimitiveInfo>& left, std::vector<BVHPrimitiveInfo>& right)
+{
+    auto axisIndex = (uint32_t)split.axis;
+    BoundingBox leftBounds = split.leftBounds;
+    BoundingBox rightBounds = split.rightBounds;
+    Float leftCount = (Float)split.leftCount;
+    Float rightCount = (Float)split.rightCount;
+
+    for (auto const& reference : references)
+    {
+        if (reference.bounds.pMax[axisIndex] <= split.position)
+        {
+            left.push_back(reference);
+            continue;
+        }
+        if (reference.bounds.pMin[axisIndex] >= split.position)
+        {
+            right.push_back(reference);
+            continue;
+        }
+
+        /* The reference straddles the plane => either split it or, if that's cheaper, move it entirely to one side ("unsplitting") */
+        BoundingBox leftWithReference = Union(leftBounds, reference.bounds);
+        BoundingBox rightWithReference = Union(rightBounds, reference.bounds);
+        Float splitCost = leftBounds.SurfaceArea() * leftCount + rightBounds.SurfaceArea() * rightCount;
+        Float leftOnlyCost = leftWithReference.SurfaceArea() * leftCount + rightBounds.SurfaceArea() * (rightCount - 1);
+        Float rightOnlyCost = leftBounds.SurfaceArea() * (leftCount - 1) + rightWithReference.SurfaceArea() * rightCount;
+
+        if (sbvh.remainingDuplicates == 0)
+        {
+            splitCost = FLT_MAX;
+        }
+
+        if (leftOnlyCost < splitCost && leftOnlyCost <= rightOnlyCost)
+        {
+            left.push_back(reference);
+            leftBounds = leftWithReference;
+            rightCount -= 1;
+        }
+        else if (rightOnlyCost < splitCost)
+        {
+            right.push_back(reference);
+            rightBounds = rightWithReference;
+            leftCount -= 1;
+        }
+        else
+        {
+            BoundingBox leftHalf, rightHalf;
+            SplitReference(sbvh.ctx, reference, split.axis, split.position, leftHalf, rightHalf);
+            /* The box of the reference may straddle the plane while the triangle inside it doesn't */
+            if (IsValid(leftHalf) && IsValid(rightHalf))
+            {
+                left.emplace_back(reference.index, leftHalf);
+                right.emplace_back(reference.index, rightHalf);
+                sbvh.remainingDuplicates--;
+            }
+            else if (IsValid(leftHalf))
+            {
+                left.emplace_back(reference.index, leftHalf);
+            }
+            else
+            {
+                right.emplace_back(reference.index, rightHalf);
+            }
+        }
+    }
+}
+
+static void InitSBVHLeaf(Context& ctx, BVHBuildNode* node, std::vector<BVHPrimitiveInfo> const& references, BoundingBox const& bounds)
+{
+    /* Leaves can't own a fixed range of the primitives like in RecursiveBuild, because split triangles are referenced more than once */
+    uint32_t firstPrimitive = (uint32_t)ctx.orderedPrimitives.size();
+    for (auto const& reference : references)
+    {
+        ctx.orderedPrimitives.push_back(reference.index);
+    }
+    node->InitAsLeaf(firstPrimitive, (uint32_t)references.size(), bounds);
+}
+
+static BVHBuildNode* RecursiveBuildSBVH(SBVHContext& sbvh, MemoryArena& arena, std::vector<BVHPrimitiveInfo>& references)
+{
+    CHECK(!references.empty()) << "SBVH build with no references";
+    Context& ctx = sbvh.ctx;
+
+    auto node = arena.Create<BVHBuildNode>();
+    ctx.totalNodes++;
+
+    BoundingBox bounds;
+    BoundingBox centroidBounds;
+    for (auto const& reference : references)
+    {
+        bounds = Union(bounds, reference.bounds);
+        centroidBounds = Union(centroidBounds, reference.centroid);
+    }
+
+    if (references.size() <= ctx.input.maxPrimsInNode)
+    {
+        InitSBVHLeaf(ctx, node, references, bounds);
+        return node;
+    }
+
+    SBVHSplit split{};
+    FindObjectSplit(references, bounds, centroidBounds, split);
+
+    /* Spatial splits only pay off where the object split leaves the children overlapping */
+    BoundingBox overlap = Intersect(split.leftBounds, split.rightBounds);
+    Float overlapArea = IsValid(overlap) ? overlap.SurfaceArea() : Zero;
+    if (sbvh.remainingDuplicates > 0 && (split.cost == FLT_MAX || overlapArea / sbvh.rootSurfaceArea > SBVH_OVERLAP_THRESHOLD))
+    {
+        FindSpatialSplit(sbvh, references, bounds, split);
+    }
+
+    if (split.cost == FLT_MAX)
+    {
+        /* All the references have the same centroid and can't be split => Make this a leaf */
+        InitSBVHLeaf(ctx, node, references, bounds);
+        return node;
+    }
+
+    std::vector<BVHPrimitiveInfo> left, right;
+    left.reserve(split.leftCount);
+    right.reserve(split.rightCount);
+    if (split.spatial)
+    {
+        PerformSpatialSplit(sbvh, references, split, left, right);
+    }
+    else
+    {
+        for (auto const& reference : references)
+        {
+            if (GetBucketIndex(centroidBounds, reference.centroid, split.axis) <= split.bucket)
+                left.push_back(reference);
+            else
+                right.push_back(reference);
+        }
+    }
+    if (left.empty() || right.empty())
+    {
+        /* Unsplitting moved every reference to the same side => Fall back to splitting in the middle of the centroids */
+        Axis maximumAxis = centroidBounds.MaximumExtent();
+        auto axisIndex = (uint32_t)maximumAxis;
+        if (centroidBounds.pMin[axisIndex] == centroidBounds.pMax[axisIndex])
+        {
+            InitSBVHLeaf(ctx, node, references, bounds);
+            return node;
+        }
+
+        size_t mid = references.size() / 2;
+        std::nth_element(references.begin(), references.begin() + mid, references.end(),
+                         [&](BVHPrimitiveInfo const& lhs, BVHPrimitiveInfo const& rhs)
+        {
+            return lhs.centroid[axisIndex] < rhs.centroid[axisIndex];
+        });
+        left.assign(references.begin(), references.begin() + mid);
+        right.assign(references.begin() + mid, references.end());
+        split.axis = maximumAxis;
+    }
+
+    /* Not needed anymore; Freeing it keeps the memory bounded by the depth of the tree */
+    std::vector<BVHPrimitiveInfo>().swap(references);
+
+    BVHBuildNode* leftChild = RecursiveBuildSBVH(sbvh, arena, left);
+    BVHBuildNode* rightChild = RecursiveBuildSBVH(sbvh, arena, right);
+    node->InitAsInterior(split.axis, leftChild, rightChild);
+
+    return node;
+}
+
+static BVHBuildNode* BuildSBVH(Context& ctx)
+{
+    CHECK(!ctx.input.indices.empty()) << "Spatial splits need the triangles of the primitives";
+
+    uint32_t triangleCount = (uint32_t)ctx.primitives.size();
+    SBVHContext sbvh{
+        .ctx = ctx,
+        .rootSurfaceArea = Zero,
+        .remainingDuplicates = (uint32_t)((Float)triangleCount * std::max(ctx.input.sbvhMemoryBudget, 0.0f)),
+    };
+    uint32_t duplicateBudget = sbvh.remainingDuplicates;
+
+    BoundingBox rootBounds;
+    for (auto const& primitive : ctx.primitives)
+    {
+        rootBounds = Union(rootBounds, primitive.bounds);
+    }
+    sbvh.rootSurfaceArea = std::max(rootBounds.SurfaceArea(), std::numeric_limits<Float>::min());
+
+    ctx.orderedPrimitives.clear();
+    ctx.orderedPrimitives.reserve(triangleCount + duplicateBudget);
+
+    std::vector<BVHPrimitiveInfo> references = std::move(ctx.primitives);
+    BVHBuildNode* root = RecursiveBuildSBVH(sbvh, ctx.callerArena, references);
+
+    VLOG(1) << "SBVH split " << duplicateBudget - sbvh.remainingDuplicates << " triangle references out of a budget of " << duplicateBudget;
+    return root;
+}
+
+static void InitContext(Context& ctx)
+{
+    ctx.workerArenas.resize(ThreadPool::Get()->GetNumberOfThreads());
+
+    uint32_t buildThreads = ctx.input.buildThreads == 0 ? ThreadPool::Get()->GetNumberOfThreads() + 1 : ctx.input.buildThreads;
+    ctx.buildThreads = buildThreads;
+    if (buildThreads > 1)
+    {
+        /* Create around four subtrees per thread, so unbalanced splits still keep every thread busy */
+        uint32_t depth = 0;
+        while ((1u << depth) < buildThreads)
+            depth++;
+        ctx.maxTaskDepth = depth + 2;
+    }
+}
+
+template <typename Function>
+static void CreatePrimitives(Context& ctx, uint32_t totalPrimitives, Function&& getBounds)
+{
+    ctx.primitives.resize(totalPrimitives);
+    auto createPrimitive = [&](uint32_t i)
+    {
+        ctx.primitives[i] = BVHPrimitiveInfo(i, getBounds(i));
+    };
+    if (ctx.maxTaskDepth > 0)
+    {
+        ThreadPool::Get()->ExecuteParallelForImmediate(createPrimitive, totalPrimitives, ctx.input.parallelGrainSize);
+    }
+    else
+    {
+        for (uint32_t i = 0; i < totalPrimitives; ++i)
+        {
+            createPrimitive(i);
+        }
+    }
+}
+
+struct ArenaUsage
+{
+    size_t bytesUsed = 0;
+    size_t bytesReserved = 0;
+};
+
+/* Builds the tree over ctx.primitives and flattens it into nodes. The build nodes are released before returning */
+static ArenaUsage BuildAndFlatten(Context& ctx, std::vector<LinearBVHNode>& nodes)
+{
+    BVHBuildNode* root = nullptr;
+    if (ctx.input.splitType == SplitType::HLBVH)
+    {
+        root = BuildHLBVH(ctx);
+    }
+    else if (ctx.input.splitType == SplitType::HLBVH_Optimized)
+    {
+        root = BuildHLBVH(ctx);
+        OptimizeTreeletsPasses(ctx, root);
+    }
+    else if (ctx.input.splitType == SplitType::SBVH)
+    {
+        root = BuildSBVH(ctx);
+    }
+    else
+    {
+        ctx.orderedPrimitives.resize(ctx.primitives.size());
+        root = RecursiveBuild(ctx, ctx.callerArena, 0, (uint32_t)ctx.primitives.size());
+    }
+
     CHECK(root != nullptr) << "Could not build a BVH";
 
+    /* Flatten BVH tree to be used */
+    AccelerationStructure flattened;
+    flattened.nodes.resize(ctx.totalNodes);
+    uint32_t offset = 0;
+    FlattenBVHTree(root, &offset, flattened);
+    CHECK(offset == ctx.totalNodes);
+    nodes = std::move(flattened.nodes);
+
+    /* The build nodes are not needed anymore */
+    ArenaUsage arenaUsage{};
+    ForEachArena(ctx, [&](MemoryArena& arena)
+    {
+        arenaUsage.bytesUsed += arena.GetTotalUsed();
+        arenaUsage.bytesReserved += arena.GetTotalReserved();
+        arena.Release();
+    });
+    return arenaUsage;
+}
+
+Output Common::Accelerators::BVH::Generate(Input const& input)
+{
+    if (input.indices.empty())
+        return {}; // Empty Input => Empty Output
+
+    CHECK(input.indices.size() % 3 == 0) << "Cannot generate BVH with non-triangle faces";
+    CHECK(input.width == 2 || input.width == 4 || input.width == 8) << "Unsupported BVH width " << input.width;
+
+    auto buildStart = std::chrono::high_resolution_clock::now();
+
+    Context ctx{.input = input};
+    InitContext(ctx);
+
+    /* Create array of primitives */
+    uint32_t totalPrimitives = (uint32_t)input.indices.size() / 3;
+    CreatePrimitives(ctx, totalPrimitives, [&](uint32_t i)
+    {
+        uint32_t index0 = input.indices[i * 3 + 0];
+        uint32_t index1 = input.indices[i * 3 + 1];
+        uint32_t index2 = input.indices[i * 3 + 2];
+
+        BoundingBox box(input.vertices[index0].position);
+        box = Union(box, input.vertices[index1].position);
+        box = Union(box, input.vertices[index2].position);
+        return box;
+    });
+
     /* Build the output */
     Output output{};
+    auto& accelerationStructure = output.accelerationStructure;
+    ArenaUsage arenaUsage = BuildAndFlatten(ctx, accelerationStructure.nodes);
     ReorderPrimitives(ctx, output.new_indices);
+    accelerationStructure.buildCost = ComputeSAHCost(accelerationStructure.nodes);
 
-    /* Flatten BVH tree to be used */
-    output.accelerationStructure.nodes.resize(ctx.totalNodes);
-    uint32_t offset = 0;
-    FlattenBVHTree(root, &offset, output.accelerationStructure);
-    CHECK(offset == ctx.totalNodes);
+    if (input.precomputeTriangles)
+    {
+        /* Has to be done before compressing the nodes, as it needs the leaves of the binary tree */
+        accelerationStructure.precomputedTriangles.resize(output.new_indices.size() / 3 * PRECOMPUTED_TRIANGLE_FLOATS);
+        PrecomputeTriangles(accelerationStructure.nodes, output.new_indices.data(), input.vertices.data(), accelerationStructure.precomputedTriangles);
+    }
+
+    accelerationStructure.width = input.width;
+    if (input.width == 4)
+    {
+        accelerationStructure.nodes4 = CollapseBVH<4>(accelerationStructure.nodes);
+    }
+    else if (input.width == 8)
+    {
+        accelerationStructure.nodes8 = CollapseBVH<8>(accelerationStructure.nodes);
+    }
+
+    if (input.nodeCompression != NodeCompression::None)
+    {
+        size_t uncompressedSize = accelerationStructure.nodes.size() * sizeof(LinearBVHNode);
+        size_t compressedSize = 0;
+        if (input.width != 2)
+        {
+            LOG(WARNING) << "Node compression is only supported for binary BVHs; Keeping uncompressed nodes";
+        }
+        else if (input.nodeCompression == NodeCompression::Quantized8)
+        {
+            accelerationStructure.quantizedNodes8 = QuantizeBVH<uint8_t>(accelerationStructure);
+            compressedSize = accelerationStructure.quantizedNodes8.size() * sizeof(QuantizedBVH8Node);
+        }
+        else if (input.nodeCompression == NodeCompression::Quantized16)
+        {
+            accelerationStructure.quantizedNodes16 = QuantizeBVH<uint16_t>(accelerationStructure);
+            compressedSize = accelerationStructure.quantizedNodes16.size() * sizeof(QuantizedBVH16Node);
+        }
+
+        if (compressedSize > 0)
+        {
+            /* The compressed nodes replace the binary ones */
+            accelerationStructure.nodes = std::vector<LinearBVHNode>();
+            LOG(INFO) << "Compressed BVH nodes from " << uncompressedSize / 1024 << "KB to " << compressedSize / 1024 << "KB; Saved "
+                << (uncompressedSize - compressedSize) / 1024 << "KB";
+        }
+    }
+
+    auto buildEnd = std::chrono::high_resolution_clock::now();
+    auto buildTime = std::chrono::duration<float, std::milli>(buildEnd - buildStart).count();
+    LOG(INFO) << "Built a " << magic_enum::enum_name(input.splitType) << " BVH with " << ctx.totalNodes << " nodes for "
+        << totalPrimitives << " triangles in " << buildTime << "ms; build nodes used " << arenaUsage.bytesUsed / 1024
+        << "KB out of " << arenaUsage.bytesReserved / 1024 << "KB of arena memory";
+
+    auto statistics = ComputeStatistics(accelerationStructure);
+    LOG(INFO) << "BVH has a SAH cost of " << statistics.sahCost << ", " << statistics.leafCount << " leaves with "
+        << (Float)(output.new_indices.size() / 3) / (Float)std::max(statistics.leafCount, 1u) << " triangles on average, a depth of "
+        << statistics.maxDepth << " and uses " << statistics.memoryUsage / 1024 << "KB";
 
     return output;
 }
+
+Output Common::Accelerators::BVH::GenerateFromBounds(Input const& input, std::vector<BoundingBox> const& bounds)
+{
+    if (bounds.empty())
+        return {};
+    CHECK(input.splitType != SplitType::SBVH) << "Spatial splits need triangles; Use another split type when building from bounds";
+
+    Context ctx{.input = input};
+    InitContext(ctx);
+    CreatePrimitives(ctx, (uint32_t)bounds.size(), [&](uint32_t i)
+    {
+        return bounds[i];
+    });
+
+    Output output{};
+    BuildAndFlatten(ctx, output.accelerationStructure.nodes);
+    output.accelerationStructure.buildCost = ComputeSAHCost(output.accelerationStructure.nodes);
+    output.primitiveOrder.assign(ctx.orderedPrimitives.begin(), ctx.orderedPrimitives.end());
+
+    return output;
+}
+
+Float Common::Accelerators::BVH::ComputeSAHCost(std::vector<LinearBVHNode> const& nodes)
+{
+    if (nodes.empty())
+        return Zero;
+
+    Float rootSurfaceArea = nodes[0].bounds.SurfaceArea();
+    if (rootSurfaceArea <= Zero)
+        return Zero;
+
+    /* Same costs as the build: 1 for traversing a node, 1 for every primitive in a leaf */
+    Float cost = Zero;
+    for (auto const& node : nodes)
+    {
+        Float primitiveCost = node.primitiveCount > 0 ? (Float)node.primitiveCount : One;
+        cost += primitiveCost * node.bounds.SurfaceArea() / rootSurfaceArea;
+    }
+    return cost;
+}
+
+static void AddLeafStatistics(Statistics& statistics, uint32_t depth, uint32_t primitiveCount)
+{
+    if (statistics.depthHistogram.size() <= depth)
+        statistics.depthHistogram.resize(depth + 1);
+    if (statistics.leafSizeHistogram.size() <= primitiveCount)
+        statistics.leafSizeHistogram.resize(primitiveCount + 1);
+
+    statistics.depthHistogram[depth]++;
+    statistics.leafSizeHistogram[primitiveCount]++;
+    statistics.leafCount++;
+    statistics.maxDepth = std::max(statistics.maxDepth, depth);
+}
+
+template <typename T>
+static void AddQuantizedStatistics(Statistics& statistics, std::vector<QuantizedBVHNode<T>> const& nodes)
+{
+    using Node = QuantizedBVHNode<T>;
+    statistics.nodeCount = (uint32_t)nodes.size();
+
+    struct NodeToVisit
+    {
+        uint32_t node;
+        uint32_t depth;
+    };
+    std::vector<NodeToVisit> nodesToVisit = {NodeToVisit{0, 0}};
+    while (!nodesToVisit.empty())
+    {
+        NodeToVisit current = nodesToVisit.back();
+        nodesToVisit.pop_back();
+        statistics.maxDepth = std::max(statistics.maxDepth, current.depth);
+        for (uint32_t i = 0; i < 2; ++i)
+        {
+            auto const& node = nodes[current.node];
+            if (node.primitiveCount[i] == Node::EMPTY_CHILD)
+                continue;
+            if (node.primitiveCount[i] == Node::INTERIOR_CHILD)
+                nodesToVisit.push_back(NodeToVisit{node.childOffset[i], current.depth + 1});
+            else
+                AddLeafStatistics(statistics, current.depth + 1, node.primitiveCount[i]);
+        }
+    }
+}
+
+Statistics Common::Accelerators::BVH::ComputeStatistics(AccelerationStructure const& accelerationStructure)
+{
+    Statistics statistics{};
+    statistics.memoryUsage = accelerationStructure.nodes.size() * sizeof(LinearBVHNode) +
+        accelerationStructure.nodes4.size() * sizeof(BVH4Node) +
+        accelerationStructure.nodes8.size() * sizeof(BVH8Node) +
+        accelerationStructure.quantizedNodes8.size() * sizeof(QuantizedBVH8Node) +
+        accelerationStructure.quantizedNodes16.size() * sizeof(QuantizedBVH16Node) +
+        accelerationStructure.precomputedTriangles.size() * sizeof(float);
+
+    auto const& nodes = accelerationStructure.nodes;
+    if (nodes.empty())
+    {
+        statistics.sahCost = accelerationStructure.buildCost;
+        if (!accelerationStructure.quantizedNodes8.empty())
+            AddQuantizedStatistics(statistics, accelerationStructure.quantizedNodes8);
+        else if (!accelerationStructure.quantizedNodes16.empty())
+            AddQuantizedStatistics(statistics, accelerationStructure.quantizedNodes16);
+        return statistics;
+    }
+
+    statistics.sahCost = ComputeSAHCost(nodes);
+    statistics.nodeCount = (uint32_t)nodes.size();
+
+    /* Nodes are flattened depth first, so the depth of every node can be found in a single pass with a stack of the second children */
+    std::vector<std::pair<uint32_t, uint32_t>> secondChildren;
+    uint32_t depth = 0;
+    for (uint32_t i = 0; i < nodes.size(); ++i)
+    {
+        if (!secondChildren.empty() && secondChildren.back().first == i)
+        {
+            depth = secondChildren.back().second;
+            secondChildren.pop_back();
+        }
+
+        if (nodes[i].primitiveCount > 0)
+        {
+            AddLeafStatistics(statistics, depth, nodes[i].primitiveCount);
+        }
+        else
+        {
+            secondChildren.emplace_back(nodes[i].secondChildOffset, depth + 1);
+            depth++;
+        }
+    }
+    return statistics;
+}
+
+template <typename Function>
+static void RefitNodes(std::vector<LinearBVHNode>& nodes, Function&& getPrimitiveBounds)
+{
+    /* Children are always flattened after their parent, so going backwards refits them first */
+    for (uint32_t i = (uint32_t)nodes.size(); i-- > 0; )
+    {
+        auto& node = nodes[i];
+        if (node.primitiveCount > 0)
+        {
+            BoundingBox bounds = getPrimitiveBounds(node.primitiveOffset);
+            for (uint32_t j = 1; j < node.primitiveCount; ++j)
+            {
+                bounds = Union(bounds, getPrimitiveBounds(node.primitiveOffset + j));
+            }
+            node.bounds = bounds;
+        }
+        else
+        {
+            node.bounds = Union(nodes[i + 1].bounds, nodes[node.secondChildOffset].bounds);
+        }
+    }
+}
+
+static bool ShouldRebuild(std::vector<LinearBVHNode> const& nodes, Float buildCost)
+{
+    Float cost = ComputeSAHCost(nodes);
+    if (buildCost > Zero && cost > buildCost * MAX_REFIT_COST_RATIO)
+    {
+        VLOG(1) << "Refitted BVH cost went from " << buildCost << " to " << cost << "; It should be rebuilt";
+        return true;
+    }
+    return false;
+}
+
+bool Common::Accelerators::BVH::Refit(AccelerationStructure& accelerationStructure, uint32_t const* indices, VertexPositionNormal const* vertices)
+{
+    if (accelerationStructure.nodes.empty())
+        return false; // Compressed or empty => nothing to refit
+
+    RefitNodes(accelerationStructure.nodes, [&](uint32_t primitive)
+    {
+        BoundingBox box(vertices[indices[primitive * 3 + 0]].position);
+        box = Union(box, vertices[indices[primitive * 3 + 1]].position);
+        box = Union(box, vertices[indices[primitive * 3 + 2]].position);
+        return box;
+    });
+
+    if (!accelerationStructure.precomputedTriangles.empty())
+    {
+        PrecomputeTriangles(accelerationStructure.nodes, indices, vertices, accelerationStructure.precomputedTriangles);
+    }
+
+    /* Collapsing is linear in the number of nodes, so it's cheaper to redo than to refit the wide nodes in place */
+    if (accelerationStructure.width == 4)
+    {
+        accelerationStructure.nodes4 = CollapseBVH<4>(accelerationStructure.nodes);
+    }
+    else if (accelerationStructure.width == 8)
+    {
+        accelerationStructure.nodes8 = CollapseBVH<8>(accelerationStructure.nodes);
+    }
+
+    return !ShouldRebuild(accelerationStructure.nodes, accelerationStructure.buildCost);
+}
+
+bool Common::Accelerators::BVH::RefitFromBounds(std::vector<LinearBVHNode>& nodes, Float buildCost, std::vector<BoundingBox> const& bounds)
+{
+    if (nodes.empty())
+        return false;
+
+    RefitNodes(nodes, [&](uint32_t primitive)
+    {
+        return bounds[primitive];
+    });
+
+    return !ShouldRebuild(nodes, buildCost);
+}
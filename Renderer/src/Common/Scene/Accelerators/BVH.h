@@ -19,12 +19,41 @@ namespace Common
                 Middle,
                 EqualCount,
                 HLBVH,
+                /* HLBVH followed by treelet restructuring, which brings the tree close to a SAH one for some extra build time */
+                HLBVH_Optimized,
+                /* SAH with spatial splits: triangles may be referenced by more than one leaf. Always built on the calling thread */
+                SBVH,
+            };
+            enum class NodeCompression
+            {
+                None,
+                /* Child bounds quantized to 8 / 16 bits relative to the parent box. Only used for binary BVHs */
+                Quantized8,
+                Quantized16,
             };
             struct Input
             {
                 uint32_t maxPrimsInNode;
                 SplitType splitType;
 
+                /* Number of threads used by the SAH, Middle and EqualCount builds and by the HLBVH sort. 1 => single threaded, 0 => whole thread pool */
+                uint32_t buildThreads = 1;
+                /* Nodes with fewer primitives than this are built and binned on the current thread */
+                uint32_t parallelGrainSize = 4096;
+
+                /* Number of children per node: 2 => binary tree only, 4 or 8 => the binary tree is also collapsed to a wide tree */
+                uint32_t width = 2;
+                NodeCompression nodeCompression = NodeCompression::None;
+
+                /* HLBVH and HLBVH_Optimized only: meshes with at least this many triangles use 63 bit Morton codes (21 bits per axis) instead of 30 bit ones */
+                uint32_t hlbvhWideMortonThreshold = 1 << 18;
+
+                /* SBVH only: extra triangle references spatial splits may create, relative to the number of triangles */
+                float sbvhMemoryBudget = 0.3f;
+
+                /* Stores the triangles of every leaf in edge form next to each other, for a faster but not watertight leaf test */
+                bool precomputeTriangles = false;
+
                 std::vector<uint32_t> indices;
                 std::vector<Common::VertexPositionNormal> vertices;
             };
@@ -32,11 +61,47 @@ namespace Common
             struct Output
             {
                 Common::Components::AccelerationStructure accelerationStructure;
+                /* Triangles in the order the leaves reference them. Bigger than the input for SBVHs, which duplicate split triangles */
                 std::vector<uint32_t> new_indices;
+                /* Only filled by GenerateFromBounds: leaves reference primitive primitiveOrder[i] at offset i */
+                std::vector<uint32_t> primitiveOrder;
                 /* TODO: Might reorder the vertices to improve cache accesses if requested */
             };
 
+            /* Once refitting makes the SAH cost of a BVH this much bigger than it was after the build, it's better to rebuild it */
+            constexpr const Jnrlib::Float MAX_REFIT_COST_RATIO = 1.5f;
+
             Output Generate(Input const& input);
+            /* Builds a binary BVH over arbitrary boxes. The triangles in input are ignored */
+            Output GenerateFromBounds(Input const& input, std::vector<Jnrlib::BoundingBox> const& bounds);
+
+            /* SAH cost of a binary BVH, relative to the surface of its root */
+            Jnrlib::Float ComputeSAHCost(std::vector<Common::Components::LinearBVHNode> const& nodes);
+
+            /* Shape of a BVH, for judging how good it is */
+            struct Statistics
+            {
+                /* Of the binary tree; the cost right after the build if only compressed nodes are left */
+                Jnrlib::Float sahCost = 0;
+                /* Binary nodes, leaves included. Compressed trees only count their interior nodes */
+                uint32_t nodeCount = 0;
+                uint32_t leafCount = 0;
+                uint32_t maxDepth = 0;
+                /* Number of leaves at each depth; the root is at depth 0 */
+                std::vector<uint32_t> depthHistogram;
+                /* Number of leaves with each primitive count */
+                std::vector<uint32_t> leafSizeHistogram;
+                /* Nodes of every layout that was built, plus the triangle data stored next to them */
+                size_t memoryUsage = 0;
+            };
+            Statistics ComputeStatistics(Common::Components::AccelerationStructure const& accelerationStructure);
+
+            /* Recomputes the bounds of every node for moved vertices, without changing the topology.
+             * Returns false if the BVH must be rebuilt instead: the nodes are compressed or the SAH cost grew past MAX_REFIT_COST_RATIO
+             */
+            bool Refit(Common::Components::AccelerationStructure& accelerationStructure, uint32_t const* indices, Common::VertexPositionNormal const* vertices);
+            /* Same as above for a BVH built by GenerateFromBounds; bounds are ordered as the leaves reference them */
+            bool RefitFromBounds(std::vector<Common::Components::LinearBVHNode>& nodes, Jnrlib::Float buildCost, std::vector<Jnrlib::BoundingBox> const& bounds);
         }
     }
 }
\ No newline at end of file
@@ -0,0 +1,288 @@
+#include "BVHCache.h"
+#include "MappedFile.h"
+
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <thread>
+#include <cstring>
+#include <algorithm>
+
+using namespace Common;
+using namespace Components;
+using namespace Jnrlib;
+using namespace Accelerators;
+using namespace BVHCache;
+
+/* "JBVH" */
+static constexpr const uint32_t CACHE_MAGIC = 0x4856424A;
+/* Every section of the payload starts at a multiple of this, so the nodes in a mapped entry are properly aligned */
+static constexpr const size_t SECTION_ALIGNMENT = 32;
+
+struct CacheHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t key;
+
+    uint64_t nodeCount;
+    uint64_t nodes4Count;
+    uint64_t nodes8Count;
+    uint64_t quantizedNodes8Count;
+    uint64_t quantizedNodes16Count;
+    uint64_t indexCount;
+    uint64_t vertexCount;
+    uint64_t precomputedTriangleFloatCount;
+
+    uint32_t width;
+    float quantizedRootMin[3];
+    float quantizedRootMax[3];
+    double buildCost;
+
+    uint64_t payloadSize;
+    uint64_t payloadChecksum;
+};
+
+static size_t AlignSection(size_t offset)
+{
+    return (offset + SECTION_ALIGNMENT - 1) & ~(SECTION_ALIGNMENT - 1);
+}
+
+static size_t GetPayloadOffset()
+{
+    return AlignSection(sizeof(CacheHeader));
+}
+
+/* Calls func(offset, vector) for every section of the payload, in the order they're stored */
+template <typename EntryType, typename Func>
+static void ForEachSection(EntryType& entry, Func&& func)
+{
+    auto& accelerationStructure = entry.accelerationStructure;
+    size_t offset = 0;
+    offset = func(offset, accelerationStructure.nodes);
+    offset = func(offset, accelerationStructure.nodes4);
+    offset = func(offset, accelerationStructure.nodes8);
+    offset = func(offset, accelerationStructure.quantizedNodes8);
+    offset = func(offset, accelerationStructure.quantizedNodes16);
+    offset = func(offset, accelerationStructure.precomputedTriangles);
+    offset = func(offset, entry.indices);
+    offset = func(offset, entry.vertices);
+}
+
+static size_t ComputePayloadSize(CacheHeader const& header)
+{
+    uint64_t const counts[] = {header.nodeCount, header.nodes4Count, header.nodes8Count,
+        header.quantizedNodes8Count, header.quantizedNodes16Count, header.precomputedTriangleFloatCount, header.indexCount, header.vertexCount};
+    size_t const sizes[] = {sizeof(LinearBVHNode), sizeof(BVH4Node), sizeof(BVH8Node),
+        sizeof(QuantizedBVH8Node), sizeof(QuantizedBVH16Node), sizeof(float), sizeof(uint32_t), sizeof(VertexPositionNormal)};
+
+    size_t size = 0;
+    for (uint32_t i = 0; i < std::size(counts); ++i)
+    {
+        /* Counts come from the file, so they can be anything. Reject the ones that would overflow */
+        if (counts[i] > (uint64_t)(std::numeric_limits<size_t>::max() / 2) / sizes[i])
+            return std::numeric_limits<size_t>::max();
+        size = AlignSection(size) + (size_t)counts[i] * sizes[i];
+    }
+    return size;
+}
+
+uint64_t BVHCache::HashMeshFiles(std::string const& path)
+{
+    MappedFile file;
+    if (!file.Open(path))
+        return 0;
+
+    uint64_t hash = HashBytes(file.GetData(), file.GetSize());
+
+    std::filesystem::path meshPath(path);
+    std::error_code error;
+    std::vector<std::filesystem::path> companions;
+    for (auto const& directoryEntry : std::filesystem::directory_iterator(meshPath.parent_path().empty() ? "." : meshPath.parent_path(), error))
+    {
+        auto const& companionPath = directoryEntry.path();
+        if (directoryEntry.is_regular_file(error) && companionPath.stem() == meshPath.stem() && companionPath.filename() != meshPath.filename())
+            companions.push_back(companionPath);
+    }
+    /* The directory isn't listed in any particular order */
+    std::sort(companions.begin(), companions.end());
+
+    for (auto const& companionPath : companions)
+    {
+        std::string name = companionPath.filename().string();
+        hash = HashBytes(name.data(), name.size(), hash);
+
+        MappedFile companion;
+        if (companion.Open(companionPath.string()))
+            hash = HashBytes(companion.GetData(), companion.GetSize(), hash);
+    }
+    return hash;
+}
+
+uint64_t BVHCache::ComputeKey(uint64_t contentHash, BVH::Input const& input)
+{
+    /* The number of build threads and the grain size are missing on purpose: they don't change the tree */
+    uint64_t key = HashBytes(&contentHash, sizeof(contentHash));
+    uint32_t const parameters[] = {(uint32_t)input.splitType, input.maxPrimsInNode, input.width, (uint32_t)input.nodeCompression,
+        (uint32_t)input.precomputeTriangles, (uint32_t)sizeof(Float), (uint32_t)sizeof(LinearBVHNode), (uint32_t)sizeof(VertexPositionNormal)};
+    key = HashBytes(parameters, sizeof(parameters), key);
+    if (input.splitType == BVH::SplitType::SBVH)
+    {
+        key = HashBytes(&input.sbvhMemoryBudget, sizeof(input.sbvhMemoryBudget), key);
+    }
+    else if (input.splitType == BVH::SplitType::HLBVH || input.splitType == BVH::SplitType::HLBVH_Optimized)
+    {
+        key = HashBytes(&input.hlbvhWideMortonThreshold, sizeof(input.hlbvhWideMortonThreshold), key);
+    }
+    return key;
+}
+
+std::string BVHCache::GetEntryPath(std::string const& cacheDirectory, std::string const& meshPath, uint64_t key)
+{
+    std::stringstream fileName;
+    fileName << std::filesystem::path(meshPath).stem().string() << "-" << std::hex << std::setw(16) << std::setfill('0') << key << ".bvh";
+    return (std::filesystem::path(cacheDirectory) / fileName.str()).string();
+}
+
+std::optional<Entry> BVHCache::Load(std::string const& entryPath, uint64_t key)
+{
+    MappedFile file;
+    if (!file.Open(entryPath))
+        return std::nullopt;
+
+    auto reject = [&](const char* reason) -> std::optional<Entry>
+    {
+        LOG(WARNING) << "Ignoring BVH cache entry " << entryPath << ": " << reason;
+        return std::nullopt;
+    };
+
+    if (file.GetSize() < GetPayloadOffset())
+        return reject("the file is truncated");
+
+    CacheHeader header;
+    memcpy(&header, file.GetData(), sizeof(header));
+    if (header.magic != CACHE_MAGIC)
+        return reject("not a BVH cache entry");
+    if (header.version != VERSION)
+        return reject("created by a different version");
+    if (header.key != key)
+        return reject("created for a different mesh or different build parameters");
+
+    size_t payloadSize = ComputePayloadSize(header);
+    if (payloadSize != header.payloadSize || file.GetSize() != GetPayloadOffset() + payloadSize)
+        return reject("the size doesn't match the header");
+
+    unsigned char const* payload = file.GetData() + GetPayloadOffset();
+    if (HashBytes(payload, payloadSize) != header.payloadChecksum)
+        return reject("the checksum doesn't match");
+
+    Entry entry{};
+    entry.accelerationStructure.nodes.resize(header.nodeCount);
+    entry.accelerationStructure.nodes4.resize(header.nodes4Count);
+    entry.accelerationStructure.nodes8.resize(header.nodes8Count);
+    entry.accelerationStructure.quantizedNodes8.resize(header.quantizedNodes8Count);
+    entry.accelerationStructure.quantizedNodes16.resize(header.quantizedNodes16Count);
+    entry.accelerationStructure.precomputedTriangles.resize(header.precomputedTriangleFloatCount);
+    entry.indices.resize(header.indexCount);
+    entry.vertices.resize(header.vertexCount);
+    ForEachSection(entry, [&](size_t offset, auto& section)
+    {
+        offset = AlignSection(offset);
+        size_t sectionSize = section.size() * sizeof(section[0]);
+        if (sectionSize > 0)
+            memcpy((void*)section.data(), payload + offset, sectionSize);
+        return offset + sectionSize;
+    });
+
+    entry.accelerationStructure.width = header.width;
+    memcpy(entry.accelerationStructure.quantizedRootMin, header.quantizedRootMin, sizeof(header.quantizedRootMin));
+    memcpy(entry.accelerationStructure.quantizedRootMax, header.quantizedRootMax, sizeof(header.quantizedRootMax));
+    entry.accelerationStructure.buildCost = (Float)header.buildCost;
+
+    if (entry.accelerationStructure.Empty())
+        return reject("the BVH is empty");
+
+    return entry;
+}
+
+bool BVHCache::Store(std::string const& entryPath, uint64_t key, Entry const& entry)
+{
+    auto const& accelerationStructure = entry.accelerationStructure;
+
+    CacheHeader header{};
+    header.magic = CACHE_MAGIC;
+    header.version = VERSION;
+    header.key = key;
+    header.nodeCount = accelerationStructure.nodes.size();
+    header.nodes4Count = accelerationStructure.nodes4.size();
+    header.nodes8Count = accelerationStructure.nodes8.size();
+    header.quantizedNodes8Count = accelerationStructure.quantizedNodes8.size();
+    header.quantizedNodes16Count = accelerationStructure.quantizedNodes16.size();
+    header.precomputedTriangleFloatCount = accelerationStructure.precomputedTriangles.size();
+    header.indexCount = entry.indices.size();
+    header.vertexCount = entry.vertices.size();
+    header.width = accelerationStructure.width;
+    memcpy(header.quantizedRootMin, accelerationStructure.quantizedRootMin, sizeof(header.quantizedRootMin));
+    memcpy(header.quantizedRootMax, accelerationStructure.quantizedRootMax, sizeof(header.quantizedRootMax));
+    header.buildCost = (double)accelerationStructure.buildCost;
+    header.payloadSize = ComputePayloadSize(header);
+
+    std::vector<unsigned char> payload(header.payloadSize, 0);
+    ForEachSection(entry, [&](size_t offset, auto const& section)
+    {
+        offset = AlignSection(offset);
+        size_t sectionSize = section.size() * sizeof(section[0]);
+        if (sectionSize > 0)
+            memcpy(payload.data() + offset, (void const*)section.data(), sectionSize);
+        return offset + sectionSize;
+    });
+    header.payloadChecksum = HashBytes(payload.data(), payload.size());
+
+    std::error_code error;
+    std::filesystem::path path(entryPath);
+    if (path.has_parent_path())
+    {
+        std::filesystem::create_directories(path.parent_path(), error);
+        if (error)
+        {
+            LOG(WARNING) << "Unable to create BVH cache directory " << path.parent_path() << ": " << error.message();
+            return false;
+        }
+    }
+
+    /* Unique per thread, in case two threads store the same mesh */
+    std::stringstream temporaryPath;
+    temporaryPath << entryPath << "." << std::this_thread::get_id() << ".tmp";
+    {
+        std::ofstream file(temporaryPath.str(), std::ios::binary | std::ios::trunc);
+        if (!file.is_open())
+        {
+            LOG(WARNING) << "Unable to open " << temporaryPath.str() << " for writing";
+            return false;
+        }
+
+        std::vector<unsigned char> headerBytes(GetPayloadOffset(), 0);
+        memcpy(headerBytes.data(), &header, sizeof(header));
+        file.write((const char*)headerBytes.data(), headerBytes.size());
+        file.write((const char*)payload.data(), payload.size());
+        if (!file.good())
+        {
+            LOG(WARNING) << "Unable to write BVH cache entry " << temporaryPath.str();
+            file.close();
+            std::filesystem::remove(temporaryPath.str(), error);
+            return false;
+        }
+    }
+
+    std::filesystem::rename(temporaryPath.str(), path, error);
+    if (error)
+    {
+        LOG(WARNING) << "Unable to move BVH cache entry to " << entryPath << ": " << error.message();
+        std::filesystem::remove(temporaryPath.str(), error);
+        return false;
+    }
+
+    VLOG(1) << "Stored BVH cache entry " << entryPath << " (" << GetPayloadOffset() + payload.size() << " bytes)";
+    return true;
+}
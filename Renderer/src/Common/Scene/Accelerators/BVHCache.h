@@ -0,0 +1,42 @@
+#pragma once
+
+#include <Jnrlib.h>
+#include <optional>
+
+#include "BVH.h"
+
+namespace Common
+{
+    namespace Accelerators
+    {
+        /* BVHs of meshes loaded from disk, stored next to the triangles they were built for, so a mesh that didn't change
+         * skips both the import and the build. Entries are keyed by the content of the mesh file and by the build parameters
+         */
+        namespace BVHCache
+        {
+            /* Bump when the layout of an entry or of the nodes it stores changes */
+            constexpr const uint32_t VERSION = 4;
+
+            struct Entry
+            {
+                Common::Components::AccelerationStructure accelerationStructure;
+                /* Already reordered for the BVH */
+                std::vector<uint32_t> indices;
+                std::vector<Common::VertexPositionNormal> vertices;
+            };
+
+            /* Hashes the mesh file and every file next to it with the same stem, like the .mtl of an .obj or the .bin of a .gltf.
+             * Files referenced under other names aren't tracked; clear the cache after changing those. Returns 0 if the mesh file can't be read
+             */
+            uint64_t HashMeshFiles(std::string const& path);
+            /* Combines the hash of the mesh file with every parameter of input that changes the resulting BVH */
+            uint64_t ComputeKey(uint64_t contentHash, BVH::Input const& input);
+            std::string GetEntryPath(std::string const& cacheDirectory, std::string const& meshPath, uint64_t key);
+
+            /* Returns nothing if there's no entry at entryPath or if it's stale or corrupt; the caller is expected to rebuild it */
+            std::optional<Entry> Load(std::string const& entryPath, uint64_t key);
+            /* Writes to a temporary file first, so readers never see a partially written entry */
+            bool Store(std::string const& entryPath, uint64_t key, Entry const& entry);
+        }
+    }
+}
@@ -0,0 +1,222 @@
+#include "KdTree.h"
+
+#include <algorithm>
+#include <numeric>
+#include <chrono>
+#include <cmath>
+
+using namespace Common;
+using namespace Components;
+using namespace Jnrlib;
+using namespace Accelerators;
+using namespace KdTree;
+
+/* Stop trying to split a node after this many splits in a row that didn't improve the SAH cost */
+static constexpr const uint32_t MAX_BAD_REFINES = 3;
+
+enum class EdgeType
+{
+    Start,
+    End,
+};
+
+struct BoundEdge
+{
+    Float position;
+    uint32_t primitive;
+    EdgeType type;
+
+    bool operator < (BoundEdge const& rhs) const
+    {
+        /* Starting edges go first on ties, so primitives that only touch the splitting plane are kept on both sides */
+        if (position == rhs.position)
+            return type < rhs.type;
+        return position < rhs.position;
+    }
+};
+
+struct Context
+{
+    Input const& input;
+    std::vector<BoundingBox> primitiveBounds;
+
+    std::vector<KdTreeNode> nodes;
+    std::vector<uint32_t> primitiveIndices;
+
+    /* Sorted edges of the node being split, reused by every node */
+    std::vector<BoundEdge> edges[(uint32_t)Axis::COUNT];
+};
+
+static void InitLeaf(Context& ctx, uint32_t const* primitives, uint32_t primitiveCount)
+{
+    KdTreeNode node;
+    node.InitLeaf((uint32_t)ctx.primitiveIndices.size(), primitiveCount);
+    ctx.primitiveIndices.insert(ctx.primitiveIndices.end(), primitives, primitives + primitiveCount);
+    ctx.nodes.push_back(node);
+}
+
+struct KdSplit
+{
+    uint32_t axis = (uint32_t)-1;
+    uint32_t edge = (uint32_t)-1;
+    Float cost = Infinity;
+};
+
+static KdSplit FindSplit(Context& ctx, BoundingBox const& nodeBounds, uint32_t const* primitives, uint32_t primitiveCount)
+{
+    auto const& input = ctx.input;
+    KdSplit bestSplit;
+    Float invTotalSurfaceArea = One / nodeBounds.SurfaceArea();
+    Position diagonal = nodeBounds.Diagonal();
+
+    /* Try the longest axis first and the others only if it didn't give a split */
+    uint32_t axis = (uint32_t)nodeBounds.MaximumExtent();
+    for (uint32_t retries = 0; retries < (uint32_t)Axis::COUNT && bestSplit.axis == (uint32_t)-1; ++retries)
+    {
+        auto& edges = ctx.edges[axis];
+        edges.resize(primitiveCount * 2);
+        for (uint32_t i = 0; i < primitiveCount; ++i)
+        {
+            uint32_t primitive = primitives[i];
+            auto const& bounds = ctx.primitiveBounds[primitive];
+            edges[i * 2 + 0] = BoundEdge{bounds.pMin[axis], primitive, EdgeType::Start};
+            edges[i * 2 + 1] = BoundEdge{bounds.pMax[axis], primitive, EdgeType::End};
+        }
+        std::sort(edges.begin(), edges.end());
+
+        uint32_t belowCount = 0, aboveCount = primitiveCount;
+        uint32_t otherAxis0 = (axis + 1) % 3, otherAxis1 = (axis + 2) % 3;
+        for (uint32_t i = 0; i < primitiveCount * 2; ++i)
+        {
+            if (edges[i].type == EdgeType::End)
+                aboveCount--;
+
+            Float position = edges[i].position;
+            if (position > nodeBounds.pMin[axis] && position < nodeBounds.pMax[axis])
+            {
+                Float belowSurfaceArea = 2 * (diagonal[otherAxis0] * diagonal[otherAxis1] +
+                                              (position - nodeBounds.pMin[axis]) * (diagonal[otherAxis0] + diagonal[otherAxis1]));
+                Float aboveSurfaceArea = 2 * (diagonal[otherAxis0] * diagonal[otherAxis1] +
+                                              (nodeBounds.pMax[axis] - position) * (diagonal[otherAxis0] + diagonal[otherAxis1]));
+                Float belowProbability = belowSurfaceArea * invTotalSurfaceArea;
+                Float aboveProbability = aboveSurfaceArea * invTotalSurfaceArea;
+                Float bonus = (aboveCount == 0 || belowCount == 0) ? (Float)input.emptyBonus : Zero;
+                Float cost = (Float)input.traversalCost +
+                    (Float)input.intersectCost * (One - bonus) * (belowProbability * belowCount + aboveProbability * aboveCount);
+
+                if (cost < bestSplit.cost)
+                {
+                    bestSplit.cost = cost;
+                    bestSplit.axis = axis;
+                    bestSplit.edge = i;
+                }
+            }
+
+            if (edges[i].type == EdgeType::Start)
+                belowCount++;
+        }
+        CHECK(belowCount == primitiveCount && aboveCount == 0) << "Kd-tree edges didn't cover every primitive";
+
+        axis = (axis + 1) % 3;
+    }
+    return bestSplit;
+}
+
+static void RecursiveBuild(Context& ctx, BoundingBox const& nodeBounds, uint32_t const* primitives, uint32_t primitiveCount,
+                           uint32_t depth, uint32_t badRefines)
+{
+    auto const& input = ctx.input;
+    if (primitiveCount <= input.maxPrimsInNode || depth == 0)
+    {
+        InitLeaf(ctx, primitives, primitiveCount);
+        return;
+    }
+
+    KdSplit split = FindSplit(ctx, nodeBounds, primitives, primitiveCount);
+
+    Float leafCost = (Float)input.intersectCost * (Float)primitiveCount;
+    if (split.cost > leafCost)
+        badRefines++;
+    if ((split.cost > 4 * leafCost && primitiveCount < 16) || split.axis == (uint32_t)-1 || badRefines == MAX_BAD_REFINES)
+    {
+        InitLeaf(ctx, primitives, primitiveCount);
+        return;
+    }
+
+    /* The edges are overwritten by the children, so both sides have to be copied out first */
+    auto const& edges = ctx.edges[split.axis];
+    std::vector<uint32_t> belowPrimitives, abovePrimitives;
+    for (uint32_t i = 0; i < split.edge; ++i)
+    {
+        if (edges[i].type == EdgeType::Start)
+            belowPrimitives.push_back(edges[i].primitive);
+    }
+    for (uint32_t i = split.edge + 1; i < primitiveCount * 2; ++i)
+    {
+        if (edges[i].type == EdgeType::End)
+            abovePrimitives.push_back(edges[i].primitive);
+    }
+
+    Float splitPosition = edges[split.edge].position;
+    BoundingBox belowBounds = nodeBounds, aboveBounds = nodeBounds;
+    belowBounds.pMax[split.axis] = splitPosition;
+    aboveBounds.pMin[split.axis] = splitPosition;
+
+    uint32_t nodeIndex = (uint32_t)ctx.nodes.size();
+    ctx.nodes.emplace_back().InitInterior(split.axis, splitPosition);
+
+    RecursiveBuild(ctx, belowBounds, belowPrimitives.data(), (uint32_t)belowPrimitives.size(), depth - 1, badRefines);
+    /* The index of the above child has to fit in 30 bits */
+    CHECK(ctx.nodes.size() < (1u << 30)) << "Too many kd-tree nodes";
+    ctx.nodes[nodeIndex].SetAboveChild((uint32_t)ctx.nodes.size());
+    RecursiveBuild(ctx, aboveBounds, abovePrimitives.data(), (uint32_t)abovePrimitives.size(), depth - 1, badRefines);
+}
+
+KdTreeAccelerationStructure Common::Accelerators::KdTree::Generate(Input const& input)
+{
+    if (input.indices.empty())
+        return {}; // Empty Input => Empty Output
+
+    CHECK(input.indices.size() % 3 == 0) << "Cannot generate a kd-tree with non-triangle faces";
+    CHECK(input.maxPrimsInNode > 0) << "Kd-tree leaves need room for at least one primitive";
+
+    auto buildStart = std::chrono::high_resolution_clock::now();
+
+    Context ctx{.input = input};
+    uint32_t totalPrimitives = (uint32_t)input.indices.size() / 3;
+    ctx.primitiveBounds.reserve(totalPrimitives);
+
+    KdTreeAccelerationStructure kdTree{};
+    for (uint32_t i = 0; i < totalPrimitives; ++i)
+    {
+        BoundingBox box(input.vertices[input.indices[i * 3 + 0]].position);
+        box = Union(box, input.vertices[input.indices[i * 3 + 1]].position);
+        box = Union(box, input.vertices[input.indices[i * 3 + 2]].position);
+        ctx.primitiveBounds.push_back(box);
+        kdTree.bounds = Union(kdTree.bounds, box);
+    }
+
+    /* Every interior node on the path to a leaf can push one node on the traversal stack */
+    CHECK(input.maxDepth <= KdTreeAccelerationStructure::MAX_DEPTH)
+        << "kd-tree max depth " << input.maxDepth << " is greater than " << KdTreeAccelerationStructure::MAX_DEPTH;
+    uint32_t maxDepth = input.maxDepth;
+    if (maxDepth == 0)
+    {
+        maxDepth = (uint32_t)std::round(8 + 1.3f * std::log2((float)totalPrimitives));
+        maxDepth = std::min(maxDepth, KdTreeAccelerationStructure::MAX_DEPTH);
+    }
+
+    std::vector<uint32_t> primitives(totalPrimitives);
+    std::iota(primitives.begin(), primitives.end(), 0);
+    RecursiveBuild(ctx, kdTree.bounds, primitives.data(), totalPrimitives, maxDepth, 0);
+
+    kdTree.nodes = std::move(ctx.nodes);
+    kdTree.primitiveIndices = std::move(ctx.primitiveIndices);
+
+    auto buildEnd = std::chrono::high_resolution_clock::now();
+    auto buildTime = std::chrono::duration<float, std::milli>(buildEnd - buildStart).count();
+    LOG(INFO) << "Built a kd-tree with " << kdTree.nodes.size() << " nodes and " << kdTree.primitiveIndices.size()
+        << " triangle references for " << totalPrimitives << " triangles in " << buildTime << "ms";
+
+    return kdTree;
+}
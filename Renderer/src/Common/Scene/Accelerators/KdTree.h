@@ -0,0 +1,34 @@
+#pragma once
+
+
+#include <Jnrlib.h>
+
+#include "Vertex.h"
+#include "Scene/Components/KdTreeAccelerationStructure.h"
+
+namespace Common
+{
+    namespace Accelerators
+    {
+        namespace KdTree
+        {
+            struct Input
+            {
+                /* Costs of a ray-triangle test and of visiting an interior node, used by the SAH */
+                uint32_t intersectCost = 80;
+                uint32_t traversalCost = 1;
+                /* Fraction of the cost removed for splits that leave one side empty */
+                float emptyBonus = 0.5f;
+                uint32_t maxPrimsInNode = 1;
+                /* 0 => 8 + 1.3 * log2(number of triangles) */
+                uint32_t maxDepth = 0;
+
+                std::vector<uint32_t> indices;
+                std::vector<Common::VertexPositionNormal> vertices;
+            };
+
+            /* Builds a SAH kd-tree over the triangles in input. Leaves reference triangles by their index, so input.indices is left as it is */
+            Common::Components::KdTreeAccelerationStructure Generate(Input const& input);
+        }
+    }
+}
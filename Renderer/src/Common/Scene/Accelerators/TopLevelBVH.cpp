@@ -0,0 +1,173 @@
+#include "TopLevelBVH.h"
+#include "BVH.h"
+
+#include "Scene/Components/Base.h"
+#include "Scene/Components/Sphere.h"
+#include "Scene/Components/Mesh.h"
+#include "Scene/Components/MeshInstance.h"
+#include "Scene/Components/KdTreeAccelerationStructure.h"
+
+using namespace Common;
+using namespace Components;
+using namespace Accelerators;
+using namespace Jnrlib;
+
+static BoundingBox GetSphereBounds(Sphere const& sphere)
+{
+    return BoundingBox(Position(-sphere.radius), Position(sphere.radius));
+}
+
+/* The transform only rotates, translates and scales uniformly, so the sphere is still a sphere in world space */
+static bool KeepsSphereRound(Matrix4x4 const& world, Float& scale)
+{
+    Matrix3x3 linear(world);
+    Float lengths[3] = {glm::length(linear[0]), glm::length(linear[1]), glm::length(linear[2])};
+    scale = lengths[0];
+
+    const Float tolerance = (Float)1e-4 * scale;
+    for (uint32_t i = 1; i < 3; ++i)
+    {
+        if (std::abs(lengths[i] - scale) > tolerance)
+            return false;
+    }
+    /* The axes also have to stay perpendicular, which they don't if a parent scales non-uniformly a rotated child */
+    const Float dotTolerance = (Float)1e-4 * scale * scale;
+    return std::abs(glm::dot(linear[0], linear[1])) <= dotTolerance &&
+        std::abs(glm::dot(linear[0], linear[2])) <= dotTolerance &&
+        std::abs(glm::dot(linear[1], linear[2])) <= dotTolerance;
+}
+
+/* Bakes the world space center and radius of the sphere when possible, otherwise it's tested through its transform */
+static void UpdateSphereInstance(TopLevelBVH::Instance& instance, Sphere const& sphere, Matrix4x4 const& world)
+{
+    Float scale;
+    if (KeepsSphereRound(world, scale))
+    {
+        instance.type = TopLevelBVH::InstanceType::WorldSphere;
+        instance.worldCenter = Position(world[3]);
+        instance.worldRadius = sphere.radius * scale;
+        instance.worldBounds = BoundingBox(instance.worldCenter - Position(instance.worldRadius), instance.worldCenter + Position(instance.worldRadius));
+    }
+    else
+    {
+        instance.type = TopLevelBVH::InstanceType::Sphere;
+        instance.worldBounds = Transform(GetSphereBounds(sphere), world);
+    }
+}
+
+void TopLevelBVH::Build(entt::registry& registry, Systems::TransformHierarchy const& transforms)
+{
+    std::vector<Instance> instances;
+    std::vector<BoundingBox> instanceBounds;
+
+    auto addInstance = [&](entt::entity entity, entt::entity geometry, Base const& base, InstanceType type, BoundingBox const& localBounds)
+    {
+        CHECK(base.entityPtr != nullptr) << "Base doesn't include an entity pointer";
+        uint32_t transformIndex = transforms.GetIndex(entity);
+        CHECK(transformIndex != Systems::TransformHierarchy::INVALID_INDEX) << "Entity " << base.name << " is not part of the transform hierarchy";
+
+        Instance instance{};
+        instance.entity = entity;
+        instance.geometry = geometry;
+        instance.entityPtr = base.entityPtr;
+        instance.type = type;
+        instance.transformIndex = transformIndex;
+        if (type == InstanceType::Sphere)
+            UpdateSphereInstance(instance, registry.get<const Sphere>(entity), transforms.Get(transformIndex).world);
+        else
+            instance.worldBounds = Transform(localBounds, transforms.Get(transformIndex).world);
+
+        instanceBounds.push_back(instance.worldBounds);
+        instances.push_back(instance);
+    };
+
+    for (auto const& [entity, base, sphere] : registry.view<const Base, const Sphere>().each())
+    {
+        addInstance(entity, entity, base, InstanceType::Sphere, GetSphereBounds(sphere));
+    }
+
+    for (auto const& [entity, base, mesh, accel] : registry.view<const Base, const Mesh, const AccelerationStructure>().each())
+    {
+        /* Spheres also have a mesh, but only for realtime rendering */
+        if (registry.all_of<Sphere>(entity) || accel.Empty())
+            continue;
+
+        addInstance(entity, entity, base, InstanceType::Mesh, accel.GetBounds());
+    }
+
+    for (auto const& [entity, base, mesh, kdTree] : registry.view<const Base, const Mesh, const KdTreeAccelerationStructure>().each())
+    {
+        if (registry.all_of<Sphere>(entity) || kdTree.Empty())
+            continue;
+
+        addInstance(entity, entity, base, InstanceType::KdTreeMesh, kdTree.bounds);
+    }
+
+    for (auto const& [entity, base, mesh, meshInstance] : registry.view<const Base, const Mesh, const MeshInstance>().each())
+    {
+        if (auto const* accel = registry.try_get<const AccelerationStructure>(meshInstance.source); accel != nullptr && !accel->Empty())
+        {
+            addInstance(entity, meshInstance.source, base, InstanceType::Mesh, accel->GetBounds());
+        }
+        else if (auto const* kdTree = registry.try_get<const KdTreeAccelerationStructure>(meshInstance.source); kdTree != nullptr && !kdTree->Empty())
+        {
+            addInstance(entity, meshInstance.source, base, InstanceType::KdTreeMesh, kdTree->bounds);
+        }
+    }
+
+    BVH::Input input{};
+    input.maxPrimsInNode = 2;
+    input.splitType = BVH::SplitType::SAH;
+    auto output = BVH::GenerateFromBounds(input, instanceBounds);
+
+    mNodes = std::move(output.accelerationStructure.nodes);
+    mBuildCost = output.accelerationStructure.buildCost;
+    mInstances.clear();
+    mInstances.reserve(instances.size());
+    for (uint32_t index : output.primitiveOrder)
+    {
+        mInstances.push_back(instances[index]);
+    }
+
+    VLOG(1) << "Built top level BVH with " << mNodes.size() << " nodes for " << mInstances.size() << " instances";
+}
+
+bool TopLevelBVH::Refit(entt::registry& registry, Systems::TransformHierarchy const& transforms)
+{
+    std::vector<BoundingBox> instanceBounds;
+    instanceBounds.reserve(mInstances.size());
+    for (auto& instance : mInstances)
+    {
+        BoundingBox localBounds;
+        switch (instance.type)
+        {
+            case InstanceType::Sphere:
+            case InstanceType::WorldSphere:
+                /* Might switch between the two, if the transform changed */
+                UpdateSphereInstance(instance, registry.get<const Sphere>(instance.entity), transforms.Get(instance.transformIndex).world);
+                instanceBounds.push_back(instance.worldBounds);
+                continue;
+            case InstanceType::Mesh:
+                localBounds = registry.get<const AccelerationStructure>(instance.geometry).GetBounds();
+                break;
+            case InstanceType::KdTreeMesh:
+                localBounds = registry.get<const KdTreeAccelerationStructure>(instance.geometry).bounds;
+                break;
+        }
+
+        instance.worldBounds = Transform(localBounds, transforms.Get(instance.transformIndex).world);
+        instanceBounds.push_back(instance.worldBounds);
+    }
+
+    return BVH::RefitFromBounds(mNodes, mBuildCost, instanceBounds);
+}
+
+std::vector<LinearBVHNode> const& TopLevelBVH::GetNodes() const
+{
+    return mNodes;
+}
+
+std::vector<TopLevelBVH::Instance> const& TopLevelBVH::GetInstances() const
+{
+    return mInstances;
+}
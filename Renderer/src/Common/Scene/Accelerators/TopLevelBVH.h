@@ -0,0 +1,64 @@
+#pragma once
+
+#include <Jnrlib.h>
+#include <entt/entt.hpp>
+
+#include "Scene/Components/AccelerationStructure.h"
+#include "Scene/Systems/TransformHierarchySystem.h"
+
+namespace Common
+{
+    class Entity;
+
+    namespace Accelerators
+    {
+        /* BVH over the world space bounds of every entity that can be hit by a ray, so a ray only visits the entities it might hit */
+        class TopLevelBVH
+        {
+        public:
+            enum class InstanceType
+            {
+                /* Sphere with a transform that doesn't keep it round, tested in its local space */
+                Sphere,
+                /* Sphere tested in world space against worldCenter and worldRadius, without transforming the ray */
+                WorldSphere,
+                Mesh,
+                /* Mesh with a kd-tree instead of a BVH */
+                KdTreeMesh,
+            };
+
+            struct Instance
+            {
+                entt::entity entity;
+                /* Entity with the acceleration structure of a mesh. Same as entity, unless entity is a MeshInstance */
+                entt::entity geometry;
+                Entity* entityPtr;
+                InstanceType type;
+
+                /* Index in the transform hierarchy the BVH was built from */
+                uint32_t transformIndex;
+                Jnrlib::BoundingBox worldBounds;
+
+                /* Only for WorldSphere */
+                Jnrlib::Position worldCenter;
+                Jnrlib::Float worldRadius;
+            };
+
+        public:
+            void Build(entt::registry& registry, Systems::TransformHierarchy const& transforms);
+            /* Updates the bounds of the instances found by the last Build, for when entities only moved.
+             * Returns false if the tree degraded enough that it should be rebuilt
+             */
+            bool Refit(entt::registry& registry, Systems::TransformHierarchy const& transforms);
+
+            std::vector<Components::LinearBVHNode> const& GetNodes() const;
+            /* Ordered as referenced by the leaves */
+            std::vector<Instance> const& GetInstances() const;
+
+        private:
+            std::vector<Components::LinearBVHNode> mNodes;
+            std::vector<Instance> mInstances;
+            Jnrlib::Float mBuildCost = 0;
+        };
+    }
+}
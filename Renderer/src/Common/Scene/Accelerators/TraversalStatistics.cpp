@@ -0,0 +1,49 @@
+#include "TraversalStatistics.h"
+
+#if defined(BVH_STATISTICS)
+
+#include <list>
+#include <mutex>
+
+using namespace Common;
+using namespace Accelerators;
+
+/* Counters of every thread that counted anything. They outlive their threads, so their work is still collected */
+static std::mutex gCountersMutex;
+static std::list<TraversalStatistics::ThreadCounters> gThreadCounters;
+
+TraversalStatistics::ThreadCounters& TraversalStatistics::GetThreadCounters()
+{
+    thread_local ThreadCounters* counters = []()
+    {
+        std::unique_lock lock(gCountersMutex);
+        return &gThreadCounters.emplace_back();
+    }();
+    return *counters;
+}
+
+TraversalStatistics::Counters TraversalStatistics::Collect()
+{
+    std::unique_lock lock(gCountersMutex);
+    Counters total{};
+    for (auto const& counters : gThreadCounters)
+    {
+        total.rays += counters.rays.load(std::memory_order_relaxed);
+        total.nodesVisited += counters.nodesVisited.load(std::memory_order_relaxed);
+        total.trianglesTested += counters.trianglesTested.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+void TraversalStatistics::Reset()
+{
+    std::unique_lock lock(gCountersMutex);
+    for (auto& counters : gThreadCounters)
+    {
+        counters.rays.store(0, std::memory_order_relaxed);
+        counters.nodesVisited.store(0, std::memory_order_relaxed);
+        counters.trianglesTested.store(0, std::memory_order_relaxed);
+    }
+}
+
+#endif
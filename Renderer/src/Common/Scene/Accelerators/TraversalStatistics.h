@@ -0,0 +1,55 @@
+#pragma once
+
+#include <Jnrlib.h>
+#include <atomic>
+
+/* Counters of the work done by the ray traversals. Only compiled in with BVH_STATISTICS, as updating them slows every traversal down */
+#if defined(BVH_STATISTICS)
+#define COUNT_TRAVERSAL(counter, value) (Common::Accelerators::TraversalStatistics::Add(Common::Accelerators::TraversalStatistics::GetThreadCounters().counter, (value)))
+#else
+#define COUNT_TRAVERSAL(counter, value) ((void)0)
+#endif
+
+namespace Common
+{
+    namespace Accelerators
+    {
+        namespace TraversalStatistics
+        {
+            struct Counters
+            {
+                /* Rays traced through the scene: closest hit, occlusion and packet rays */
+                uint64_t rays = 0;
+                /* Nodes of the top level BVH and of the mesh BVHs / kd-trees; a node visited by a packet counts once for every ray */
+                uint64_t nodesVisited = 0;
+                uint64_t trianglesTested = 0;
+            };
+
+#if defined(BVH_STATISTICS)
+            /* Same counters, owned by one thread. They're atomic because Collect reads them while that thread is still tracing,
+             * e.g. from the editor during a preview render. Relaxed, as no other data depends on them
+             */
+            struct ThreadCounters
+            {
+                std::atomic<uint64_t> rays = 0;
+                std::atomic<uint64_t> nodesVisited = 0;
+                std::atomic<uint64_t> trianglesTested = 0;
+            };
+
+            /* Only the owning thread writes a counter, so a load and a store are enough; there's no need for a locked add */
+            inline void Add(std::atomic<uint64_t>& counter, uint64_t value)
+            {
+                counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+            }
+
+            /* Every thread counts in its own counters, so counting never locks */
+            ThreadCounters& GetThreadCounters();
+
+            /* Sum over every thread that traced rays. Only exact when no thread is tracing */
+            Counters Collect();
+            /* Counts of threads that are tracing meanwhile may survive the reset */
+            void Reset();
+#endif
+        }
+    }
+}
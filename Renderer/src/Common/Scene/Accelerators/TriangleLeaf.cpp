@@ -0,0 +1,416 @@
+#include "TriangleLeaf.h"
+#include "CpuFeatures.h"
+#include "Scene/Components/AccelerationStructure.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TRIANGLE_LEAF_SSE
+#define TRIANGLE_LEAF_AVX
+#include <immintrin.h>
+#endif
+
+using namespace Common;
+using namespace Components;
+using namespace Jnrlib;
+using namespace Accelerators;
+using namespace TriangleLeaf;
+
+/* Moller-Trumbore, written with the same operations in the same order as the SIMD kernels, so they all compute the same t, u and v.
+ * NaNs fail every comparison, so degenerate triangles are never hit
+ */
+static bool IntersectScalar(LeafRay& ray, float const* leaf, uint32_t primitiveCount, LeafHit& hit)
+{
+    float const* v0x = leaf + 0 * primitiveCount;
+    float const* v0y = leaf + 1 * primitiveCount;
+    float const* v0z = leaf + 2 * primitiveCount;
+    float const* e1x = leaf + 3 * primitiveCount;
+    float const* e1y = leaf + 4 * primitiveCount;
+    float const* e1z = leaf + 5 * primitiveCount;
+    float const* e2x = leaf + 6 * primitiveCount;
+    float const* e2y = leaf + 7 * primitiveCount;
+    float const* e2z = leaf + 8 * primitiveCount;
+    float const* o = ray.origin;
+    float const* d = ray.direction;
+
+    bool found = false;
+    for (uint32_t i = 0; i < primitiveCount; ++i)
+    {
+        /* p = cross(d, e2) */
+        float px = d[1] * e2z[i] - e2y[i] * d[2];
+        float py = d[2] * e2x[i] - e2z[i] * d[0];
+        float pz = d[0] * e2y[i] - e2x[i] * d[1];
+        float det = e1x[i] * px + e1y[i] * py + e1z[i] * pz;
+        if (det == 0.0f)
+            continue;
+        float invDet = 1.0f / det;
+
+        float sx = o[0] - v0x[i];
+        float sy = o[1] - v0y[i];
+        float sz = o[2] - v0z[i];
+        float u = (sx * px + sy * py + sz * pz) * invDet;
+        if (!(u >= 0.0f && u <= 1.0f))
+            continue;
+
+        /* q = cross(s, e1) */
+        float qx = sy * e1z[i] - e1y[i] * sz;
+        float qy = sz * e1x[i] - e1z[i] * sx;
+        float qz = sx * e1y[i] - e1x[i] * sy;
+        float v = (d[0] * qx + d[1] * qy + d[2] * qz) * invDet;
+        if (!(v >= 0.0f && u + v <= 1.0f))
+            continue;
+
+        float t = (e2x[i] * qx + e2y[i] * qy + e2z[i] * qz) * invDet;
+        if (!(t > 0.0f && t <= ray.maxT))
+            continue;
+
+        ray.maxT = t;
+        hit.index = i;
+        hit.u = u;
+        hit.v = v;
+        found = true;
+    }
+    return found;
+}
+
+#if defined(TRIANGLE_LEAF_SSE)
+/* Copies the last triangles of a leaf into a group of groupWidth triangles. The empty lanes are all zero, which is never hit */
+static void PadGroup(float const* leaf, uint32_t primitiveCount, uint32_t first, uint32_t groupWidth, float* group)
+{
+    uint32_t remaining = primitiveCount - first;
+    for (uint32_t j = 0; j < PRECOMPUTED_TRIANGLE_FLOATS; ++j)
+    {
+        for (uint32_t lane = 0; lane < groupWidth; ++lane)
+        {
+            group[j * groupWidth + lane] = lane < remaining ? leaf[j * primitiveCount + first + lane] : 0.0f;
+        }
+    }
+}
+
+/* Visits the lanes in order, so the closest hit wins and ties go to the last triangle, like in the scalar kernel */
+static bool PickClosest(uint32_t mask, uint32_t first, float const t[], float const u[], float const v[], LeafRay& ray, LeafHit& hit)
+{
+    bool found = false;
+    for (uint32_t lane = 0; mask != 0; ++lane, mask >>= 1)
+    {
+        if ((mask & 1) && t[lane] <= ray.maxT)
+        {
+            ray.maxT = t[lane];
+            hit.index = first + lane;
+            hit.u = u[lane];
+            hit.v = v[lane];
+            found = true;
+        }
+    }
+    return found;
+}
+
+/* group[j * stride + lane] is the j-th precomputed float of the triangle in lane. Returns the mask of the lanes hit before maxT */
+static inline uint32_t IntersectGroupSSE(__m128 const o[3], __m128 const d[3], float maxT, float const* group, uint32_t stride,
+                                         float t[4], float u[4], float v[4])
+{
+    __m128 v0x = _mm_loadu_ps(group + 0 * stride);
+    __m128 v0y = _mm_loadu_ps(group + 1 * stride);
+    __m128 v0z = _mm_loadu_ps(group + 2 * stride);
+    __m128 e1x = _mm_loadu_ps(group + 3 * stride);
+    __m128 e1y = _mm_loadu_ps(group + 4 * stride);
+    __m128 e1z = _mm_loadu_ps(group + 5 * stride);
+    __m128 e2x = _mm_loadu_ps(group + 6 * stride);
+    __m128 e2y = _mm_loadu_ps(group + 7 * stride);
+    __m128 e2z = _mm_loadu_ps(group + 8 * stride);
+
+    __m128 px = _mm_sub_ps(_mm_mul_ps(d[1], e2z), _mm_mul_ps(e2y, d[2]));
+    __m128 py = _mm_sub_ps(_mm_mul_ps(d[2], e2x), _mm_mul_ps(e2z, d[0]));
+    __m128 pz = _mm_sub_ps(_mm_mul_ps(d[0], e2y), _mm_mul_ps(e2x, d[1]));
+    __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+    __m128 valid = _mm_cmpneq_ps(det, _mm_setzero_ps());
+    __m128 invDet = _mm_div_ps(_mm_set1_ps(1.0f), det);
+
+    __m128 sx = _mm_sub_ps(o[0], v0x);
+    __m128 sy = _mm_sub_ps(o[1], v0y);
+    __m128 sz = _mm_sub_ps(o[2], v0z);
+    __m128 uValues = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), invDet);
+    valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(uValues, _mm_setzero_ps()), _mm_cmple_ps(uValues, _mm_set1_ps(1.0f))));
+
+    __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(e1y, sz));
+    __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(e1z, sx));
+    __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(e1x, sy));
+    __m128 vValues = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(d[0], qx), _mm_mul_ps(d[1], qy)), _mm_mul_ps(d[2], qz)), invDet);
+    valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(vValues, _mm_setzero_ps()), _mm_cmple_ps(_mm_add_ps(uValues, vValues), _mm_set1_ps(1.0f))));
+
+    __m128 tValues = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), invDet);
+    valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpgt_ps(tValues, _mm_setzero_ps()), _mm_cmple_ps(tValues, _mm_set1_ps(maxT))));
+
+    uint32_t mask = (uint32_t)_mm_movemask_ps(valid);
+    if (mask != 0)
+    {
+        _mm_storeu_ps(t, tValues);
+        _mm_storeu_ps(u, uValues);
+        _mm_storeu_ps(v, vValues);
+    }
+    return mask;
+}
+
+static bool IntersectSSE(LeafRay& ray, float const* leaf, uint32_t primitiveCount, LeafHit& hit)
+{
+    __m128 const o[3] = {_mm_set1_ps(ray.origin[0]), _mm_set1_ps(ray.origin[1]), _mm_set1_ps(ray.origin[2])};
+    __m128 const d[3] = {_mm_set1_ps(ray.direction[0]), _mm_set1_ps(ray.direction[1]), _mm_set1_ps(ray.direction[2])};
+    float t[4], u[4], v[4];
+
+    bool found = false;
+    uint32_t i = 0;
+    for (; i + 4 <= primitiveCount; i += 4)
+    {
+        uint32_t mask = IntersectGroupSSE(o, d, ray.maxT, leaf + i, primitiveCount, t, u, v);
+        found |= PickClosest(mask, i, t, u, v, ray, hit);
+    }
+    if (i < primitiveCount)
+    {
+        float group[PRECOMPUTED_TRIANGLE_FLOATS * 4];
+        PadGroup(leaf, primitiveCount, i, 4, group);
+        uint32_t mask = IntersectGroupSSE(o, d, ray.maxT, group, 4, t, u, v);
+        found |= PickClosest(mask, i, t, u, v, ray, hit);
+    }
+    return found;
+}
+#endif
+
+#if defined(TRIANGLE_LEAF_AVX)
+TARGET_AVX static inline uint32_t IntersectGroupAVX(__m256 const o[3], __m256 const d[3], float maxT, float const* group, uint32_t stride,
+                                                    float t[8], float u[8], float v[8])
+{
+    __m256 v0x = _mm256_loadu_ps(group + 0 * stride);
+    __m256 v0y = _mm256_loadu_ps(group + 1 * stride);
+    __m256 v0z = _mm256_loadu_ps(group + 2 * stride);
+    __m256 e1x = _mm256_loadu_ps(group + 3 * stride);
+    __m256 e1y = _mm256_loadu_ps(group + 4 * stride);
+    __m256 e1z = _mm256_loadu_ps(group + 5 * stride);
+    __m256 e2x = _mm256_loadu_ps(group + 6 * stride);
+    __m256 e2y = _mm256_loadu_ps(group + 7 * stride);
+    __m256 e2z = _mm256_loadu_ps(group + 8 * stride);
+    __m256 zero = _mm256_setzero_ps();
+    __m256 one = _mm256_set1_ps(1.0f);
+
+    __m256 px = _mm256_sub_ps(_mm256_mul_ps(d[1], e2z), _mm256_mul_ps(e2y, d[2]));
+    __m256 py = _mm256_sub_ps(_mm256_mul_ps(d[2], e2x), _mm256_mul_ps(e2z, d[0]));
+    __m256 pz = _mm256_sub_ps(_mm256_mul_ps(d[0], e2y), _mm256_mul_ps(e2x, d[1]));
+    __m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)), _mm256_mul_ps(e1z, pz));
+    __m256 valid = _mm256_cmp_ps(det, zero, _CMP_NEQ_UQ);
+    __m256 invDet = _mm256_div_ps(one, det);
+
+    __m256 sx = _mm256_sub_ps(o[0], v0x);
+    __m256 sy = _mm256_sub_ps(o[1], v0y);
+    __m256 sz = _mm256_sub_ps(o[2], v0z);
+    __m256 uValues = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sx, px), _mm256_mul_ps(sy, py)), _mm256_mul_ps(sz, pz)), invDet);
+    valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(uValues, zero, _CMP_GE_OQ), _mm256_cmp_ps(uValues, one, _CMP_LE_OQ)));
+
+    __m256 qx = _mm256_sub_ps(_mm256_mul_ps(sy, e1z), _mm256_mul_ps(e1y, sz));
+    __m256 qy = _mm256_sub_ps(_mm256_mul_ps(sz, e1x), _mm256_mul_ps(e1z, sx));
+    __m256 qz = _mm256_sub_ps(_mm256_mul_ps(sx, e1y), _mm256_mul_ps(e1x, sy));
+    __m256 vValues = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(d[0], qx), _mm256_mul_ps(d[1], qy)), _mm256_mul_ps(d[2], qz)), invDet);
+    valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(vValues, zero, _CMP_GE_OQ),
+                                               _mm256_cmp_ps(_mm256_add_ps(uValues, vValues), one, _CMP_LE_OQ)));
+
+    __m256 tValues = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz)), invDet);
+    valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(tValues, zero, _CMP_GT_OQ), _mm256_cmp_ps(tValues, _mm256_set1_ps(maxT), _CMP_LE_OQ)));
+
+    uint32_t mask = (uint32_t)_mm256_movemask_ps(valid);
+    if (mask != 0)
+    {
+        _mm256_storeu_ps(t, tValues);
+        _mm256_storeu_ps(u, uValues);
+        _mm256_storeu_ps(v, vValues);
+    }
+    return mask;
+}
+
+TARGET_AVX static bool IntersectAVX(LeafRay& ray, float const* leaf, uint32_t primitiveCount, LeafHit& hit)
+{
+    __m256 const o[3] = {_mm256_set1_ps(ray.origin[0]), _mm256_set1_ps(ray.origin[1]), _mm256_set1_ps(ray.origin[2])};
+    __m256 const d[3] = {_mm256_set1_ps(ray.direction[0]), _mm256_set1_ps(ray.direction[1]), _mm256_set1_ps(ray.direction[2])};
+    float t[8], u[8], v[8];
+
+    bool found = false;
+    uint32_t i = 0;
+    for (; i + 8 <= primitiveCount; i += 8)
+    {
+        uint32_t mask = IntersectGroupAVX(o, d, ray.maxT, leaf + i, primitiveCount, t, u, v);
+        found |= PickClosest(mask, i, t, u, v, ray, hit);
+    }
+
+    uint32_t remaining = primitiveCount - i;
+    if (remaining > 4)
+    {
+        float group[PRECOMPUTED_TRIANGLE_FLOATS * 8];
+        PadGroup(leaf, primitiveCount, i, 8, group);
+        uint32_t mask = IntersectGroupAVX(o, d, ray.maxT, group, 8, t, u, v);
+        found |= PickClosest(mask, i, t, u, v, ray, hit);
+    }
+    else if (remaining > 0)
+    {
+        /* Small leaves and short tails would waste most of the lanes of an 8 wide group */
+        __m128 const o4[3] = {_mm_set1_ps(ray.origin[0]), _mm_set1_ps(ray.origin[1]), _mm_set1_ps(ray.origin[2])};
+        __m128 const d4[3] = {_mm_set1_ps(ray.direction[0]), _mm_set1_ps(ray.direction[1]), _mm_set1_ps(ray.direction[2])};
+        float const* group = leaf + i;
+        uint32_t stride = primitiveCount;
+        float padded[PRECOMPUTED_TRIANGLE_FLOATS * 4];
+        if (remaining < 4)
+        {
+            PadGroup(leaf, primitiveCount, i, 4, padded);
+            group = padded;
+            stride = 4;
+        }
+        uint32_t mask = IntersectGroupSSE(o4, d4, ray.maxT, group, stride, t, u, v);
+        found |= PickClosest(mask, i, t, u, v, ray, hit);
+    }
+    return found;
+}
+#endif
+
+#if defined(TRIANGLE_LEAF_SSE)
+static __m128 Select(__m128 mask, __m128 a, __m128 b)
+{
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+/* Same operations as IntersectScalar, with a ray in each lane and the triangle broadcast */
+static uint32_t Intersect4SSE(LeafRay4& rays, float const* leaf, uint32_t primitiveCount, LeafHit4& hits)
+{
+    __m128 const o[3] = {_mm_loadu_ps(rays.originX), _mm_loadu_ps(rays.originY), _mm_loadu_ps(rays.originZ)};
+    __m128 const d[3] = {_mm_loadu_ps(rays.directionX), _mm_loadu_ps(rays.directionY), _mm_loadu_ps(rays.directionZ)};
+    __m128 const zero = _mm_setzero_ps();
+    __m128 const one = _mm_set1_ps(1.0f);
+
+    __m128 maxT = _mm_loadu_ps(rays.maxT);
+    __m128 hitU = zero, hitV = zero, hitIndex = zero, hit = zero;
+    for (uint32_t i = 0; i < primitiveCount; ++i)
+    {
+        __m128 v0x = _mm_set1_ps(leaf[0 * primitiveCount + i]);
+        __m128 v0y = _mm_set1_ps(leaf[1 * primitiveCount + i]);
+        __m128 v0z = _mm_set1_ps(leaf[2 * primitiveCount + i]);
+        __m128 e1x = _mm_set1_ps(leaf[3 * primitiveCount + i]);
+        __m128 e1y = _mm_set1_ps(leaf[4 * primitiveCount + i]);
+        __m128 e1z = _mm_set1_ps(leaf[5 * primitiveCount + i]);
+        __m128 e2x = _mm_set1_ps(leaf[6 * primitiveCount + i]);
+        __m128 e2y = _mm_set1_ps(leaf[7 * primitiveCount + i]);
+        __m128 e2z = _mm_set1_ps(leaf[8 * primitiveCount + i]);
+
+        __m128 px = _mm_sub_ps(_mm_mul_ps(d[1], e2z), _mm_mul_ps(e2y, d[2]));
+        __m128 py = _mm_sub_ps(_mm_mul_ps(d[2], e2x), _mm_mul_ps(e2z, d[0]));
+        __m128 pz = _mm_sub_ps(_mm_mul_ps(d[0], e2y), _mm_mul_ps(e2x, d[1]));
+        __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+        __m128 valid = _mm_cmpneq_ps(det, zero);
+        __m128 invDet = _mm_div_ps(one, det);
+
+        __m128 sx = _mm_sub_ps(o[0], v0x);
+        __m128 sy = _mm_sub_ps(o[1], v0y);
+        __m128 sz = _mm_sub_ps(o[2], v0z);
+        __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), invDet);
+        valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmple_ps(u, one)));
+
+        __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(e1y, sz));
+        __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(e1z, sx));
+        __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(e1x, sy));
+        __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(d[0], qx), _mm_mul_ps(d[1], qy)), _mm_mul_ps(d[2], qz)), invDet);
+        valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(v, zero), _mm_cmple_ps(_mm_add_ps(u, v), one)));
+
+        __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), invDet);
+        valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpgt_ps(t, zero), _mm_cmple_ps(t, maxT)));
+
+        maxT = Select(valid, t, maxT);
+        hitU = Select(valid, u, hitU);
+        hitV = Select(valid, v, hitV);
+        hitIndex = Select(valid, _mm_castsi128_ps(_mm_set1_epi32((int)i)), hitIndex);
+        hit = _mm_or_ps(hit, valid);
+    }
+
+    _mm_storeu_ps(rays.maxT, maxT);
+    _mm_storeu_ps(hits.u, hitU);
+    _mm_storeu_ps(hits.v, hitV);
+    _mm_storeu_si128((__m128i*)hits.index, _mm_castps_si128(hitIndex));
+    return (uint32_t)_mm_movemask_ps(hit);
+}
+#endif
+
+bool TriangleLeaf::IsSupported(Kernel kernel)
+{
+    switch (kernel)
+    {
+        case Kernel::Scalar:
+            return true;
+#if defined(TRIANGLE_LEAF_SSE)
+        case Kernel::SSE:
+            return GetCpuFeatures().sse2;
+#endif
+#if defined(TRIANGLE_LEAF_AVX)
+        case Kernel::AVX:
+            return GetCpuFeatures().avx;
+#endif
+        default:
+            return false;
+    }
+}
+
+Kernel TriangleLeaf::GetBestKernel()
+{
+    static Kernel const bestKernel = []()
+    {
+        for (Kernel kernel : {Kernel::AVX, Kernel::SSE})
+        {
+            if (IsSupported(kernel))
+                return kernel;
+        }
+        return Kernel::Scalar;
+    }();
+    return bestKernel;
+}
+
+IntersectFunction TriangleLeaf::GetKernel(Kernel kernel)
+{
+    CHECK(IsSupported(kernel)) << "Leaf kernel " << magic_enum::enum_name(kernel) << " is not supported on this CPU";
+    switch (kernel)
+    {
+#if defined(TRIANGLE_LEAF_SSE)
+        case Kernel::SSE:
+            return IntersectSSE;
+#endif
+#if defined(TRIANGLE_LEAF_AVX)
+        case Kernel::AVX:
+            return IntersectAVX;
+#endif
+        default:
+            return IntersectScalar;
+    }
+}
+
+bool TriangleLeaf::Intersect(LeafRay& ray, float const* leaf, uint32_t primitiveCount, LeafHit& hit)
+{
+    static IntersectFunction const intersect = GetKernel(GetBestKernel());
+    return intersect(ray, leaf, primitiveCount, hit);
+}
+
+uint32_t TriangleLeaf::Intersect4(LeafRay4& rays, float const* leaf, uint32_t primitiveCount, LeafHit4& hits)
+{
+#if defined(TRIANGLE_LEAF_SSE)
+    if (IsSupported(Kernel::SSE))
+        return Intersect4SSE(rays, leaf, primitiveCount, hits);
+#endif
+
+    uint32_t mask = 0;
+    for (uint32_t lane = 0; lane < 4; ++lane)
+    {
+        LeafRay ray{
+            .origin = {rays.originX[lane], rays.originY[lane], rays.originZ[lane]},
+            .direction = {rays.directionX[lane], rays.directionY[lane], rays.directionZ[lane]},
+            .maxT = rays.maxT[lane],
+        };
+        LeafHit hit;
+        if (IntersectScalar(ray, leaf, primitiveCount, hit))
+        {
+            rays.maxT[lane] = ray.maxT;
+            hits.index[lane] = hit.index;
+            hits.u[lane] = hit.u;
+            hits.v[lane] = hit.v;
+            mask |= 1 << lane;
+        }
+    }
+    return mask;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <Jnrlib.h>
+
+namespace Common
+{
+    namespace Accelerators
+    {
+        /* Ray tests against a whole leaf of precomputed triangles (AccelerationStructure::precomputedTriangles).
+         * The SIMD kernels test 4 or 8 triangles at once and find exactly the same hit as the scalar one
+         */
+        namespace TriangleLeaf
+        {
+            enum class Kernel
+            {
+                Scalar,
+                SSE,
+                AVX,
+            };
+
+            struct LeafRay
+            {
+                float origin[3];
+                float direction[3];
+                /* Lowered to the distance of the closest hit */
+                float maxT;
+            };
+
+            struct LeafHit
+            {
+                /* Relative to the first triangle of the leaf */
+                uint32_t index;
+                float u;
+                float v;
+            };
+
+            /* 4 rays of a packet, tested against the same leaf */
+            struct LeafRay4
+            {
+                float originX[4], originY[4], originZ[4];
+                float directionX[4], directionY[4], directionZ[4];
+                /* 0 for the lanes without a ray, they're never hit */
+                float maxT[4];
+            };
+
+            struct LeafHit4
+            {
+                uint32_t index[4];
+                float u[4];
+                float v[4];
+            };
+
+            /* leaf points to the first precomputed float of the leaf, which stores primitiveCount triangles */
+            using IntersectFunction = bool (*)(LeafRay& ray, float const* leaf, uint32_t primitiveCount, LeafHit& hit);
+
+            /* Whether the kernel was compiled in and the CPU can run it */
+            bool IsSupported(Kernel kernel);
+            /* The widest supported kernel, picked once from the features of the CPU */
+            Kernel GetBestKernel();
+            IntersectFunction GetKernel(Kernel kernel);
+
+            /* Uses the best kernel */
+            bool Intersect(LeafRay& ray, float const* leaf, uint32_t primitiveCount, LeafHit& hit);
+            /* Tests 4 rays at once against every triangle of the leaf and returns the mask of the rays that hit one.
+             * Finds the same hits as Intersect
+             */
+            uint32_t Intersect4(LeafRay4& rays, float const* leaf, uint32_t primitiveCount, LeafHit4& hits);
+        }
+    }
+}
@@ -19,9 +19,111 @@ namespace Common::Components
         Jnrlib::Axis axis;
     };
 
+    /* Node of a BVH collapsed to Width children. The bounds of the children are stored as SoA, so one SIMD slab test covers all of them */
+    template <uint32_t Width>
+    struct ALIGN(32) WideBVHNode
+    {
+        static constexpr const uint32_t WIDTH = Width;
+        /* primitiveCount of an interior child */
+        static constexpr const uint32_t INTERIOR_CHILD = 0;
+        /* primitiveCount of an unused slot. Unused slots also have inverted bounds, so they never pass the slab test */
+        static constexpr const uint32_t EMPTY_CHILD = (uint32_t)-1;
+
+        /* Always single precision, so the slab test can use the float SIMD registers. Rounded outwards when Float is a double */
+        float minX[Width];
+        float minY[Width];
+        float minZ[Width];
+        float maxX[Width];
+        float maxY[Width];
+        float maxZ[Width];
+
+        /* Interior child => index of the child node; leaf => offset of the first primitive */
+        uint32_t childOffset[Width];
+        uint32_t primitiveCount[Width];
+    };
+
+    using BVH4Node = WideBVHNode<4>;
+    using BVH8Node = WideBVHNode<8>;
+
+    /* Binary node that stores the bounds of both its children quantized relative to its own (decoded) bounds.
+     * Only the root box is stored in full precision, so traversal has to carry the decoded box of each node
+     */
+    template <typename T>
+    struct QuantizedBVHNode
+    {
+        static constexpr const uint32_t QUANTIZATION_STEPS = std::numeric_limits<T>::max();
+        static constexpr const uint32_t INTERIOR_CHILD = 0;
+        static constexpr const uint32_t EMPTY_CHILD = (uint32_t)-1;
+
+        T childMin[2][3];
+        T childMax[2][3];
+
+        /* Same meaning as in WideBVHNode */
+        uint32_t childOffset[2];
+        uint32_t primitiveCount[2];
+    };
+
+    using QuantizedBVH8Node = QuantizedBVHNode<uint8_t>;
+    using QuantizedBVH16Node = QuantizedBVHNode<uint16_t>;
+
+    /* Used both when building and when traversing, so the decoded boxes are bit-for-bit the ones the build checked to be conservative */
+    inline float DequantizeBound(float parentMin, float parentMax, uint32_t value, uint32_t steps)
+    {
+        if (value >= steps)
+            return parentMax;
+        return parentMin + (parentMax - parentMin) * ((float)value / (float)steps);
+    }
+
+    template <typename T>
+    inline void DequantizeChildBounds(QuantizedBVHNode<T> const& node, uint32_t child, float const parentMin[3], float const parentMax[3],
+                                      float childMin[3], float childMax[3])
+    {
+        for (uint32_t axis = 0; axis < 3; ++axis)
+        {
+            childMin[axis] = DequantizeBound(parentMin[axis], parentMax[axis], node.childMin[child][axis], QuantizedBVHNode<T>::QUANTIZATION_STEPS);
+            childMax[axis] = DequantizeBound(parentMin[axis], parentMax[axis], node.childMax[child][axis], QuantizedBVHNode<T>::QUANTIZATION_STEPS);
+        }
+    }
+
+    /* Triangles in edge form: v0, v1 - v0 and v2 - v0 */
+    constexpr const uint32_t PRECOMPUTED_TRIANGLE_FLOATS = 9;
+
     struct AccelerationStructure
     {
+        /* The binary tree is always available; it's used for the debug view and it's what the wide trees are built from */
         std::vector<LinearBVHNode> nodes;
+        /* Filled only if the BVH was built with a width of 4 or 8 */
+        uint32_t width = 2;
+        std::vector<BVH4Node> nodes4;
+        std::vector<BVH8Node> nodes8;
+        /* Filled only if the BVH was built with node compression. The binary nodes are dropped in that case */
+        std::vector<QuantizedBVH8Node> quantizedNodes8;
+        std::vector<QuantizedBVH16Node> quantizedNodes16;
+        float quantizedRootMin[3] = {};
+        float quantizedRootMax[3] = {};
+        /* Filled only if the BVH was built with precomputeTriangles. The triangles of a leaf start at PRECOMPUTED_TRIANGLE_FLOATS * primitiveOffset
+         * and are stored as SoA: v0.x of every triangle in the leaf, then v0.y of every triangle, and so on
+         */
+        std::vector<float> precomputedTriangles;
+        /* SAH cost right after the build; refitting compares against it */
+        Jnrlib::Float buildCost = 0;
         bool shouldRender = false;
+
+        bool Empty() const
+        {
+            return nodes.empty() && quantizedNodes8.empty() && quantizedNodes16.empty();
+        }
+
+        /* Bounds of the whole mesh */
+        Jnrlib::BoundingBox GetBounds() const
+        {
+            if (!nodes.empty())
+                return nodes[0].bounds;
+            if (Empty())
+                return Jnrlib::BoundingBox();
+
+            return Jnrlib::BoundingBox(Jnrlib::Position(quantizedRootMin[0], quantizedRootMin[1], quantizedRootMin[2]),
+                                       Jnrlib::Position(quantizedRootMax[0], quantizedRootMax[1], quantizedRootMax[2]));
+        }
     };
 }
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <Jnrlib.h>
+
+namespace Common::Components
+{
+    struct KdTreeNode
+    {
+        static constexpr const uint32_t LEAF = 3;
+
+        union
+        {
+            /* Interior => position of the splitting plane */
+            Jnrlib::Float split;
+            /* Leaf => offset of the first primitive in KdTreeAccelerationStructure::primitiveIndices */
+            uint32_t primitiveOffset;
+        };
+        /* The low 2 bits are the split axis, or LEAF. The rest is the index of the child above the plane for interior nodes
+         * and the number of primitives for leaves. The child below the plane always follows its parent
+         */
+        uint32_t flags;
+
+        void InitLeaf(uint32_t offset, uint32_t primitiveCount)
+        {
+            primitiveOffset = offset;
+            flags = LEAF | (primitiveCount << 2);
+        }
+
+        void InitInterior(uint32_t axis, Jnrlib::Float splitPosition)
+        {
+            split = splitPosition;
+            flags = axis;
+        }
+
+        void SetAboveChild(uint32_t aboveChild)
+        {
+            flags |= aboveChild << 2;
+        }
+
+        bool IsLeaf() const
+        {
+            return (flags & 3) == LEAF;
+        }
+
+        uint32_t GetSplitAxis() const
+        {
+            return flags & 3;
+        }
+
+        uint32_t GetAboveChild() const
+        {
+            return flags >> 2;
+        }
+
+        uint32_t GetPrimitiveCount() const
+        {
+            return flags >> 2;
+        }
+    };
+
+    struct KdTreeAccelerationStructure
+    {
+        /* Deepest tree the traversal stack can hold */
+        static constexpr const uint32_t MAX_DEPTH = 64;
+
+        std::vector<KdTreeNode> nodes;
+        /* Triangles of the mesh referenced by the leaves. A triangle that straddles a split is referenced by more than one leaf */
+        std::vector<uint32_t> primitiveIndices;
+        Jnrlib::BoundingBox bounds;
+
+        bool Empty() const
+        {
+            return nodes.empty();
+        }
+    };
+}
@@ -7,6 +7,7 @@ namespace Common::Components
     struct Indices
     {
         uint32_t firstVertex = 0;
+        uint32_t vertexCount = 0;
         uint32_t firstIndex = 0;
         uint32_t indexCount = 0;
     };
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <Jnrlib.h>
+#include <entt/entt.hpp>
+
+namespace Common::Components
+{
+    /* Places the mesh loaded by another entity. The Mesh of the instance has the same indices as the one of the source, with its own material,
+     * and rays use the acceleration structure of the source, so a mesh is stored once no matter how many times it's placed
+     */
+    struct MeshInstance
+    {
+        entt::entity source;
+    };
+}
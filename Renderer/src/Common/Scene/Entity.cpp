@@ -22,8 +22,7 @@ void Entity::SetParent(Entity* parentEntity)
     if (parentEntity == mParentEntity)
         return;
 
-    mParentEntity = parentEntity;
-
+    /* AddChild sets the parent as well; setting it here first made AddChild return before registering the child */
     parentEntity->AddChild(this);
 }
 
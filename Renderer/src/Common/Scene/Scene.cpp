@@ -5,7 +5,12 @@
 #include "Scene/Components/Base.h"
 #include "Scene/Components/Sphere.h"
 #include "Scene/Components/Update.h"
+#include "Scene/Components/MeshInstance.h"
 #include "Scene/Components/Camera.h"
+#include "Scene/Components/AccelerationStructure.h"
+#include "Scene/Components/KdTreeAccelerationStructure.h"
+#include "Scene/Accelerators/BVHCache.h"
+#include "Scene/Accelerators/KdTree.h"
 #include "Constants.h"
 #include "MaterialManager.h"
 
@@ -25,6 +30,31 @@ namespace Helpers
         return std::filesystem::path(path).stem().string();
     }
 
+    Accelerators::BVH::Input CreateBVHInput(CreateInfo::AccelerationStructure const& accelerationInfo)
+    {
+        Accelerators::BVH::Input bvhAcceleration{};
+        bvhAcceleration.splitType = accelerationInfo.splitType;
+        bvhAcceleration.maxPrimsInNode = accelerationInfo.maxPrimsInNode;
+        bvhAcceleration.buildThreads = accelerationInfo.buildThreads;
+        bvhAcceleration.parallelGrainSize = accelerationInfo.parallelGrainSize;
+        bvhAcceleration.width = accelerationInfo.bvhWidth;
+        bvhAcceleration.nodeCompression = accelerationInfo.nodeCompression;
+        bvhAcceleration.sbvhMemoryBudget = accelerationInfo.sbvhMemoryBudget;
+        bvhAcceleration.precomputeTriangles = accelerationInfo.precomputeTriangles;
+        return bvhAcceleration;
+    }
+
+    Accelerators::KdTree::Input CreateKdTreeInput(CreateInfo::AccelerationStructure const& accelerationInfo)
+    {
+        Accelerators::KdTree::Input kdTreeAcceleration{};
+        kdTreeAcceleration.intersectCost = accelerationInfo.intersectCost;
+        kdTreeAcceleration.traversalCost = accelerationInfo.traversalCost;
+        kdTreeAcceleration.emptyBonus = accelerationInfo.emptyBonus;
+        kdTreeAcceleration.maxPrimsInNode = accelerationInfo.maxPrimsInKdTreeNode;
+        kdTreeAcceleration.maxDepth = accelerationInfo.maxDepth;
+        return kdTreeAcceleration;
+    }
+
     /* Helpers */
     class ModelLoader
     {
@@ -40,13 +70,31 @@ if (!mSuccess)\
             std::vector<uint32_t> indices;
         };
 
+        /* What the stages of loading a mesh hand over to each other */
+        struct MeshLoad
+        {
+            std::string path;
+            Entity* ent;
+            std::shared_ptr<IMaterial> material;
+            CreateInfo::AccelerationStructure const* accelerationInfo;
+
+            MeshProcessContext context;
+            std::string cacheEntryPath;
+            uint64_t cacheKey = 0;
+            /* A cached BVH also holds the triangles it was built for, so there's nothing to import or build */
+            bool cached = false;
+
+            std::optional<Components::AccelerationStructure> accelerationStructure;
+            std::optional<Components::KdTreeAccelerationStructure> kdTree;
+        };
+
     public:
         ModelLoader(Scene* scene) :
             mScene(scene)
         {
             auto threadPool = ThreadPool::Get();
-            mImporters.resize(threadPool->GetNumberOfThreads());
-            mTasksToWaitFor.reserve(16); // Simple beginning case
+            /* The last one is for the thread that waits for the loader, it executes loading tasks as well */
+            mImporters.resize(threadPool->GetNumberOfThreads() + 1);
         }
 
         ~ModelLoader()
@@ -66,10 +114,10 @@ if (!mSuccess)\
 
         void Wait()
         {
-            auto threadPool = ThreadPool::Get();
-            for (auto const& task : mTasksToWaitFor)
+            /* Every mesh is appended after the one before it, so the last append finishes the whole pipeline */
+            if (mLastAppend.IsValid())
             {
-                threadPool->Wait(task);
+                ThreadPool::Get()->Wait(mLastAppend);
             }
         }
 
@@ -79,8 +127,20 @@ if (!mSuccess)\
 
             MarkMesh(path);
 
+            auto& load = mLoads.emplace_back();
+            load.path = path;
+            load.ent = ent;
+            load.material = material;
+            load.accelerationInfo = &accelerationInfo;
+
+            /* The stages of a mesh run as soon as the previous one is done, while other meshes are still importing.
+             * Appends are chained, so only one of them touches the scene at a time and the meshes end up in the
+             * vertex and index buffers in the order they were loaded
+             */
             auto threadPool = ThreadPool::Get();
-            mTasksToWaitFor.emplace_back(threadPool->ExecuteDeffered(std::bind(&ModelLoader::HandleLoading, this, std::cref(path), ent, material, std::cref(accelerationInfo))));
+            auto imported = threadPool->ExecuteDeffered(std::bind(&ModelLoader::ImportMesh, this, std::ref(load)));
+            auto built = threadPool->Then(imported, std::bind(&ModelLoader::BuildAccelerationStructure, this, std::ref(load)));
+            mLastAppend = threadPool->ExecuteAfter({ built, mLastAppend }, std::bind(&ModelLoader::AppendMesh, this, std::ref(load)));
         }
 
     private:
@@ -91,20 +151,46 @@ if (!mSuccess)\
             mScene->AddMeshIndices(name, indices);
         }
 
-        void HandleLoading(std::string const& path, Entity* ent, std::shared_ptr<IMaterial> material, CreateInfo::AccelerationStructure const& accelerationInfo)
+        bool UsesKdTree(MeshLoad const& load) const
+        {
+            return load.accelerationInfo->accelerationType == CreateInfo::AccelerationType::KdTree;
+        }
+
+        void ImportMesh(MeshLoad& load)
         {
+            RETURN_IF_FAILURE_FOUND;
+
+            if (!UsesKdTree(load) && !load.accelerationInfo->cacheDirectory.empty())
+            {
+                if (uint64_t contentHash = Accelerators::BVHCache::HashMeshFiles(load.path); contentHash != 0)
+                {
+                    load.cacheKey = Accelerators::BVHCache::ComputeKey(contentHash, CreateBVHInput(*load.accelerationInfo));
+                    load.cacheEntryPath = Accelerators::BVHCache::GetEntryPath(load.accelerationInfo->cacheDirectory, load.path, load.cacheKey);
+                    if (auto entry = Accelerators::BVHCache::Load(load.cacheEntryPath, load.cacheKey); entry.has_value())
+                    {
+                        VLOG(1) << "Loaded mesh " << load.path << " from the BVH cache";
+                        load.accelerationStructure = std::move(entry->accelerationStructure);
+                        load.context.vertices = std::move(entry->vertices);
+                        load.context.indices = std::move(entry->indices);
+                        load.cached = true;
+                        return;
+                    }
+                }
+            }
+
             auto threadPool = ThreadPool::Get();
             uint32_t id = threadPool->GetCurrentThreadId();
-            CHECK(id != -1) << "Invalid thread id returned by thread pool. Is this executed on the main thread?";
+            if (id == -1)
+            {
+                id = (uint32_t)mImporters.size() - 1;
+            }
 
             if (mImporters[id] == nullptr)
             {
                 mImporters[id].reset(new Assimp::Importer());
             }
 
-            RETURN_IF_FAILURE_FOUND;
-
-            auto scene = mImporters[id]->ReadFile(path, aiProcess_GenNormals |
+            auto scene = mImporters[id]->ReadFile(load.path, aiProcess_GenNormals |
                                                   aiProcess_FlipWindingOrder |
                                                   aiProcess_MakeLeftHanded |
                                                   aiProcess_Triangulate |
@@ -113,44 +199,89 @@ if (!mSuccess)\
             if (scene == nullptr && mSuccess)
             {
                 std::unique_lock<std::mutex> lock(mMessageMutex);
-                mFailureMessage = "Couldn't load mesh from file " + path;
+                mFailureMessage = "Couldn't load mesh from file " + load.path;
                 mSuccess = false;
             }
 
             RETURN_IF_FAILURE_FOUND;
 
-            MeshProcessContext context;
-            ProcessNode(scene, scene->mRootNode, context);
+            ProcessNode(scene, scene->mRootNode, load.context);
+        }
+
+        void BuildAccelerationStructure(MeshLoad& load)
+        {
+            RETURN_IF_FAILURE_FOUND;
+
+            if (load.cached)
+                return;
+
+            if (UsesKdTree(load))
+            {
+                Accelerators::KdTree::Input kdTreeAcceleration = CreateKdTreeInput(*load.accelerationInfo);
+                kdTreeAcceleration.indices = load.context.indices;
+                kdTreeAcceleration.vertices = load.context.vertices;
+                if (auto kdTree = Accelerators::KdTree::Generate(kdTreeAcceleration); !kdTree.Empty())
+                {
+                    load.kdTree = std::move(kdTree);
+                }
+                return;
+            }
 
             /* Create acceleration structure */
-            Accelerators::BVH::Input bvhAcceleration{};
-            bvhAcceleration.splitType = accelerationInfo.splitType;
-            bvhAcceleration.maxPrimsInNode = accelerationInfo.maxPrimsInNode;
-            bvhAcceleration.indices = context.indices;
-            bvhAcceleration.vertices = context.vertices;
-            if (auto output = Accelerators::BVH::Generate(bvhAcceleration); !output.accelerationStructure.nodes.empty())
+            Accelerators::BVH::Input bvhAcceleration = CreateBVHInput(*load.accelerationInfo);
+            bvhAcceleration.indices = load.context.indices;
+            bvhAcceleration.vertices = load.context.vertices;
+            if (auto output = Accelerators::BVH::Generate(bvhAcceleration); !output.accelerationStructure.Empty())
             {
                 /* Use the new indices */
-                context.indices = std::move(output.new_indices);
+                load.context.indices = std::move(output.new_indices);
+
+                if (!load.cacheEntryPath.empty())
+                {
+                    Accelerators::BVHCache::Entry entry{};
+                    entry.accelerationStructure = output.accelerationStructure;
+                    entry.indices = load.context.indices;
+                    entry.vertices = load.context.vertices;
+                    Accelerators::BVHCache::Store(load.cacheEntryPath, load.cacheKey, entry);
+                }
+
                 /* Created a valid acceleration structure */
-                ent->AddComponent(output.accelerationStructure);
+                load.accelerationStructure = std::move(output.accelerationStructure);
             }
+        }
+
+        void AppendMesh(MeshLoad& load)
+        {
+            RETURN_IF_FAILURE_FOUND;
 
+            if (load.kdTree.has_value())
+            {
+                load.ent->AddComponent(std::move(*load.kdTree));
+            }
+            if (load.accelerationStructure.has_value())
             {
-                std::string name = GetMeshNameFromPath(path);
-                Components::Mesh mesh;
-                mesh.indices.indexCount = (uint32_t)context.indices.size();
-                mesh.indices.firstVertex = mScene->AddVertices(std::move(context.vertices));
-                mesh.indices.firstIndex = mScene->AddIndices(std::move(context.indices));
-                // mesh.name = name;
-                mesh.material = material;
-                
-                /* Update the indices */
-                auto& indices = mScene->GetMeshIndices(name);
-                indices = mesh.indices;
-
-                ent->AddComponent(mesh);
+                load.ent->AddComponent(std::move(*load.accelerationStructure));
             }
+            AddMesh(load.path, load.ent, load.material, std::move(load.context.vertices), std::move(load.context.indices));
+        }
+
+        void AddMesh(std::string const& path, Entity* ent, std::shared_ptr<IMaterial> material,
+                     std::vector<VertexPositionNormal>&& vertices, std::vector<uint32_t>&& indices)
+        {
+            std::string name = GetMeshNameFromPath(path);
+            Components::Mesh mesh;
+            mesh.indices.indexCount = (uint32_t)indices.size();
+            mesh.indices.vertexCount = (uint32_t)vertices.size();
+            mesh.indices.firstVertex = mScene->AddVertices(std::move(vertices));
+            mesh.indices.firstIndex = mScene->AddIndices(std::move(indices));
+            // mesh.name = name;
+            mesh.material = material;
+            
+            /* Update the indices */
+            auto& meshIndices = mScene->GetMeshIndices(name);
+            meshIndices = mesh.indices;
+
+            ent->AddComponent(mesh);
         }
 
         void ProcessNode(aiScene const* scene, aiNode* node, MeshProcessContext& ctx)
@@ -213,7 +344,9 @@ if (!mSuccess)\
         Scene* mScene;
 
         std::vector<std::unique_ptr<Assimp::Importer>> mImporters;
-        std::vector<std::shared_ptr<struct Jnrlib::Task>> mTasksToWaitFor;
+        /* A deque, so the loads don't move while their tasks run */
+        std::deque<MeshLoad> mLoads;
+        Jnrlib::TaskHandle mLastAppend;
 
         std::mutex mMessageMutex;
         bool mSuccess = true;
@@ -229,8 +362,21 @@ Scene::Scene(CreateInfo::Scene const& info) :
     mImageInfo(info.imageInfo)
 {
     LOG(INFO) << "Creating scene with info: " << info;
+
+    /* New entities need a rebuild; edits of existing ones only need a refit */
+    mRegistry.on_construct<Components::Base>().connect<&Scene::MarkRayTracingDataDirty>(this);
+    mRegistry.on_construct<Components::Sphere>().connect<&Scene::MarkRayTracingDataDirty>(this);
+    mRegistry.on_construct<Components::AccelerationStructure>().connect<&Scene::MarkRayTracingDataDirty>(this);
+    mRegistry.on_construct<Components::KdTreeAccelerationStructure>().connect<&Scene::MarkRayTracingDataDirty>(this);
+    mRegistry.on_construct<Components::MeshInstance>().connect<&Scene::MarkRayTracingDataDirty>(this);
+    mRegistry.on_update<Components::Base>().connect<&Scene::MarkRayTracingDataMoved>(this);
+    mRegistry.on_update<Components::Sphere>().connect<&Scene::MarkRayTracingDataMoved>(this);
+    mRegistry.on_update<Components::AccelerationStructure>().connect<&Scene::MarkRayTracingDataMoved>(this);
+    mRegistry.on_update<Components::KdTreeAccelerationStructure>().connect<&Scene::MarkRayTracingDataMoved>(this);
+
     CreateCamera(info.cameraInfo, info.alsoBuildForRealTimeRendering);
     CreatePrimitives(info.primitives, info.alsoBuildForRealTimeRendering);
+    UpdateRayTracingData();
 }
 
 Scene::~Scene()
@@ -333,6 +479,7 @@ void Scene::AddSphereComponent(Entity* entity, bool alsoBuildRealtime, std::shar
             std::vector<VertexPositionNormal> sphereVertices;
             std::vector<uint32_t> sphereIndices;
             Sphere::GetVertices(One, sliceCount, stackCount, sphereVertices, sphereIndices);
+            indices.vertexCount = (uint32_t)sphereVertices.size();
             AddVertices(std::move(sphereVertices));
             AddIndices(std::move(sphereIndices));
             indices.indexCount = (uint32_t)mIndices.size() - indices.firstIndex;
@@ -353,11 +500,36 @@ void Scene::AddSphereComponent(Entity* entity, bool alsoBuildRealtime, std::shar
     entity->AddComponent(Components::Sphere{ .radius = radius, .material = material });
 }
 
+void Scene::AddMeshInstanceComponent(Entity* entity, Entity* source, std::shared_ptr<IMaterial> material)
+{
+    CHECK(material != nullptr) << "Can not add a mesh instance with an empty material";
+    auto const* sourceMesh = source->TryGetComponent<Components::Mesh>();
+    CHECK(sourceMesh != nullptr) << "Entity " << source->GetComponent<Components::Base>().name << " has no mesh to instance";
+    CHECK(source->TryGetComponent<Components::MeshInstance>() == nullptr) << "Instances can only be made of the entity that loaded the mesh";
+
+    Components::Mesh mesh{};
+    mesh.name = sourceMesh->name;
+    mesh.indices = sourceMesh->indices;
+    mesh.material = material;
+    entity->AddComponent(mesh);
+    entity->AddComponent(Components::MeshInstance{ .source = *source });
+}
+
 std::optional<HitPoint> Scene::GetClosestHit(Ray& r) const
 {
     return Systems::Intersection::Get()->IntersectRay(r, mRegistry, this);
 }
 
+void Scene::GetClosestHits(RayPacket& packet) const
+{
+    Systems::Intersection::Get()->IntersectPacket(packet, mRegistry, this);
+}
+
+bool Scene::IsOccluded(Ray const& r, Jnrlib::Float maxT) const
+{
+    return Systems::Intersection::Get()->IsOccluded(r, maxT, mRegistry, this);
+}
+
 uint32_t Scene::GetNumberOfObjects() const
 {
     return (uint32_t)mEntities.size();
@@ -365,6 +537,8 @@ uint32_t Scene::GetNumberOfObjects() const
 
 void Scene::PerformUpdate()
 {
+    UpdateRayTracingData();
+
     for (auto const& [entity, update] : mRegistry.view<Components::Update>().each())
     {
         if (update.dirtyFrames)
@@ -377,6 +551,114 @@ void Scene::PerformUpdate()
     }
 }
 
+bool Scene::IsRayTracingDataOutdated() const
+{
+    return mRayTracingDataDirty || mRayTracingDataMoved;
+}
+
+Accelerators::TopLevelBVH const& Scene::GetTopLevelBVH() const
+{
+    return mTopLevelBVH;
+}
+
+Systems::TransformHierarchy const& Scene::GetTransformHierarchy() const
+{
+    return mTransformHierarchy;
+}
+
+void Scene::MarkRayTracingDataDirty()
+{
+    mRayTracingDataDirty = true;
+}
+
+void Scene::MarkRayTracingDataMoved()
+{
+    mRayTracingDataMoved = true;
+}
+
+void Scene::UpdateRayTracingData()
+{
+    bool moved = mRayTracingDataMoved.exchange(false);
+    if (mRayTracingDataDirty.exchange(false))
+    {
+        mTransformHierarchy.Build(mRootEntities);
+        mTopLevelBVH.Build(mRegistry, mTransformHierarchy);
+    }
+    else if (moved)
+    {
+        mTransformHierarchy.Update();
+        if (!mTopLevelBVH.Refit(mRegistry, mTransformHierarchy))
+        {
+            mTopLevelBVH.Build(mRegistry, mTransformHierarchy);
+        }
+    }
+}
+
+void Scene::UpdateMeshVertices(Entity* entity, std::vector<Common::VertexPositionNormal> const& vertices)
+{
+    /* Instances share the vertices and the acceleration structure of their source */
+    if (auto* meshInstance = entity->TryGetComponent<Components::MeshInstance>(); meshInstance != nullptr)
+    {
+        entity = mRegistry.get<Components::Base>(meshInstance->source).entityPtr;
+    }
+
+    auto const& mesh = entity->GetComponent<Components::Mesh>();
+    CHECK(vertices.size() == mesh.indices.vertexCount) << "Mesh " << entity->GetComponent<Components::Base>().name << " has "
+        << mesh.indices.vertexCount << " vertices, it can't be updated with " << vertices.size();
+    std::copy(vertices.begin(), vertices.end(), mVertices.begin() + mesh.indices.firstVertex);
+
+    RefitAccelerationStructure(entity);
+}
+
+void Scene::RefitAccelerationStructure(Entity* entity)
+{
+    auto const& mesh = entity->GetComponent<Components::Mesh>();
+    uint32_t* indices = mIndices.data() + mesh.indices.firstIndex;
+    VertexPositionNormal const* vertices = mVertices.data() + mesh.indices.firstVertex;
+
+    /* Kd-trees can't be refitted, so they're always rebuilt */
+    if (entity->TryGetComponent<Components::KdTreeAccelerationStructure>() != nullptr)
+    {
+        auto accelerationInfo = mAccelerationInfos.find(*entity);
+        CHECK(accelerationInfo != mAccelerationInfos.end()) << "Mesh " << entity->GetComponent<Components::Base>().name << " has no acceleration info";
+
+        auto kdTreeAcceleration = Helpers::CreateKdTreeInput(accelerationInfo->second);
+        kdTreeAcceleration.indices.assign(indices, indices + mesh.indices.indexCount);
+        kdTreeAcceleration.vertices.assign(vertices, vertices + mesh.indices.vertexCount);
+
+        auto kdTree = Accelerators::KdTree::Generate(kdTreeAcceleration);
+        entity->PatchComponent<Components::KdTreeAccelerationStructure>([&](Components::KdTreeAccelerationStructure& kdTreeAccelerationStructure)
+        {
+            kdTreeAccelerationStructure = std::move(kdTree);
+        });
+        return;
+    }
+
+    entity->PatchComponent<Components::AccelerationStructure>([&](Components::AccelerationStructure& accelerationStructure)
+    {
+        if (Accelerators::BVH::Refit(accelerationStructure, indices, vertices))
+            return;
+
+        auto accelerationInfo = mAccelerationInfos.find(*entity);
+        CHECK(accelerationInfo != mAccelerationInfos.end()) << "Mesh " << entity->GetComponent<Components::Base>().name << " has no acceleration info";
+
+        auto bvhAcceleration = Helpers::CreateBVHInput(accelerationInfo->second);
+        /* The new indices are written in place, so the rebuild can't create more triangle references than there are */
+        if (bvhAcceleration.splitType == Accelerators::BVH::SplitType::SBVH)
+        {
+            bvhAcceleration.splitType = Accelerators::BVH::SplitType::SAH;
+        }
+        bvhAcceleration.indices.assign(indices, indices + mesh.indices.indexCount);
+        bvhAcceleration.vertices.assign(vertices, vertices + mesh.indices.vertexCount);
+
+        auto output = Accelerators::BVH::Generate(bvhAcceleration);
+        output.accelerationStructure.shouldRender = accelerationStructure.shouldRender;
+        accelerationStructure = std::move(output.accelerationStructure);
+        /* Same triangles in a different order, so the realtime index buffer stays valid */
+        std::copy(output.new_indices.begin(), output.new_indices.end(), indices);
+    });
+}
+
 Entity const* Scene::GetCameraEntity() const
 {
     return mCameraEntity;
@@ -436,6 +718,15 @@ void Scene::CreatePrimitives(std::vector<CreateInfo::Primitive> const& primitive
     CHECK(primitives.size() > 0) << "There must be at least one object to be rendered";
 
     Helpers::ModelLoader loader(this);
+    /* Entity that loads each mesh. Primitives placing a mesh again become instances of it once it's loaded */
+    std::unordered_map<std::string, Entity*> meshSources;
+    struct PendingInstance
+    {
+        Entity* entity;
+        Entity* source;
+        std::shared_ptr<IMaterial> material;
+    };
+    std::vector<PendingInstance> pendingInstances;
     mEntities.reserve(primitives.size());
     mRootEntities.reserve(primitives.size());
     for (uint32_t i = 0; i < primitives.size(); ++i)
@@ -474,11 +765,16 @@ void Scene::CreatePrimitives(std::vector<CreateInfo::Primitive> const& primitive
                 std::string name = Helpers::GetMeshNameFromPath(p.path);
                 if (mMeshIndices.find(name) == mMeshIndices.end())
                 {
+                    mAccelerationInfos[*entity] = p.accelerationInfo;
+                    meshSources[name] = entity;
                     loader.LoadModel(p.path, entity, material, p.accelerationInfo);
                 }
                 else
                 {
-                    CHECK(false) << "Unable to load the same mesh multiple times";
+                    auto source = meshSources.find(name);
+                    CHECK(source != meshSources.end()) << "Mesh " << name << " was not loaded by a primitive, so it can't be instanced";
+                    /* The acceleration structure of the source is shared, so it's built with the settings of the first primitive */
+                    pendingInstances.push_back(PendingInstance{.entity = entity, .source = source->second, .material = material});
                 }
 
                 break;
@@ -487,6 +783,11 @@ void Scene::CreatePrimitives(std::vector<CreateInfo::Primitive> const& primitive
     }
 
     loader.Wait();
+
+    for (auto const& instance : pendingInstances)
+    {
+        AddMeshInstanceComponent(instance.entity, instance.source, instance.material);
+    }
 }
 
 void Scene::CreateRenderingBuffers(Vulkan::CommandList* cmdList, uint32_t cmdBufIndex)
@@ -7,9 +7,12 @@
 
 #include "CreateInfo/SceneCreateInfo.h"
 #include "HitPoint.h"
+#include "RayPacket.h"
 #include "Vertex.h"
 #include "Vulkan/Buffer.h"
 #include "Scene/Components/Mesh.h"
+#include "Scene/Accelerators/TopLevelBVH.h"
+#include "Scene/Systems/TransformHierarchySystem.h"
 #include "Entity.h"
 
 namespace Vulkan
@@ -48,16 +51,27 @@ namespace Common
         Entity* AddNewEntity(bool buildRealtime, Entity* parentEntity = nullptr);
 
         void AddSphereComponent(Entity *entity, bool alsoBuildRealtime, std::shared_ptr<IMaterial> material, Jnrlib::Float radius);
+        /* Places the mesh of source on entity as well, with its own material. Nothing is copied, the two share the mesh */
+        void AddMeshInstanceComponent(Entity* entity, Entity* source, std::shared_ptr<IMaterial> material);
 
     public:
         std::optional<HitPoint> GetClosestHit(Ray&) const;
+        /* Same as GetClosestHit for every ray of the packet. Coherent rays are traced together */
+        void GetClosestHits(RayPacket&) const;
+        /* Whether the ray hits anything before maxT. Meant for shadow rays */
+        bool IsOccluded(Ray const&, Jnrlib::Float maxT) const;
         uint32_t GetNumberOfObjects() const;
         void PerformUpdate();
+        /* Whether the next PerformUpdate rebuilds or refits what rays are traced against */
+        bool IsRayTracingDataOutdated() const;
 
         Entity const* GetCameraEntity() const;
 
         entt::registry& GetRegistry() const;
 
+        Accelerators::TopLevelBVH const& GetTopLevelBVH() const;
+        Systems::TransformHierarchy const& GetTransformHierarchy() const;
+
     public:
         uint32_t AddVertices(std::vector<Common::VertexPositionNormal>&& vertices);
         uint32_t AddIndices(std::vector<uint32_t>&& indices);
@@ -65,11 +79,24 @@ namespace Common
         void AddMeshIndices(std::string const& meshName, Components::Indices const& mesh);
         Components::Indices& GetMeshIndices(std::string const& meshName);
 
+        /* Moves the vertices of the mesh of entity, the triangles stay the same. The BVH of the mesh is refitted, or rebuilt if refitting
+         * degraded it too much; kd-trees are always rebuilt. Rays are traced against the new vertices right away, so nothing may be rendering.
+         * Only the ray tracing data is updated, the realtime buffers keep the vertices they were created with
+         */
+        void UpdateMeshVertices(Entity* entity, std::vector<Common::VertexPositionNormal> const& vertices);
+
     private:
         void CreatePrimitives(std::vector<CreateInfo::Primitive> const& primitives, bool alsoBuildRealtime);
         void CreateRenderingBuffers(Vulkan::CommandList* cmdList, uint32_t cmdBufIndex);
         void CreateCamera(CreateInfo::Camera const& cameraInfo, bool alsoBuildRealtime);
 
+        /* Has to be called after changing the vertices of a mesh */
+        void RefitAccelerationStructure(Entity* entity);
+
+        void MarkRayTracingDataDirty();
+        void MarkRayTracingDataMoved();
+        void UpdateRayTracingData();
+
     private:
         std::string mOutputFile;
         CreateInfo::ImageInfo mImageInfo;
@@ -81,6 +108,15 @@ namespace Common
 
         std::unordered_map<std::string, Components::Indices> mMeshIndices;
 
+        /* Rebuilt in PerformUpdate when an entity is added and refitted when an entity is moved */
+        Systems::TransformHierarchy mTransformHierarchy;
+        Accelerators::TopLevelBVH mTopLevelBVH;
+        std::atomic<bool> mRayTracingDataDirty = true;
+        std::atomic<bool> mRayTracingDataMoved = false;
+
+        /* Settings each mesh BVH was built with, needed to rebuild it */
+        std::unordered_map<entt::entity, CreateInfo::AccelerationStructure> mAccelerationInfos;
+
         bool mGraphicsInitialized = false;
 
         std::unique_ptr<Vulkan::Buffer> mVertexBuffer;
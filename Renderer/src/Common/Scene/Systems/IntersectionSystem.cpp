@@ -1,20 +1,36 @@
 #include "IntersectionSystem.h"
 
 #include "Ray.h"
+#include "RayPacket.h"
 #include "HitPoint.h"
 #include "Scene/Components/Base.h"
 #include "Scene/Components/Sphere.h"
 #include "Scene/Components/Mesh.h"
 #include "Scene/Components/AccelerationStructure.h"
+#include "Scene/Components/KdTreeAccelerationStructure.h"
 #include "Scene/Scene.h"
+#include "Scene/Accelerators/TopLevelBVH.h"
+#include "Scene/Accelerators/TriangleLeaf.h"
+#include "Scene/Accelerators/TraversalStatistics.h"
+#include "Scene/Systems/TransformHierarchySystem.h"
 
 #include "Material/Lambertian.h"
 
-#include <glm/gtx/matrix_decompose.hpp>
+#include "CpuFeatures.h"
+
+/* The AVX node test is compiled whenever SSE is, and only used if the CPU has AVX */
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define WIDE_BVH_SSE
+#define WIDE_BVH_AVX
+#include <immintrin.h>
+#endif
+
+#include <bit>
 
 using namespace Common;
 using namespace Components;
 using namespace Systems;
+using namespace Accelerators;
 using namespace Jnrlib;
 
 /* Helpers */
@@ -23,12 +39,12 @@ inline Float gamma(int n)
     return (n * EPSILON) / (1 - n * EPSILON);
 }
 
-static std::optional<HitPoint> RaySphereIntersection(Ray& r, Base const& base, Sphere const& s)
+/* Distance to the sphere, without building a HitPoint */
+static bool FindSphereHit(Ray const& r, Position const& center, Float radius, Float& intersectionPoint)
 {
     /* sphere = (x-pos.x)^2 + (y-pos.y)^2 + (z-pos.z)^2 - radius^2 = 0
      * ray = o + t * d
      */
-    Float radius = s.radius;
     Float ox = r.origin.x;
     Float oy = r.origin.y;
     Float oz = r.origin.z;
@@ -38,19 +54,18 @@ static std::optional<HitPoint> RaySphereIntersection(Ray& r, Base const& base, S
     Float dz = r.direction.z;
 
     /* Extracing the components for the equation ax^2 + bx + c = 0 */
-    Float lx = ox;
-    Float ly = oy;
-    Float lz = oz;
+    Float lx = ox - center.x;
+    Float ly = oy - center.y;
+    Float lz = oz - center.z;
 
     Float a = dx * dx + dy * dy + dz * dz;
     Float b = 2 * (dx * lx + dy * ly + dz * lz);
-    Float c = lx * lx + ly * ly + lz * lz - s.radius * s.radius;
+    Float c = lx * lx + ly * ly + lz * lz - radius * radius;
 
     Float t1, t2;
     if (!Quadratic(a, b, c, &t1, &t2))
-        return std::nullopt;
+        return false;
 
-    Float intersectionPoint;
     if (t1 >= 0.0)
     {
         intersectionPoint = t1;
@@ -61,21 +76,16 @@ static std::optional<HitPoint> RaySphereIntersection(Ray& r, Base const& base, S
     }
     else
     {
-        return std::nullopt;
+        return false;
     }
 
-    Jnrlib::Vec3 scale;
-    Jnrlib::Quaternion rotation;
-    Jnrlib::Position translation;
-    Jnrlib::Vec3 skew;
-    Jnrlib::Vec4 perspective;
-    glm::decompose(base.world, scale, rotation, translation, skew, perspective);
-
-    Position hitPosition = r.At(t1);
-    Direction normal = glm::normalize(hitPosition - translation);
+    return !(fabs(intersectionPoint) < EPSILON || intersectionPoint > r.maxT);
+}
 
-    if (fabs(intersectionPoint) < EPSILON || intersectionPoint > r.maxT)
-        return std::nullopt;
+static HitPoint CreateSphereHitPoint(Ray& r, Position const& center, Float intersectionPoint, Sphere const& s)
+{
+    Position hitPosition = r.At(intersectionPoint);
+    Direction normal = glm::normalize(hitPosition - center);
 
     r.maxT = intersectionPoint;
 
@@ -99,6 +109,16 @@ static std::optional<HitPoint> RaySphereIntersection(Ray& r, Base const& base, S
     return hp;
 }
 
+static std::optional<HitPoint> RaySphereIntersection(Ray& r, Sphere const& s)
+{
+    /* The ray is in object space, so the sphere is centered in the origin */
+    Float intersectionPoint;
+    if (!FindSphereHit(r, Position(Zero), s.radius, intersectionPoint))
+        return std::nullopt;
+
+    return CreateSphereHitPoint(r, Position(Zero), intersectionPoint, s);
+}
+
 static bool RayAABBIntersectionSlow(Ray const& r, BoundingBox const& b, Float* hitt0 = nullptr, Float* hitt1 = nullptr)
 {
     /* Check intersection with the 6 planes that define the AABB
@@ -302,25 +322,136 @@ static std::optional<HitPoint> RayMeshIntersectionSlow(Ray& r, Base const& base,
     return hp;
 }
 
-static std::optional<HitPoint> RayMeshIntersectionFast(Ray &r, Base const& base, Mesh const& mesh, AccelerationStructure const& accelStructure, Scene const* scene)
+/* Where the leaf tests read the triangles of a mesh from */
+struct LeafTriangles
 {
-    if (accelStructure.nodes.empty())
-        return std::nullopt;
+    uint32_t const* indices;
+    VertexPositionNormal const* vertices;
+    /* Triangles in edge form, if the acceleration structure stores them. Used instead of indices and vertices */
+    float const* precomputed;
+};
+
+static LeafTriangles GetLeafTriangles(Mesh const& mesh, AccelerationStructure const& accelStructure, Scene const* scene)
+{
+    LeafTriangles triangles{};
+    triangles.indices = scene->GetIndices().data() + mesh.indices.firstIndex;
+    triangles.vertices = scene->GetVertices().data() + mesh.indices.firstVertex;
+    triangles.precomputed = accelStructure.precomputedTriangles.empty() ? nullptr : accelStructure.precomputedTriangles.data();
+    return triangles;
+}
+
+/* Float might be a double with a maxT out of the range of a float */
+static float ToSinglePrecisionT(Float t)
+{
+    return (float)std::min(t, (Float)std::numeric_limits<float>::max());
+}
+
+/* Moller-Trumbore against the precomputed triangles of a leaf, 4 or 8 at a time if the CPU can. A lot cheaper than RayTriangleIntersection,
+ * as the edges are already there and there's no per-triangle transform, but it's not watertight: rays going exactly through a shared edge
+ * might miss both triangles
+ */
+static bool RayPrecomputedLeafIntersection(Ray& r, float const* precomputed, uint32_t primitiveOffset, uint32_t primitiveCount,
+                                           uint32_t& hitPrimitive, Float hitBarycentrics[3])
+{
+    TriangleLeaf::LeafRay ray{
+        .origin = {(float)r.origin.x, (float)r.origin.y, (float)r.origin.z},
+        .direction = {(float)r.direction.x, (float)r.direction.y, (float)r.direction.z},
+        .maxT = ToSinglePrecisionT(r.maxT),
+    };
+    TriangleLeaf::LeafHit hit;
+    if (!TriangleLeaf::Intersect(ray, precomputed + primitiveOffset * PRECOMPUTED_TRIANGLE_FLOATS, primitiveCount, hit))
+        return false;
+
+    r.maxT = ray.maxT;
+    hitPrimitive = primitiveOffset + hit.index;
+    hitBarycentrics[0] = 1 - hit.u - hit.v;
+    hitBarycentrics[1] = hit.u;
+    hitBarycentrics[2] = hit.v;
+    return true;
+}
+
+/* With AnyHit it returns on the first triangle that was hit, which isn't necessarily the closest one */
+template <bool AnyHit = false>
+static bool RayLeafIntersection(Ray& r, LeafTriangles const& triangles, uint32_t primitiveOffset, uint32_t primitiveCount,
+                                uint32_t& hitPrimitive, Float hitBarycentrics[3])
+{
+    COUNT_TRAVERSAL(trianglesTested, primitiveCount);
+    if (triangles.precomputed != nullptr)
+        return RayPrecomputedLeafIntersection(r, triangles.precomputed, primitiveOffset, primitiveCount, hitPrimitive, hitBarycentrics);
 
+    bool hit = false;
+    for (uint32_t i = 0; i < primitiveCount; ++i)
+    {
+        uint32_t first = (primitiveOffset + i) * 3;
+        glm::vec3 p0 = triangles.vertices[triangles.indices[first + 0]].position;
+        glm::vec3 p1 = triangles.vertices[triangles.indices[first + 1]].position;
+        glm::vec3 p2 = triangles.vertices[triangles.indices[first + 2]].position;
+
+        Float barycentrics[3]{};
+        float t;
+        if (RayTriangleIntersection(r, p0, p1, p2, &t, barycentrics))
+        {
+            r.maxT = t;
+            hit = true;
+            hitPrimitive = primitiveOffset + i;
+            memcpy_s(hitBarycentrics, sizeof(Float) * 3, barycentrics, sizeof(barycentrics));
+            if constexpr (AnyHit)
+                return true;
+        }
+    }
+    return hit;
+}
+
+static HitPoint CreateMeshHitPoint(Ray const& r, Base const& base, Mesh const& mesh, Scene const* scene, uint32_t hitPrimitive, Float const hitBarycentrics[3])
+{
     auto const& indices = scene->GetIndices();
     auto const& vertices = scene->GetVertices();
 
+    HitPoint hp{};
+    hp.SetEntity(base.entityPtr);
+    hp.SetIntersectionPoint(r.maxT);
+    hp.SetMaterial(mesh.material);
+
+    auto index0 = mesh.indices.firstIndex + hitPrimitive * 3 + 0;
+    auto index1 = mesh.indices.firstIndex + hitPrimitive * 3 + 1;
+    auto index2 = mesh.indices.firstIndex + hitPrimitive * 3 + 2;
+
+    auto& v0 = vertices[mesh.indices.firstVertex + indices[index0]];
+    auto& v1 = vertices[mesh.indices.firstVertex + indices[index1]];
+    auto& v2 = vertices[mesh.indices.firstVertex + indices[index2]];
+
+
+    auto normal = v0.normal * hitBarycentrics[0] + v1.normal * hitBarycentrics[1] + v2.normal * hitBarycentrics[2];
+    {
+        /* We're hitting the sphere in the front */
+        hp.SetNormal(normal);
+        hp.SetFrontFace(true);
+    }
+    return hp;
+}
+
+/* The mesh traversals below write the triangle that was hit and its barycentrics, and leave r.maxT at its distance. With AnyHit they stop
+ * at the first triangle that was hit, which is enough for occlusion queries
+ */
+template <bool AnyHit>
+static bool FindMeshHitFast(Ray& r, Mesh const& mesh, AccelerationStructure const& accelStructure, Scene const* scene,
+                            uint32_t& hitPrimitive, Float hitBarycentrics[3])
+{
+    if (accelStructure.nodes.empty())
+        return false;
+
+    LeafTriangles triangles = GetLeafTriangles(mesh, accelStructure, scene);
+
     Direction invDir = One / r.direction;
     int isDirNeg[3] = {r.direction.x < 0, r.direction.y < 0, r.direction.z < 0};
 
     int toVisitOffset = 0;
     int currentNodeIndex = 0;
     int nodesToVisit[64] = {};
-    const Common::Components::LinearBVHNode* hitNode = nullptr;
-    uint32_t hitPrimitve = -1;
-    Float hitBarycentrics[3]{};
+    bool hit = false;
     while (true)
     {
+        COUNT_TRAVERSAL(nodesVisited, 1);
         const Common::Components::LinearBVHNode* node = &accelStructure.nodes[currentNodeIndex];
         auto bounds = node->bounds;
         if (RayAABBIntersectionFast(r, bounds, invDir, isDirNeg))
@@ -328,27 +459,8 @@ static std::optional<HitPoint> RayMeshIntersectionFast(Ray &r, Base const& base,
             if (node->primitiveCount)
             {
                 /* Should check against each primitive */
-                for (uint32_t i = 0; i < node->primitiveCount; ++i)
-                {
-                    auto index0 = mesh.indices.firstIndex + (node->primitiveOffset + i) * 3 + 0;
-                    auto index1 = mesh.indices.firstIndex + (node->primitiveOffset + i) * 3 + 1;
-                    auto index2 = mesh.indices.firstIndex + (node->primitiveOffset + i) * 3 + 2;
-
-                    glm::vec3 p0 = vertices[mesh.indices.firstVertex + indices[index0]].position;
-                    glm::vec3 p1 = vertices[mesh.indices.firstVertex + indices[index1]].position;
-                    glm::vec3 p2 = vertices[mesh.indices.firstVertex + indices[index2]].position;
-
-                    Float barycentrics[3]{};
-                    float t;
-                    if (RayTriangleIntersection(r, p0, p1, p2, &t, barycentrics))
-                    {
-                        r.maxT = t;
-                        hitNode = node;
-                        hitPrimitve = i;
-                        memcpy_s(hitBarycentrics, sizeof(hitBarycentrics), barycentrics, sizeof(barycentrics));
-                    }
-                }
-                if (toVisitOffset == 0)
+                hit |= RayLeafIntersection<AnyHit>(r, triangles, node->primitiveOffset, node->primitiveCount, hitPrimitive, hitBarycentrics);
+                if ((AnyHit && hit) || toVisitOffset == 0)
                     break;
                 currentNodeIndex = nodesToVisit[--toVisitOffset];
             }
@@ -373,32 +485,468 @@ static std::optional<HitPoint> RayMeshIntersectionFast(Ray &r, Base const& base,
             currentNodeIndex = nodesToVisit[--toVisitOffset];
         }
     }
+    return hit;
+}
 
-    if (hitNode)
+struct SinglePrecisionRay
+{
+    float origin[3];
+    float invDir[3];
+    int dirIsNeg[3];
+};
+
+#if defined(WIDE_BVH_AVX)
+/* One slab test for all the children of an 8 wide node. Only called if the CPU has AVX */
+TARGET_AVX static uint32_t RayWide8NodeIntersectionAVX(WideBVHNode<8> const& node, SinglePrecisionRay const& ray, float maxT, float tNear[8])
+{
+    float const* nearX = ray.dirIsNeg[0] ? node.maxX : node.minX;
+    float const* nearY = ray.dirIsNeg[1] ? node.maxY : node.minY;
+    float const* nearZ = ray.dirIsNeg[2] ? node.maxZ : node.minZ;
+    float const* farX = ray.dirIsNeg[0] ? node.minX : node.maxX;
+    float const* farY = ray.dirIsNeg[1] ? node.minY : node.maxY;
+    float const* farZ = ray.dirIsNeg[2] ? node.minZ : node.maxZ;
+    const float robustFactor = (float)(1 + 2 * gamma(3));
+
+    __m256 originX = _mm256_set1_ps(ray.origin[0]);
+    __m256 originY = _mm256_set1_ps(ray.origin[1]);
+    __m256 originZ = _mm256_set1_ps(ray.origin[2]);
+    __m256 invDirX = _mm256_set1_ps(ray.invDir[0]);
+    __m256 invDirY = _mm256_set1_ps(ray.invDir[1]);
+    __m256 invDirZ = _mm256_set1_ps(ray.invDir[2]);
+
+    __m256 txMin = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(nearX), originX), invDirX);
+    __m256 tyMin = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(nearY), originY), invDirY);
+    __m256 tzMin = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(nearZ), originZ), invDirZ);
+    __m256 txMax = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(farX), originX), invDirX);
+    __m256 tyMax = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(farY), originY), invDirY);
+    __m256 tzMax = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(farZ), originZ), invDirZ);
+
+    /* The accumulator is always the second operand: min / max return it when the other one is a NaN (0 * inf) */
+    __m256 tMin = _mm256_max_ps(txMin, _mm256_max_ps(tyMin, _mm256_max_ps(tzMin, _mm256_setzero_ps())));
+    __m256 tMax = _mm256_min_ps(txMax, _mm256_min_ps(tyMax, _mm256_min_ps(tzMax, _mm256_set1_ps(std::numeric_limits<float>::infinity()))));
+    tMax = _mm256_mul_ps(tMax, _mm256_set1_ps(robustFactor));
+
+    __m256 hit = _mm256_and_ps(_mm256_cmp_ps(tMin, tMax, _CMP_LE_OQ), _mm256_cmp_ps(tMin, _mm256_set1_ps(maxT), _CMP_LT_OQ));
+    _mm256_storeu_ps(tNear, tMin);
+    return (uint32_t)_mm256_movemask_ps(hit);
+}
+
+static bool HasAVX()
+{
+    static bool const hasAVX = GetCpuFeatures().avx;
+    return hasAVX;
+}
+#endif
+
+/* Slab test against all the children of a wide node. Returns a bitmask of the children that were hit and writes their entry distance in tNear */
+template <uint32_t Width>
+static uint32_t RayWideNodeIntersection(WideBVHNode<Width> const& node, SinglePrecisionRay const& ray, float maxT, float tNear[Width])
+{
+#if defined(WIDE_BVH_AVX)
+    if constexpr (Width == 8)
     {
-        HitPoint hp{};
-        hp.SetEntity(base.entityPtr);
-        hp.SetIntersectionPoint(r.maxT);
-        hp.SetMaterial(mesh.material);
+        if (HasAVX())
+            return RayWide8NodeIntersectionAVX(node, ray, maxT, tNear);
+    }
+#endif
+
+    /* The near plane is the min plane, unless the ray goes in the negative direction */
+    float const* nearX = ray.dirIsNeg[0] ? node.maxX : node.minX;
+    float const* nearY = ray.dirIsNeg[1] ? node.maxY : node.minY;
+    float const* nearZ = ray.dirIsNeg[2] ? node.maxZ : node.minZ;
+    float const* farX = ray.dirIsNeg[0] ? node.minX : node.maxX;
+    float const* farY = ray.dirIsNeg[1] ? node.minY : node.maxY;
+    float const* farZ = ray.dirIsNeg[2] ? node.minZ : node.maxZ;
+    const float robustFactor = (float)(1 + 2 * gamma(3));
+
+#if defined(WIDE_BVH_SSE)
+    {
+        __m128 originX = _mm_set1_ps(ray.origin[0]);
+        __m128 originY = _mm_set1_ps(ray.origin[1]);
+        __m128 originZ = _mm_set1_ps(ray.origin[2]);
+        __m128 invDirX = _mm_set1_ps(ray.invDir[0]);
+        __m128 invDirY = _mm_set1_ps(ray.invDir[1]);
+        __m128 invDirZ = _mm_set1_ps(ray.invDir[2]);
+        __m128 robust = _mm_set1_ps(robustFactor);
+        __m128 rayMaxT = _mm_set1_ps(maxT);
+        __m128 infinity = _mm_set1_ps(std::numeric_limits<float>::infinity());
+
+        uint32_t mask = 0;
+        /* Without AVX an 8 wide node is tested as two halves */
+        for (uint32_t i = 0; i < Width; i += 4)
+        {
+            __m128 txMin = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(nearX + i), originX), invDirX);
+            __m128 tyMin = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(nearY + i), originY), invDirY);
+            __m128 tzMin = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(nearZ + i), originZ), invDirZ);
+            __m128 txMax = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(farX + i), originX), invDirX);
+            __m128 tyMax = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(farY + i), originY), invDirY);
+            __m128 tzMax = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(farZ + i), originZ), invDirZ);
+
+            /* The accumulator is always the second operand: min / max return it when the other one is a NaN (0 * inf) */
+            __m128 tMin = _mm_max_ps(txMin, _mm_max_ps(tyMin, _mm_max_ps(tzMin, _mm_setzero_ps())));
+            __m128 tMax = _mm_min_ps(txMax, _mm_min_ps(tyMax, _mm_min_ps(tzMax, infinity)));
+            tMax = _mm_mul_ps(tMax, robust);
+
+            __m128 hit = _mm_and_ps(_mm_cmple_ps(tMin, tMax), _mm_cmplt_ps(tMin, rayMaxT));
+            _mm_storeu_ps(tNear + i, tMin);
+            mask |= (uint32_t)_mm_movemask_ps(hit) << i;
+        }
+        return mask;
+    }
+#else
+    {
+        uint32_t mask = 0;
+        for (uint32_t i = 0; i < Width; ++i)
+        {
+            float const nearT[3] = {(nearX[i] - ray.origin[0]) * ray.invDir[0], (nearY[i] - ray.origin[1]) * ray.invDir[1], (nearZ[i] - ray.origin[2]) * ray.invDir[2]};
+            float const farT[3] = {(farX[i] - ray.origin[0]) * ray.invDir[0], (farY[i] - ray.origin[1]) * ray.invDir[1], (farZ[i] - ray.origin[2]) * ray.invDir[2]};
+            float tMin = 0.0f;
+            float tMax = std::numeric_limits<float>::infinity();
+            for (uint32_t axis = 0; axis < 3; ++axis)
+            {
+                /* Written so a NaN plane (0 * inf) doesn't change the interval */
+                tMin = nearT[axis] > tMin ? nearT[axis] : tMin;
+                tMax = farT[axis] < tMax ? farT[axis] : tMax;
+            }
+            tMax *= robustFactor;
+            tNear[i] = tMin;
+            if (tMin <= tMax && tMin < maxT)
+                mask |= 1 << i;
+        }
+        return mask;
+    }
+#endif
+}
+
+static bool RayBoxIntersection(SinglePrecisionRay const& ray, float const boxMin[3], float const boxMax[3], float maxT, float& tNear)
+{
+    const float robustFactor = (float)(1 + 2 * gamma(3));
+    float tMin = 0.0f;
+    float tMax = maxT;
+    for (uint32_t axis = 0; axis < 3; ++axis)
+    {
+        float tNearPlane = ((ray.dirIsNeg[axis] ? boxMax[axis] : boxMin[axis]) - ray.origin[axis]) * ray.invDir[axis];
+        float tFarPlane = ((ray.dirIsNeg[axis] ? boxMin[axis] : boxMax[axis]) - ray.origin[axis]) * ray.invDir[axis];
+        tFarPlane *= robustFactor;
+        /* Written so a NaN plane (0 * inf) doesn't change the interval */
+        tMin = tNearPlane > tMin ? tNearPlane : tMin;
+        tMax = tFarPlane < tMax ? tFarPlane : tMax;
+        if (tMin > tMax)
+            return false;
+    }
+    tNear = tMin;
+    return true;
+}
+
+template <bool AnyHit, uint32_t Width>
+static bool FindMeshHitWide(Ray& r, Mesh const& mesh, AccelerationStructure const& accelStructure, std::vector<WideBVHNode<Width>> const& nodes,
+                            Scene const* scene, uint32_t& hitPrimitive, Float hitBarycentrics[3])
+{
+    using Node = WideBVHNode<Width>;
+
+    LeafTriangles triangles = GetLeafTriangles(mesh, accelStructure, scene);
 
-        auto index0 = mesh.indices.firstIndex + (hitNode->primitiveOffset + hitPrimitve) * 3 + 0;
-        auto index1 = mesh.indices.firstIndex + (hitNode->primitiveOffset + hitPrimitve) * 3 + 1;
-        auto index2 = mesh.indices.firstIndex + (hitNode->primitiveOffset + hitPrimitve) * 3 + 2;
+    SinglePrecisionRay singlePrecisionRay;
+    for (uint32_t i = 0; i < 3; ++i)
+    {
+        singlePrecisionRay.origin[i] = (float)r.origin[i];
+        singlePrecisionRay.invDir[i] = (float)(One / r.direction[i]);
+        singlePrecisionRay.dirIsNeg[i] = r.direction[i] < 0;
+    }
 
-        auto& v0 = vertices[mesh.indices.firstVertex + indices[index0]];
-        auto& v1 = vertices[mesh.indices.firstVertex + indices[index1]];
-        auto& v2 = vertices[mesh.indices.firstVertex + indices[index2]];
+    struct NodeToVisit
+    {
+        uint32_t offset;
+        uint32_t primitiveCount;
+        float tNear;
+    };
+    /* Every visited node pushes at most Width - 1 entries more than it pops */
+    NodeToVisit nodesToVisit[64 * Width];
+    int toVisitOffset = 0;
+    nodesToVisit[toVisitOffset++] = NodeToVisit{0, Node::INTERIOR_CHILD, 0.0f};
 
+    bool hit = false;
+    while (toVisitOffset > 0)
+    {
+        NodeToVisit current = nodesToVisit[--toVisitOffset];
+        /* A closer hit was found after this node was pushed */
+        if (current.tNear > r.maxT)
+            continue;
 
-        auto normal = v0.normal * hitBarycentrics[0] + v1.normal * hitBarycentrics[1] + v2.normal * hitBarycentrics[2];
+        if (current.primitiveCount != Node::INTERIOR_CHILD)
         {
-            /* We're hitting the sphere in the front */
-            hp.SetNormal(normal);
-            hp.SetFrontFace(true);
+            hit |= RayLeafIntersection<AnyHit>(r, triangles, current.offset, current.primitiveCount, hitPrimitive, hitBarycentrics);
+            if (AnyHit && hit)
+                break;
+            continue;
+        }
+
+        COUNT_TRAVERSAL(nodesVisited, 1);
+        Node const& node = nodes[current.offset];
+        float tNear[Width];
+        uint32_t hitMask = RayWideNodeIntersection(node, singlePrecisionRay, (float)r.maxT, tNear);
+        if (hitMask == 0)
+            continue;
+
+        /* Sort the children that were hit from far to near, so the nearest one is popped first */
+        NodeToVisit children[Width];
+        uint32_t childCount = 0;
+        for (uint32_t i = 0; i < Width; ++i)
+        {
+            if (!(hitMask & (1 << i)))
+                continue;
+
+            NodeToVisit child{node.childOffset[i], node.primitiveCount[i], tNear[i]};
+            uint32_t j = childCount++;
+            while (j > 0 && children[j - 1].tNear < child.tNear)
+            {
+                children[j] = children[j - 1];
+                j--;
+            }
+            children[j] = child;
+        }
+
+        for (uint32_t i = 0; i < childCount; ++i)
+        {
+            nodesToVisit[toVisitOffset++] = children[i];
+        }
+    }
+    return hit;
+}
+
+template <bool AnyHit, typename T>
+static bool FindMeshHitQuantized(Ray& r, Mesh const& mesh, AccelerationStructure const& accelStructure, std::vector<QuantizedBVHNode<T>> const& nodes,
+                                 Scene const* scene, uint32_t& hitPrimitive, Float hitBarycentrics[3])
+{
+    using Node = QuantizedBVHNode<T>;
+
+    LeafTriangles triangles = GetLeafTriangles(mesh, accelStructure, scene);
+
+    SinglePrecisionRay singlePrecisionRay;
+    for (uint32_t i = 0; i < 3; ++i)
+    {
+        singlePrecisionRay.origin[i] = (float)r.origin[i];
+        singlePrecisionRay.invDir[i] = (float)(One / r.direction[i]);
+        singlePrecisionRay.dirIsNeg[i] = r.direction[i] < 0;
+    }
+
+    /* The decoded box of an interior node travels with it, as its children are stored relative to it */
+    struct NodeToVisit
+    {
+        uint32_t offset;
+        uint32_t primitiveCount;
+        float tNear;
+        float boundsMin[3];
+        float boundsMax[3];
+    };
+    NodeToVisit nodesToVisit[64];
+    int toVisitOffset = 0;
+
+    NodeToVisit& root = nodesToVisit[toVisitOffset++];
+    root = NodeToVisit{0, Node::INTERIOR_CHILD, 0.0f};
+    memcpy(root.boundsMin, accelStructure.quantizedRootMin, sizeof(root.boundsMin));
+    memcpy(root.boundsMax, accelStructure.quantizedRootMax, sizeof(root.boundsMax));
+
+    bool hit = false;
+    while (toVisitOffset > 0)
+    {
+        NodeToVisit current = nodesToVisit[--toVisitOffset];
+        /* A closer hit was found after this node was pushed */
+        if (current.tNear > r.maxT)
+            continue;
+
+        if (current.primitiveCount != Node::INTERIOR_CHILD)
+        {
+            hit |= RayLeafIntersection<AnyHit>(r, triangles, current.offset, current.primitiveCount, hitPrimitive, hitBarycentrics);
+            if (AnyHit && hit)
+                break;
+            continue;
+        }
+
+        COUNT_TRAVERSAL(nodesVisited, 1);
+        Node const& node = nodes[current.offset];
+        NodeToVisit children[2];
+        uint32_t childCount = 0;
+        for (uint32_t i = 0; i < 2; ++i)
+        {
+            if (node.primitiveCount[i] == Node::EMPTY_CHILD)
+                continue;
+
+            NodeToVisit& child = children[childCount];
+            DequantizeChildBounds(node, i, current.boundsMin, current.boundsMax, child.boundsMin, child.boundsMax);
+            if (RayBoxIntersection(singlePrecisionRay, child.boundsMin, child.boundsMax, (float)r.maxT, child.tNear))
+            {
+                child.offset = node.childOffset[i];
+                child.primitiveCount = node.primitiveCount[i];
+                childCount++;
+            }
+        }
+
+        /* Push the far child first, so the near one is popped first */
+        if (childCount == 2 && children[0].tNear < children[1].tNear)
+        {
+            std::swap(children[0], children[1]);
+        }
+        for (uint32_t i = 0; i < childCount; ++i)
+        {
+            nodesToVisit[toVisitOffset++] = children[i];
         }
-        return hp;
     }
-    return std::nullopt;
+    return hit;
+}
+
+/* Whether RayMeshIntersection traverses the binary nodes of the BVH */
+static bool UsesLinearNodes(AccelerationStructure const& accelStructure)
+{
+    if (accelStructure.width == 4 && !accelStructure.nodes4.empty())
+        return false;
+    if (accelStructure.width == 8 && !accelStructure.nodes8.empty())
+        return false;
+    return accelStructure.quantizedNodes8.empty() && accelStructure.quantizedNodes16.empty();
+}
+
+template <bool AnyHit>
+static bool FindMeshHit(Ray& r, Mesh const& mesh, AccelerationStructure const& accelStructure, Scene const* scene,
+                        uint32_t& hitPrimitive, Float hitBarycentrics[3])
+{
+    if (accelStructure.width == 4 && !accelStructure.nodes4.empty())
+    {
+        return FindMeshHitWide<AnyHit>(r, mesh, accelStructure, accelStructure.nodes4, scene, hitPrimitive, hitBarycentrics);
+    }
+    else if (accelStructure.width == 8 && !accelStructure.nodes8.empty())
+    {
+        return FindMeshHitWide<AnyHit>(r, mesh, accelStructure, accelStructure.nodes8, scene, hitPrimitive, hitBarycentrics);
+    }
+    else if (!accelStructure.quantizedNodes8.empty())
+    {
+        return FindMeshHitQuantized<AnyHit>(r, mesh, accelStructure, accelStructure.quantizedNodes8, scene, hitPrimitive, hitBarycentrics);
+    }
+    else if (!accelStructure.quantizedNodes16.empty())
+    {
+        return FindMeshHitQuantized<AnyHit>(r, mesh, accelStructure, accelStructure.quantizedNodes16, scene, hitPrimitive, hitBarycentrics);
+    }
+    return FindMeshHitFast<AnyHit>(r, mesh, accelStructure, scene, hitPrimitive, hitBarycentrics);
+}
+
+static std::optional<HitPoint> RayMeshIntersection(Ray& r, Base const& base, Mesh const& mesh, AccelerationStructure const& accelStructure, Scene const* scene)
+{
+    uint32_t hitPrimitive = -1;
+    Float hitBarycentrics[3]{};
+    if (!FindMeshHit<false>(r, mesh, accelStructure, scene, hitPrimitive, hitBarycentrics))
+        return std::nullopt;
+    return CreateMeshHitPoint(r, base, mesh, scene, hitPrimitive, hitBarycentrics);
+}
+
+static bool RayMeshOccluded(Ray& r, Mesh const& mesh, AccelerationStructure const& accelStructure, Scene const* scene)
+{
+    uint32_t hitPrimitive;
+    Float hitBarycentrics[3];
+    return FindMeshHit<true>(r, mesh, accelStructure, scene, hitPrimitive, hitBarycentrics);
+}
+
+template <bool AnyHit>
+static bool FindMeshHitKdTree(Ray& r, Mesh const& mesh, KdTreeAccelerationStructure const& kdTree, Scene const* scene,
+                              uint32_t& hitPrimitive, Float hitBarycentrics[3])
+{
+    Float tMin, tMax;
+    if (kdTree.nodes.empty() || !RayAABBIntersectionSlow(r, kdTree.bounds, &tMin, &tMax))
+        return false;
+
+    uint32_t const* indices = scene->GetIndices().data() + mesh.indices.firstIndex;
+    VertexPositionNormal const* vertices = scene->GetVertices().data() + mesh.indices.firstVertex;
+
+    Direction invDir = One / r.direction;
+
+    struct NodeToVisit
+    {
+        uint32_t node;
+        Float tMin, tMax;
+    };
+    NodeToVisit nodesToVisit[KdTreeAccelerationStructure::MAX_DEPTH];
+    int toVisitOffset = 0;
+
+    bool hit = false;
+    uint32_t currentNodeIndex = 0;
+    while (true)
+    {
+        /* The closest hit so far is in front of this node */
+        if (r.maxT < tMin)
+            break;
+
+        COUNT_TRAVERSAL(nodesVisited, 1);
+        KdTreeNode const& node = kdTree.nodes[currentNodeIndex];
+        if (!node.IsLeaf())
+        {
+            uint32_t axis = node.GetSplitAxis();
+            Float tPlane = (node.split - r.origin[axis]) * invDir[axis];
+
+            /* Visit the child the ray starts in first */
+            bool belowFirst = (r.origin[axis] < node.split) || (r.origin[axis] == node.split && r.direction[axis] <= 0);
+            uint32_t firstChild = belowFirst ? currentNodeIndex + 1 : node.GetAboveChild();
+            uint32_t secondChild = belowFirst ? node.GetAboveChild() : currentNodeIndex + 1;
+
+            if (tPlane > tMax || tPlane <= 0)
+            {
+                currentNodeIndex = firstChild;
+            }
+            else if (tPlane < tMin)
+            {
+                currentNodeIndex = secondChild;
+            }
+            else
+            {
+                nodesToVisit[toVisitOffset++] = NodeToVisit{secondChild, tPlane, tMax};
+                currentNodeIndex = firstChild;
+                tMax = tPlane;
+            }
+            continue;
+        }
+
+        COUNT_TRAVERSAL(trianglesTested, node.GetPrimitiveCount());
+        for (uint32_t i = 0; i < node.GetPrimitiveCount(); ++i)
+        {
+            uint32_t primitive = kdTree.primitiveIndices[node.primitiveOffset + i];
+            glm::vec3 p0 = vertices[indices[primitive * 3 + 0]].position;
+            glm::vec3 p1 = vertices[indices[primitive * 3 + 1]].position;
+            glm::vec3 p2 = vertices[indices[primitive * 3 + 2]].position;
+
+            Float barycentrics[3]{};
+            float t;
+            if (RayTriangleIntersection(r, p0, p1, p2, &t, barycentrics))
+            {
+                r.maxT = t;
+                hit = true;
+                hitPrimitive = primitive;
+                memcpy_s(hitBarycentrics, sizeof(Float) * 3, barycentrics, sizeof(barycentrics));
+                if constexpr (AnyHit)
+                    return true;
+            }
+        }
+
+        if (toVisitOffset == 0)
+            break;
+        toVisitOffset--;
+        currentNodeIndex = nodesToVisit[toVisitOffset].node;
+        tMin = nodesToVisit[toVisitOffset].tMin;
+        tMax = nodesToVisit[toVisitOffset].tMax;
+    }
+    return hit;
+}
+
+static std::optional<HitPoint> RayMeshIntersectionKdTree(Ray& r, Base const& base, Mesh const& mesh, KdTreeAccelerationStructure const& kdTree, Scene const* scene)
+{
+    uint32_t hitPrimitive = -1;
+    Float hitBarycentrics[3]{};
+    if (!FindMeshHitKdTree<false>(r, mesh, kdTree, scene, hitPrimitive, hitBarycentrics))
+        return std::nullopt;
+    return CreateMeshHitPoint(r, base, mesh, scene, hitPrimitive, hitBarycentrics);
+}
+
+static bool RayMeshOccludedKdTree(Ray& r, Mesh const& mesh, KdTreeAccelerationStructure const& kdTree, Scene const* scene)
+{
+    uint32_t hitPrimitive;
+    Float hitBarycentrics[3];
+    return FindMeshHitKdTree<true>(r, mesh, kdTree, scene, hitPrimitive, hitBarycentrics);
 }
 
 Intersection::Intersection()
@@ -407,73 +955,690 @@ Intersection::Intersection()
 Intersection::~Intersection()
 { }
 
+/* Moves a hit found in the local space of an instance to world space */
+static void FinishInstanceHit(Ray& r, Ray const& localSpaceRay, HitPoint& hp, TopLevelBVH::Instance const& instance, WorldTransform const& transform)
+{
+    /* Normals are transformed by the inverse transpose, which keeps them perpendicular to the surface under non-uniform scaling */
+    hp.SetNormal(glm::normalize(glm::transpose(Matrix3x3(transform.inverseWorld)) * hp.GetNormal()));
+    hp.SetEntity(instance.entityPtr);
+    /* The local ray is normalized, so its t has to be scaled back to the units of the world ray */
+    Float worldT = localSpaceRay.maxT / r.TransformedLength(transform.inverseWorld);
+    hp.SetIntersectionPoint(worldT);
+    r.maxT = worldT;
+}
+
+static std::optional<HitPoint> RayInstanceIntersection(Ray& r, entt::registry& objects, TopLevelBVH::Instance const& instance, Scene const* scene)
+{
+    if (instance.type == TopLevelBVH::InstanceType::WorldSphere)
+    {
+        Float t;
+        if (!FindSphereHit(r, instance.worldCenter, instance.worldRadius, t))
+            return std::nullopt;
+
+        /* The sphere component is only fetched for the spheres that were hit */
+        HitPoint hp = CreateSphereHitPoint(r, instance.worldCenter, t, objects.get<const Sphere>(instance.entity));
+        hp.SetEntity(instance.entityPtr);
+        return hp;
+    }
+
+    auto const& transform = scene->GetTransformHierarchy().Get(instance.transformIndex);
+    auto localSpaceRay = r.TransformedRay(transform.inverseWorld);
+    std::optional<HitPoint> hp;
+    switch (instance.type)
+    {
+        case TopLevelBVH::InstanceType::Sphere:
+        {
+            auto const& sphere = objects.get<const Sphere>(instance.entity);
+            hp = RaySphereIntersection(localSpaceRay, sphere);
+            break;
+        }
+        case TopLevelBVH::InstanceType::WorldSphere:
+            break;
+        case TopLevelBVH::InstanceType::Mesh:
+        {
+            auto const& [base, mesh] = objects.get<const Base, const Mesh>(instance.entity);
+            auto const& accel = objects.get<const AccelerationStructure>(instance.geometry);
+            hp = RayMeshIntersection(localSpaceRay, base, mesh, accel, scene);
+            break;
+        }
+        case TopLevelBVH::InstanceType::KdTreeMesh:
+        {
+            auto const& [base, mesh] = objects.get<const Base, const Mesh>(instance.entity);
+            auto const& kdTree = objects.get<const KdTreeAccelerationStructure>(instance.geometry);
+            hp = RayMeshIntersectionKdTree(localSpaceRay, base, mesh, kdTree, scene);
+            break;
+        }
+    }
+
+    if (!hp.has_value())
+        return std::nullopt;
+
+    FinishInstanceHit(r, localSpaceRay, *hp, instance, transform);
+    return hp;
+}
+
 std::optional<Common::HitPoint> Intersection::IntersectRay(Ray& r, entt::registry& objects, Common::Scene const* scene)
 {
+    auto const& topLevelBVH = scene->GetTopLevelBVH();
+    auto const& nodes = topLevelBVH.GetNodes();
+    auto const& instances = topLevelBVH.GetInstances();
+    if (nodes.empty())
+        return std::nullopt;
+
+    COUNT_TRAVERSAL(rays, 1);
+    Direction invDir = One / r.direction;
+    int isDirNeg[3] = {r.direction.x < 0, r.direction.y < 0, r.direction.z < 0};
+
     std::optional<HitPoint> finalHitPoint;
-    Direction invDir = One / r.origin;
+    int toVisitOffset = 0;
+    int currentNodeIndex = 0;
+    int nodesToVisit[64] = {};
+    while (true)
     {
-        /* Perform ray-sphere intersections */
-        auto view = objects.view<const Base, const Sphere>();
-        for (auto const& [entity, base, sphere] : view.each())
+        COUNT_TRAVERSAL(nodesVisited, 1);
+        LinearBVHNode const& node = nodes[currentNodeIndex];
+        if (RayAABBIntersectionFast(r, node.bounds, invDir, isDirNeg))
         {
-            /* TODO: This code is duplicated; Ideally we should not do this during raytracing => bake all world matrices */
-            Jnrlib::Matrix4x4 world = base.world;
-            auto parent = base.entityPtr->GetParent();
-            while (parent != nullptr)
+            if (node.primitiveCount)
             {
-                auto &parentBase = parent->GetComponent<Base>();
-                world = world * parentBase.world;
-                parent = parent->GetParent();
+                for (uint32_t i = 0; i < node.primitiveCount; ++i)
+                {
+                    if (auto hp = RayInstanceIntersection(r, objects, instances[node.primitiveOffset + i], scene); hp.has_value())
+                    {
+                        finalHitPoint = hp;
+                    }
+                }
+                if (toVisitOffset == 0)
+                    break;
+                currentNodeIndex = nodesToVisit[--toVisitOffset];
+            }
+            else
+            {
+                if (isDirNeg[static_cast<uint32_t>(node.axis)])
+                {
+                    nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
+                    currentNodeIndex = node.secondChildOffset;
+                }
+                else
+                {
+                    nodesToVisit[toVisitOffset++] = node.secondChildOffset;
+                    currentNodeIndex = currentNodeIndex + 1;
+                }
             }
-            Jnrlib::Matrix4x4 inverseWorld = glm::inverse(world);
+        }
+        else
+        {
+            if (toVisitOffset == 0)
+                break;
+            currentNodeIndex = nodesToVisit[--toVisitOffset];
+        }
+    }
+    return finalHitPoint;
+}
 
-            auto localSpaceRay = r.TransformedRay(inverseWorld);
-            std::optional<HitPoint> hp = RaySphereIntersection(localSpaceRay, base, sphere);
 
-            if (!hp.has_value())
-                continue;
+/* Occlusion */
 
-            Float intersectionPoint = hp->GetIntersectionPoint();
-            CHECK(base.entityPtr != nullptr) << "Base doesn't include an entity pointer";
-            hp->SetEntity(base.entityPtr);
+static bool RayInstanceOccluded(Ray& r, entt::registry& objects, TopLevelBVH::Instance const& instance, Scene const* scene)
+{
+    if (instance.type == TopLevelBVH::InstanceType::WorldSphere)
+    {
+        Float t;
+        return FindSphereHit(r, instance.worldCenter, instance.worldRadius, t);
+    }
 
-            finalHitPoint = hp.value();
-            r.maxT = localSpaceRay.maxT;
+    auto const& transform = scene->GetTransformHierarchy().Get(instance.transformIndex);
+    auto localSpaceRay = r.TransformedRay(transform.inverseWorld);
+    switch (instance.type)
+    {
+        case TopLevelBVH::InstanceType::Sphere:
+        {
+            Float t;
+            return FindSphereHit(localSpaceRay, Position(Zero), objects.get<const Sphere>(instance.entity).radius, t);
+        }
+        case TopLevelBVH::InstanceType::WorldSphere:
+            break;
+        case TopLevelBVH::InstanceType::Mesh:
+        {
+            auto const& mesh = objects.get<const Mesh>(instance.entity);
+            auto const& accel = objects.get<const AccelerationStructure>(instance.geometry);
+            return RayMeshOccluded(localSpaceRay, mesh, accel, scene);
+        }
+        case TopLevelBVH::InstanceType::KdTreeMesh:
+        {
+            auto const& mesh = objects.get<const Mesh>(instance.entity);
+            auto const& kdTree = objects.get<const KdTreeAccelerationStructure>(instance.geometry);
+            return RayMeshOccludedKdTree(localSpaceRay, mesh, kdTree, scene);
         }
     }
+    return false;
+}
+
+bool Intersection::IsOccluded(Ray const& r, Float maxT, entt::registry& objects, Common::Scene const* scene)
+{
+    auto const& topLevelBVH = scene->GetTopLevelBVH();
+    auto const& nodes = topLevelBVH.GetNodes();
+    auto const& instances = topLevelBVH.GetInstances();
+    if (nodes.empty())
+        return false;
 
+    COUNT_TRAVERSAL(rays, 1);
+    Ray ray = r.Shortened(maxT);
+    Direction invDir = One / ray.direction;
+    int isDirNeg[3] = {ray.direction.x < 0, ray.direction.y < 0, ray.direction.z < 0};
+
+    /* Same traversal as IntersectRay, except the order of the children doesn't matter and the first hit ends it */
+    int toVisitOffset = 0;
+    int nodesToVisit[64] = {};
+    nodesToVisit[toVisitOffset++] = 0;
+    while (toVisitOffset > 0)
     {
-        /* Perform ray-mesh intersections */
-        auto view = objects.view<const Base, const Mesh, const AccelerationStructure>();
-        for (auto const& [entity, base, mesh, accel] : view.each())
+        int currentNodeIndex = nodesToVisit[--toVisitOffset];
+        COUNT_TRAVERSAL(nodesVisited, 1);
+        LinearBVHNode const& node = nodes[currentNodeIndex];
+        if (!RayAABBIntersectionFast(ray, node.bounds, invDir, isDirNeg))
+            continue;
+
+        if (node.primitiveCount)
         {
-            if (auto ptr = base.entityPtr->TryGetComponent<Sphere>(); ptr != nullptr) [[unlikely]]
-                continue;
+            for (uint32_t i = 0; i < node.primitiveCount; ++i)
+            {
+                if (RayInstanceOccluded(ray, objects, instances[node.primitiveOffset + i], scene))
+                    return true;
+            }
+        }
+        else
+        {
+            nodesToVisit[toVisitOffset++] = node.secondChildOffset;
+            nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
+        }
+    }
+    return false;
+}
+
+
+/* Packets */
+
+/* Packets, or the part of a packet that reaches a mesh, with fewer rays than this are traced one ray at a time */
+static constexpr const uint32_t MIN_PACKET_RAYS = 4;
+
+static_assert(RayPacket::MAX_SIZE % 4 == 0 && RayPacket::MAX_SIZE <= 64, "Rays are tested in groups of 4 and tracked with a 64 bit mask");
+
+/* Single precision copy of the rays of a packet, stored so the box tests check 4 rays at once */
+struct PacketRays
+{
+    uint32_t size;
+    /* The same for every ray of the packet */
+    int dirIsNeg[3];
+
+    alignas(16) float originX[RayPacket::MAX_SIZE];
+    alignas(16) float originY[RayPacket::MAX_SIZE];
+    alignas(16) float originZ[RayPacket::MAX_SIZE];
+    alignas(16) float invDirX[RayPacket::MAX_SIZE];
+    alignas(16) float invDirY[RayPacket::MAX_SIZE];
+    alignas(16) float invDirZ[RayPacket::MAX_SIZE];
+    /* Only used by the leaf tests */
+    alignas(16) float directionX[RayPacket::MAX_SIZE];
+    alignas(16) float directionY[RayPacket::MAX_SIZE];
+    alignas(16) float directionZ[RayPacket::MAX_SIZE];
+    /* 0 for the rays that aren't traced, so they never hit anything */
+    alignas(16) float maxT[RayPacket::MAX_SIZE];
+
+    /* Bounds of the origins and of the inverse directions of the traced rays, used to cull a node for all of them at once */
+    float originMin[3], originMax[3];
+    float invDirMin[3], invDirMax[3];
+};
+
+/* Copies the rays in the active mask. Returns false if they don't all point the same way on each axis, as the packet traversal
+ * needs the same near child and the same near planes for every ray
+ */
+static bool InitPacketRays(PacketRays& packetRays, Ray const* rays, uint32_t size, uint64_t active)
+{
+    /* Whole groups of 4, the extra rays are never hit */
+    packetRays.size = (size + 3) & ~3u;
+    for (uint32_t i = 0; i < packetRays.size; ++i)
+    {
+        packetRays.originX[i] = packetRays.originY[i] = packetRays.originZ[i] = 0.0f;
+        packetRays.invDirX[i] = packetRays.invDirY[i] = packetRays.invDirZ[i] = 0.0f;
+        packetRays.directionX[i] = packetRays.directionY[i] = packetRays.directionZ[i] = 0.0f;
+        packetRays.maxT[i] = 0.0f;
+    }
+    for (uint32_t axis = 0; axis < 3; ++axis)
+    {
+        packetRays.originMin[axis] = packetRays.invDirMin[axis] = std::numeric_limits<float>::infinity();
+        packetRays.originMax[axis] = packetRays.invDirMax[axis] = -std::numeric_limits<float>::infinity();
+    }
+
+    bool first = true;
+    for (uint64_t mask = active; mask != 0; mask &= mask - 1)
+    {
+        uint32_t i = (uint32_t)std::countr_zero(mask);
+        Ray const& r = rays[i];
+        int dirIsNeg[3] = {r.direction.x < 0, r.direction.y < 0, r.direction.z < 0};
+        if (first)
+        {
+            memcpy(packetRays.dirIsNeg, dirIsNeg, sizeof(dirIsNeg));
+            first = false;
+        }
+        else if (memcmp(packetRays.dirIsNeg, dirIsNeg, sizeof(dirIsNeg)) != 0)
+        {
+            return false;
+        }
+
+        Direction invDir = One / r.direction;
+        float origin[3] = {(float)r.origin.x, (float)r.origin.y, (float)r.origin.z};
+        float singlePrecisionInvDir[3] = {(float)invDir.x, (float)invDir.y, (float)invDir.z};
+        packetRays.originX[i] = origin[0];
+        packetRays.originY[i] = origin[1];
+        packetRays.originZ[i] = origin[2];
+        packetRays.invDirX[i] = singlePrecisionInvDir[0];
+        packetRays.invDirY[i] = singlePrecisionInvDir[1];
+        packetRays.invDirZ[i] = singlePrecisionInvDir[2];
+        packetRays.directionX[i] = (float)r.direction.x;
+        packetRays.directionY[i] = (float)r.direction.y;
+        packetRays.directionZ[i] = (float)r.direction.z;
+        packetRays.maxT[i] = ToSinglePrecisionT(r.maxT);
+        for (uint32_t axis = 0; axis < 3; ++axis)
+        {
+            packetRays.originMin[axis] = std::min(packetRays.originMin[axis], origin[axis]);
+            packetRays.originMax[axis] = std::max(packetRays.originMax[axis], origin[axis]);
+            packetRays.invDirMin[axis] = std::min(packetRays.invDirMin[axis], singlePrecisionInvDir[axis]);
+            packetRays.invDirMax[axis] = std::max(packetRays.invDirMax[axis], singlePrecisionInvDir[axis]);
+        }
+    }
+    return !first;
+}
+
+/* Interval arithmetic over the bounds of the packet. Returns false only if none of its rays can hit the box */
+static bool PacketMayHitBox(PacketRays const& rays, BoundingBox const& box)
+{
+    const float robustFactor = (float)(1 + 2 * gamma(3));
+    float tMin = 0.0f;
+    float tMax = std::numeric_limits<float>::infinity();
+    for (uint32_t axis = 0; axis < 3; ++axis)
+    {
+        float nearPlane = (float)(rays.dirIsNeg[axis] ? box.pMax[axis] : box.pMin[axis]);
+        float farPlane = (float)(rays.dirIsNeg[axis] ? box.pMin[axis] : box.pMax[axis]);
+
+        /* The product of two intervals has its extremes at their ends */
+        float nearT[4] = {(nearPlane - rays.originMin[axis]) * rays.invDirMin[axis], (nearPlane - rays.originMin[axis]) * rays.invDirMax[axis],
+                          (nearPlane - rays.originMax[axis]) * rays.invDirMin[axis], (nearPlane - rays.originMax[axis]) * rays.invDirMax[axis]};
+        float farT[4] = {(farPlane - rays.originMin[axis]) * rays.invDirMin[axis], (farPlane - rays.originMin[axis]) * rays.invDirMax[axis],
+                         (farPlane - rays.originMax[axis]) * rays.invDirMin[axis], (farPlane - rays.originMax[axis]) * rays.invDirMax[axis]};
+
+        /* A NaN (0 * inf) means a ray lies in the plane, so this axis can't cull anything */
+        bool hasNaN = false;
+        for (uint32_t i = 0; i < 4; ++i)
+        {
+            hasNaN |= std::isnan(nearT[i]) || std::isnan(farT[i]);
+        }
+        if (hasNaN)
+            continue;
+
+        tMin = std::max(tMin, std::min(std::min(nearT[0], nearT[1]), std::min(nearT[2], nearT[3])));
+        tMax = std::min(tMax, std::max(std::max(farT[0], farT[1]), std::max(farT[2], farT[3])) * robustFactor);
+        if (tMin > tMax)
+            return false;
+    }
+    return true;
+}
+
+/* Slab test of one ray of the packet against a box, given the near and the far planes of the box for the packet */
+static bool PacketRayBoxIntersection(PacketRays const& rays, uint32_t ray, float const nearPlane[3], float const farPlane[3])
+{
+    const float robustFactor = (float)(1 + 2 * gamma(3));
+    float const origin[3] = {rays.originX[ray], rays.originY[ray], rays.originZ[ray]};
+    float const invDir[3] = {rays.invDirX[ray], rays.invDirY[ray], rays.invDirZ[ray]};
+    float tMin = 0.0f;
+    float tMax = std::numeric_limits<float>::infinity();
+    for (uint32_t axis = 0; axis < 3; ++axis)
+    {
+        float tNearPlane = (nearPlane[axis] - origin[axis]) * invDir[axis];
+        float tFarPlane = (farPlane[axis] - origin[axis]) * invDir[axis] * robustFactor;
+        /* Written so a NaN plane (0 * inf) doesn't change the interval */
+        tMin = tNearPlane > tMin ? tNearPlane : tMin;
+        tMax = tFarPlane < tMax ? tFarPlane : tMax;
+    }
+    return tMin <= tMax && tMin < rays.maxT[ray];
+}
+
+/* Slab test of the 4 rays starting at first against a box. Returns the mask of the rays that hit it */
+static uint32_t PacketBoxIntersection(PacketRays const& rays, uint32_t first, float const nearPlane[3], float const farPlane[3])
+{
+#if defined(WIDE_BVH_SSE)
+    const float robustFactor = (float)(1 + 2 * gamma(3));
+    __m128 originX = _mm_load_ps(rays.originX + first);
+    __m128 originY = _mm_load_ps(rays.originY + first);
+    __m128 originZ = _mm_load_ps(rays.originZ + first);
+    __m128 invDirX = _mm_load_ps(rays.invDirX + first);
+    __m128 invDirY = _mm_load_ps(rays.invDirY + first);
+    __m128 invDirZ = _mm_load_ps(rays.invDirZ + first);
+
+    __m128 txMin = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(nearPlane[0]), originX), invDirX);
+    __m128 tyMin = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(nearPlane[1]), originY), invDirY);
+    __m128 tzMin = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(nearPlane[2]), originZ), invDirZ);
+    __m128 txMax = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(farPlane[0]), originX), invDirX);
+    __m128 tyMax = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(farPlane[1]), originY), invDirY);
+    __m128 tzMax = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(farPlane[2]), originZ), invDirZ);
+
+    /* The accumulator is always the second operand: min / max return it when the other one is a NaN (0 * inf) */
+    __m128 tMin = _mm_max_ps(txMin, _mm_max_ps(tyMin, _mm_max_ps(tzMin, _mm_setzero_ps())));
+    __m128 tMax = _mm_min_ps(txMax, _mm_min_ps(tyMax, _mm_min_ps(tzMax, _mm_set1_ps(std::numeric_limits<float>::infinity()))));
+    tMax = _mm_mul_ps(tMax, _mm_set1_ps(robustFactor));
+
+    __m128 hit = _mm_and_ps(_mm_cmple_ps(tMin, tMax), _mm_cmplt_ps(tMin, _mm_load_ps(rays.maxT + first)));
+    return (uint32_t)_mm_movemask_ps(hit);
+#else
+    uint32_t mask = 0;
+    for (uint32_t i = 0; i < 4; ++i)
+    {
+        if (PacketRayBoxIntersection(rays, first + i, nearPlane, farPlane))
+            mask |= 1 << i;
+    }
+    return mask;
+#endif
+}
+
+static void GetPacketPlanes(PacketRays const& rays, BoundingBox const& box, float nearPlane[3], float farPlane[3])
+{
+    for (uint32_t axis = 0; axis < 3; ++axis)
+    {
+        nearPlane[axis] = (float)(rays.dirIsNeg[axis] ? box.pMax[axis] : box.pMin[axis]);
+        farPlane[axis] = (float)(rays.dirIsNeg[axis] ? box.pMin[axis] : box.pMax[axis]);
+    }
+}
+
+/* Mask of the rays in the active mask that hit the box. Groups of 4 rays without an active one are skipped */
+static uint64_t GetPacketHitMask(PacketRays const& rays, uint64_t active, BoundingBox const& box)
+{
+    if (!PacketMayHitBox(rays, box))
+        return 0;
+
+    float nearPlane[3], farPlane[3];
+    GetPacketPlanes(rays, box, nearPlane, farPlane);
+
+    uint64_t hitMask = 0;
+    for (uint32_t first = 0; first < rays.size; first += 4)
+    {
+        if (((active >> first) & 0xF) != 0)
+            hitMask |= (uint64_t)PacketBoxIntersection(rays, first, nearPlane, farPlane) << first;
+    }
+    return hitMask & active;
+}
 
-            /* TODO: This code is duplicated; Ideally we should not do this during raytracing => bake all world matrices */
-            Jnrlib::Matrix4x4 world = base.world;
-            auto parent = base.entityPtr->GetParent();
-            while (parent != nullptr)
+/* Single ray traversal of the subtree under rootNode, for the rays of a packet that diverged */
+template <typename LeafFunc>
+static void TraversePacketRay(std::vector<LinearBVHNode> const& nodes, int rootNode, PacketRays const& rays, uint32_t ray, LeafFunc& leaf)
+{
+    int toVisitOffset = 0;
+    int currentNodeIndex = rootNode;
+    int nodesToVisit[64] = {};
+    while (true)
+    {
+        COUNT_TRAVERSAL(nodesVisited, 1);
+        LinearBVHNode const& node = nodes[currentNodeIndex];
+        float nearPlane[3], farPlane[3];
+        GetPacketPlanes(rays, node.bounds, nearPlane, farPlane);
+        if (PacketRayBoxIntersection(rays, ray, nearPlane, farPlane))
+        {
+            if (node.primitiveCount)
             {
-                auto &parentBase = parent->GetComponent<Base>();
-                world = world * parentBase.world;
-                parent = parent->GetParent();
+                leaf(node, 1ull << ray);
             }
-            Jnrlib::Matrix4x4 inverseWorld = glm::inverse(world);
+            else
+            {
+                if (rays.dirIsNeg[static_cast<uint32_t>(node.axis)])
+                {
+                    nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
+                    currentNodeIndex = node.secondChildOffset;
+                }
+                else
+                {
+                    nodesToVisit[toVisitOffset++] = node.secondChildOffset;
+                    currentNodeIndex = currentNodeIndex + 1;
+                }
+                continue;
+            }
+        }
 
-            auto localSpaceRay = r.TransformedRay(inverseWorld);
-            std::optional<HitPoint> hp = RayMeshIntersectionFast(localSpaceRay, base, mesh, accel, scene);
+        if (toVisitOffset == 0)
+            break;
+        currentNodeIndex = nodesToVisit[--toVisitOffset];
+    }
+}
+
+/* Masked packet traversal: a node is visited with the mask of the rays that hit its parent. Once fewer than MIN_PACKET_RAYS rays are left,
+ * they go through the rest of the subtree one at a time. Calls leaf(node, mask) with the rays that hit each leaf, which may lower
+ * the maxT of the rays as they find hits
+ */
+template <typename LeafFunc>
+static void TraversePacket(std::vector<LinearBVHNode> const& nodes, PacketRays const& rays, uint64_t active, LeafFunc&& leaf)
+{
+    struct NodeToVisit
+    {
+        int node;
+        uint64_t active;
+    };
 
-            if (!hp.has_value())
+    int toVisitOffset = 0;
+    NodeToVisit nodesToVisit[64] = {};
+    NodeToVisit current{0, active};
+    while (true)
+    {
+        COUNT_TRAVERSAL(nodesVisited, std::popcount(current.active));
+        LinearBVHNode const& node = nodes[current.node];
+        uint64_t hitMask = GetPacketHitMask(rays, current.active, node.bounds);
+        if ((uint32_t)std::popcount(hitMask) >= MIN_PACKET_RAYS)
+        {
+            if (node.primitiveCount)
+            {
+                leaf(node, hitMask);
+            }
+            else
+            {
+                /* Every ray points the same way, so they all have the same near child */
+                if (rays.dirIsNeg[static_cast<uint32_t>(node.axis)])
+                {
+                    nodesToVisit[toVisitOffset++] = NodeToVisit{current.node + 1, hitMask};
+                    current = NodeToVisit{node.secondChildOffset, hitMask};
+                }
+                else
+                {
+                    nodesToVisit[toVisitOffset++] = NodeToVisit{node.secondChildOffset, hitMask};
+                    current = NodeToVisit{current.node + 1, hitMask};
+                }
                 continue;
+            }
+        }
+        else if (hitMask != 0)
+        {
+            if (node.primitiveCount)
+            {
+                leaf(node, hitMask);
+            }
+            else
+            {
+                for (uint64_t mask = hitMask; mask != 0; mask &= mask - 1)
+                {
+                    TraversePacketRay(nodes, current.node, rays, (uint32_t)std::countr_zero(mask), leaf);
+                }
+            }
+        }
 
-            Float intersectionPoint = hp->GetIntersectionPoint();
-            CHECK(base.entityPtr != nullptr) << "Base doesn't include an entity pointer";
-            hp->SetEntity(base.entityPtr);
+        if (toVisitOffset == 0)
+            break;
+        current = nodesToVisit[--toVisitOffset];
+    }
+}
 
-            finalHitPoint = hp.value();
-            r.maxT = localSpaceRay.maxT;
+/* Packet version of RayPrecomputedLeafIntersection, testing 4 rays at a time against each triangle. Finds the same hits */
+static void PacketPrecomputedLeafIntersection(PacketRays& packetRays, Ray* rays, uint64_t active, float const* precomputed,
+                                              uint32_t primitiveOffset, uint32_t primitiveCount,
+                                              uint64_t& hits, uint32_t hitPrimitives[], Float hitBarycentrics[][3])
+{
+    float const* leaf = precomputed + primitiveOffset * PRECOMPUTED_TRIANGLE_FLOATS;
+    for (uint32_t first = 0; first < packetRays.size; first += 4)
+    {
+        uint32_t groupMask = (uint32_t)(active >> first) & 0xF;
+        if (groupMask == 0)
+            continue;
+
+        COUNT_TRAVERSAL(trianglesTested, std::popcount(groupMask) * primitiveCount);
+        TriangleLeaf::LeafRay4 leafRays;
+        memcpy(leafRays.originX, packetRays.originX + first, sizeof(leafRays.originX));
+        memcpy(leafRays.originY, packetRays.originY + first, sizeof(leafRays.originY));
+        memcpy(leafRays.originZ, packetRays.originZ + first, sizeof(leafRays.originZ));
+        memcpy(leafRays.directionX, packetRays.directionX + first, sizeof(leafRays.directionX));
+        memcpy(leafRays.directionY, packetRays.directionY + first, sizeof(leafRays.directionY));
+        memcpy(leafRays.directionZ, packetRays.directionZ + first, sizeof(leafRays.directionZ));
+        for (uint32_t lane = 0; lane < 4; ++lane)
+        {
+            leafRays.maxT[lane] = (groupMask & (1 << lane)) ? packetRays.maxT[first + lane] : 0.0f;
+        }
+
+        TriangleLeaf::LeafHit4 leafHits;
+        for (uint32_t mask = TriangleLeaf::Intersect4(leafRays, leaf, primitiveCount, leafHits); mask != 0; mask &= mask - 1)
+        {
+            uint32_t lane = (uint32_t)std::countr_zero(mask);
+            uint32_t i = first + lane;
+            rays[i].maxT = leafRays.maxT[lane];
+            packetRays.maxT[i] = leafRays.maxT[lane];
+            hitPrimitives[i] = primitiveOffset + leafHits.index[lane];
+            hitBarycentrics[i][0] = 1 - leafHits.u[lane] - leafHits.v[lane];
+            hitBarycentrics[i][1] = leafHits.u[lane];
+            hitBarycentrics[i][2] = leafHits.v[lane];
+            hits |= 1ull << i;
         }
     }
-    return finalHitPoint;
+}
+
+/* Packet version of RayMeshIntersection for the rays in the active mask, already in the space of the mesh.
+ * Writes the hits to hitPoints and returns their mask
+ */
+static uint64_t PacketMeshIntersection(Ray* rays, uint32_t size, uint64_t active, Base const& base, Mesh const& mesh,
+                                       AccelerationStructure const& accelStructure, Scene const* scene, std::optional<HitPoint>* hitPoints)
+{
+    uint64_t hits = 0;
+    PacketRays packetRays;
+    if (!UsesLinearNodes(accelStructure) || (uint32_t)std::popcount(active) < MIN_PACKET_RAYS ||
+        !InitPacketRays(packetRays, rays, size, active))
+    {
+        /* The rays diverged */
+        for (uint64_t mask = active; mask != 0; mask &= mask - 1)
+        {
+            uint32_t i = (uint32_t)std::countr_zero(mask);
+            if (auto hp = RayMeshIntersection(rays[i], base, mesh, accelStructure, scene); hp.has_value())
+            {
+                hitPoints[i] = std::move(hp);
+                hits |= 1ull << i;
+            }
+        }
+        return hits;
+    }
+
+    if (accelStructure.nodes.empty())
+        return hits;
+
+    LeafTriangles triangles = GetLeafTriangles(mesh, accelStructure, scene);
+    uint32_t hitPrimitives[RayPacket::MAX_SIZE];
+    Float hitBarycentrics[RayPacket::MAX_SIZE][3];
+    TraversePacket(accelStructure.nodes, packetRays, active, [&](LinearBVHNode const& node, uint64_t hitMask)
+    {
+        if (triangles.precomputed != nullptr && (uint32_t)std::popcount(hitMask) >= MIN_PACKET_RAYS)
+        {
+            PacketPrecomputedLeafIntersection(packetRays, rays, hitMask, triangles.precomputed, node.primitiveOffset, node.primitiveCount,
+                                              hits, hitPrimitives, hitBarycentrics);
+            return;
+        }
+
+        for (uint64_t mask = hitMask; mask != 0; mask &= mask - 1)
+        {
+            uint32_t i = (uint32_t)std::countr_zero(mask);
+            if (RayLeafIntersection(rays[i], triangles, node.primitiveOffset, node.primitiveCount, hitPrimitives[i], hitBarycentrics[i]))
+            {
+                hits |= 1ull << i;
+                packetRays.maxT[i] = ToSinglePrecisionT(rays[i].maxT);
+            }
+        }
+    });
+
+    for (uint64_t mask = hits; mask != 0; mask &= mask - 1)
+    {
+        uint32_t i = (uint32_t)std::countr_zero(mask);
+        hitPoints[i] = CreateMeshHitPoint(rays[i], base, mesh, scene, hitPrimitives[i], hitBarycentrics[i]);
+    }
+    return hits;
+}
+
+/* Tests the rays in the active mask against an instance, as a packet when it's a mesh with a binary BVH */
+static void PacketInstanceIntersection(RayPacket& packet, PacketRays& packetRays, uint64_t active, entt::registry& objects,
+                                       TopLevelBVH::Instance const& instance, Scene const* scene)
+{
+    if (instance.type == TopLevelBVH::InstanceType::Mesh)
+    {
+        auto const& transform = scene->GetTransformHierarchy().Get(instance.transformIndex);
+        auto const& [base, mesh] = objects.get<const Base, const Mesh>(instance.entity);
+        auto const& accel = objects.get<const AccelerationStructure>(instance.geometry);
+
+        Ray localSpaceRays[RayPacket::MAX_SIZE];
+        std::optional<HitPoint> hitPoints[RayPacket::MAX_SIZE];
+        for (uint64_t mask = active; mask != 0; mask &= mask - 1)
+        {
+            uint32_t i = (uint32_t)std::countr_zero(mask);
+            localSpaceRays[i] = packet.rays[i].TransformedRay(transform.inverseWorld);
+        }
+
+        uint64_t hits = PacketMeshIntersection(localSpaceRays, packet.size, active, base, mesh, accel, scene, hitPoints);
+        for (uint64_t mask = hits; mask != 0; mask &= mask - 1)
+        {
+            uint32_t i = (uint32_t)std::countr_zero(mask);
+            FinishInstanceHit(packet.rays[i], localSpaceRays[i], *hitPoints[i], instance, transform);
+            packet.hitPoints[i] = std::move(hitPoints[i]);
+            packetRays.maxT[i] = ToSinglePrecisionT(packet.rays[i].maxT);
+        }
+        return;
+    }
+
+    for (uint64_t mask = active; mask != 0; mask &= mask - 1)
+    {
+        uint32_t i = (uint32_t)std::countr_zero(mask);
+        if (auto hp = RayInstanceIntersection(packet.rays[i], objects, instance, scene); hp.has_value())
+        {
+            packet.hitPoints[i] = std::move(hp);
+            packetRays.maxT[i] = ToSinglePrecisionT(packet.rays[i].maxT);
+        }
+    }
+}
+
+void Intersection::IntersectPacket(RayPacket& packet, entt::registry& objects, Common::Scene const* scene)
+{
+    auto const& topLevelBVH = scene->GetTopLevelBVH();
+    auto const& nodes = topLevelBVH.GetNodes();
+    auto const& instances = topLevelBVH.GetInstances();
+    for (uint32_t i = 0; i < packet.size; ++i)
+    {
+        packet.hitPoints[i].reset();
+    }
+    if (nodes.empty() || packet.size == 0)
+        return;
+
+    PacketRays packetRays;
+    uint64_t allRays = packet.size == 64 ? ~0ull : (1ull << packet.size) - 1;
+    if (packet.size < MIN_PACKET_RAYS || !InitPacketRays(packetRays, packet.rays, packet.size, allRays))
+    {
+        for (uint32_t i = 0; i < packet.size; ++i)
+        {
+            packet.hitPoints[i] = IntersectRay(packet.rays[i], objects, scene);
+        }
+        return;
+    }
+
+    COUNT_TRAVERSAL(rays, packet.size);
+    TraversePacket(nodes, packetRays, allRays, [&](LinearBVHNode const& node, uint64_t hitMask)
+    {
+        for (uint32_t i = 0; i < node.primitiveCount; ++i)
+        {
+            PacketInstanceIntersection(packet, packetRays, hitMask, objects, instances[node.primitiveOffset + i], scene);
+        }
+    });
 }
@@ -6,6 +6,7 @@
 namespace Common
 {
     class Ray;
+    class RayPacket;
     class HitPoint;
     class Scene;
 }
@@ -22,6 +23,10 @@ namespace Common::Systems
     public:
         /* TODO: Make this system as part of the scene */
         std::optional<HitPoint> IntersectRay(Ray&, entt::registry &, Common::Scene const* scene);
+        /* Writes the closest hit of every ray to the packet. Traces the rays together while they go the same way, one at a time after */
+        void IntersectPacket(RayPacket&, entt::registry&, Common::Scene const* scene);
+        /* Whether anything is hit before maxT. Stops at the first hit and doesn't build a HitPoint, so it's cheaper than IntersectRay */
+        bool IsOccluded(Ray const&, Jnrlib::Float maxT, entt::registry&, Common::Scene const* scene);
 
     };
 }
\ No newline at end of file
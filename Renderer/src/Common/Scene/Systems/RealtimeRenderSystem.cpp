@@ -15,6 +15,8 @@
 #include "glm/gtc/matrix_transform.hpp"
 #include "glm/gtx/matrix_decompose.hpp"
 
+#include <map>
+
 using namespace Common;
 using namespace Systems;
 using namespace Vulkan;
@@ -125,17 +127,13 @@ void RealtimeRender::RenderScene(CommandList* cmdList)
         cmdList->BindPipeline(mDefaultPipeline.get());
         cmdList->BindDescriptorSet(mDefaultDescriptorSets.get(), 0, mDefaultRootSignature.get());
 
-        for (auto const& [entity, base, update, mesh] : updatables.each())
+        BuildDrawBatches();
+        uint32_t index = INSTANCED_DRAW;
+        cmdList->BindPushRange<uint32_t>(mDefaultRootSignature.get(), 0, 1, &index, VK_SHADER_STAGE_VERTEX_BIT);
+        for (auto const& batch : mDrawBatches)
         {
-             if (mSelectedEntities.find(base.entityPtr) != mSelectedEntities.end())
-                continue;
-             if (mesh.hidden)
-                continue;
-
-            /* TODO: pass this as instance */
-            uint32_t index = update.bufferIndex;
-            cmdList->BindPushRange<uint32_t>(mDefaultRootSignature.get(), 0, 1, &index, VK_SHADER_STAGE_VERTEX_BIT);
-            cmdList->DrawIndexedInstanced(mesh.indices.indexCount, mesh.indices.firstIndex, mesh.indices.firstVertex);
+            cmdList->DrawIndexedInstanced(batch.indices.indexCount, batch.indices.firstIndex, batch.indices.firstVertex,
+                                          batch.instanceCount, batch.firstInstance);
         }
 
         DrawAccelerationStructures();
@@ -274,6 +272,8 @@ void RealtimeRender::InitRootSignatures()
 
         mDefaultDescriptorSets->AddStorageBuffer(2, 1, VK_SHADER_STAGE_FRAGMENT_BIT);
         mDefaultDescriptorSets->AddInputBuffer(3, 1, VK_SHADER_STAGE_FRAGMENT_BIT);
+
+        mDefaultDescriptorSets->AddStorageBuffer(4, 1, VK_SHADER_STAGE_VERTEX_BIT);
     }
     mDefaultDescriptorSets->Bake();
     mDefaultRootSignature = std::make_unique<RootSignature>();
@@ -312,6 +312,51 @@ void RealtimeRender::InitPerObjectBuffer()
             memcpy(dst, src, mPerObjectBuffer->GetElementSize());
         }
     }
+
+    /* Every object is drawn at most once, so it can't have more instances than objects */
+    mOldInstanceBuffer = std::move(mInstanceBuffer);
+    mInstanceBuffer = std::make_unique<Buffer>(sizeof(uint32_t), std::max(mScene->GetNumberOfObjects(), 1u),
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT);
+    mDefaultDescriptorSets->BindStorageBuffer(mInstanceBuffer.get(), 4, 0, 0);
+    mInstanceObjects.clear();
+}
+
+void RealtimeRender::BuildDrawBatches()
+{
+    auto const& updatables = mScene->GetRegistry().group<const Base, const Components::Update, const Mesh>();
+
+    std::map<std::tuple<uint32_t, uint32_t, uint32_t>, std::vector<uint32_t>> objectsByIndices;
+    for (auto const& [entity, base, update, mesh] : updatables.each())
+    {
+        if (mSelectedEntities.find(base.entityPtr) != mSelectedEntities.end())
+            continue;
+        if (mesh.hidden)
+            continue;
+
+        objectsByIndices[{mesh.indices.firstIndex, mesh.indices.indexCount, mesh.indices.firstVertex}].push_back(update.bufferIndex);
+    }
+
+    std::vector<uint32_t> instanceObjects;
+    mDrawBatches.clear();
+    for (auto const& [indices, objects] : objectsByIndices)
+    {
+        DrawBatch batch{};
+        batch.indices.firstIndex = std::get<0>(indices);
+        batch.indices.indexCount = std::get<1>(indices);
+        batch.indices.firstVertex = std::get<2>(indices);
+        batch.firstInstance = (uint32_t)instanceObjects.size();
+        batch.instanceCount = (uint32_t)objects.size();
+        mDrawBatches.push_back(batch);
+
+        instanceObjects.insert(instanceObjects.end(), objects.begin(), objects.end());
+    }
+
+    if (instanceObjects != mInstanceObjects)
+    {
+        CHECK(instanceObjects.size() <= mInstanceBuffer->GetCount()) << "More instances than objects; ReloadObjects wasn't called";
+        memcpy(mInstanceBuffer->GetData(), instanceObjects.data(), instanceObjects.size() * sizeof(uint32_t));
+        mInstanceObjects = std::move(instanceObjects);
+    }
 }
 
 void RealtimeRender::ReloadObjects()
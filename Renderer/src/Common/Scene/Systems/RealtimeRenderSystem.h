@@ -10,6 +10,7 @@
 #include "Helpers/BatchRenderer.h"
 
 #include "Scene/Scene.h"
+#include "Scene/Components/Mesh.h"
 
 #include "LightHelpers.h"
 
@@ -64,6 +65,8 @@ namespace Common::Systems
     private:
         void InitRootSignatures();
         void InitPerObjectBuffer();
+        /* Groups the visible meshes by their indices and writes the objects of every group to the instance buffer */
+        void BuildDrawBatches();
         void InitUniformBuffer();
         void InitMaterialsBuffer(Vulkan::CommandList* cmdList);
         void InitPipelines(uint32_t width, uint32_t height);
@@ -96,6 +99,20 @@ namespace Common::Systems
             glm::vec3 pad;
         };
 
+        /* Pushed instead of an object index by the batched draws, same value as in basic.vert */
+        static constexpr const uint32_t INSTANCED_DRAW = (uint32_t)-1;
+
+        /* Meshes with the same indices, like the instances of a mesh or the spheres, drawn with one call */
+        struct DrawBatch
+        {
+            Components::Indices indices;
+            uint32_t firstInstance;
+            uint32_t instanceCount;
+        };
+        std::vector<DrawBatch> mDrawBatches;
+        /* What the instance buffer holds, so it's only written when it changes */
+        std::vector<uint32_t> mInstanceObjects;
+
         std::unique_ptr<Vulkan::Buffer> mUniformBuffer;
         std::unique_ptr<Vulkan::Buffer> mMaterialsBuffer;
 
@@ -113,6 +130,8 @@ namespace Common::Systems
 
         std::unique_ptr<Vulkan::Buffer> mPerObjectBuffer;
         std::unique_ptr<Vulkan::Buffer> mOldPerObjectBuffer;
+        std::unique_ptr<Vulkan::Buffer> mInstanceBuffer;
+        std::unique_ptr<Vulkan::Buffer> mOldInstanceBuffer;
         std::unique_ptr<Vulkan::DescriptorSet> mDefaultDescriptorSets;
 
         std::unique_ptr<Vulkan::RootSignature> mDefaultRootSignature;
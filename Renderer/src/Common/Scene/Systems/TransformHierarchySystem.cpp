@@ -0,0 +1,104 @@
+#include "TransformHierarchySystem.h"
+
+#include "Scene/Entity.h"
+#include "Scene/Components/Base.h"
+
+using namespace Common;
+using namespace Components;
+using namespace Systems;
+using namespace Jnrlib;
+
+void TransformHierarchy::Build(std::vector<Entity*> const& rootEntities)
+{
+    mEntities.clear();
+    mParents.clear();
+    mLevelOffsets.clear();
+    mIndices.clear();
+
+    /* Breadth first, so every level ends up contiguous */
+    for (auto entity : rootEntities)
+    {
+        mEntities.push_back(entity);
+        mParents.push_back(INVALID_INDEX);
+    }
+    uint32_t levelStart = 0;
+    while (levelStart < mEntities.size())
+    {
+        mLevelOffsets.push_back(levelStart);
+
+        uint32_t levelEnd = (uint32_t)mEntities.size();
+        for (uint32_t i = levelStart; i < levelEnd; ++i)
+        {
+            for (auto child : mEntities[i]->GetChildren())
+            {
+                mEntities.push_back(child);
+                mParents.push_back(i);
+            }
+        }
+        levelStart = levelEnd;
+    }
+    mLevelOffsets.push_back((uint32_t)mEntities.size());
+
+    mTransforms.resize(mEntities.size());
+    mIndices.reserve(mEntities.size());
+    for (uint32_t i = 0; i < mEntities.size(); ++i)
+    {
+        mIndices[(entt::entity)(*mEntities[i])] = i;
+    }
+
+    Update();
+}
+
+void TransformHierarchy::Update()
+{
+    for (uint32_t level = 0; level + 1 < mLevelOffsets.size(); ++level)
+    {
+        uint32_t levelOffset = mLevelOffsets[level];
+        uint32_t levelSize = mLevelOffsets[level + 1] - levelOffset;
+
+        ThreadPool::Get()->ExecuteParallelForImmediate(
+            [&, levelOffset](uint32_t i)
+            {
+                uint32_t index = levelOffset + i;
+                auto const& base = mEntities[index]->GetComponent<Base>();
+
+                auto& transform = mTransforms[index];
+                transform.world = base.world;
+                if (mParents[index] != INVALID_INDEX)
+                {
+                    /* Parents are one level up, so they are already done */
+                    transform.world = transform.world * mTransforms[mParents[index]].world;
+                }
+                transform.inverseWorld = glm::inverse(transform.world);
+                transform.translation = Position(transform.world[3]);
+                transform.scale = Vec3(glm::length(Vec3(transform.world[0])),
+                                       glm::length(Vec3(transform.world[1])),
+                                       glm::length(Vec3(transform.world[2])));
+            }, levelSize, UPDATE_BATCH_SIZE
+        );
+    }
+}
+
+uint32_t TransformHierarchy::GetIndex(entt::entity entity) const
+{
+    if (auto it = mIndices.find(entity); it != mIndices.end())
+        return it->second;
+    return INVALID_INDEX;
+}
+
+WorldTransform const& TransformHierarchy::Get(uint32_t index) const
+{
+    return mTransforms[index];
+}
+
+WorldTransform const& TransformHierarchy::Get(entt::entity entity) const
+{
+    uint32_t index = GetIndex(entity);
+    CHECK(index != INVALID_INDEX) << "Entity " << (uint32_t)entity << " is not part of the transform hierarchy";
+    return mTransforms[index];
+}
+
+std::vector<WorldTransform> const& TransformHierarchy::GetTransforms() const
+{
+    return mTransforms;
+}
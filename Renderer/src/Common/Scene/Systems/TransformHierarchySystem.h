@@ -0,0 +1,54 @@
+#pragma once
+
+#include <Jnrlib.h>
+#include <entt/entt.hpp>
+
+namespace Common
+{
+    class Entity;
+}
+
+namespace Common::Systems
+{
+    /* World space transform of an entity, together with everything ray tracing derives from it */
+    struct WorldTransform
+    {
+        Jnrlib::Matrix4x4 world;
+        Jnrlib::Matrix4x4 inverseWorld;
+        Jnrlib::Position translation;
+        Jnrlib::Vec3 scale;
+    };
+
+    /* Bakes the world transforms of the whole entity hierarchy, so rays never walk the parent chain or invert matrices */
+    class TransformHierarchy
+    {
+    public:
+        static constexpr const uint32_t INVALID_INDEX = (uint32_t)-1;
+        /* Entities on the same level of the hierarchy updated by one task */
+        static constexpr const uint32_t UPDATE_BATCH_SIZE = 256;
+
+    public:
+        /* Orders all the entities reachable from rootEntities by depth and computes their transforms. Needed when entities are added or reparented */
+        void Build(std::vector<Entity*> const& rootEntities);
+        /* Recomputes the transforms of the entities found by the last Build. Levels are updated one after another, entities of a level in parallel */
+        void Update();
+
+        /* INVALID_INDEX if the entity wasn't part of the hierarchy during the last update */
+        uint32_t GetIndex(entt::entity entity) const;
+
+        WorldTransform const& Get(uint32_t index) const;
+        WorldTransform const& Get(entt::entity entity) const;
+
+        /* Ordered by depth, so a parent always comes before its children */
+        std::vector<WorldTransform> const& GetTransforms() const;
+
+    private:
+        std::vector<WorldTransform> mTransforms;
+        std::vector<Entity*> mEntities;
+        std::vector<uint32_t> mParents;
+        /* mTransforms[mLevelOffsets[i], mLevelOffsets[i + 1]) are the entities at depth i */
+        std::vector<uint32_t> mLevelOffsets;
+
+        std::unordered_map<entt::entity, uint32_t> mIndices;
+    };
+}
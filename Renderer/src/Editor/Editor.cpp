@@ -59,9 +59,11 @@ Editor::Editor::~Editor()
 {
     LOG(INFO) << "Stopping started";
 
-    /* To be replaced */
-    Jnrlib::ThreadPool::Get()->CancelRemainingTasks();
-    Jnrlib::ThreadPool::Get()->WaitForAll();
+    /* The preview render is the only work the editor leaves in the thread pool, it has to stop before the scene goes away */
+    if (mRenderPreview)
+    {
+        mRenderPreview->StopRendering();
+    }
     Renderer::Get()->WaitIdle();
 
     SerializeWindows();
@@ -408,6 +410,7 @@ void Editor::Editor::InitImguiWindows()
         auto renderPreview = std::make_unique<RenderPreview>(mActiveScene.get(), mPixelInspector);
         mRenderPreview = renderPreview.get();
         mImguiWindows.emplace_back(std::move(renderPreview));
+        mSceneViewer->SetRenderPreview(mRenderPreview);
     }
     
     {
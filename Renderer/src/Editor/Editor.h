@@ -82,7 +82,7 @@ namespace Editor
         SceneViewer* mSceneViewer;
         SceneHierarchy* mSceneHierarchy;
         ObjectInspector* mObjectInspector;
-        RenderPreview* mRenderPreview;
+        RenderPreview* mRenderPreview = nullptr;
         PixelInspector* mPixelInspector;
  
         bool mShouldClose = false;
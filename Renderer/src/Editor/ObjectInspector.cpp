@@ -13,6 +13,7 @@
 #include "Common/Scene/Components/Mesh.h"
 #include "Common/Scene/Components/AccelerationStructure.h"
 #include "Common/Scene/Scene.h"
+#include "Common/Scene/Accelerators/TraversalStatistics.h"
 
 #include "Common/MaterialManager.h"
 
@@ -117,6 +118,7 @@ void ObjectInspector::SetEntity(Entity* entity, Scene* scene)
 void ObjectInspector::ClearSelection()
 {
     mActiveEntity = nullptr;
+    mStatisticsEntity = nullptr;
 }
 
 void ObjectInspector::RenderBase(Base& b, bool isUpdatable)
@@ -260,4 +262,44 @@ void ObjectInspector::RenderAccelerationStructure(Common::Components::Accelerati
             c.shouldRender = shouldRender;
         });
     }
+
+    if (ImGui::TreeNode("Statistics"))
+    {
+        bool refresh = ImGui::Button("Refresh");
+        if (refresh || mStatisticsEntity != mActiveEntity)
+        {
+            mStatistics = Accelerators::BVH::ComputeStatistics(c);
+            mStatisticsEntity = mActiveEntity;
+        }
+
+        ImGui::Text("SAH cost: %.3f", (float)mStatistics.sahCost);
+        ImGui::Text("Nodes: %u; Leaves: %u; Depth: %u", mStatistics.nodeCount, mStatistics.leafCount, mStatistics.maxDepth);
+        ImGui::Text("Memory: %zuKB", mStatistics.memoryUsage / 1024);
+
+        auto plotHistogram = [](const char* label, std::vector<uint32_t> const& histogram)
+        {
+            std::vector<float> values(histogram.begin(), histogram.end());
+            ImGui::PlotHistogram(label, values.data(), (int)values.size(), 0, nullptr, 0.0f, FLT_MAX, ImVec2(0.0f, 80.0f));
+        };
+        plotHistogram("Leaves per depth", mStatistics.depthHistogram);
+        plotHistogram("Leaves per size", mStatistics.leafSizeHistogram);
+        ImGui::TreePop();
+    }
+
+#if defined(BVH_STATISTICS)
+    /* Counted over every mesh, since the last ray traced render or the last reset */
+    if (ImGui::TreeNode("Traversal"))
+    {
+        auto counters = Accelerators::TraversalStatistics::Collect();
+        double rays = (double)std::max(counters.rays, (uint64_t)1);
+        ImGui::Text("Rays: %llu", (unsigned long long)counters.rays);
+        ImGui::Text("Nodes visited per ray: %.2f", (double)counters.nodesVisited / rays);
+        ImGui::Text("Triangles tested per ray: %.2f", (double)counters.trianglesTested / rays);
+        if (ImGui::Button("Reset"))
+        {
+            Accelerators::TraversalStatistics::Reset();
+        }
+        ImGui::TreePop();
+    }
+#endif
 }
\ No newline at end of file
@@ -2,6 +2,7 @@
 
 #include "ImguiWindow.h"
 #include "Common/Scene/Entity.h"
+#include "Common/Scene/Accelerators/BVH.h"
 
 namespace Common::Components
 {
@@ -40,5 +41,9 @@ namespace Editor
         Common::Entity *mActiveEntity = nullptr;
         Common::Scene *mActiveScene = nullptr;
         SceneViewer *mSceneViewer = nullptr;
+
+        /* Walking the whole BVH every frame would be too slow, so its statistics are computed when it's selected or on request */
+        Common::Entity *mStatisticsEntity = nullptr;
+        Common::Accelerators::BVH::Statistics mStatistics;
     };
 }
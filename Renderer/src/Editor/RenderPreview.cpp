@@ -3,6 +3,7 @@
 #include "Editor.h"
 
 #include "Scene/Scene.h"
+#include "Scene/Components/Camera.h"
 #include "Scene/Systems/RealtimeRenderSystem.h"
 
 #include "CreateInfo/RayTracingCreateInfo.h"
@@ -34,13 +35,35 @@ Editor::RenderPreview::RenderPreview(Common::Scene* scene, PixelInspector* pixel
 }
 
 Editor::RenderPreview::~RenderPreview()
-{ }
+{
+    StopRendering();
+}
 
 void Editor::RenderPreview::SetRenderingContext(RenderingContext const& ctx)
 {
     mActiveRenderingContext = ctx;
 }
 
+void Editor::RenderPreview::StopRendering()
+{
+    if (mRenderer && mIsRenderingActive)
+    {
+        mRenderer->Cancel();
+    }
+    if (mRenderThread.joinable())
+    {
+        mRenderThread.join();
+    }
+}
+
+void Editor::RenderPreview::RestartRendering()
+{
+    if (mRenderer)
+    {
+        StartRendering();
+    }
+}
+
 void Editor::RenderPreview::HandleSelect()
 {
     if (!ImGui::IsWindowFocused())
@@ -130,6 +153,13 @@ void Editor::RenderPreview::OnRender()
         mPixelInspector->CopySelectedRegion(0, 0, nullptr, nullptr, nullptr);
     }
 
+    /* Once something was rendered, the preview follows the camera. Edits of the scene restart it from SceneViewer::RenderScene */
+    if (mRenderer && GetCameraState() != mRenderedCamera)
+    {
+        VLOG(2) << "Camera moved, restarting the render preview";
+        StartRendering();
+    }
+
     ShowProgress();
 
     ImGui::End();
@@ -144,18 +174,39 @@ void Editor::RenderPreview::OnResize(float newWidth, float newHeight)
 
 void Editor::RenderPreview::StartRendering()
 {
+    /* Only the tiles of the old render are dropped, the rest of the work in the thread pool isn't waited for */
+    StopRendering();
+    mRenderedCamera = GetCameraState();
+    /* The inspected pixels belong to the old renderer */
+    mPixelInspector->CopySelectedRegion(0, 0, nullptr, nullptr, nullptr);
+
     if (mRendererType == (uint32_t)CreateInfo::RayTracingType::PathTracing)
     {
-        RenderSimplePathTracing();
         mIsRenderingActive = true;
+        RenderSimplePathTracing();
     }
     else if (mRendererType == (uint32_t)CreateInfo::RayTracingType::SimpleRayTracing)
     {
-        RenderSimpleRayTracing();
         mIsRenderingActive = true;
+        RenderSimpleRayTracing();
     }
 }
 
+Editor::RenderPreview::CameraState Editor::RenderPreview::GetCameraState() const
+{
+    auto cameraEntity = mScene->GetCameraEntity();
+    auto const& camera = cameraEntity->GetComponent<Components::Camera>();
+    auto const& transform = mScene->GetTransformHierarchy().Get((entt::entity)*cameraEntity);
+
+    return CameraState{
+        .position = glm::vec3(transform.translation),
+        .upperLeftCorner = glm::vec3(camera.GetUpperLeftCorner()),
+        .forwardDirection = glm::vec3(camera.GetForwardDirection()),
+        .rightDirection = glm::vec3(camera.GetRightDirection()),
+        .upDirection = glm::vec3(camera.GetUpDirection()),
+    };
+}
+
 void Editor::RenderPreview::ShowProgress()
 {
     if (mBufferDumper)
@@ -187,30 +238,40 @@ void Editor::RenderPreview::ShowProgress()
 
 void Editor::RenderPreview::RenderSimplePathTracing()
 {
-    auto const& imageInfo = mScene->GetImageInfo();
-    mLastBufferDumper = std::move(mBufferDumper);
-    mBufferDumper = std::make_unique<BufferDumper>((uint32_t)imageInfo.width, (uint32_t)imageInfo.height);
+    PrepareBufferDumper();
 
     mRenderer = std::make_unique<RayTracing::PathTracing>(*(Common::IDumper*)mBufferDumper.get(), *mScene, 100, 50);
-    std::thread th([&]()
+    mRenderThread = std::thread([&]()
     {
         mRenderer->Render();
         mIsRenderingActive = false;
     });
-    th.detach();
 }
 
 void Editor::RenderPreview::RenderSimpleRayTracing()
 {
-    auto const& imageInfo = mScene->GetImageInfo();
-    mLastBufferDumper = std::move(mBufferDumper);
-    mBufferDumper = std::make_unique<BufferDumper>((uint32_t)imageInfo.width, (uint32_t)imageInfo.height);
+    PrepareBufferDumper();
 
     mRenderer = std::make_unique<RayTracing::SimpleRayTracing>(*(Common::IDumper*)mBufferDumper.get(), *mScene, 10);
-    std::thread th([&]()
+    mRenderThread = std::thread([&]()
     {
         mRenderer->Render();
         mIsRenderingActive = false;
     });
-    th.detach();
+}
+
+void Editor::RenderPreview::PrepareBufferDumper()
+{
+    auto const& imageInfo = mScene->GetImageInfo();
+    /* Restarts happen every frame while the camera moves, so the image is reused instead of being recreated
+     * while the previous frames may still use it
+     */
+    if (mBufferDumper && mBufferDumper->GetWidth() == (uint32_t)imageInfo.width &&
+        mBufferDumper->GetHeight() == (uint32_t)imageInfo.height)
+    {
+        return;
+    }
+
+    mLastBufferDumper = std::move(mBufferDumper);
+    mBufferDumper = std::make_unique<BufferDumper>((uint32_t)imageInfo.width, (uint32_t)imageInfo.height);
 }
@@ -2,6 +2,9 @@
 
 #include <vector>
 #include <memory>
+#include <thread>
+#include <atomic>
+#include <glm/glm.hpp>
 #include "ImguiWindow.h"
 
 
@@ -45,12 +48,31 @@ namespace Editor
 
         void SetRenderingContext(RenderingContext const& ctx);
 
+        /* Cancels the render in progress and waits for it, the rest of the thread pool keeps going */
+        void StopRendering();
+        /* Renders again with the same renderer, if anything was rendered so far */
+        void RestartRendering();
+
         virtual void OnRender() override;
 
+    private:
+        /* What a render sees of the scene camera, it's restarted when this changes */
+        struct CameraState
+        {
+            glm::vec3 position;
+            glm::vec3 upperLeftCorner;
+            glm::vec3 forwardDirection;
+            glm::vec3 rightDirection;
+            glm::vec3 upDirection;
+
+            bool operator==(CameraState const&) const = default;
+        };
+
     private:
         void OnResize(float newWidth, float newHeight);
 
         void StartRendering();
+        CameraState GetCameraState() const;
 
         void ShowProgress();
 
@@ -59,6 +81,7 @@ namespace Editor
     private:
         void RenderSimplePathTracing();
         void RenderSimpleRayTracing();
+        void PrepareBufferDumper();
 
     private:
         float mWidth = 0.0f;
@@ -73,10 +96,12 @@ namespace Editor
         std::unique_ptr<Common::BufferDumper> mLastBufferDumper;
 
         std::unique_ptr<RayTracing::Renderer> mRenderer;
+        std::thread mRenderThread;
+        CameraState mRenderedCamera{};
 
         int32_t mRendererType = 0;
         std::vector<std::string> mRendererTypes;
-        bool mIsRenderingActive = false;
+        std::atomic<bool> mIsRenderingActive = false;
     };
 }
 
@@ -1,6 +1,7 @@
 #include "SceneViewer.h"
 #include "SceneHierarchy.h"
 #include "PixelInspector.h"
+#include "RenderPreview.h"
 #include "Editor.h"
 
 #include "imgui.h"
@@ -109,6 +110,11 @@ void Editor::SceneViewer::SetPixelInspector(PixelInspector* pixelInspector)
     mPixelInspector = pixelInspector;
 }
 
+void Editor::SceneViewer::SetRenderPreview(RenderPreview* renderPreview)
+{
+    mRenderPreview = renderPreview;
+}
+
 void Editor::SceneViewer::RenderScene()
 {
     if (mActiveRenderingContext.cmdList == nullptr)
@@ -127,8 +133,21 @@ void Editor::SceneViewer::RenderScene()
     cmdList->TransitionImageToImguiLayout(currentFrameResources.renderTarget.get());
 
     mCamera->PerformUpdate();
+
+    /* The render preview traces the ray tracing data from other threads, so it's stopped while that data is rebuilt or refitted.
+     * What it rendered is out of date anyway, so it starts again right after
+     */
+    bool rayTracingDataOutdated = mScene->IsRayTracingDataOutdated();
+    if (rayTracingDataOutdated && mRenderPreview)
+    {
+        mRenderPreview->StopRendering();
+    }
     /* TODO: Give user the ability not to perform update on the scene */
     mScene->PerformUpdate();
+    if (rayTracingDataOutdated && mRenderPreview)
+    {
+        mRenderPreview->RestartRendering();
+    }
 }
 
 void Editor::SceneViewer::AddDebugVertex(glm::vec3 const& pos, glm::vec4 const& color, float time)
@@ -20,6 +20,7 @@ namespace Editor
 {
     class SceneHierarchy;
     class PixelInspector;
+    class RenderPreview;
 
     class SceneViewer : public ImguiWindow
     {
@@ -45,6 +46,7 @@ namespace Editor
 
         void SetSceneHierarchy(SceneHierarchy* hierarchy);
         void SetPixelInspector(PixelInspector* pixelInspector);
+        void SetRenderPreview(RenderPreview* renderPreview);
 
     private:
         void OnResize(float newWidth, float newHeight);
@@ -71,6 +73,7 @@ namespace Editor
         Common::Scene* mScene;
         SceneHierarchy* mSceneHierarchy = nullptr;
         PixelInspector* mPixelInspector = nullptr;
+        RenderPreview* mRenderPreview = nullptr;
 
         RenderingContext mActiveRenderingContext{};
 
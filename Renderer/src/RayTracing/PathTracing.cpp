@@ -3,12 +3,15 @@
 
 #include "Scene/Components/Camera.h"
 #include "Scene/Components/Base.h"
-
-#include <glm/gtx/matrix_decompose.hpp>
+#include "RayPacket.h"
 
 using namespace RayTracing;
 using namespace Common;
 
+/* BLOCK_SIZE x BLOCK_SIZE pixels fill a packet */
+constexpr uint32_t BLOCK_SIZE = 8;
+static_assert(BLOCK_SIZE * BLOCK_SIZE <= RayPacket::MAX_SIZE);
+
 PathTracing::PathTracing(IDumper& dumper, Scene& scene, uint32_t numSamples, uint32_t maxDepth) :
     mDumper(dumper),
     mScene(scene),
@@ -21,51 +24,75 @@ void PathTracing::Render()
     mWidth = mDumper.GetWidth();
     mHeight = mDumper.GetHeight();
 
-    auto threadPool = Jnrlib::ThreadPool::Get();
-
     mDumper.SetTotalWork(mWidth * mHeight);
 
     mUpperLeftCorner = mScene.GetCameraEntity()->GetComponent<Common::Components::Camera>().GetUpperLeftCorner();
 
-    for (uint32_t y = 0; y < mHeight; ++y)
+    for (uint32_t y = 0; y < mHeight; y += BLOCK_SIZE)
     {
-        for (uint32_t x = 0; x < mWidth; ++x)
+        for (uint32_t x = 0; x < mWidth; x += BLOCK_SIZE)
         {
-            threadPool->ExecuteDeffered(
-                std::bind(&PathTracing::TracePixel, this, x, y)
+            mTiles.ExecuteDeffered(
+                std::bind(&PathTracing::RenderBlock, this, x, y, mTiles.GetToken())
             );
         }
     }
 
-    threadPool->WaitForAll();
+    mTiles.Wait();
 }
 
-void PathTracing::TracePixel(uint32_t x, uint32_t y)
+void PathTracing::RenderBlock(uint32_t blockX, uint32_t blockY, Jnrlib::CancellationToken token)
 {
-    auto const& cameraComponent = mScene.GetCameraEntity()->GetComponent<Common::Components::Camera>();
-    auto const& baseComponent = mScene.GetCameraEntity()->GetComponent<Common::Components::Base>();
+    uint32_t blockWidth = std::min(blockX + BLOCK_SIZE, mWidth);
+    uint32_t blockHeight = std::min(blockY + BLOCK_SIZE, mHeight);
 
-    Jnrlib::Vec3 scale;
-    Jnrlib::Quaternion rotation;
-    Jnrlib::Position translation;
-    Jnrlib::Vec3 skew;
-    Jnrlib::Vec4 perspective;
-    glm::decompose(baseComponent.world, scale, rotation, translation, skew, perspective);
+    Jnrlib::Color colors[BLOCK_SIZE * BLOCK_SIZE];
+    std::fill(std::begin(colors), std::end(colors), Jnrlib::Color(Jnrlib::Zero));
 
-    Jnrlib::Position pos = translation;
-    Jnrlib::Direction rightDirection = cameraComponent.GetRightDirection();
-    Jnrlib::Direction upDirection = cameraComponent.GetUpDirection();
+    /* The same sample of every pixel in the block is traced together, the bounces after the first hit one ray at a time.
+     * Primary rays are at depth 1, so like in GetRayColor there's nothing to trace if that's already the maximum depth
+     */
+    RayPacket packet;
+    for (uint32_t i = 0; i < mNumSamples && mMaxDepth > 1; ++i)
+    {
+        /* A cancelled block leaves its pixels alone, they'd only have some of the samples */
+        if (token.IsCancelled())
+            return;
 
-    Jnrlib::Float viewportWidth = cameraComponent.viewportSize.x;
-    Jnrlib::Float viewportHeight = cameraComponent.viewportSize.y;
+        packet.Clear();
+        for (uint32_t y = blockY; y < blockHeight; ++y)
+        {
+            for (uint32_t x = blockX; x < blockWidth; ++x)
+            {
+                packet.Add(GetCameraRay(x, y));
+            }
+        }
+
+        mScene.GetClosestHits(packet);
+
+        for (uint32_t rayIndex = 0; rayIndex < packet.size; ++rayIndex)
+        {
+            colors[rayIndex] += GetHitColor(packet.rays[rayIndex], packet.hitPoints[rayIndex], 1);
+        }
+    }
 
+    uint32_t pixelIndex = 0;
+    for (uint32_t y = blockY; y < blockHeight; ++y)
+    {
+        for (uint32_t x = blockX; x < blockWidth; ++x, ++pixelIndex)
+        {
+            mDumper.SetPixelColor(x, y, colors[pixelIndex] / (Jnrlib::Float)mNumSamples);
+            mDumper.AddDoneWork();
+        }
+    }
+}
+
+void PathTracing::TracePixel(uint32_t x, uint32_t y)
+{
     Jnrlib::Color color(Jnrlib::Zero);
     for (uint32_t i = 0; i < mNumSamples; ++i)
     {
-        Jnrlib::Float u = ((Jnrlib::Float)x + Jnrlib::Random::get(-Jnrlib::One, Jnrlib::One)) / (mWidth - 1);
-        Jnrlib::Float v = ((Jnrlib::Float)y + Jnrlib::Random::get(-Jnrlib::One, Jnrlib::One)) / (mHeight - 1);
-
-        Ray ray(pos, mUpperLeftCorner + u * rightDirection * viewportWidth - v * upDirection * viewportHeight - pos);
+        Ray ray = GetCameraRay(x, y);
         color += GetRayColor(ray);
     }
 
@@ -76,6 +103,23 @@ void PathTracing::TracePixel(uint32_t x, uint32_t y)
     mDumper.AddDoneWork();
 }
 
+Ray PathTracing::GetCameraRay(uint32_t x, uint32_t y) const
+{
+    auto const& cameraComponent = mScene.GetCameraEntity()->GetComponent<Common::Components::Camera>();
+
+    Jnrlib::Position pos = mScene.GetTransformHierarchy().Get((entt::entity)*mScene.GetCameraEntity()).translation;
+    Jnrlib::Direction rightDirection = cameraComponent.GetRightDirection();
+    Jnrlib::Direction upDirection = cameraComponent.GetUpDirection();
+
+    Jnrlib::Float viewportWidth = cameraComponent.viewportSize.x;
+    Jnrlib::Float viewportHeight = cameraComponent.viewportSize.y;
+
+    Jnrlib::Float u = ((Jnrlib::Float)x + Jnrlib::Random::get(-Jnrlib::One, Jnrlib::One)) / (mWidth - 1);
+    Jnrlib::Float v = ((Jnrlib::Float)y + Jnrlib::Random::get(-Jnrlib::One, Jnrlib::One)) / (mHeight - 1);
+
+    return Ray(pos, mUpperLeftCorner + u * rightDirection * viewportWidth - v * upDirection * viewportHeight - pos);
+}
+
 Jnrlib::Color PathTracing::GetRayColor(Ray& ray, uint32_t depth)
 {
     if (depth >= mMaxDepth)
@@ -83,9 +127,14 @@ Jnrlib::Color PathTracing::GetRayColor(Ray& ray, uint32_t depth)
         return Jnrlib::Color(Jnrlib::Zero);
     }
 
-    if (auto _hp = mScene.GetClosestHit(ray); _hp.has_value())
+    return GetHitColor(ray, mScene.GetClosestHit(ray), depth);
+}
+
+Jnrlib::Color PathTracing::GetHitColor(Ray const& ray, std::optional<HitPoint> const& _hp, uint32_t depth)
+{
+    if (_hp.has_value())
     {
-        HitPoint hp = (*_hp);
+        HitPoint const& hp = (*_hp);
 
         auto material = hp.GetMaterial();
         
@@ -18,8 +18,12 @@ namespace RayTracing
         void TracePixel(uint32_t x, uint32_t y) override;
 
     private:
+        void RenderBlock(uint32_t x, uint32_t y, Jnrlib::CancellationToken token);
+        Common::Ray GetCameraRay(uint32_t x, uint32_t y) const;
 
         Jnrlib::Color GetRayColor(Common::Ray&, uint32_t depth = 1);
+        /* Color of a ray whose closest hit was already found */
+        Jnrlib::Color GetHitColor(Common::Ray const&, std::optional<Common::HitPoint> const& hp, uint32_t depth);
 
     private:
         Common::IDumper& mDumper;
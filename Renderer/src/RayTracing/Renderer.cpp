@@ -3,7 +3,64 @@
 #include "SimpleRayTracing.h"
 #include "PngDumper.h"
 
+#if defined(BVH_STATISTICS)
+#include "Scene/Components/Mesh.h"
+#include "Scene/Components/AccelerationStructure.h"
+#include "Scene/Accelerators/BVH.h"
+#include "Scene/Accelerators/TraversalStatistics.h"
 
+#include <nlohmann/json.hpp>
+#include <filesystem>
+#include <fstream>
+
+/* Writes the shape of every BVH and the traversal counters of the render next to the image, as <image>.stats.json */
+static void DumpStatistics(Common::Scene const& scene)
+{
+	using namespace Common;
+	using json = nlohmann::json;
+
+	json accelerationStructures = json::array();
+	auto view = scene.GetRegistry().view<const Components::Mesh, const Components::AccelerationStructure>();
+	for (auto const& [entity, mesh, accelerationStructure] : view.each())
+	{
+		auto statistics = Accelerators::BVH::ComputeStatistics(accelerationStructure);
+		accelerationStructures.push_back(json{
+			{"mesh", mesh.name},
+			{"sahCost", statistics.sahCost},
+			{"nodes", statistics.nodeCount},
+			{"leaves", statistics.leafCount},
+			{"maxDepth", statistics.maxDepth},
+			{"memoryBytes", statistics.memoryUsage},
+			{"depthHistogram", statistics.depthHistogram},
+			{"leafSizeHistogram", statistics.leafSizeHistogram},
+		});
+	}
+
+	auto counters = Accelerators::TraversalStatistics::Collect();
+	double rays = (double)std::max(counters.rays, (uint64_t)1);
+	json statistics{
+		{"accelerationStructures", accelerationStructures},
+		{"traversal", {
+			{"rays", counters.rays},
+			{"nodesVisited", counters.nodesVisited},
+			{"trianglesTested", counters.trianglesTested},
+			{"nodesPerRay", (double)counters.nodesVisited / rays},
+			{"trianglesPerRay", (double)counters.trianglesTested / rays},
+		}},
+	};
+
+	auto path = std::filesystem::path(scene.GetOutputFile()).replace_extension(".stats.json");
+	std::ofstream file(path);
+	file << statistics.dump(4);
+	LOG(INFO) << "Traced " << counters.rays << " rays, visiting " << (double)counters.nodesVisited / rays << " nodes and testing "
+		<< (double)counters.trianglesTested / rays << " triangles per ray; Statistics written to " << path.string();
+}
+#endif
+
+void RayTracing::Renderer::Cancel()
+{
+	mTiles.Cancel();
+}
 
 void RayTracing::RenderScene(std::unique_ptr<Common::Scene>& scene, CreateInfo::RayTracing const& rendererInfo)
 {
@@ -11,6 +68,10 @@ void RayTracing::RenderScene(std::unique_ptr<Common::Scene>& scene, CreateInfo::
 
 	const auto& imageInfo = scene->GetImageInfo();
 
+#if defined(BVH_STATISTICS)
+	Common::Accelerators::TraversalStatistics::Reset();
+#endif
+
 	Common::PngDumper dumper((uint32_t)imageInfo.width, (uint32_t)imageInfo.height, scene->GetOutputFile());
 
 	switch (rendererInfo.rendererType)
@@ -29,5 +90,8 @@ void RayTracing::RenderScene(std::unique_ptr<Common::Scene>& scene, CreateInfo::
 			LOG(ERROR) << "Invalid renderer specified in scene";
 			break;
 	}
-	
+
+#if defined(BVH_STATISTICS)
+	DumpStatistics(*scene);
+#endif
 }
@@ -9,8 +9,19 @@ namespace RayTracing
     class Renderer
     {
     public:
+        virtual ~Renderer() = default;
+
         virtual void Render() = 0;
         virtual void TracePixel(uint32_t x, uint32_t y) = 0;
+
+        /* Stops a render in progress without touching the other work of the thread pool.
+         * Render returns once the tiles that already started notice it
+         */
+        void Cancel();
+
+    protected:
+        /* The tiles of the render */
+        Jnrlib::JobGroup mTiles;
     };
 
     void RenderScene(std::unique_ptr<Common::Scene>& scene, CreateInfo::RayTracing const& rendererInfo);
@@ -4,12 +4,18 @@
 #include "Scene/Components/Camera.h"
 #include "Scene/Components/Base.h"
 #include "CameraUtils.h"
+#include "RayPacket.h"
 #include "SimpleRayTracing.h"
 
 using namespace RayTracing;
 using namespace Common;
 
 constexpr uint32_t TILE_SIZE = 64;
+/* PACKET_SIZE x PACKET_SIZE pixels fill a packet */
+constexpr uint32_t PACKET_SIZE = 8;
+static_assert(PACKET_SIZE * PACKET_SIZE <= Common::RayPacket::MAX_SIZE);
+/* Shadow rays start this far along the normal, so they don't hit the surface they leave */
+constexpr Jnrlib::Float SHADOW_RAY_OFFSET = 0.001f;
 
 SimpleRayTracing::SimpleRayTracing(Common::IDumper& dumper, Common::Scene& scene, uint32_t maxDepth):
     mDumper(dumper),
@@ -19,7 +25,6 @@ SimpleRayTracing::SimpleRayTracing(Common::IDumper& dumper, Common::Scene& scene
 
 void SimpleRayTracing::Render()
 {
-    auto threadPool = Jnrlib::ThreadPool::Get();
     auto width = mDumper.GetWidth();
     auto height = mDumper.GetHeight();
 
@@ -30,37 +35,52 @@ void SimpleRayTracing::Render()
     {
         for (uint32_t x = 0; x < width; x += TILE_SIZE)
         {
-            threadPool->ExecuteDeffered(
-                std::bind(&SimpleRayTracing::RenderTile, this, x, y, tileId)
+            mTiles.ExecuteDeffered(
+                std::bind(&SimpleRayTracing::RenderTile, this, x, y, tileId, mTiles.GetToken())
             );
             tileId++;
         }
     }
 
-    threadPool->WaitForAll();
+    mTiles.Wait();
 }
 
 void SimpleRayTracing::TracePixel(uint32_t x, uint32_t y)
 {
     auto& cameraComponent = mScene.GetCameraEntity()->GetComponent<Common::Components::Camera>();
-    auto &cameraBaseComponent = mScene.GetCameraEntity()->GetComponent<Common::Components::Base>();
+    auto const& cameraTransform = mScene.GetTransformHierarchy().Get((entt::entity)*mScene.GetCameraEntity());
 
-    auto ray = Common::CameraUtils::GetRayForPixel(&cameraBaseComponent, &cameraComponent, x, y);
+    auto ray = Common::CameraUtils::GetRayForPixel(cameraTransform, &cameraComponent, x, y);
+    auto hp = mScene.GetClosestHit(ray);
+    ShadePixel(x, y, ray, hp);
+}
 
+void SimpleRayTracing::ShadePixel(uint32_t x, uint32_t y, Common::Ray const& ray, std::optional<Common::HitPoint> const& hp)
+{
     Jnrlib::Float t = Jnrlib::Half * (ray.direction.y + Jnrlib::One);
     Jnrlib::Color whiteSkyColor = Jnrlib::Color(Jnrlib::Half);
     Jnrlib::Color blueSkyColor = Jnrlib::Color(Jnrlib::Quarter, Jnrlib::Quarter, Jnrlib::One, 1.0f);
 
     Jnrlib::Color color = t * whiteSkyColor + (Jnrlib::One - t) * blueSkyColor;
 
-    if (auto hp = mScene.GetClosestHit(ray); hp.has_value())
+    if (hp.has_value())
     {
         auto material = hp->GetMaterial();
 
         if (std::optional<ScatterInfo> scatterInfo = material->Scatter(ray, *hp); scatterInfo.has_value())
             color = scatterInfo->attenuation;
 
-        Jnrlib::Float attenuation = std::clamp(glm::dot(hp->GetNormal(), glm::normalize(Jnrlib::Direction(0.5f, 0.5f, -1.0f))) + 0.2f, Jnrlib::Zero, Jnrlib::One);
+        Jnrlib::Direction lightDirection = glm::normalize(Jnrlib::Direction(0.5f, 0.5f, -1.0f));
+        Jnrlib::Direction normal = glm::normalize(hp->GetNormal());
+        Jnrlib::Float lightAmount = glm::dot(normal, lightDirection);
+        if (lightAmount > Jnrlib::Zero)
+        {
+            Common::Ray shadowRay(ray.At(hp->GetIntersectionPoint()) + normal * SHADOW_RAY_OFFSET, lightDirection);
+            if (mScene.IsOccluded(shadowRay, Jnrlib::Infinity))
+                lightAmount = Jnrlib::Zero;
+        }
+
+        Jnrlib::Float attenuation = std::clamp(lightAmount + 0.2f, Jnrlib::Zero, Jnrlib::One);
         color *= attenuation;
     }
 
@@ -68,18 +88,48 @@ void SimpleRayTracing::TracePixel(uint32_t x, uint32_t y)
     mDumper.AddDoneWork();
 }
 
-void SimpleRayTracing::RenderTile(uint32_t _x, uint32_t _y, uint32_t tileId)
+void SimpleRayTracing::RenderTile(uint32_t _x, uint32_t _y, uint32_t tileId, Jnrlib::CancellationToken token)
 {
     auto width = mDumper.GetWidth();
     auto height = mDumper.GetHeight();
 
+    auto& cameraComponent = mScene.GetCameraEntity()->GetComponent<Common::Components::Camera>();
+    auto const& cameraTransform = mScene.GetTransformHierarchy().Get((entt::entity)*mScene.GetCameraEntity());
+
     uint32_t actualWidth = std::min(_x + TILE_SIZE, width);
     uint32_t actualHeight = std::min(_y + TILE_SIZE, height);
-    for (uint32_t y = _y; y < actualHeight; ++y)
+
+    /* The primary rays of a block of pixels are traced together */
+    Common::RayPacket packet;
+    for (uint32_t blockY = _y; blockY < actualHeight; blockY += PACKET_SIZE)
     {
-        for (uint32_t x = _x; x < actualWidth; ++x)
+        for (uint32_t blockX = _x; blockX < actualWidth; blockX += PACKET_SIZE)
         {
-            TracePixel(x, y);
+            if (token.IsCancelled())
+                return;
+
+            uint32_t blockWidth = std::min(blockX + PACKET_SIZE, actualWidth);
+            uint32_t blockHeight = std::min(blockY + PACKET_SIZE, actualHeight);
+
+            packet.Clear();
+            for (uint32_t y = blockY; y < blockHeight; ++y)
+            {
+                for (uint32_t x = blockX; x < blockWidth; ++x)
+                {
+                    packet.Add(Common::CameraUtils::GetRayForPixel(cameraTransform, &cameraComponent, x, y));
+                }
+            }
+
+            mScene.GetClosestHits(packet);
+
+            uint32_t rayIndex = 0;
+            for (uint32_t y = blockY; y < blockHeight; ++y)
+            {
+                for (uint32_t x = blockX; x < blockWidth; ++x, ++rayIndex)
+                {
+                    ShadePixel(x, y, packet.rays[rayIndex], packet.hitPoints[rayIndex]);
+                }
+            }
         }
     }
 }
@@ -18,7 +18,8 @@ namespace RayTracing
         void TracePixel(uint32_t x, uint32_t y) override;
 
     private:
-        void RenderTile(uint32_t x, uint32_t y, uint32_t tileId);
+        void RenderTile(uint32_t x, uint32_t y, uint32_t tileId, Jnrlib::CancellationToken token);
+        void ShadePixel(uint32_t x, uint32_t y, Common::Ray const& ray, std::optional<Common::HitPoint> const& hp);
 
     private:
         Common::IDumper& mDumper;
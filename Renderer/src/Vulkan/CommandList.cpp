@@ -161,9 +161,9 @@ void CommandList::Draw(uint32_t vertexCount, uint32_t firstVertex)
     jnrCmdDraw(mCommandBuffers[mActiveCommandIndex], vertexCount, 1, firstVertex, 0);
 }
 
-void Vulkan::CommandList::DrawIndexedInstanced(uint32_t indexCount, uint32_t firstIndex, uint32_t vertexOffset)
+void Vulkan::CommandList::DrawIndexedInstanced(uint32_t indexCount, uint32_t firstIndex, uint32_t vertexOffset, uint32_t instanceCount, uint32_t firstInstance)
 {
-    jnrCmdDrawIndexed(mCommandBuffers[mActiveCommandIndex], indexCount, 1, firstIndex, vertexOffset, 0);
+    jnrCmdDrawIndexed(mCommandBuffers[mActiveCommandIndex], indexCount, instanceCount, firstIndex, vertexOffset, firstInstance);
 }
 
 void CommandList::BindPipeline(Pipeline* pipeline)
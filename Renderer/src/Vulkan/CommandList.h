@@ -55,7 +55,7 @@ namespace Vulkan
         void SetScissor(std::vector<VkRect2D> const& scissors);
         void SetViewports(std::vector<VkViewport> const& viewports);
         void Draw(uint32_t vertexCount, uint32_t firstVertex);
-        void DrawIndexedInstanced(uint32_t indexCount, uint32_t firstIndex, uint32_t vertexOffset);
+        void DrawIndexedInstanced(uint32_t indexCount, uint32_t firstIndex, uint32_t vertexOffset, uint32_t instanceCount = 1, uint32_t firstInstance = 0);
 
         void TransitionBackbufferTo(TransitionInfo const& transitionInfo);
         void TransitionImageTo(Image* img, TransitionInfo const& transitionInfo);
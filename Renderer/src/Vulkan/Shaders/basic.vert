@@ -5,6 +5,9 @@ struct PerObjectInfo {
     uint materialIndex;
 };
 
+/* Batched draws push INSTANCED_DRAW and read the object of each instance from the instance buffer */
+const uint INSTANCED_DRAW = 0xFFFFFFFF;
+
 layout(push_constant) uniform ObjectIndex
 {
     uint objectIndex;
@@ -20,6 +23,11 @@ layout(std140, set = 0, binding = 1) uniform UniformBufferObject
     mat4 viewProj;
 } uniformObject;
 
+layout(std430, set = 0, binding = 4) readonly buffer InstanceBuffer {
+
+    uint objectIndices[];
+} instanceBuffer;
+
 layout(location = 0) in vec3 position;
 layout(location = 1) in vec3 inNormal;
 
@@ -28,7 +36,10 @@ layout(location = 1) out vec3 outNormal;
 
 void main()
 {
-    PerObjectInfo ob = objectBuffer.objects[PushConstant.objectIndex];
+    uint objectIndex = PushConstant.objectIndex;
+    if (objectIndex == INSTANCED_DRAW)
+        objectIndex = instanceBuffer.objectIndices[gl_InstanceIndex];
+    PerObjectInfo ob = objectBuffer.objects[objectIndex];
     
     gl_Position = uniformObject.viewProj * ob.world * vec4(position, 1.0);
     
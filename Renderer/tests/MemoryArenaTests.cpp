@@ -0,0 +1,64 @@
+#ifdef BUILD_TESTS
+
+#include "gtest/gtest.h"
+#include "MemoryArena.h"
+#include "MathHelpers.h"
+
+#include "glog/logging.h"
+
+namespace
+{
+    struct alignas(16) AlignedObject
+    {
+        float values[4];
+    };
+
+    TEST(MemoryArenaTests, AllocationsAreAligned)
+    {
+        Jnrlib::MemoryArena arena(1024);
+        for (uint32_t i = 0; i < 100; ++i)
+        {
+            arena.Alloc(1, 1);
+            auto object = arena.Create<AlignedObject>();
+            EXPECT_TRUE(Jnrlib::IsAligned((uintptr_t)object, alignof(AlignedObject)));
+        }
+    }
+
+    TEST(MemoryArenaTests, ResetReusesMemory)
+    {
+        Jnrlib::MemoryArena arena(1024);
+        for (uint32_t i = 0; i < 100; ++i)
+        {
+            *arena.Create<uint64_t>() = i;
+        }
+        size_t reserved = arena.GetTotalReserved();
+        EXPECT_EQ(arena.GetTotalUsed(), 100 * sizeof(uint64_t));
+
+        arena.Reset();
+        EXPECT_EQ(arena.GetTotalUsed(), 0);
+        for (uint32_t i = 0; i < 100; ++i)
+        {
+            *arena.Create<uint64_t>() = i;
+        }
+        EXPECT_EQ(arena.GetTotalReserved(), reserved);
+
+        arena.Release();
+        EXPECT_EQ(arena.GetTotalReserved(), 0);
+    }
+
+    TEST(MemoryArenaTests, AllocationsBiggerThanABlock)
+    {
+        Jnrlib::MemoryArena arena(64);
+        auto values = arena.CreateArray<uint32_t>(1000);
+        for (uint32_t i = 0; i < 1000; ++i)
+        {
+            EXPECT_EQ(values[i], 0);
+            values[i] = i;
+        }
+        auto small = arena.Create<uint32_t>(5u);
+        EXPECT_EQ(*small, 5);
+        EXPECT_EQ(values[999], 999);
+    }
+}
+
+#endif
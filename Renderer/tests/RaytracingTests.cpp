@@ -5,8 +5,1430 @@
 
 #include "glog/logging.h"
 
+#include "Scene/Accelerators/BVH.h"
+#include "Scene/Accelerators/BVHCache.h"
+#include "Scene/Accelerators/KdTree.h"
+#include "Scene/Accelerators/TriangleLeaf.h"
+#include "Scene/Systems/TransformHierarchySystem.h"
+#include "Scene/Components/Base.h"
+#include "Scene/Components/Sphere.h"
+#include "Scene/Components/Mesh.h"
+#include "Scene/Components/MeshInstance.h"
+#include "Scene/Components/AccelerationStructure.h"
+#include "Scene/Entity.h"
+#include "Scene/Scene.h"
+#include "MaterialManager.h"
+
+#include <glm/gtx/transform.hpp>
+
+#include <numeric>
+#include <filesystem>
+#include <fstream>
+#include <cstring>
+
+using namespace Common;
+
 namespace
 {
+    Accelerators::BVH::Input CreateRandomTriangles(uint32_t triangleCount)
+    {
+        Accelerators::BVH::Input input{};
+        input.maxPrimsInNode = 5;
+        input.splitType = Accelerators::BVH::SplitType::SAH;
+        input.vertices.reserve(triangleCount * 3);
+        input.indices.reserve(triangleCount * 3);
+        for (uint32_t i = 0; i < triangleCount; ++i)
+        {
+            Jnrlib::Position center(Jnrlib::Random::get(-100.0f, 100.0f),
+                                    Jnrlib::Random::get(-100.0f, 100.0f),
+                                    Jnrlib::Random::get(-100.0f, 100.0f));
+            for (uint32_t j = 0; j < 3; ++j)
+            {
+                VertexPositionNormal vertex{};
+                vertex.position = center + Jnrlib::Position(Jnrlib::Random::get(-1.0f, 1.0f),
+                                                            Jnrlib::Random::get(-1.0f, 1.0f),
+                                                            Jnrlib::Random::get(-1.0f, 1.0f));
+                vertex.normal = Jnrlib::Up;
+                input.vertices.push_back(vertex);
+                input.indices.push_back(i * 3 + j);
+            }
+        }
+        return input;
+    }
+
+    void ExpectSameBVH(Accelerators::BVH::Output const& lhs, Accelerators::BVH::Output const& rhs)
+    {
+        EXPECT_EQ(lhs.new_indices, rhs.new_indices);
+        ASSERT_EQ(lhs.accelerationStructure.nodes.size(), rhs.accelerationStructure.nodes.size());
+        for (size_t i = 0; i < lhs.accelerationStructure.nodes.size(); ++i)
+        {
+            auto const& lhsNode = lhs.accelerationStructure.nodes[i];
+            auto const& rhsNode = rhs.accelerationStructure.nodes[i];
+            EXPECT_TRUE(lhsNode.bounds == rhsNode.bounds);
+            EXPECT_EQ(lhsNode.primitiveCount, rhsNode.primitiveCount);
+            EXPECT_EQ(lhsNode.primitiveOffset, rhsNode.primitiveOffset);
+        }
+    }
+
+    CreateInfo::Primitive CreateSpherePrimitive(std::string const& name, Jnrlib::Position const& position, Jnrlib::Float radius)
+    {
+        CreateInfo::Primitive primitive{};
+        primitive.primitiveType = CreateInfo::PrimitiveType::Sphere;
+        primitive.name = name;
+        primitive.materialName = "TestMaterial";
+        primitive.position = position;
+        primitive.radius = radius;
+        return primitive;
+    }
+
+    std::unique_ptr<Scene> CreateTestScene(std::vector<CreateInfo::Primitive> const& primitives)
+    {
+        CreateInfo::Material material{};
+        material.name = "TestMaterial";
+        material.type = CreateInfo::MaterialType::Lambertian;
+        material.attenuation = Jnrlib::Color(0.5f);
+        MaterialManager::Get()->AddMaterial(material);
+
+        CreateInfo::Scene info{};
+        info.outputFile = "test.png";
+        info.imageInfo = {16, 16};
+        info.primitives = primitives;
+        return std::make_unique<Scene>(info);
+    }
+
+    Entity* FindEntity(Scene& scene, std::string const& name)
+    {
+        for (auto const& entity : scene.GetEntities())
+        {
+            if (entity->GetComponent<Components::Base>().name == name)
+                return entity.get();
+        }
+        return nullptr;
+    }
+
+    /* Moves the entity and lets the scene catch up, like the editor does every frame */
+    void SetWorld(Scene& scene, std::string const& name, Jnrlib::Matrix4x4 const& world)
+    {
+        Entity* entity = FindEntity(scene, name);
+        ASSERT_NE(entity, nullptr);
+        entity->PatchComponent<Components::Base>([&](Components::Base& base)
+        {
+            base.world = world;
+        });
+        scene.PerformUpdate();
+    }
+
+    /* Writes the triangles as an .obj, so a scene loads them like any other mesh */
+    std::string WriteTestMesh(std::string const& name, Accelerators::BVH::Input const& triangles)
+    {
+        auto directory = std::filesystem::temp_directory_path() / "scene-tests";
+        std::filesystem::create_directories(directory);
+        auto path = directory / (name + ".obj");
+
+        std::ofstream file(path);
+        for (auto const& vertex : triangles.vertices)
+        {
+            file << "v " << vertex.position.x << " " << vertex.position.y << " " << vertex.position.z << "\n";
+        }
+        for (size_t i = 0; i < triangles.indices.size(); i += 3)
+        {
+            file << "f " << triangles.indices[i] + 1 << " " << triangles.indices[i + 1] + 1 << " " << triangles.indices[i + 2] + 1 << "\n";
+        }
+        return path.string();
+    }
+
+    CreateInfo::Primitive CreateMeshPrimitive(std::string const& name, std::string const& path, Jnrlib::Position const& position)
+    {
+        CreateInfo::Primitive primitive{};
+        primitive.primitiveType = CreateInfo::PrimitiveType::Mesh;
+        primitive.name = name;
+        primitive.materialName = "TestMaterial";
+        primitive.position = position;
+        primitive.path = path;
+        primitive.accelerationInfo.accelerationType = CreateInfo::AccelerationType::BVH;
+        primitive.accelerationInfo.cacheDirectory = "";
+        return primitive;
+    }
+
+    /* Closest sphere the ray hits, found by testing every sphere of the scene in world units, without any acceleration structure.
+     * Rays that barely touch a sphere may go either way in single precision, so they're reported as grazing instead
+     */
+    std::optional<std::pair<Jnrlib::Float, Entity*>> FindClosestSphereBruteForce(Scene& scene, Ray const& ray, bool& grazing)
+    {
+        grazing = false;
+        std::optional<std::pair<Jnrlib::Float, Entity*>> closest;
+        for (auto const& entity : scene.GetEntities())
+        {
+            auto const* sphere = entity->TryGetComponent<Components::Sphere>();
+            if (sphere == nullptr)
+                continue;
+
+            /* The direction isn't normalized again, so t is the same as in world space */
+            auto const& transform = scene.GetTransformHierarchy().Get((entt::entity)*entity);
+            Jnrlib::Position origin = transform.inverseWorld * glm::vec4(ray.origin, 1.0f);
+            Jnrlib::Direction direction = Jnrlib::Matrix3x3(transform.inverseWorld) * ray.direction;
+
+            double a = glm::dot(direction, direction);
+            double b = 2.0 * glm::dot(origin, direction);
+            double c = (double)glm::dot(origin, origin) - (double)sphere->radius * sphere->radius;
+            double discriminant = b * b - 4.0 * a * c;
+            if (std::abs(discriminant) < 1e-4 * b * b)
+                grazing = true;
+            if (discriminant < 0)
+                continue;
+
+            /* The rays start outside of every sphere, so the closest root is the hit */
+            Jnrlib::Float t = (Jnrlib::Float)((-b - std::sqrt(discriminant)) / (2.0 * a));
+            if (t > 0 && (!closest.has_value() || t < closest->first))
+                closest = std::make_pair(t, entity.get());
+        }
+        return closest;
+    }
+
+    /* Closest triangle of the mesh placed at world, found by testing every triangle in world space */
+    std::optional<Jnrlib::Float> FindClosestTriangleBruteForce(Scene& scene, Components::Mesh const& mesh, Jnrlib::Matrix4x4 const& world, Ray const& ray)
+    {
+        auto const& indices = scene.GetIndices();
+        auto const& vertices = scene.GetVertices();
+        std::optional<Jnrlib::Float> closest;
+        for (uint32_t i = 0; i < mesh.indices.indexCount; i += 3)
+        {
+            glm::dvec3 p[3];
+            for (uint32_t j = 0; j < 3; ++j)
+            {
+                Jnrlib::Position position = vertices[mesh.indices.firstVertex + indices[mesh.indices.firstIndex + i + j]].position;
+                p[j] = glm::dvec3(Jnrlib::Position(world * glm::vec4(position, 1.0f)));
+            }
+
+            /* Moller-Trumbore */
+            glm::dvec3 direction(ray.direction), origin(ray.origin);
+            glm::dvec3 edge1 = p[1] - p[0], edge2 = p[2] - p[0];
+            glm::dvec3 pvec = glm::cross(direction, edge2);
+            double determinant = glm::dot(edge1, pvec);
+            if (std::abs(determinant) < 1e-12)
+                continue;
+            glm::dvec3 tvec = origin - p[0];
+            double u = glm::dot(tvec, pvec) / determinant;
+            glm::dvec3 qvec = glm::cross(tvec, edge1);
+            double v = glm::dot(direction, qvec) / determinant;
+            double t = glm::dot(edge2, qvec) / determinant;
+            if (u < 0 || v < 0 || u + v > 1 || t <= 0)
+                continue;
+            if (!closest.has_value() || t < *closest)
+                closest = (Jnrlib::Float)t;
+        }
+        return closest;
+    }
+
+    /* Spheres all over the place, every other one scaled non-uniformly so it's tested through its transform */
+    std::unique_ptr<Scene> CreateRandomSphereScene(uint32_t sphereCount)
+    {
+        std::vector<CreateInfo::Primitive> primitives;
+        for (uint32_t i = 0; i < sphereCount; ++i)
+        {
+            primitives.push_back(CreateSpherePrimitive("Sphere" + std::to_string(i), Jnrlib::Position(0.0f), Jnrlib::Random::get(0.5f, 2.0f)));
+        }
+        auto scene = CreateTestScene(primitives);
+
+        for (uint32_t i = 0; i < sphereCount; ++i)
+        {
+            Jnrlib::Vec3 scale(Jnrlib::Random::get(0.5f, 2.0f));
+            if (i % 2)
+                scale = Jnrlib::Vec3(Jnrlib::Random::get(0.25f, 2.0f), Jnrlib::Random::get(0.25f, 2.0f), Jnrlib::Random::get(0.25f, 2.0f));
+            Jnrlib::Vec3 axis(Jnrlib::Random::get(-1.0f, 1.0f), Jnrlib::Random::get(-1.0f, 1.0f), Jnrlib::Random::get(0.1f, 1.0f));
+            Jnrlib::Position position(Jnrlib::Random::get(-20.0f, 20.0f), Jnrlib::Random::get(-20.0f, 20.0f), Jnrlib::Random::get(-20.0f, 20.0f));
+            SetWorld(*scene, "Sphere" + std::to_string(i),
+                     glm::translate(position) * glm::rotate(Jnrlib::Random::get(0.0f, 6.0f), axis) * glm::scale(scale));
+        }
+        return scene;
+    }
+
+    /* Starts far outside of the spheres of CreateRandomSphereScene and points somewhere around them */
+    Ray CreateRandomSceneRay()
+    {
+        Jnrlib::Position origin(Jnrlib::Random::get(-1.0f, 1.0f), Jnrlib::Random::get(-1.0f, 1.0f), Jnrlib::Random::get(-1.0f, 1.0f));
+        origin = glm::normalize(origin + Jnrlib::Position(1e-3f)) * 80.0f;
+        Jnrlib::Position target(Jnrlib::Random::get(-25.0f, 25.0f), Jnrlib::Random::get(-25.0f, 25.0f), Jnrlib::Random::get(-25.0f, 25.0f));
+        return Ray(origin, target - origin);
+    }
+
+    template <uint32_t Width>
+    void CollectWideBVHPrimitives(std::vector<Components::WideBVHNode<Width>> const& nodes, uint32_t nodeIndex, std::vector<uint32_t>& primitiveHits)
+    {
+        using Node = Components::WideBVHNode<Width>;
+        auto const& node = nodes[nodeIndex];
+        for (uint32_t i = 0; i < Width; ++i)
+        {
+            if (node.primitiveCount[i] == Node::EMPTY_CHILD)
+            {
+                EXPECT_GT(node.minX[i], node.maxX[i]);
+                continue;
+            }
+
+            EXPECT_LE(node.minX[i], node.maxX[i]);
+            EXPECT_LE(node.minY[i], node.maxY[i]);
+            EXPECT_LE(node.minZ[i], node.maxZ[i]);
+            if (node.primitiveCount[i] == Node::INTERIOR_CHILD)
+            {
+                CollectWideBVHPrimitives(nodes, node.childOffset[i], primitiveHits);
+            }
+            else
+            {
+                for (uint32_t j = 0; j < node.primitiveCount[i]; ++j)
+                {
+                    primitiveHits[node.childOffset[i] + j]++;
+                }
+            }
+        }
+    }
+
+    template <typename T>
+    void CheckQuantizedBVHBounds(Accelerators::BVH::Input const& input, Accelerators::BVH::Output const& output,
+                                 std::vector<Components::QuantizedBVHNode<T>> const& nodes, uint32_t nodeIndex,
+                                 float const nodeMin[3], float const nodeMax[3], uint32_t& primitivesFound)
+    {
+        using Node = Components::QuantizedBVHNode<T>;
+        auto const& node = nodes[nodeIndex];
+        for (uint32_t i = 0; i < 2; ++i)
+        {
+            if (node.primitiveCount[i] == Node::EMPTY_CHILD)
+                continue;
+
+            float childMin[3], childMax[3];
+            Components::DequantizeChildBounds(node, i, nodeMin, nodeMax, childMin, childMax);
+            if (node.primitiveCount[i] == Node::INTERIOR_CHILD)
+            {
+                CheckQuantizedBVHBounds(input, output, nodes, node.childOffset[i], childMin, childMax, primitivesFound);
+                continue;
+            }
+
+            /* Every vertex of every triangle in the leaf has to be inside the decoded box */
+            for (uint32_t j = 0; j < node.primitiveCount[i] * 3; ++j)
+            {
+                auto const& position = input.vertices[output.new_indices[node.childOffset[i] * 3 + j]].position;
+                for (uint32_t axis = 0; axis < 3; ++axis)
+                {
+                    EXPECT_LE(childMin[axis], position[axis]);
+                    EXPECT_GE(childMax[axis], position[axis]);
+                }
+            }
+            primitivesFound += node.primitiveCount[i];
+        }
+    }
+
+    TEST(BVH, ParallelBuildMatchesSerialBuild)
+    {
+        for (auto splitType : {Accelerators::BVH::SplitType::SAH, Accelerators::BVH::SplitType::Middle, Accelerators::BVH::SplitType::EqualCount})
+        {
+            auto input = CreateRandomTriangles(20000);
+            input.splitType = splitType;
+
+            input.buildThreads = 1;
+            auto serialOutput = Accelerators::BVH::Generate(input);
+
+            input.buildThreads = 0;
+            input.parallelGrainSize = 256;
+            auto parallelOutput = Accelerators::BVH::Generate(input);
+
+            ExpectSameBVH(serialOutput, parallelOutput);
+        }
+    }
+
+    TEST(BVH, MiddleSplitsAtTheCenterOfTheCentroids)
+    {
+        /* 90 triangles around x = 10 and 10 around x = 20; an equal count split would put 50 on each side */
+        Accelerators::BVH::Input input{};
+        input.maxPrimsInNode = 5;
+        input.splitType = Accelerators::BVH::SplitType::Middle;
+        for (uint32_t i = 0; i < 100; ++i)
+        {
+            Jnrlib::Float x = i < 90 ? 10.0f : 19.0f;
+            for (uint32_t j = 0; j < 3; ++j)
+            {
+                VertexPositionNormal vertex{};
+                vertex.position = Jnrlib::Position(x + Jnrlib::Random::get(0.0f, 1.0f), Jnrlib::Random::get(0.0f, 1.0f), Jnrlib::Random::get(0.0f, 1.0f));
+                vertex.normal = Jnrlib::Up;
+                input.vertices.push_back(vertex);
+                input.indices.push_back(i * 3 + j);
+            }
+        }
+        auto output = Accelerators::BVH::Generate(input);
+        auto const& nodes = output.accelerationStructure.nodes;
+        ASSERT_GT(nodes.size(), 1u);
+        ASSERT_EQ(nodes[0].primitiveCount, 0u);
+
+        /* The first child of the root is stored right after it, followed by its whole subtree */
+        uint32_t firstChildPrimitives = 0;
+        for (uint32_t i = 1; i < nodes[0].secondChildOffset; ++i)
+        {
+            firstChildPrimitives += nodes[i].primitiveCount;
+        }
+        EXPECT_EQ(firstChildPrimitives, 90u);
+    }
+
+    TEST(BVH, WideBVHReferencesEveryPrimitiveOnce)
+    {
+        auto input = CreateRandomTriangles(5000);
+        uint32_t triangleCount = (uint32_t)input.indices.size() / 3;
+
+        input.width = 4;
+        auto output4 = Accelerators::BVH::Generate(input);
+        std::vector<uint32_t> primitiveHits(triangleCount, 0);
+        CollectWideBVHPrimitives(output4.accelerationStructure.nodes4, 0, primitiveHits);
+        EXPECT_EQ(primitiveHits, std::vector<uint32_t>(triangleCount, 1));
+
+        input.width = 8;
+        auto output8 = Accelerators::BVH::Generate(input);
+        std::fill(primitiveHits.begin(), primitiveHits.end(), 0);
+        CollectWideBVHPrimitives(output8.accelerationStructure.nodes8, 0, primitiveHits);
+        EXPECT_EQ(primitiveHits, std::vector<uint32_t>(triangleCount, 1));
+        EXPECT_LT(output8.accelerationStructure.nodes8.size(), output4.accelerationStructure.nodes4.size());
+    }
+
+    TEST(BVH, HLBVHWideMortonCodesSplitDenseClusters)
+    {
+        auto input = CreateRandomTriangles(20000);
+        uint32_t triangleCount = (uint32_t)input.indices.size() / 3;
+        /* Half of the triangles are squeezed in a tiny cluster, where 30 bit Morton codes can't tell them apart */
+        for (uint32_t i = 0; i < triangleCount / 2 * 3; ++i)
+        {
+            input.vertices[i].position *= 0.0001f;
+        }
+        input.splitType = Accelerators::BVH::SplitType::HLBVH;
+        input.width = 4;
+        input.buildThreads = 0;
+        input.parallelGrainSize = 256;
+
+        uint32_t largestLeaf[2] = {};
+        for (uint32_t wide = 0; wide < 2; ++wide)
+        {
+            input.hlbvhWideMortonThreshold = wide ? 0 : std::numeric_limits<uint32_t>::max();
+            auto output = Accelerators::BVH::Generate(input);
+
+            std::vector<uint32_t> primitiveHits(triangleCount, 0);
+            CollectWideBVHPrimitives(output.accelerationStructure.nodes4, 0, primitiveHits);
+            EXPECT_EQ(primitiveHits, std::vector<uint32_t>(triangleCount, 1));
+
+            for (auto const& node : output.accelerationStructure.nodes4)
+            {
+                for (uint32_t i = 0; i < 4; ++i)
+                {
+                    if (node.primitiveCount[i] != Components::WideBVHNode<4>::EMPTY_CHILD &&
+                        node.primitiveCount[i] != Components::WideBVHNode<4>::INTERIOR_CHILD)
+                    {
+                        largestLeaf[wide] = std::max(largestLeaf[wide], (uint32_t)node.primitiveCount[i]);
+                    }
+                }
+            }
+        }
+        EXPECT_LE(largestLeaf[1], input.maxPrimsInNode);
+        EXPECT_GT(largestLeaf[0], largestLeaf[1]);
+    }
+
+    TEST(BVH, TreeletOptimizationLowersHLBVHCost)
+    {
+        auto input = CreateRandomTriangles(20000);
+        uint32_t triangleCount = (uint32_t)input.indices.size() / 3;
+        input.splitType = Accelerators::BVH::SplitType::HLBVH;
+        auto hlbvhOutput = Accelerators::BVH::Generate(input);
+
+        input.splitType = Accelerators::BVH::SplitType::HLBVH_Optimized;
+        input.width = 4;
+        input.buildThreads = 0;
+        input.parallelGrainSize = 256;
+        auto optimizedOutput = Accelerators::BVH::Generate(input);
+
+        /* Restructuring only moves whole leaves around */
+        EXPECT_EQ(hlbvhOutput.accelerationStructure.nodes.size(), optimizedOutput.accelerationStructure.nodes.size());
+        EXPECT_LT(optimizedOutput.accelerationStructure.buildCost, hlbvhOutput.accelerationStructure.buildCost);
+
+        std::vector<uint32_t> primitiveHits(triangleCount, 0);
+        CollectWideBVHPrimitives(optimizedOutput.accelerationStructure.nodes4, 0, primitiveHits);
+        EXPECT_EQ(primitiveHits, std::vector<uint32_t>(triangleCount, 1));
+
+        /* Every interior node has to bound its children */
+        auto const& nodes = optimizedOutput.accelerationStructure.nodes;
+        for (uint32_t i = 0; i < nodes.size(); ++i)
+        {
+            if (nodes[i].primitiveCount > 0)
+                continue;
+            EXPECT_TRUE(Union(nodes[i + 1].bounds, nodes[nodes[i].secondChildOffset].bounds) == nodes[i].bounds);
+        }
+    }
+
+    TEST(BVH, StatisticsDescribeTheTree)
+    {
+        auto input = CreateRandomTriangles(5000);
+        uint32_t triangleCount = (uint32_t)input.indices.size() / 3;
+        auto output = Accelerators::BVH::Generate(input);
+        auto statistics = Accelerators::BVH::ComputeStatistics(output.accelerationStructure);
+
+        EXPECT_EQ(statistics.nodeCount, output.accelerationStructure.nodes.size());
+        EXPECT_EQ(statistics.nodeCount, 2 * statistics.leafCount - 1);
+        EXPECT_FLOAT_EQ(statistics.sahCost, output.accelerationStructure.buildCost);
+        EXPECT_EQ(statistics.depthHistogram.size(), statistics.maxDepth + 1);
+        EXPECT_GE(statistics.memoryUsage, output.accelerationStructure.nodes.size() * sizeof(Components::LinearBVHNode));
+
+        EXPECT_EQ(std::accumulate(statistics.depthHistogram.begin(), statistics.depthHistogram.end(), 0u), statistics.leafCount);
+        uint32_t primitives = 0;
+        for (uint32_t size = 0; size < statistics.leafSizeHistogram.size(); ++size)
+        {
+            primitives += size * statistics.leafSizeHistogram[size];
+        }
+        EXPECT_EQ(primitives, triangleCount);
+
+        /* A compressed tree only keeps its quantized nodes, whose leaves are the same */
+        input.nodeCompression = Accelerators::BVH::NodeCompression::Quantized16;
+        auto compressed = Accelerators::BVH::ComputeStatistics(Accelerators::BVH::Generate(input).accelerationStructure);
+        EXPECT_EQ(compressed.leafCount, statistics.leafCount);
+        EXPECT_EQ(compressed.leafSizeHistogram, statistics.leafSizeHistogram);
+    }
+
+    TEST(BVH, QuantizedBoundsAreConservative)
+    {
+        auto input = CreateRandomTriangles(5000);
+        uint32_t triangleCount = (uint32_t)input.indices.size() / 3;
+
+        input.nodeCompression = Accelerators::BVH::NodeCompression::Quantized8;
+        auto output8 = Accelerators::BVH::Generate(input);
+        auto const& accel8 = output8.accelerationStructure;
+        ASSERT_FALSE(accel8.quantizedNodes8.empty());
+        EXPECT_TRUE(accel8.nodes.empty());
+        uint32_t primitivesFound = 0;
+        CheckQuantizedBVHBounds(input, output8, accel8.quantizedNodes8, 0, accel8.quantizedRootMin, accel8.quantizedRootMax, primitivesFound);
+        EXPECT_EQ(primitivesFound, triangleCount);
+
+        input.nodeCompression = Accelerators::BVH::NodeCompression::Quantized16;
+        auto output16 = Accelerators::BVH::Generate(input);
+        auto const& accel16 = output16.accelerationStructure;
+        ASSERT_FALSE(accel16.quantizedNodes16.empty());
+        primitivesFound = 0;
+        CheckQuantizedBVHBounds(input, output16, accel16.quantizedNodes16, 0, accel16.quantizedRootMin, accel16.quantizedRootMax, primitivesFound);
+        EXPECT_EQ(primitivesFound, triangleCount);
+    }
+
+    TEST(BVH, GenerateFromBoundsReferencesEveryBoxOnce)
+    {
+        std::vector<Jnrlib::BoundingBox> boxes;
+        for (uint32_t i = 0; i < 1000; ++i)
+        {
+            Jnrlib::Position center(Jnrlib::Random::get(-100.0f, 100.0f),
+                                    Jnrlib::Random::get(-100.0f, 100.0f),
+                                    Jnrlib::Random::get(-100.0f, 100.0f));
+            boxes.emplace_back(center - Jnrlib::Position(1.0f), center + Jnrlib::Position(1.0f));
+        }
+
+        Accelerators::BVH::Input input{};
+        input.maxPrimsInNode = 2;
+        input.splitType = Accelerators::BVH::SplitType::SAH;
+        auto output = Accelerators::BVH::GenerateFromBounds(input, boxes);
+
+        auto sortedOrder = output.primitiveOrder;
+        std::sort(sortedOrder.begin(), sortedOrder.end());
+        std::vector<uint32_t> expectedOrder(boxes.size());
+        std::iota(expectedOrder.begin(), expectedOrder.end(), 0);
+        EXPECT_EQ(sortedOrder, expectedOrder);
+
+        /* Every leaf has to contain the boxes it references */
+        for (auto const& node : output.accelerationStructure.nodes)
+        {
+            for (uint32_t i = 0; i < node.primitiveCount; ++i)
+            {
+                auto const& box = boxes[output.primitiveOrder[node.primitiveOffset + i]];
+                EXPECT_TRUE(Jnrlib::Union(node.bounds, box) == node.bounds);
+            }
+        }
+    }
+
+    TEST(BVH, RefitFollowsMovedTriangles)
+    {
+        auto input = CreateRandomTriangles(5000);
+        auto output = Accelerators::BVH::Generate(input);
+        auto& accelerationStructure = output.accelerationStructure;
+        auto const& nodes = accelerationStructure.nodes;
+
+        /* Small moves keep the tree good enough */
+        for (auto& vertex : input.vertices)
+        {
+            vertex.position += Jnrlib::Position(10.0f) + Jnrlib::Position(Jnrlib::Random::get(-0.1f, 0.1f));
+        }
+        EXPECT_TRUE(Accelerators::BVH::Refit(accelerationStructure, output.new_indices.data(), input.vertices.data()));
+
+        for (size_t i = 0; i < nodes.size(); ++i)
+        {
+            auto const& node = nodes[i];
+            if (node.primitiveCount == 0)
+            {
+                EXPECT_TRUE(node.bounds == Jnrlib::Union(nodes[i + 1].bounds, nodes[node.secondChildOffset].bounds));
+                continue;
+            }
+            for (uint32_t j = 0; j < node.primitiveCount * 3; ++j)
+            {
+                auto const& position = input.vertices[output.new_indices[node.primitiveOffset * 3 + j]].position;
+                for (uint32_t axis = 0; axis < 3; ++axis)
+                {
+                    EXPECT_LE(node.bounds.pMin[axis], position[axis]);
+                    EXPECT_GE(node.bounds.pMax[axis], position[axis]);
+                }
+            }
+        }
+
+        /* Scattering the vertices makes every triangle span the whole scene */
+        for (auto& vertex : input.vertices)
+        {
+            vertex.position = Jnrlib::Position(Jnrlib::Random::get(-100.0f, 100.0f),
+                                               Jnrlib::Random::get(-100.0f, 100.0f),
+                                               Jnrlib::Random::get(-100.0f, 100.0f));
+        }
+        EXPECT_FALSE(Accelerators::BVH::Refit(accelerationStructure, output.new_indices.data(), input.vertices.data()));
+    }
+
+    TEST(BVH, SpatialSplitsCoverEveryTriangle)
+    {
+        /* Long thin triangles, which is where spatial splits help */
+        Accelerators::BVH::Input input{};
+        input.maxPrimsInNode = 4;
+        input.splitType = Accelerators::BVH::SplitType::SAH;
+        for (uint32_t i = 0; i < 2000; ++i)
+        {
+            Jnrlib::Position start(Jnrlib::Random::get(-100.0f, 100.0f), Jnrlib::Random::get(-100.0f, 100.0f), Jnrlib::Random::get(-100.0f, 100.0f));
+            Jnrlib::Position end(Jnrlib::Random::get(-100.0f, 100.0f), Jnrlib::Random::get(-100.0f, 100.0f), Jnrlib::Random::get(-100.0f, 100.0f));
+            for (auto const& position : {start, end, end + Jnrlib::Position(0.5f)})
+            {
+                VertexPositionNormal vertex{};
+                vertex.position = position;
+                vertex.normal = Jnrlib::Up;
+                input.vertices.push_back(vertex);
+                input.indices.push_back((uint32_t)input.indices.size());
+            }
+        }
+        uint32_t triangleCount = (uint32_t)input.indices.size() / 3;
+        auto sahOutput = Accelerators::BVH::Generate(input);
+
+        input.splitType = Accelerators::BVH::SplitType::SBVH;
+        input.sbvhMemoryBudget = 0.5f;
+        auto output = Accelerators::BVH::Generate(input);
+        auto const& nodes = output.accelerationStructure.nodes;
+
+        uint32_t referenceCount = (uint32_t)output.new_indices.size() / 3;
+        EXPECT_GT(referenceCount, triangleCount);
+        EXPECT_LE(referenceCount, triangleCount + triangleCount / 2);
+        EXPECT_LT(output.accelerationStructure.buildCost, sahOutput.accelerationStructure.buildCost);
+
+        /* Every point of every triangle has to be inside one of the leaves which reference that triangle */
+        std::vector<std::vector<Jnrlib::BoundingBox>> triangleLeaves(triangleCount);
+        for (auto const& node : nodes)
+        {
+            for (uint32_t i = 0; i < node.primitiveCount; ++i)
+            {
+                uint32_t triangle = output.new_indices[(node.primitiveOffset + i) * 3] / 3;
+                triangleLeaves[triangle].push_back(node.bounds);
+            }
+        }
+        for (uint32_t triangle = 0; triangle < triangleCount; ++triangle)
+        {
+            ASSERT_FALSE(triangleLeaves[triangle].empty());
+            for (uint32_t sample = 0; sample < 16; ++sample)
+            {
+                Jnrlib::Float u = Jnrlib::Random::get(0.0f, 1.0f);
+                Jnrlib::Float v = Jnrlib::Random::get(0.0f, 1.0f - u);
+                Jnrlib::Position point = input.vertices[triangle * 3 + 0].position * (1 - u - v) +
+                    input.vertices[triangle * 3 + 1].position * u + input.vertices[triangle * 3 + 2].position * v;
+
+                bool covered = std::any_of(triangleLeaves[triangle].begin(), triangleLeaves[triangle].end(), [&](Jnrlib::BoundingBox const& bounds)
+                {
+                    for (uint32_t axis = 0; axis < 3; ++axis)
+                    {
+                        if (point[axis] < bounds.pMin[axis] - 1e-3f || point[axis] > bounds.pMax[axis] + 1e-3f)
+                            return false;
+                    }
+                    return true;
+                });
+                EXPECT_TRUE(covered);
+            }
+        }
+    }
+
+    TEST(BVH, PrecomputedTrianglesAreStoredPerLeaf)
+    {
+        auto input = CreateRandomTriangles(5000);
+        input.precomputeTriangles = true;
+        auto output = Accelerators::BVH::Generate(input);
+        auto& accelerationStructure = output.accelerationStructure;
+        ASSERT_EQ(accelerationStructure.precomputedTriangles.size(), output.new_indices.size() / 3 * Components::PRECOMPUTED_TRIANGLE_FLOATS);
+
+        auto checkLeaves = [&]()
+        {
+            for (auto const& node : accelerationStructure.nodes)
+            {
+                float const* leaf = accelerationStructure.precomputedTriangles.data() + node.primitiveOffset * Components::PRECOMPUTED_TRIANGLE_FLOATS;
+                for (uint32_t i = 0; i < node.primitiveCount; ++i)
+                {
+                    uint32_t first = (node.primitiveOffset + i) * 3;
+                    glm::vec3 p0 = input.vertices[output.new_indices[first + 0]].position;
+                    glm::vec3 p1 = input.vertices[output.new_indices[first + 1]].position;
+                    glm::vec3 p2 = input.vertices[output.new_indices[first + 2]].position;
+                    for (uint32_t axis = 0; axis < 3; ++axis)
+                    {
+                        EXPECT_EQ(leaf[(0 + axis) * node.primitiveCount + i], p0[axis]);
+                        EXPECT_EQ(leaf[(3 + axis) * node.primitiveCount + i], p1[axis] - p0[axis]);
+                        EXPECT_EQ(leaf[(6 + axis) * node.primitiveCount + i], p2[axis] - p0[axis]);
+                    }
+                }
+            }
+        };
+        checkLeaves();
+
+        /* Refitting updates them as well */
+        for (auto& vertex : input.vertices)
+        {
+            vertex.position += glm::vec3(Jnrlib::Random::get(-0.1f, 0.1f));
+        }
+        Accelerators::BVH::Refit(accelerationStructure, output.new_indices.data(), input.vertices.data());
+        checkLeaves();
+    }
+
+    TEST(TriangleLeaf, SimdKernelsMatchScalar)
+    {
+        using namespace Accelerators::TriangleLeaf;
+
+        /* Big leaves, so there are full groups of 8 and every kind of tail */
+        auto input = CreateRandomTriangles(2000);
+        input.maxPrimsInNode = 13;
+        input.precomputeTriangles = true;
+        auto output = Accelerators::BVH::Generate(input);
+        auto const& accelerationStructure = output.accelerationStructure;
+
+        auto scalar = GetKernel(Kernel::Scalar);
+        uint32_t hits = 0;
+        for (Kernel kernel : {Kernel::SSE, Kernel::AVX})
+        {
+            if (!IsSupported(kernel))
+            {
+                LOG(INFO) << "Skipping leaf kernel " << magic_enum::enum_name(kernel) << ", the CPU doesn't support it";
+                continue;
+            }
+            auto simd = GetKernel(kernel);
+
+            for (auto const& node : accelerationStructure.nodes)
+            {
+                if (node.primitiveCount == 0)
+                    continue;
+                float const* leaf = accelerationStructure.precomputedTriangles.data() + node.primitiveOffset * Components::PRECOMPUTED_TRIANGLE_FLOATS;
+                Jnrlib::Position center = (node.bounds.pMin + node.bounds.pMax) * Jnrlib::Half;
+                for (uint32_t i = 0; i < 16; ++i)
+                {
+                    /* Aimed at the leaf, so most rays hit something. Half of them are short, to check maxT is respected */
+                    Jnrlib::Position origin = center + Jnrlib::Position(Jnrlib::Random::get(-20.0f, 20.0f),
+                                                                        Jnrlib::Random::get(-20.0f, 20.0f),
+                                                                        Jnrlib::Random::get(-20.0f, 20.0f));
+                    Jnrlib::Position target = center + Jnrlib::Position(Jnrlib::Random::get(-1.0f, 1.0f),
+                                                                        Jnrlib::Random::get(-1.0f, 1.0f),
+                                                                        Jnrlib::Random::get(-1.0f, 1.0f));
+                    glm::vec3 direction = glm::normalize(glm::vec3(target - origin));
+                    float maxT = i % 2 ? glm::length(glm::vec3(target - origin)) : std::numeric_limits<float>::max();
+
+                    LeafRay scalarRay{.origin = {(float)origin.x, (float)origin.y, (float)origin.z},
+                                      .direction = {direction.x, direction.y, direction.z}, .maxT = maxT};
+                    LeafRay simdRay = scalarRay;
+                    LeafHit scalarHit{}, simdHit{};
+                    bool scalarResult = scalar(scalarRay, leaf, node.primitiveCount, scalarHit);
+                    bool simdResult = simd(simdRay, leaf, node.primitiveCount, simdHit);
+
+                    ASSERT_EQ(scalarResult, simdResult) << magic_enum::enum_name(kernel) << " with " << node.primitiveCount << " triangles";
+                    if (!scalarResult)
+                    {
+                        EXPECT_EQ(simdRay.maxT, maxT);
+                        continue;
+                    }
+                    hits++;
+                    EXPECT_EQ(scalarHit.index, simdHit.index);
+                    EXPECT_FLOAT_EQ(scalarRay.maxT, simdRay.maxT);
+                    EXPECT_FLOAT_EQ(scalarHit.u, simdHit.u);
+                    EXPECT_FLOAT_EQ(scalarHit.v, simdHit.v);
+                }
+            }
+        }
+        if (IsSupported(Kernel::SSE))
+        {
+            EXPECT_GT(hits, 0u);
+        }
+    }
+
+    TEST(TriangleLeaf, PacketKernelMatchesSingleRays)
+    {
+        using namespace Accelerators::TriangleLeaf;
+
+        auto input = CreateRandomTriangles(2000);
+        input.maxPrimsInNode = 13;
+        input.precomputeTriangles = true;
+        auto output = Accelerators::BVH::Generate(input);
+        auto const& accelerationStructure = output.accelerationStructure;
+
+        uint32_t hits = 0, misses = 0;
+        for (auto const& node : accelerationStructure.nodes)
+        {
+            if (node.primitiveCount == 0)
+                continue;
+            float const* leaf = accelerationStructure.precomputedTriangles.data() + node.primitiveOffset * Components::PRECOMPUTED_TRIANGLE_FLOATS;
+            Jnrlib::Position center = (node.bounds.pMin + node.bounds.pMax) * Jnrlib::Half;
+
+            /* The last lane stays empty, like the unused lanes of a packet */
+            LeafRay4 packet{};
+            LeafRay single[3];
+            for (uint32_t lane = 0; lane < 3; ++lane)
+            {
+                Jnrlib::Position origin = center + Jnrlib::Position(Jnrlib::Random::get(-20.0f, 20.0f),
+                                                                    Jnrlib::Random::get(-20.0f, 20.0f),
+                                                                    Jnrlib::Random::get(-20.0f, 20.0f));
+                Jnrlib::Position target = center + Jnrlib::Position(Jnrlib::Random::get(-1.0f, 1.0f),
+                                                                    Jnrlib::Random::get(-1.0f, 1.0f),
+                                                                    Jnrlib::Random::get(-1.0f, 1.0f));
+                if (lane != 1)
+                {
+                    /* Aim at a point inside one of the triangles, so some rays are sure to hit */
+                    uint32_t triangle = Jnrlib::Random::get(0u, node.primitiveCount - 1);
+                    float u = Jnrlib::Random::get(0.1f, 0.45f);
+                    float v = Jnrlib::Random::get(0.1f, 0.45f);
+                    for (uint32_t axis = 0; axis < 3; ++axis)
+                    {
+                        target[axis] = leaf[axis * node.primitiveCount + triangle] +
+                            u * leaf[(3 + axis) * node.primitiveCount + triangle] +
+                            v * leaf[(6 + axis) * node.primitiveCount + triangle];
+                    }
+                }
+                glm::vec3 direction = glm::normalize(glm::vec3(target - origin));
+                float maxT = lane == 1 ? glm::length(glm::vec3(target - origin)) : std::numeric_limits<float>::max();
+
+                single[lane] = LeafRay{.origin = {(float)origin.x, (float)origin.y, (float)origin.z},
+                                       .direction = {direction.x, direction.y, direction.z}, .maxT = maxT};
+                packet.originX[lane] = (float)origin.x;
+                packet.originY[lane] = (float)origin.y;
+                packet.originZ[lane] = (float)origin.z;
+                packet.directionX[lane] = direction.x;
+                packet.directionY[lane] = direction.y;
+                packet.directionZ[lane] = direction.z;
+                packet.maxT[lane] = maxT;
+            }
+
+            LeafHit4 packetHits{};
+            uint32_t mask = Intersect4(packet, leaf, node.primitiveCount, packetHits);
+            ASSERT_EQ(mask & 8u, 0u);
+            for (uint32_t lane = 0; lane < 3; ++lane)
+            {
+                LeafHit hit{};
+                bool result = Intersect(single[lane], leaf, node.primitiveCount, hit);
+                ASSERT_EQ(result, (mask & (1u << lane)) != 0);
+                if (!result)
+                {
+                    misses++;
+                    continue;
+                }
+                hits++;
+                EXPECT_EQ(hit.index, packetHits.index[lane]);
+                EXPECT_FLOAT_EQ(single[lane].maxT, packet.maxT[lane]);
+                EXPECT_FLOAT_EQ(hit.u, packetHits.u[lane]);
+                EXPECT_FLOAT_EQ(hit.v, packetHits.v[lane]);
+            }
+        }
+        EXPECT_GT(hits, 0u);
+        EXPECT_GT(misses, 0u);
+    }
+
+    TEST(BVH, CacheRoundTripsAndRejectsCorruptEntries)
+    {
+        auto input = CreateRandomTriangles(1000);
+        input.width = 4;
+        auto output = Accelerators::BVH::Generate(input);
+
+        Accelerators::BVHCache::Entry entry{};
+        entry.accelerationStructure = output.accelerationStructure;
+        entry.indices = output.new_indices;
+        entry.vertices = input.vertices;
+
+        auto directory = std::filesystem::temp_directory_path() / "bvh-cache-tests";
+        std::filesystem::remove_all(directory);
+        uint64_t key = Accelerators::BVHCache::ComputeKey(42, input);
+        std::string entryPath = Accelerators::BVHCache::GetEntryPath(directory.string(), "meshes/mesh.obj", key);
+        ASSERT_TRUE(Accelerators::BVHCache::Store(entryPath, key, entry));
+
+        auto loaded = Accelerators::BVHCache::Load(entryPath, key);
+        ASSERT_TRUE(loaded.has_value());
+        auto const& accelerationStructure = loaded->accelerationStructure;
+        ASSERT_EQ(accelerationStructure.nodes.size(), entry.accelerationStructure.nodes.size());
+        ASSERT_EQ(accelerationStructure.nodes4.size(), entry.accelerationStructure.nodes4.size());
+        EXPECT_EQ(accelerationStructure.width, 4u);
+        EXPECT_EQ(accelerationStructure.buildCost, entry.accelerationStructure.buildCost);
+        EXPECT_EQ(loaded->indices, entry.indices);
+        ASSERT_EQ(loaded->vertices.size(), entry.vertices.size());
+        EXPECT_EQ(memcmp(loaded->vertices.data(), entry.vertices.data(), entry.vertices.size() * sizeof(VertexPositionNormal)), 0);
+        for (size_t i = 0; i < accelerationStructure.nodes.size(); ++i)
+        {
+            EXPECT_TRUE(accelerationStructure.nodes[i].bounds == entry.accelerationStructure.nodes[i].bounds);
+            EXPECT_EQ(accelerationStructure.nodes[i].primitiveOffset, entry.accelerationStructure.nodes[i].primitiveOffset);
+            EXPECT_EQ(accelerationStructure.nodes[i].primitiveCount, entry.accelerationStructure.nodes[i].primitiveCount);
+        }
+        EXPECT_EQ(memcmp(accelerationStructure.nodes4.data(), entry.accelerationStructure.nodes4.data(),
+                         entry.accelerationStructure.nodes4.size() * sizeof(Components::BVH4Node)), 0);
+
+        /* Different content or parameters => different key */
+        EXPECT_NE(Accelerators::BVHCache::ComputeKey(43, input), key);
+        input.maxPrimsInNode++;
+        EXPECT_NE(Accelerators::BVHCache::ComputeKey(42, input), key);
+        EXPECT_FALSE(Accelerators::BVHCache::Load(entryPath, key + 1).has_value());
+
+        /* Flip one byte of the payload */
+        {
+            std::fstream file(entryPath, std::ios::binary | std::ios::in | std::ios::out);
+            file.seekg(-16, std::ios::end);
+            char value = 0;
+            file.read(&value, 1);
+            value = ~value;
+            file.seekp(-16, std::ios::end);
+            file.write(&value, 1);
+        }
+        EXPECT_FALSE(Accelerators::BVHCache::Load(entryPath, key).has_value());
+
+        /* Truncated */
+        std::filesystem::resize_file(entryPath, std::filesystem::file_size(entryPath) / 2);
+        EXPECT_FALSE(Accelerators::BVHCache::Load(entryPath, key).has_value());
+
+        std::filesystem::remove_all(directory);
+        EXPECT_FALSE(Accelerators::BVHCache::Load(entryPath, key).has_value());
+    }
+
+    TEST(BVH, CacheHashCoversFilesNextToTheMesh)
+    {
+        auto directory = std::filesystem::temp_directory_path() / "bvh-cache-hash-tests";
+        std::filesystem::remove_all(directory);
+        std::filesystem::create_directories(directory);
+        auto writeFile = [&](std::string const& name, std::string const& content)
+        {
+            std::ofstream(directory / name, std::ios::binary) << content;
+        };
+        writeFile("mesh.obj", "mtllib mesh.mtl\nv 0 0 0\nv 1 0 0\nv 0 1 0\nf 1 2 3\n");
+        writeFile("mesh.mtl", "newmtl red\nKd 1 0 0\n");
+        writeFile("other.obj", "v 0 0 0\n");
+
+        std::string meshPath = (directory / "mesh.obj").string();
+        uint64_t hash = Accelerators::BVHCache::HashMeshFiles(meshPath);
+        EXPECT_NE(hash, 0u);
+        EXPECT_EQ(Accelerators::BVHCache::HashMeshFiles(meshPath), hash);
+
+        /* Files with another stem are ignored */
+        writeFile("other.obj", "v 1 1 1\n");
+        EXPECT_EQ(Accelerators::BVHCache::HashMeshFiles(meshPath), hash);
+
+        writeFile("mesh.mtl", "newmtl red\nKd 0 1 0\n");
+        uint64_t changedMaterialHash = Accelerators::BVHCache::HashMeshFiles(meshPath);
+        EXPECT_NE(changedMaterialHash, hash);
+
+        writeFile("mesh.bin", "buffer");
+        EXPECT_NE(Accelerators::BVHCache::HashMeshFiles(meshPath), changedMaterialHash);
+
+        EXPECT_EQ(Accelerators::BVHCache::HashMeshFiles((directory / "missing.obj").string()), 0u);
+        std::filesystem::remove_all(directory);
+    }
+
+    TEST(KdTree, LeavesReferenceEveryTriangleTheyOverlap)
+    {
+        auto bvhInput = CreateRandomTriangles(5000);
+        Accelerators::KdTree::Input input{};
+        input.indices = bvhInput.indices;
+        input.vertices = bvhInput.vertices;
+        auto kdTree = Accelerators::KdTree::Generate(input);
+        ASSERT_FALSE(kdTree.Empty());
+        EXPECT_GT(kdTree.nodes.size(), 1u);
+
+        /* Every point of a triangle is in a leaf, and that leaf has to reference the triangle */
+        uint32_t triangleCount = (uint32_t)input.indices.size() / 3;
+        for (uint32_t triangle = 0; triangle < triangleCount; ++triangle)
+        {
+            for (uint32_t sample = 0; sample < 8; ++sample)
+            {
+                Jnrlib::Float u = Jnrlib::Random::get(0.0f, 1.0f);
+                Jnrlib::Float v = Jnrlib::Random::get(0.0f, 1.0f - u);
+                Jnrlib::Position point = input.vertices[input.indices[triangle * 3 + 0]].position * (1 - u - v) +
+                    input.vertices[input.indices[triangle * 3 + 1]].position * u + input.vertices[input.indices[triangle * 3 + 2]].position * v;
+
+                uint32_t nodeIndex = 0;
+                while (!kdTree.nodes[nodeIndex].IsLeaf())
+                {
+                    auto const& node = kdTree.nodes[nodeIndex];
+                    nodeIndex = point[node.GetSplitAxis()] < node.split ? nodeIndex + 1 : node.GetAboveChild();
+                }
+
+                auto const& leaf = kdTree.nodes[nodeIndex];
+                auto first = kdTree.primitiveIndices.begin() + leaf.primitiveOffset;
+                EXPECT_NE(std::find(first, first + leaf.GetPrimitiveCount(), triangle), first + leaf.GetPrimitiveCount());
+            }
+        }
+    }
+
+    TEST(Transforms, HierarchyMatchesParentChain)
+    {
+        entt::registry registry;
+        std::vector<std::unique_ptr<Entity>> entities;
+        std::vector<Entity*> rootEntities;
+        for (uint32_t i = 0; i < 200; ++i)
+        {
+            Entity* parent = nullptr;
+            if (!entities.empty() && Jnrlib::Random::get(0, 3) != 0)
+                parent = entities[Jnrlib::Random::get(0, (int)entities.size() - 1)].get();
+
+            auto entity = std::make_unique<Entity>(registry.create(), registry);
+            Jnrlib::Matrix4x4 world = glm::translate(Jnrlib::Vec3(Jnrlib::Random::get(-10.0f, 10.0f))) *
+                                      glm::scale(Jnrlib::Vec3(Jnrlib::Random::get(0.5f, 2.0f)));
+            entity->AddComponent(Components::Base{ .world = world, .name = "Entity", .entityPtr = entity.get() });
+            if (parent)
+                entity->SetParent(parent);
+            else
+                rootEntities.push_back(entity.get());
+            entities.push_back(std::move(entity));
+        }
+
+        Systems::TransformHierarchy transforms;
+        transforms.Build(rootEntities);
+        ASSERT_EQ(transforms.GetTransforms().size(), entities.size());
+
+        for (auto const& entity : entities)
+        {
+            Jnrlib::Matrix4x4 world = entity->GetComponent<Components::Base>().world;
+            for (auto parent = entity->GetParent(); parent != nullptr; parent = parent->GetParent())
+            {
+                world = world * parent->GetComponent<Components::Base>().world;
+            }
+
+            auto const& transform = transforms.Get((entt::entity)*entity);
+            for (uint32_t column = 0; column < 4; ++column)
+            {
+                for (uint32_t row = 0; row < 4; ++row)
+                {
+                    EXPECT_NEAR(transform.world[column][row], world[column][row], 1e-3f);
+                }
+            }
+            Jnrlib::Matrix4x4 identity = transform.world * transform.inverseWorld;
+            for (uint32_t column = 0; column < 4; ++column)
+            {
+                EXPECT_NEAR(identity[column][column], 1.0f, 1e-3f);
+            }
+            EXPECT_NEAR(transform.translation.x, world[3].x, 1e-3f);
+        }
+    }
+
+    TEST(SceneQueries, ScaledSphereHitsAreInWorldUnits)
+    {
+        /* Squashed along the ray, so t in its local space is twice the one in world space */
+        auto scene = CreateTestScene({CreateSpherePrimitive("Scaled", Jnrlib::Position(0.0f), 1.0f),
+                                      CreateSpherePrimitive("World", Jnrlib::Position(5.0f, 0.0f, 0.0f), 1.0f)});
+        SetWorld(*scene, "Scaled", glm::scale(Jnrlib::Vec3(0.5f, 1.0f, 2.0f)));
+
+        Ray ray(Jnrlib::Position(-10.0f, 0.0f, 0.0f), Jnrlib::Direction(1.0f, 0.0f, 0.0f));
+        auto hp = scene->GetClosestHit(ray);
+        ASSERT_TRUE(hp.has_value());
+        EXPECT_EQ(hp->GetEntity(), FindEntity(*scene, "Scaled"));
+        EXPECT_NEAR(hp->GetIntersectionPoint(), 9.5f, 1e-3f);
+        EXPECT_NEAR(ray.maxT, 9.5f, 1e-3f);
+        EXPECT_NEAR(ray.At(hp->GetIntersectionPoint()).x, -0.5f, 1e-3f);
+        EXPECT_NEAR(hp->GetNormal().x, -1.0f, 1e-3f);
+
+        /* From the other side the world sphere is in front */
+        Ray backRay(Jnrlib::Position(10.0f, 0.0f, 0.0f), Jnrlib::Direction(-1.0f, 0.0f, 0.0f));
+        hp = scene->GetClosestHit(backRay);
+        ASSERT_TRUE(hp.has_value());
+        EXPECT_EQ(hp->GetEntity(), FindEntity(*scene, "World"));
+        EXPECT_NEAR(hp->GetIntersectionPoint(), 4.0f, 1e-3f);
+
+        /* Along the stretched axis t in local space is half the one in world space */
+        Ray upRay(Jnrlib::Position(0.0f, 0.0f, -10.0f), Jnrlib::Direction(0.0f, 0.0f, 1.0f));
+        hp = scene->GetClosestHit(upRay);
+        ASSERT_TRUE(hp.has_value());
+        EXPECT_NEAR(hp->GetIntersectionPoint(), 8.0f, 1e-3f);
+        EXPECT_NEAR(upRay.maxT, 8.0f, 1e-3f);
+    }
+
+    TEST(SceneQueries, TopLevelBVHMatchesBruteForce)
+    {
+        auto scene = CreateRandomSphereScene(200);
+
+        uint32_t hits = 0, misses = 0;
+        for (uint32_t i = 0; i < 2000; ++i)
+        {
+            Ray ray = CreateRandomSceneRay();
+            bool grazing;
+            auto expected = FindClosestSphereBruteForce(*scene, ray, grazing);
+            if (grazing)
+                continue;
+
+            auto hp = scene->GetClosestHit(ray);
+            ASSERT_EQ(hp.has_value(), expected.has_value());
+            if (!hp.has_value())
+            {
+                misses++;
+                continue;
+            }
+            hits++;
+            EXPECT_NEAR(hp->GetIntersectionPoint(), expected->first, 1e-3f * expected->first);
+            EXPECT_NEAR(ray.maxT, expected->first, 1e-3f * expected->first);
+            EXPECT_EQ(hp->GetEntity(), expected->second);
+        }
+        EXPECT_GT(hits, 0u);
+        EXPECT_GT(misses, 0u);
+    }
+
+    TEST(SceneQueries, OcclusionMatchesClosestHit)
+    {
+        {
+            /* Hit at t = 9.5 along x, where t is doubled in local space, and at t = 8 along z, where it's halved */
+            auto scene = CreateTestScene({CreateSpherePrimitive("Scaled", Jnrlib::Position(0.0f), 1.0f)});
+            SetWorld(*scene, "Scaled", glm::scale(Jnrlib::Vec3(0.5f, 1.0f, 2.0f)));
+
+            Ray ray(Jnrlib::Position(-10.0f, 0.0f, 0.0f), Jnrlib::Direction(1.0f, 0.0f, 0.0f));
+            EXPECT_FALSE(scene->IsOccluded(ray, 9.0f));
+            EXPECT_TRUE(scene->IsOccluded(ray, 10.0f));
+
+            Ray upRay(Jnrlib::Position(0.0f, 0.0f, -10.0f), Jnrlib::Direction(0.0f, 0.0f, 1.0f));
+            EXPECT_FALSE(scene->IsOccluded(upRay, 6.0f));
+            EXPECT_TRUE(scene->IsOccluded(upRay, 8.5f));
+        }
+
+        auto scene = CreateRandomSphereScene(200);
+        uint32_t occluded = 0, visible = 0;
+        for (uint32_t i = 0; i < 2000; ++i)
+        {
+            Ray ray = CreateRandomSceneRay();
+            bool grazing;
+            FindClosestSphereBruteForce(*scene, ray, grazing);
+            if (grazing)
+                continue;
+
+            Jnrlib::Float maxT = Jnrlib::Random::get(1.0f, 120.0f);
+            Ray closestRay = ray;
+            auto hp = scene->GetClosestHit(closestRay);
+            /* Too close to call in single precision */
+            if (hp.has_value() && std::abs(hp->GetIntersectionPoint() - maxT) < 1e-3f * maxT)
+                continue;
+
+            bool expected = hp.has_value() && hp->GetIntersectionPoint() < maxT;
+            EXPECT_EQ(scene->IsOccluded(ray, maxT), expected);
+            expected ? occluded++ : visible++;
+        }
+        EXPECT_GT(occluded, 0u);
+        EXPECT_GT(visible, 0u);
+    }
+
+    /* Two clusters of triangles; the edge of one triangle lies on the front face (z = 0) of every box around the first cluster */
+    Accelerators::BVH::Input CreateTrianglesWithEdgeOnBoxFace()
+    {
+        Accelerators::BVH::Input triangles{};
+        auto addTriangle = [&](Jnrlib::Position const& a, Jnrlib::Position const& b, Jnrlib::Position const& c)
+        {
+            for (auto const& position : {a, b, c})
+            {
+                VertexPositionNormal vertex{};
+                vertex.position = position;
+                vertex.normal = Jnrlib::Up;
+                triangles.indices.push_back((uint32_t)triangles.vertices.size());
+                triangles.vertices.push_back(vertex);
+            }
+        };
+        addTriangle(Jnrlib::Position(5.0f, -1.0f, 0.0f), Jnrlib::Position(5.0f, 1.0f, 0.0f), Jnrlib::Position(5.0f, 0.0f, -1.0f));
+        for (Jnrlib::Float clusterZ : {-10.0f, 60.0f})
+        {
+            for (uint32_t i = 0; i < 200; ++i)
+            {
+                Jnrlib::Position center(Jnrlib::Random::get(-20.0f, 20.0f), Jnrlib::Random::get(-20.0f, 20.0f), clusterZ + Jnrlib::Random::get(-8.0f, 8.0f));
+                addTriangle(center + Jnrlib::Position(Jnrlib::Random::get(-1.0f, 1.0f), Jnrlib::Random::get(-1.0f, 1.0f), Jnrlib::Random::get(-1.0f, 1.0f)),
+                            center + Jnrlib::Position(Jnrlib::Random::get(-1.0f, 1.0f), Jnrlib::Random::get(-1.0f, 1.0f), Jnrlib::Random::get(-1.0f, 1.0f)),
+                            center + Jnrlib::Position(Jnrlib::Random::get(-1.0f, 1.0f), Jnrlib::Random::get(-1.0f, 1.0f), Jnrlib::Random::get(-1.0f, 1.0f)));
+            }
+        }
+        return triangles;
+    }
+
+    TEST(SceneQueries, PacketsMatchSingleRays)
+    {
+        auto triangles = CreateRandomTriangles(20000);
+        auto scene = CreateTestScene({CreateMeshPrimitive("Mesh", WriteTestMesh("PacketsMatchSingleRays", triangles), Jnrlib::Position(0.0f)),
+                                      CreateSpherePrimitive("Sphere", Jnrlib::Position(30.0f, 0.0f, 0.0f), 20.0f)});
+        SetWorld(*scene, "Mesh", glm::rotate(0.3f, Jnrlib::Vec3(0.0f, 1.0f, 0.0f)) * glm::scale(Jnrlib::Vec3(0.8f, 0.6f, 1.2f)));
+
+        /* 8x8 blocks of a pinhole camera in front of the scene, like the primary rays of the renderer */
+        const uint32_t size = 64;
+        const Jnrlib::Position eye(0.0f, 0.0f, -300.0f);
+        uint32_t hits = 0, misses = 0;
+        for (uint32_t blockY = 0; blockY < size; blockY += 8)
+        {
+            for (uint32_t blockX = 0; blockX < size; blockX += 8)
+            {
+                RayPacket packet;
+                for (uint32_t y = blockY; y < blockY + 8; ++y)
+                {
+                    for (uint32_t x = blockX; x < blockX + 8; ++x)
+                    {
+                        Jnrlib::Position target((x + 0.5f) / size * 280.0f - 140.0f, (y + 0.5f) / size * 280.0f - 140.0f, 0.0f);
+                        packet.Add(Ray(eye, target - eye));
+                    }
+                }
+                scene->GetClosestHits(packet);
+
+                for (uint32_t i = 0; i < packet.size; ++i)
+                {
+                    Ray ray(packet.rays[i].origin, packet.rays[i].direction);
+                    auto hp = scene->GetClosestHit(ray);
+                    ASSERT_EQ(hp.has_value(), packet.hitPoints[i].has_value());
+                    if (!hp.has_value())
+                    {
+                        misses++;
+                        continue;
+                    }
+                    hits++;
+                    EXPECT_NEAR(packet.hitPoints[i]->GetIntersectionPoint(), hp->GetIntersectionPoint(), 1e-3f * hp->GetIntersectionPoint());
+                    EXPECT_NEAR(packet.rays[i].maxT, ray.maxT, 1e-3f * ray.maxT);
+                    EXPECT_EQ(packet.hitPoints[i]->GetEntity(), hp->GetEntity());
+                    EXPECT_NEAR(glm::dot(packet.hitPoints[i]->GetNormal(), hp->GetNormal()), 1.0f, 1e-3f);
+                }
+            }
+        }
+        EXPECT_GT(hits, 0u);
+        EXPECT_GT(misses, 0u);
+
+        /* Rays parallel to the z face they start on have NaN z slabs, which must not cull the boxes of that face */
+        auto faceScene = CreateTestScene({CreateMeshPrimitive("Mesh", WriteTestMesh("PacketsMatchSingleRaysOnFaces", CreateTrianglesWithEdgeOnBoxFace()), Jnrlib::Position(0.0f))});
+        RayPacket packet;
+        for (uint32_t i = 0; i < 8; ++i)
+        {
+            packet.Add(Ray(Jnrlib::Position(-30.0f, -0.875f + 0.25f * i, 0.0f), Jnrlib::Direction(1.0f, 0.0f, 0.0f)));
+        }
+        faceScene->GetClosestHits(packet);
+        for (uint32_t i = 0; i < packet.size; ++i)
+        {
+            Ray ray(packet.rays[i].origin, packet.rays[i].direction);
+            auto hp = faceScene->GetClosestHit(ray);
+            ASSERT_TRUE(hp.has_value()) << "ray " << i;
+            ASSERT_TRUE(packet.hitPoints[i].has_value()) << "ray " << i;
+            EXPECT_NEAR(packet.hitPoints[i]->GetIntersectionPoint(), hp->GetIntersectionPoint(), 1e-3f) << "ray " << i;
+        }
+    }
+
+    TEST(SceneQueries, WideBVHsFindTheSameHits)
+    {
+        auto path = WriteTestMesh("WideBVHsFindTheSameHits", CreateRandomTriangles(20000));
+        std::vector<Ray> rays;
+        const Jnrlib::Position eye(0.0f, 0.0f, -300.0f);
+        for (uint32_t i = 0; i < 2000; ++i)
+        {
+            Jnrlib::Position target(Jnrlib::Random::get(-140.0f, 140.0f), Jnrlib::Random::get(-140.0f, 140.0f), 0.0f);
+            rays.push_back(Ray(eye, target - eye));
+        }
+
+        /* The 8 wide nodes go through the AVX slab test on CPUs which have it, the others through SSE */
+        std::vector<std::optional<Jnrlib::Float>> binaryHits;
+        for (uint32_t width : {2u, 4u, 8u})
+        {
+            auto primitive = CreateMeshPrimitive("Mesh", path, Jnrlib::Position(0.0f));
+            primitive.accelerationInfo.bvhWidth = width;
+            auto scene = CreateTestScene({primitive});
+
+            uint32_t hits = 0;
+            for (uint32_t i = 0; i < rays.size(); ++i)
+            {
+                Ray ray = rays[i];
+                auto hp = scene->GetClosestHit(ray);
+                std::optional<Jnrlib::Float> t;
+                if (hp.has_value())
+                {
+                    t = hp->GetIntersectionPoint();
+                    hits++;
+                }
+
+                if (width == 2)
+                {
+                    binaryHits.push_back(t);
+                    continue;
+                }
+                ASSERT_EQ(t.has_value(), binaryHits[i].has_value()) << "width " << width << ", ray " << i;
+                if (t.has_value())
+                {
+                    EXPECT_NEAR(*t, *binaryHits[i], 1e-3f * *t) << "width " << width << ", ray " << i;
+                }
+            }
+            EXPECT_GT(hits, 0u);
+            EXPECT_LT(hits, rays.size());
+        }
+    }
+
+    TEST(SceneQueries, AxisParallelRaysOnBoxFacesHitInEveryWidth)
+    {
+        auto path = WriteTestMesh("AxisParallelRaysOnBoxFacesHitInEveryWidth", CreateTrianglesWithEdgeOnBoxFace());
+
+        /* The rays run along x at z = 0, so their z slabs are 0 * inf = NaN. Such a plane can't cull anything;
+         * every ray has to hit the edge of the first triangle
+         */
+        for (uint32_t width : {2u, 4u, 8u})
+        {
+            auto primitive = CreateMeshPrimitive("Mesh", path, Jnrlib::Position(0.0f));
+            primitive.accelerationInfo.bvhWidth = width;
+            auto scene = CreateTestScene({primitive});
+
+            for (Jnrlib::Float y = -0.75f; y <= 0.75f; y += 0.25f)
+            {
+                Ray ray(Jnrlib::Position(-30.0f, y, 0.0f), Jnrlib::Direction(1.0f, 0.0f, 0.0f));
+                auto hp = scene->GetClosestHit(ray);
+                ASSERT_TRUE(hp.has_value()) << "width " << width << ", y " << y;
+                EXPECT_NEAR(hp->GetIntersectionPoint(), 35.0f, 1e-3f) << "width " << width << ", y " << y;
+            }
+        }
+    }
+
+    TEST(SceneQueries, MeshInstancesShareTheAccelerationStructure)
+    {
+        auto path = WriteTestMesh("MeshInstancesShareTheAccelerationStructure", CreateRandomTriangles(2000));
+        auto scene = CreateTestScene({CreateMeshPrimitive("Source", path, Jnrlib::Position(0.0f)),
+                                      CreateMeshPrimitive("Copy", path, Jnrlib::Position(0.0f))});
+        SetWorld(*scene, "Copy", glm::translate(Jnrlib::Vec3(300.0f, 0.0f, 0.0f)) *
+                                 glm::rotate(1.0f, Jnrlib::Vec3(1.0f, 1.0f, 0.0f)) * glm::scale(Jnrlib::Vec3(0.5f, 1.5f, 1.0f)));
+
+        /* The copy only references the mesh and the acceleration structure of the source */
+        Entity* entities[2] = {FindEntity(*scene, "Source"), FindEntity(*scene, "Copy")};
+        ASSERT_NE(entities[0], nullptr);
+        ASSERT_NE(entities[1], nullptr);
+        ASSERT_NE(entities[0]->TryGetComponent<Components::AccelerationStructure>(), nullptr);
+        EXPECT_EQ(entities[1]->TryGetComponent<Components::AccelerationStructure>(), nullptr);
+        auto const* meshInstance = entities[1]->TryGetComponent<Components::MeshInstance>();
+        ASSERT_NE(meshInstance, nullptr);
+        EXPECT_EQ(meshInstance->source, (entt::entity)*entities[0]);
+
+        auto const& sourceMesh = entities[0]->GetComponent<Components::Mesh>();
+        auto const& copyMesh = entities[1]->GetComponent<Components::Mesh>();
+        EXPECT_EQ(copyMesh.indices.firstVertex, sourceMesh.indices.firstVertex);
+        EXPECT_EQ(copyMesh.indices.firstIndex, sourceMesh.indices.firstIndex);
+        EXPECT_EQ(copyMesh.indices.indexCount, sourceMesh.indices.indexCount);
+        EXPECT_EQ(scene->GetIndices().size(), sourceMesh.indices.indexCount);
+
+        auto const& instances = scene->GetTopLevelBVH().GetInstances();
+        ASSERT_EQ(instances.size(), 2u);
+        for (auto const& instance : instances)
+        {
+            EXPECT_EQ(instance.geometry, (entt::entity)*entities[0]);
+        }
+
+        /* Rays aimed at the middle of a triangle of each instance have to hit it where its own transform placed it */
+        auto const& indices = scene->GetIndices();
+        auto const& vertices = scene->GetVertices();
+        for (uint32_t e = 0; e < 2; ++e)
+        {
+            Jnrlib::Matrix4x4 const& world = scene->GetTransformHierarchy().Get((entt::entity)*entities[e]).world;
+            for (uint32_t i = 0; i < 200; ++i)
+            {
+                uint32_t triangle = Jnrlib::Random::get(0u, sourceMesh.indices.indexCount / 3 - 1);
+                Jnrlib::Position center(0.0f);
+                for (uint32_t j = 0; j < 3; ++j)
+                {
+                    center += vertices[sourceMesh.indices.firstVertex + indices[sourceMesh.indices.firstIndex + triangle * 3 + j]].position / 3.0f;
+                }
+                center = world * glm::vec4(center, 1.0f);
+                Jnrlib::Direction offset(Jnrlib::Random::get(-1.0f, 1.0f), Jnrlib::Random::get(-1.0f, 1.0f), Jnrlib::Random::get(-1.0f, 1.0f));
+                Jnrlib::Position origin = center + glm::normalize(offset + Jnrlib::Direction(1e-3f)) * 400.0f;
+
+                Ray ray(origin, center - origin);
+                std::optional<Jnrlib::Float> expected[2];
+                for (uint32_t k = 0; k < 2; ++k)
+                {
+                    expected[k] = FindClosestTriangleBruteForce(*scene, sourceMesh, scene->GetTransformHierarchy().Get((entt::entity)*entities[k]).world, ray);
+                }
+                ASSERT_TRUE(expected[e].has_value());
+                uint32_t closest = expected[1 - e].has_value() && *expected[1 - e] < *expected[e] ? 1 - e : e;
+
+                auto hp = scene->GetClosestHit(ray);
+                ASSERT_TRUE(hp.has_value());
+                EXPECT_EQ(hp->GetEntity(), entities[closest]);
+                EXPECT_NEAR(hp->GetIntersectionPoint(), *expected[closest], 1e-3f * *expected[closest]);
+                EXPECT_NEAR(ray.maxT, *expected[closest], 1e-3f * *expected[closest]);
+            }
+        }
+    }
+
+    TEST(SceneQueries, UpdatedMeshVerticesAreRefitted)
+    {
+        auto scene = CreateTestScene({CreateMeshPrimitive("Mesh", WriteTestMesh("UpdatedMeshVerticesAreRefitted", CreateRandomTriangles(2000)), Jnrlib::Position(0.0f))});
+        Entity* entity = FindEntity(*scene, "Mesh");
+        ASSERT_NE(entity, nullptr);
+        auto const& mesh = entity->GetComponent<Components::Mesh>();
+        auto const& accelerationStructure = entity->GetComponent<Components::AccelerationStructure>();
+        ASSERT_EQ(mesh.indices.vertexCount, 6000u);
+
+        std::vector<VertexPositionNormal> vertices(scene->GetVertices().begin() + mesh.indices.firstVertex,
+                                                   scene->GetVertices().begin() + mesh.indices.firstVertex + mesh.indices.vertexCount);
+        for (uint32_t step = 0; step < 2; ++step)
+        {
+            /* A small move is only refitted, scattering the vertices degrades the tree enough to rebuild it */
+            Jnrlib::Float distance = step == 0 ? 0.5f : 100.0f;
+            for (auto& vertex : vertices)
+            {
+                vertex.position += Jnrlib::Position(Jnrlib::Random::get(-distance, distance),
+                                                    Jnrlib::Random::get(-distance, distance),
+                                                    Jnrlib::Random::get(-distance, distance));
+            }
+            size_t nodeCount = accelerationStructure.nodes.size();
+            Jnrlib::Float buildCost = accelerationStructure.buildCost;
+            scene->UpdateMeshVertices(entity, vertices);
+            scene->PerformUpdate();
+            if (step == 0)
+            {
+                EXPECT_EQ(accelerationStructure.nodes.size(), nodeCount);
+                EXPECT_EQ(accelerationStructure.buildCost, buildCost);
+            }
+            else
+            {
+                EXPECT_NE(accelerationStructure.buildCost, buildCost);
+            }
+
+            /* Same bounds as a BVH built from scratch over the moved triangles */
+            Accelerators::BVH::Input input{};
+            input.splitType = Accelerators::BVH::SplitType::SAH;
+            input.vertices.assign(scene->GetVertices().begin() + mesh.indices.firstVertex,
+                                  scene->GetVertices().begin() + mesh.indices.firstVertex + mesh.indices.vertexCount);
+            input.indices.assign(scene->GetIndices().begin() + mesh.indices.firstIndex,
+                                 scene->GetIndices().begin() + mesh.indices.firstIndex + mesh.indices.indexCount);
+            auto output = Accelerators::BVH::Generate(input);
+            EXPECT_TRUE(accelerationStructure.GetBounds() == output.accelerationStructure.GetBounds());
+            ASSERT_EQ(scene->GetTopLevelBVH().GetInstances().size(), 1u);
+            EXPECT_TRUE(scene->GetTopLevelBVH().GetInstances()[0].worldBounds == output.accelerationStructure.GetBounds());
+
+            /* Every leaf still holds its triangles */
+            for (auto const& node : accelerationStructure.nodes)
+            {
+                for (uint32_t i = 0; i < node.primitiveCount * 3; ++i)
+                {
+                    auto const& position = input.vertices[input.indices[node.primitiveOffset * 3 + i]].position;
+                    for (uint32_t axis = 0; axis < 3; ++axis)
+                    {
+                        EXPECT_LE(node.bounds.pMin[axis], position[axis]);
+                        EXPECT_GE(node.bounds.pMax[axis], position[axis]);
+                    }
+                }
+            }
+
+            Jnrlib::Matrix4x4 const identity = glm::identity<Jnrlib::Matrix4x4>();
+            for (uint32_t i = 0; i < 200; ++i)
+            {
+                uint32_t triangle = Jnrlib::Random::get(0u, mesh.indices.indexCount / 3 - 1);
+                Jnrlib::Position center(0.0f);
+                for (uint32_t j = 0; j < 3; ++j)
+                {
+                    center += input.vertices[input.indices[triangle * 3 + j]].position / 3.0f;
+                }
+                Ray ray(Jnrlib::Position(0.0f, 0.0f, -400.0f), center - Jnrlib::Position(0.0f, 0.0f, -400.0f));
+                auto expected = FindClosestTriangleBruteForce(*scene, mesh, identity, ray);
+                ASSERT_TRUE(expected.has_value());
+
+                auto hp = scene->GetClosestHit(ray);
+                ASSERT_TRUE(hp.has_value());
+                EXPECT_NEAR(hp->GetIntersectionPoint(), *expected, 1e-3f * *expected);
+            }
+        }
+    }
 }
 
-#endif
\ No newline at end of file
+#endif
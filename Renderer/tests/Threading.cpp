@@ -21,7 +21,7 @@ namespace
         result += "Task1";
     }
 
-    void Func2(std::string& result, std::mutex& mu, std::shared_ptr<struct Task> task1)
+    void Func2(std::string& result, std::mutex& mu, TaskHandle task1)
     {
         auto threadPool = ThreadPool::Get();
         threadPool->Wait(task1, ThreadPool::WaitPolicy::EXIT_ASAP);
@@ -30,7 +30,7 @@ namespace
         result += "Task2";
     }
 
-    void Func3(std::string& result, std::mutex& mu, std::shared_ptr<struct Task> task1)
+    void Func3(std::string& result, std::mutex& mu, TaskHandle task1)
     {
         auto threadPool = ThreadPool::Get();
         threadPool->Wait(task1, ThreadPool::WaitPolicy::EXIT_ASAP);
@@ -39,7 +39,7 @@ namespace
         result += "Task3";
     }
 
-    void Func4(std::string& result, std::mutex& mu, std::shared_ptr<struct Task> task2, std::shared_ptr<struct Task> task3)
+    void Func4(std::string& result, std::mutex& mu, TaskHandle task2, TaskHandle task3)
     {
         auto threadPool = ThreadPool::Get();
         threadPool->Wait(task2, ThreadPool::WaitPolicy::EXIT_ASAP);
@@ -145,7 +145,7 @@ namespace
         constexpr const unsigned int numbersCount = 1000;
         int numbers[numbersCount];
 
-        std::shared_ptr<struct Task> first_task;
+        TaskHandle first_task;
 
         for (uint32_t j = 0; j < numbersCount; ++j)
         {
@@ -177,7 +177,7 @@ namespace
         constexpr const unsigned int numbersCount = 1000;
         int numbers[numbersCount];
 
-        std::shared_ptr<struct Task> first_task;
+        TaskHandle first_task;
 
         for (uint32_t j = 0; j < numbersCount; ++j)
         {
@@ -208,7 +208,7 @@ namespace
 
         constexpr const unsigned int numbersCount = 1000;
         int numbers[numbersCount];
-        std::shared_ptr<struct Task> first_task;
+        TaskHandle first_task;
 
         for (uint32_t j = 0; j < numbersCount; ++j)
         {
@@ -241,7 +241,7 @@ namespace
         std::mutex numbersMutex;
         std::set<uint32_t> numbers;
 
-        std::shared_ptr<struct Task> task =
+        TaskHandle task =
             threadPool->ExecuteDeffered([&numbersMutex, &numbers]()
         {
             std::unique_lock<std::mutex> lock(numbersMutex);
@@ -265,7 +265,7 @@ namespace
         constexpr unsigned int numbersCount = 1000;
         uint32_t numbers[numbersCount];
 
-        std::shared_ptr<struct Task> task =
+        TaskHandle task =
             threadPool->ExecuteDeffered(
                 [&numbers]()
                 {
@@ -290,7 +290,7 @@ namespace
         std::mutex numbersMutex;
         std::set<uint32_t> numbers;
 
-        std::shared_ptr<struct Task> task =
+        TaskHandle task =
             threadPool->ExecuteDeffered(
                 [&numbersMutex, &numbers]()
                 {
@@ -353,6 +353,282 @@ namespace
         threadPool->WaitForAll();
     }
 
+    TEST(Threading, HandlesOfReusedTasksStayCompleted)
+    {
+        auto threadPool = ThreadPool::Get();
+
+        std::atomic<uint32_t> executed = 0;
+        TaskHandle first = threadPool->ExecuteDeffered([&executed]() { executed++; });
+        threadPool->Wait(first);
+        EXPECT_TRUE(threadPool->IsTaskCompleted(first));
+
+        /* Enough tasks to reuse the storage of the first one */
+        constexpr const uint32_t tasksCount = 10000;
+        std::vector<TaskHandle> tasks;
+        for (uint32_t i = 0; i < tasksCount; ++i)
+        {
+            tasks.push_back(threadPool->ExecuteDeffered([&executed]() { executed++; }));
+            EXPECT_TRUE(threadPool->IsTaskCompleted(first));
+        }
+        for (auto const& task : tasks)
+        {
+            threadPool->Wait(task);
+        }
+        threadPool->WaitForAll();
+
+        EXPECT_EQ(executed, tasksCount + 1);
+        EXPECT_TRUE(threadPool->IsTaskCompleted(first));
+    }
+
+    TEST(Threading, SmallCapturesAreStoredInline)
+    {
+        struct Capture
+        {
+            void* pointers[8];
+        };
+        Capture capture{};
+        auto small = [capture]() { (void)capture; };
+        auto large = [capture, capture2 = capture]() { (void)capture; (void)capture2; };
+        EXPECT_TRUE(TaskFunction::IsStoredInline<decltype(small)>());
+        EXPECT_FALSE(TaskFunction::IsStoredInline<decltype(large)>());
+
+        /* Both still run */
+        uint32_t calls = 0;
+        TaskFunction smallTask = [&calls, capture]() { (void)capture; calls++; };
+        TaskFunction largeTask = [&calls, capture, capture2 = capture]() { (void)capture; (void)capture2; calls++; };
+        TaskFunction movedTask = std::move(largeTask);
+        smallTask();
+        movedTask();
+        EXPECT_EQ(calls, 2);
+        EXPECT_FALSE(largeTask);
+    }
+
+    TEST_P(Threading, TaskGraphRunsAfterPredecessors)
+    {
+        auto threadPool = ThreadPool::Get();
+
+        std::atomic<uint32_t> order = 0;
+        uint32_t first = 0, left = 0, right = 0, last = 0;
+
+        auto firstTask = threadPool->ExecuteDeffered([&]() { first = ++order; });
+        auto leftTask = threadPool->Then(firstTask, [&]() { left = ++order; });
+        auto rightTask = threadPool->Then(firstTask, [&]() { right = ++order; });
+        auto lastTask = threadPool->ExecuteAfter({ leftTask, rightTask, TaskHandle{} }, [&]() { last = ++order; });
+
+        TaskHandle branches[] = { leftTask, rightTask, lastTask };
+        auto join = threadPool->Join(branches);
+        threadPool->Wait(join);
+
+        EXPECT_EQ(first, 1);
+        EXPECT_TRUE((left == 2 && right == 3) || (left == 3 && right == 2));
+        EXPECT_EQ(last, 4);
+        EXPECT_TRUE(threadPool->IsTaskCompleted(lastTask));
+
+        /* Already completed predecessors don't hold anything back */
+        bool executed = false;
+        threadPool->Wait(threadPool->Then(firstTask, [&]() { executed = true; }));
+        EXPECT_TRUE(executed);
+    }
+
+    TEST(Threading, ContinuationsOfCancelledTasksAreCancelled)
+    {
+        auto threadPool = ThreadPool::Get();
+
+        /* Keep every worker busy, so the next task stays in the queue */
+        std::atomic<uint32_t> started = 0;
+        std::atomic<bool> release = false;
+        for (uint32_t i = 0; i < threadPool->GetNumberOfThreads(); ++i)
+        {
+            threadPool->ExecuteDeffered([&]()
+            {
+                started++;
+                while (!release)
+                    std::this_thread::yield();
+            });
+        }
+        while (started != threadPool->GetNumberOfThreads())
+            std::this_thread::yield();
+
+        std::atomic<uint32_t> executed = 0;
+        auto task = threadPool->ExecuteDeffered([&]() { executed++; });
+        auto continuation = threadPool->Then(task, [&]() { executed++; });
+        auto nextContinuation = threadPool->Then(continuation, [&]() { executed++; });
+
+        threadPool->CancelRemainingTasks();
+        release = true;
+
+        threadPool->Wait(nextContinuation, ThreadPool::WaitPolicy::EXIT_ASAP);
+        threadPool->WaitForAll();
+        EXPECT_EQ(executed, 0);
+        EXPECT_TRUE(threadPool->IsTaskCompleted(continuation));
+    }
+
+    /* Every task forks two children and waits for them, so owners push and pop their deques while idle threads steal from them */
+    void ForkTaskTree(uint32_t depth, std::atomic<uint32_t>& leaves)
+    {
+        if (depth == 0)
+        {
+            leaves++;
+            return;
+        }
+
+        auto threadPool = ThreadPool::Get();
+        auto left = threadPool->ExecuteDeffered([depth, &leaves]() { ForkTaskTree(depth - 1, leaves); });
+        auto right = threadPool->ExecuteDeffered([depth, &leaves]() { ForkTaskTree(depth - 1, leaves); });
+        threadPool->Wait(right);
+        threadPool->Wait(left);
+    }
+
+    TEST(Threading, OversubscribedTaskTreesComplete)
+    {
+        auto threadPool = ThreadPool::Get();
+        auto spinBudget = threadPool->GetSpinBudget();
+
+        /* Threads outside the pool submit and wait too, so there are more threads than cores fighting over the same deques */
+        uint32_t externalThreads = std::max(std::thread::hardware_concurrency(), 1u) * 2 + 2;
+        constexpr uint32_t depth = 8;
+        for (uint32_t budget : { spinBudget, 0u })
+        {
+            threadPool->SetSpinBudget(budget);
+            for (uint32_t round = 0; round < 5; ++round)
+            {
+                std::atomic<uint32_t> leaves = 0;
+                std::vector<std::thread> threads;
+                for (uint32_t i = 0; i < externalThreads; ++i)
+                {
+                    threads.emplace_back([&]()
+                    {
+                        auto root = threadPool->ExecuteDeffered([&]() { ForkTaskTree(depth, leaves); });
+                        threadPool->Wait(root);
+                    });
+                }
+                for (auto& thread : threads)
+                {
+                    thread.join();
+                }
+                EXPECT_EQ(leaves, externalThreads << depth);
+            }
+        }
+
+        threadPool->SetSpinBudget(spinBudget);
+    }
+
+    /* With a spin budget of 0 nothing spins: idle workers and waiting threads sleep right away. Checks that nothing is left
+     * asleep, i.e. that queuing a task wakes a sleeping worker and that finishing a task wakes the threads waiting on it
+     */
+    TEST_P(Threading, WaitsCompleteWithoutSpinning)
+    {
+        auto threadPool = ThreadPool::Get();
+        auto spinBudget = threadPool->GetSpinBudget();
+        threadPool->SetSpinBudget(0);
+
+        std::atomic<uint32_t> executed = 0;
+        auto slowTask = threadPool->ExecuteDeffered([&]()
+        {
+            std::this_thread::sleep_for(1ms);
+            executed++;
+        });
+        auto continuation = threadPool->Then(slowTask, [&]() { executed++; });
+        threadPool->Wait(continuation, ThreadPool::WaitPolicy::EXIT_ASAP);
+        EXPECT_EQ(executed, 2);
+
+        for (uint32_t i = 0; i < 16; ++i)
+        {
+            threadPool->ExecuteDeffered([&]() { executed++; });
+        }
+        threadPool->WaitForAll(ThreadPool::WaitPolicy::EXECUTE_THEN_EXIT);
+        EXPECT_EQ(executed, 18);
+
+        threadPool->ExecuteParallelForImmediate([&](uint32_t) { executed++; }, 64, 4);
+        EXPECT_EQ(executed, 82);
+
+        /* Give every worker time to fall asleep, then wait from a thread outside the pool without helping,
+         * so only a woken worker can run the tasks
+         */
+        std::this_thread::sleep_for(1ms);
+        std::thread waiter([&]()
+        {
+            auto first = threadPool->ExecuteDeffered([&]() { executed++; });
+            auto second = threadPool->Then(first, [&]() { executed++; });
+            threadPool->Wait(second, ThreadPool::WaitPolicy::EXIT_ASAP);
+        });
+        waiter.join();
+        EXPECT_EQ(executed, 84);
+
+        threadPool->SetSpinBudget(spinBudget);
+    }
+
+    TEST_P(Threading, JobGroupsWaitOnlyForTheirTasks)
+    {
+        auto threadPool = ThreadPool::Get();
+
+        std::atomic<bool> release = false;
+        auto blockedTask = threadPool->ExecuteDeffered([&]()
+        {
+            while (!release)
+                std::this_thread::yield();
+        });
+
+        JobGroup group;
+        std::atomic<uint32_t> executed = 0;
+        for (uint32_t i = 0; i < 16; ++i)
+        {
+            group.ExecuteDeffered([&]() { executed++; });
+        }
+        auto first = group.ExecuteDeffered([&]() { executed++; });
+        group.Then(first, [&]() { executed++; });
+
+        group.Wait(ThreadPool::WaitPolicy::EXIT_ASAP);
+        EXPECT_TRUE(group.IsDone());
+        EXPECT_EQ(executed, 18);
+        EXPECT_FALSE(threadPool->IsTaskCompleted(blockedTask));
+
+        release = true;
+        threadPool->Wait(blockedTask);
+    }
+
+    TEST(Threading, CancelledJobGroupsSkipQueuedTasks)
+    {
+        auto threadPool = ThreadPool::Get();
+
+        /* Keep every worker busy with a task that runs until the group is cancelled */
+        JobGroup group;
+        auto token = group.GetToken();
+        std::atomic<uint32_t> started = 0;
+        for (uint32_t i = 0; i < threadPool->GetNumberOfThreads(); ++i)
+        {
+            group.ExecuteDeffered([&, token]()
+            {
+                started++;
+                while (!token.IsCancelled())
+                    std::this_thread::yield();
+            });
+        }
+        while (started != threadPool->GetNumberOfThreads())
+            std::this_thread::yield();
+
+        std::atomic<uint32_t> executed = 0;
+        auto queuedTask = group.ExecuteDeffered([&]() { executed++; });
+        auto continuation = threadPool->Then(queuedTask, [&]() { executed++; });
+        bool otherExecuted = false;
+        auto otherTask = threadPool->ExecuteDeffered([&]() { otherExecuted = true; });
+
+        group.Cancel();
+        EXPECT_TRUE(token.IsCancelled());
+        group.Wait(ThreadPool::WaitPolicy::EXIT_ASAP);
+        threadPool->Wait(continuation, ThreadPool::WaitPolicy::EXIT_ASAP);
+        threadPool->Wait(otherTask, ThreadPool::WaitPolicy::EXIT_ASAP);
+
+        EXPECT_EQ(executed, 0);
+        EXPECT_TRUE(otherExecuted);
+        EXPECT_FALSE(CancellationToken().IsCancelled());
+
+        group.Reset();
+        group.ExecuteDeffered([&]() { executed++; });
+        group.Wait();
+        EXPECT_EQ(executed, 1);
+    }
+
     INSTANTIATE_TEST_SUITE_P(ThreadingTests, Threading, testing::Range(0, 100));
 
 }